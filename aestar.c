@@ -26,18 +26,39 @@
  *      Encrypts or decrypts the file data in a tar archive using the aespipe
  *      utility.
  *
+ *      Format 1 encrypts each member's data with a single aespipe run, so an
+ *      archive can only be decrypted front to back.  Format 2 (-c) takes the
+ *      IVs from the position of the data in the archive and appends an index
+ *      of the members and the chunk size after the end-of-archive blocks.  A
+ *      format 2 archive in a regular file can be decrypted in chunks by
+ *      several processes at once (-j) or one member at a time (-x).
+ *
  */
 
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdint.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <tar.h>
+#include <unistd.h>
+
+#include "probes.h"
+#include "size.h"
 
 static int verbose = 0;
+static const char *keyfile = NULL;
+
+/* Trailer block at the very end of a format 2 archive */
+#define TRAILERMAGIC "aestar-trailer"
 
 struct Tar
 {
@@ -59,21 +80,19 @@ struct Tar
     char prefix[167];
 };
 
+/* One entry of a format 2 index */
+struct Member
+{
+    uintmax_t offset;           /* offset of the header in the archive */
+    uintmax_t size;
+    char *name;
+};
+
 int
-ReadTarHeader(struct Tar *tar)
+CheckTarHeader(struct Tar *tar)
 {
     size_t i;
     unsigned int chksum, mychksum = 0;
-    if (fread(tar, 1, sizeof(struct Tar), stdin) != sizeof(struct Tar))
-    {
-        if (feof(stdin))
-        {
-            fprintf(stderr, "end of file\n");
-            return 1;
-        }
-        fprintf(stderr, "Could not read tar header\n");
-        return 1;
-    }
 
     sscanf(tar->chksum, "%07o", &chksum);
     for (i = 0; i < sizeof(struct Tar); i++)
@@ -96,8 +115,9 @@ ReadTarHeader(struct Tar *tar)
     }
     mychksum += ' '*8;
 
-    if (tar->magic[0] == 'a')
-        mychksum += 'u' - 'a';
+    /* The checksum was computed before the magic was changed */
+    if (tar->magic[0] == 'a' || tar->magic[0] == 'c')
+        mychksum += 'u' - tar->magic[0];
 
     if (mychksum != chksum)
     {
@@ -112,40 +132,588 @@ ReadTarHeader(struct Tar *tar)
     return 0;
 }
 
+int
+ReadTarHeader(struct Tar *tar)
+{
+    if (fread(tar, 1, sizeof(struct Tar), stdin) != sizeof(struct Tar))
+    {
+        if (feof(stdin))
+        {
+            fprintf(stderr, "end of file\n");
+            return 1;
+        }
+        fprintf(stderr, "Could not read tar header\n");
+        return 1;
+    }
+
+    return CheckTarHeader(tar);
+}
+
+/* Return the size of the data following a tar header */
+static uintmax_t
+TarSize(struct Tar *tar)
+{
+    uintmax_t size = 0LL;
+    char buf[sizeof(tar->size) + 1];
+
+    /*
+     * POSIX lets the size field of a directory hold its allocated size, but
+     * no data follows the header.  tarvol writes such sizes.
+     */
+    if (tar->typeflag == DIRTYPE || tar->typeflag == SYMTYPE ||
+            tar->typeflag == LNKTYPE)
+        return 0;
+
+    if (tar->size[0] & -128)
+    {
+        int i;
+        /* GNU size extension */
+        for (i = 1; i < sizeof(tar->size); i++)
+        {
+            size = size << 8;
+            size += tar->size[i];
+        }
+    }
+    else
+    {
+        /* Make sure size is NULL-terminated */
+        strncpy(buf, tar->size, sizeof(tar->size));
+        buf[sizeof(tar->size)] = 0;
+
+        sscanf(buf, "%11llo", &size);
+    }
+    return size;
+}
+
+/* Build the full member name from the prefix and name fields */
+static void
+TarName(struct Tar *tar, char *name, size_t len)
+{
+    if (tar->prefix[0])
+        snprintf(name, len, "%.*s/%.*s", (int)sizeof(tar->prefix),
+                tar->prefix, (int)sizeof(tar->name), tar->name);
+    else
+        snprintf(name, len, "%.*s", (int)sizeof(tar->name), tar->name);
+}
+
+/*
+ * Start aespipe writing to our stdout.  In format 2 the IV offset is the
+ * position of the data in the archive, so no two sectors share an IV and any
+ * chunk can be decrypted on its own.
+ */
+static FILE *
+OpenAespipe(int decrypt, int format, uintmax_t offset)
+{
+    char cmd[MAXPATHLEN + 60];
+    int ret;
+
+    if (format == 2)
+        ret = snprintf(cmd, sizeof(cmd), "aespipe %s -P %s -O %llu",
+                decrypt ? "-d" : "", keyfile,
+                (unsigned long long)(offset / 512));
+    else
+        ret = snprintf(cmd, sizeof(cmd), "aespipe %s -P %s",
+                decrypt ? "-d" : "", keyfile);
+
+    if (ret < 0 || ret >= sizeof(cmd))
+    {
+        fprintf(stderr, "Could not format command string\n");
+        return NULL;
+    }
+
+    fflush(stdout);
+    return popen(cmd, "w");
+}
+
+/*
+ * Copy length bytes (a multiple of 512) of archive data from stdin through a
+ * single aespipe run.
+ */
+static int
+CryptStream(int decrypt, int format, uintmax_t offset, uintmax_t length)
+{
+    char buf[512];
+    FILE *aespipe = OpenAespipe(decrypt, format, offset);
+
+    if (!aespipe)
+    {
+        fprintf(stderr, "Could not start aespipe\n");
+        return 1;
+    }
+
+    while (length)
+    {
+        /*
+         * CBC mode requires 512-byte blocks.  Luckily, the tar format
+         * also uses 512-byte blocks.  We leave the real file size in
+         * the header, so while the result may look like a tar file,
+         * using tar to extract the contents would result in data loss.
+         */
+        if (fread(buf, 1, 512, stdin) != 512)
+        {
+            if (feof(stdin))
+            {
+                fprintf(stderr, "encountered end-of-file\n");
+                return 1;
+            }
+
+            perror("fread");
+            return 1;
+        }
+
+        fwrite(buf, 1, 512, aespipe);
+        length -= 512;
+    }
+
+    if (pclose(aespipe) != 0)
+    {
+        fprintf(stderr, "aespipe failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* Find and parse the index of a format 2 archive in a regular file */
+static struct Member *
+ReadIndex(int fd, size_t *count, uintmax_t *chunksize, uintmax_t *end)
+{
+    struct stat st;
+    char trailer[513], *index, *line, *next;
+    unsigned long long chunk, indexoff, indexlen;
+    struct Member *members = NULL;
+    size_t n = 0, alloc = 0;
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size < 512)
+    {
+        fprintf(stderr, "input is not a seekable format 2 archive\n");
+        return NULL;
+    }
+
+    if (pread(fd, trailer, 512, st.st_size - 512) != 512)
+    {
+        perror("pread");
+        return NULL;
+    }
+    trailer[512] = 0;
+
+    if (sscanf(trailer, TRAILERMAGIC " 2 %llu %llu %llu", &chunk,
+                &indexoff, &indexlen) != 3 || indexoff < 1024 ||
+            indexoff + indexlen > st.st_size - 512)
+    {
+        fprintf(stderr, "input has no format 2 index\n");
+        return NULL;
+    }
+
+    index = malloc(indexlen + 1);
+    if (!index || pread(fd, index, indexlen, indexoff) != indexlen)
+    {
+        fprintf(stderr, "Could not read index\n");
+        free(index);
+        return NULL;
+    }
+    index[indexlen] = 0;
+
+    for (line = index; *line; line = next)
+    {
+        unsigned long long offset, size;
+        int namepos;
+
+        next = strchr(line, '\n');
+        if (!next)
+            break;
+        *next++ = 0;
+
+        if (sscanf(line, "%llu %llu %n", &offset, &size, &namepos) < 2)
+        {
+            fprintf(stderr, "Malformed index entry: %s\n", line);
+            continue;
+        }
+
+        if (n == alloc)
+        {
+            alloc = alloc ? alloc * 2 : 1024;
+            members = realloc(members, alloc * sizeof(struct Member));
+            if (!members)
+            {
+                fprintf(stderr, "Out of memory reading index\n");
+                return NULL;
+            }
+        }
+        members[n].offset = offset;
+        members[n].size = size;
+        members[n].name = line + namepos;
+        n++;
+    }
+
+    *count = n;
+    *chunksize = chunk;
+    /* The index directly follows the two end-of-archive blocks */
+    *end = indexoff - 1024;
+    return members;
+}
+
+/*
+ * Decrypt one chunk of the archive on fd 0 into the same position of the
+ * regular file on fd 1.  aespipe's output comes back through a pipe so that
+ * several of these can run at once without sharing a file offset.
+ */
+static int
+DecryptChunk(uintmax_t offset, uintmax_t length)
+{
+    int in[2], out[2], status, ret = 0;
+    char sector[32], buf[65536];
+    pid_t aespipe, feeder;
+    uintmax_t pos = offset;
+    ssize_t n;
+
+    snprintf(sector, sizeof(sector), "%llu",
+            (unsigned long long)(offset / 512));
+
+    if (pipe(in) || pipe(out))
+    {
+        perror("pipe");
+        return 1;
+    }
+
+    aespipe = fork();
+    if (aespipe == 0)
+    {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execlp("aespipe", "aespipe", "-d", "-P", keyfile, "-O", sector,
+                (char *)NULL);
+        perror("aespipe");
+        _exit(127);
+    }
+
+    feeder = fork();
+    if (feeder == 0)
+    {
+        close(in[0]);
+        close(out[0]);
+        close(out[1]);
+        while (length)
+        {
+            size_t s = length > sizeof(buf) ? sizeof(buf) : length;
+            if (pread(0, buf, s, pos) != s || write(in[1], buf, s) != s)
+                _exit(1);
+            pos += s;
+            length -= s;
+        }
+        _exit(0);
+    }
+
+    close(in[0]);
+    close(in[1]);
+    close(out[1]);
+    if (aespipe < 0 || feeder < 0)
+    {
+        perror("fork");
+        ret = 1;
+    }
+
+    while ((n = read(out[0], buf, sizeof(buf))) > 0)
+    {
+        if (pwrite(1, buf, n, pos) != n)
+        {
+            perror("pwrite");
+            ret = 1;
+            break;
+        }
+        pos += n;
+    }
+    close(out[0]);
+
+    if (feeder > 0 && (waitpid(feeder, &status, 0) < 0 || status != 0))
+        ret = 1;
+    if (aespipe > 0 && (waitpid(aespipe, &status, 0) < 0 || status != 0))
+        ret = 1;
+    if (pos != offset + length)
+        ret = 1;
+
+    if (ret)
+    {
+        fprintf(stderr, "Could not decrypt %llu bytes at offset %llu\n",
+                (unsigned long long)length, (unsigned long long)offset);
+    }
+    return ret;
+}
+
+/* Read a header from an indexed archive and put back the original magic */
+static int
+ReadIndexedHeader(struct Member *m, struct Tar *tar)
+{
+    if (pread(0, tar, sizeof(struct Tar), m->offset) != sizeof(struct Tar)
+            || CheckTarHeader(tar))
+    {
+        fprintf(stderr, "Bad header for %s\n", m->name);
+        return 1;
+    }
+    tar->magic[0] = 'u';
+    return 0;
+}
+
+/*
+ * Decrypt a whole format 2 archive using several worker processes, each of
+ * which takes chunks from a shared pipe until there are none left.
+ */
+static int
+DecryptParallel(int jobs)
+{
+    struct Member *members;
+    size_t count, i, nchunks = 0;
+    uintmax_t chunksize, end;
+    struct { uintmax_t offset, length; } *chunks;
+    char zeros[1024];
+    int queue[2], w, ret = 0;
+    struct stat st;
+
+    if (fstat(1, &st) || !S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "parallel decryption requires output to a file\n");
+        return 1;
+    }
+
+    members = ReadIndex(0, &count, &chunksize, &end);
+    if (!members)
+        return 1;
+
+    chunks = NULL;
+    for (i = 0; i < count; i++)
+    {
+        struct Tar tar;
+        uintmax_t length = (members[i].size + 511) / 512 * 512;
+        uintmax_t offset = members[i].offset + 512;
+
+        if (ReadIndexedHeader(&members[i], &tar))
+            return 1;
+        if (pwrite(1, &tar, sizeof(tar), members[i].offset) != sizeof(tar))
+        {
+            perror("pwrite");
+            return 1;
+        }
+
+        while (length)
+        {
+            uintmax_t s = length > chunksize ? chunksize : length;
+            if (!(nchunks & (nchunks - 1)))
+            {
+                chunks = realloc(chunks,
+                        (nchunks ? nchunks * 2 : 1) * sizeof(*chunks));
+                if (!chunks)
+                {
+                    fprintf(stderr, "Out of memory\n");
+                    return 1;
+                }
+            }
+            chunks[nchunks].offset = offset;
+            chunks[nchunks].length = s;
+            nchunks++;
+            offset += s;
+            length -= s;
+        }
+    }
+
+    if (verbose > 1)
+    {
+        fprintf(stderr, "decrypting %llu chunks with %d processes\n",
+                (unsigned long long)nchunks, jobs);
+    }
+
+    if (pipe(queue))
+    {
+        perror("pipe");
+        return 1;
+    }
+
+    for (w = 0; w < jobs; w++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            uint32_t c;
+            int failed = 0;
+
+            close(queue[1]);
+            /* Writes of this size to a pipe are atomic */
+            while (read(queue[0], &c, sizeof(c)) == sizeof(c))
+            {
+                PROBE2(aestar, chunk__start, chunks[c].offset,
+                        chunks[c].length);
+                failed |= DecryptChunk(chunks[c].offset, chunks[c].length);
+                PROBE2(aestar, chunk__done, chunks[c].offset,
+                        chunks[c].length);
+            }
+            _exit(failed);
+        }
+        else if (pid < 0)
+        {
+            perror("fork");
+            ret = 1;
+            break;
+        }
+    }
+    close(queue[0]);
+
+    for (i = 0; i < nchunks && !ret; i++)
+    {
+        uint32_t c = i;
+        if (write(queue[1], &c, sizeof(c)) != sizeof(c))
+        {
+            perror("write");
+            ret = 1;
+        }
+    }
+    close(queue[1]);
+
+    {
+        int status;
+        while (wait(&status) > 0)
+        {
+            if (!WIFEXITED(status) || WEXITSTATUS(status))
+                ret = 1;
+        }
+    }
+
+    memset(zeros, 0, sizeof(zeros));
+    if (pwrite(1, zeros, sizeof(zeros), end) != sizeof(zeros) ||
+            ftruncate(1, end + sizeof(zeros)))
+    {
+        perror("pwrite");
+        ret = 1;
+    }
+
+    if (ret)
+        fprintf(stderr, "parallel decryption failed\n");
+    return ret;
+}
+
+/* Decrypt a single member of a format 2 archive into a one-member tar */
+static int
+DecryptMember(const char *name)
+{
+    struct Member *members;
+    size_t count, i;
+    uintmax_t chunksize, end;
+    unsigned char zeros[1024];
+
+    members = ReadIndex(0, &count, &chunksize, &end);
+    if (!members)
+        return 1;
+
+    for (i = 0; i < count; i++)
+    {
+        struct Tar tar;
+        uintmax_t length, offset;
+        char buf[65536];
+
+        if (strcmp(members[i].name, name) != 0)
+            continue;
+
+        if (ReadIndexedHeader(&members[i], &tar))
+            return 1;
+        fwrite(&tar, 1, sizeof(struct Tar), stdout);
+
+        length = (members[i].size + 511) / 512 * 512;
+        offset = members[i].offset + 512;
+        if (length)
+        {
+            FILE *aespipe = OpenAespipe(1, 2, offset);
+
+            if (!aespipe)
+            {
+                fprintf(stderr, "Could not start aespipe\n");
+                return 1;
+            }
+
+            while (length)
+            {
+                size_t s = length > sizeof(buf) ? sizeof(buf) : length;
+                if (pread(0, buf, s, offset) != s)
+                {
+                    perror("pread");
+                    return 1;
+                }
+                fwrite(buf, 1, s, aespipe);
+                offset += s;
+                length -= s;
+            }
+
+            if (pclose(aespipe) != 0)
+            {
+                fprintf(stderr, "aespipe failed\n");
+                return 1;
+            }
+        }
+
+        memset(zeros, 0, 1024);
+        fwrite(zeros, 1, 1024, stdout);
+        return 0;
+    }
+
+    fprintf(stderr, "%s not found in index\n", name);
+    return 1;
+}
+
 /* Print a usage message and exit */
 static void usage(const char *arg, int status, const char *msg)
 {
     if (msg) fprintf(stderr, "%s: %s\n", arg, msg);
     fprintf(stderr, "Usage: %s [options] -k file\n", arg);
+    fprintf(stderr, "  -c size      Encrypt in format 2 with chunks of size bytes\n");
     fprintf(stderr, "  -d           Decrypt (default is encrypt)\n");
     fprintf(stderr, "  -h           Print this help message\n");
+    fprintf(stderr, "  -j jobs      Decrypt a format 2 file with jobs processes\n");
     fprintf(stderr, "  -k file      Use passphrase in file\n");
     fprintf(stderr, "  -v           Verbose (multiple for more verbosity)\n");
+    fprintf(stderr, "  -x name      Decrypt only member name of a format 2 file\n");
     exit(status);
 }
 
 int
 main(int argc, char* argv[])
 {
-    int arg, decrypt = 0;
-    char cmd[MAXPATHLEN + 20];
-    const char *fileparam = NULL;
-    while ((arg = getopt(argc, argv, "dhk:v")) != -1)
+    int arg, decrypt = 0, jobs = 0;
+    uintmax_t chunksize = 0, offset = 0;
+    const char *member = NULL;
+    FILE *index = NULL;
+    while ((arg = getopt(argc, argv, "c:dhj:k:vx:")) != -1)
     {
         switch (arg)
         {
+            case 'c':
+                if (parsesize(optarg, &chunksize) || !chunksize ||
+                        chunksize % 512)
+                {
+                    usage(argv[0], 1, "chunk size must be a multiple of 512");
+                }
+                break;
             case 'd':
                 decrypt = 1;
                 break;
             case 'h':
                 usage(argv[0], 0, NULL);
                 break;
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 1)
+                {
+                    usage(argv[0], 1, "jobs must be at least 1");
+                }
+                break;
             case 'k':
-                fileparam = optarg;
+                keyfile = optarg;
                 break;
             case 'v':
                 verbose++;
                 break;
+            case 'x':
+                member = optarg;
+                break;
             case '?':
                 usage(argv[0], 1, NULL);
                 break;
@@ -155,54 +723,73 @@ main(int argc, char* argv[])
         }
     }
 
-    if (!fileparam)
+    if (!keyfile)
     {
         usage(argv[0], 1, "passphrase file must be specified");
     }
 
+    if ((jobs || member) && !decrypt)
     {
-        int ret = snprintf(cmd, MAXPATHLEN + 20, "aespipe %s -P %s",
-                decrypt ? "-d" : "", fileparam);
+        usage(argv[0], 1, "-j and -x can only be used with -d");
+    }
 
-        if (ret < 0 || ret >= MAXPATHLEN + 20)
+    if (chunksize && decrypt)
+    {
+        usage(argv[0], 1, "-c can only be used when encrypting");
+    }
+
+    if (strlen(keyfile) > MAXPATHLEN)
+    {
+        fprintf(stderr, "Could not format command string\n");
+        return 1;
+    }
+
+    if (member)
+    {
+        return DecryptMember(member);
+    }
+
+    if (jobs)
+    {
+        return DecryptParallel(jobs);
+    }
+
+    if (chunksize)
+    {
+        index = tmpfile();
+        if (!index)
         {
-            fprintf(stderr, "Could not format command string\n");
+            fprintf(stderr, "Could not create temp file for index\n");
             return 1;
         }
     }
 
-
     struct Tar tar;
     while (!feof(stdin) && !ReadTarHeader(&tar))
     {
-        uintmax_t size = 0LL;
-        char buf[512];
-        FILE *aespipe;
+        uintmax_t size = TarSize(&tar);
+        uintmax_t length = (size + 511) / 512 * 512;
+        int format;
 
-        if (tar.size[0] & -128)
-        {
-            int i;
-            /* GNU size extension */
-            for (i = 1; i < sizeof(tar.size); i++)
-            {
-                size = size << 8;
-                size += tar.size[i];
-            }
-        }
+        if (decrypt)
+            format = (tar.magic[0] == 'c') ? 2 : 1;
         else
-        {
-            /* Make sure size is NULL-terminated */
-            strncpy(buf, tar.size, sizeof(tar.size));
-            buf[sizeof(tar.size)] = 0;
+            format = chunksize ? 2 : 1;
 
-            sscanf(buf, "%11llo", &size);
-        }
         if (verbose > 1)
         {
             fprintf(stderr, "%s %11llu bytes of data\n",
                     decrypt ? "decrypting" : "encrypting", size);
         }
 
+        if (index)
+        {
+            char name[sizeof(tar.prefix) + sizeof(tar.name) + 2];
+            TarName(&tar, name, sizeof(name));
+            fprintf(index, "%llu %llu %s\n", (unsigned long long)offset,
+                    (unsigned long long)size, name);
+        }
+
         /*
          * Our output will look like a tar file, but data will be lost if a tar
          * program is used to extract its contents.  So we change the magic,
@@ -212,49 +799,57 @@ main(int argc, char* argv[])
         if (decrypt)
             tar.magic[0] = 'u';
         else
-            tar.magic[0] = 'a';
+            tar.magic[0] = (format == 2) ? 'c' : 'a';
 
         fwrite(&tar, 1, sizeof(struct Tar), stdout);
-        fflush(stdout);
-        if (size)
-        {
-            aespipe = popen(cmd, "w");
+        offset += sizeof(struct Tar);
 
-            while (size)
-            {
-                /*
-                 * CBC mode requires 512-byte blocks.  Luckily, the tar format
-                 * also uses 512-byte blocks.  We leave the real file size in
-                 * the header, so while the result may look like a tar file,
-                 * using tar to extract the contents would result in data loss.
-                 */
-                if (fread(buf, 1, 512, stdin) != 512)
-                {
-                    if (feof(stdin))
-                    {
-                        fprintf(stderr, "encountered end-of-file\n");
-                        return 1;
-                    }
-
-                    perror("fread");
-                    return 1;
-                }
+        /*
+         * Sector numbers run on across chunk boundaries, so a member can be
+         * encrypted or decrypted in one run and still be split into chunks
+         * later.
+         */
+        PROBE3(aestar, member__start, offset, length, decrypt);
+        if (length && CryptStream(decrypt, format, offset, length))
+            return 1;
+        PROBE3(aestar, member__done, offset, length, decrypt);
+        offset += length;
+    }
 
-                fwrite(buf, 1, 512, aespipe);
+    unsigned char zeros[1024];
+    memset(zeros, 0, 1024);
+    fwrite(zeros, 1, 1024, stdout);
+    offset += 1024;
 
-                if (size > 512LL) size -= 512LL; else size = 0LL;
-            }
+    if (index)
+    {
+        /*
+         * The index and trailer follow the end-of-archive blocks, where tar
+         * programs and sequential decryption never look.
+         */
+        char buf[512];
+        uintmax_t indexlen = ftello(index);
+        size_t n;
 
-            if (pclose(aespipe) != 0)
-            {
-                fprintf(stderr, "aespipe failed\n");
-                return 1;
-            }
+        rewind(index);
+        while ((n = fread(buf, 1, sizeof(buf), index)) > 0)
+        {
+            fwrite(buf, 1, n, stdout);
         }
+        fclose(index);
+
+        memset(buf, 0, sizeof(buf));
+        fwrite(buf, 1, (512 - indexlen % 512) % 512, stdout);
+        snprintf(buf, sizeof(buf), TRAILERMAGIC " 2 %llu %llu %llu\n",
+                (unsigned long long)chunksize, (unsigned long long)offset,
+                (unsigned long long)indexlen);
+        fwrite(buf, 1, sizeof(buf), stdout);
     }
 
-    unsigned char zeros[1024];
-    memset(zeros, 0, 1024);
-    fwrite(zeros, 1, 1024, stdout);
+    if (fflush(stdout))
+    {
+        perror("fflush");
+        return 1;
+    }
     return 0;
 }
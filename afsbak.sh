@@ -8,6 +8,10 @@
 TARVOL=/usr/local/sbin/tarvol
 VOS=/usr/bin/vos
 VOSARGS=-localauth
+# Set to a file to record volume statistics for volsched
+STATSFILE=
+# Set to a directory to keep a catalog of archived files for tarfind
+CATALOG=
 
 TIME="0"
 
@@ -37,7 +41,17 @@ while [[ "$1" != "--" ]]; do
     shift
 done
 shift
+VOLUME=$1
 
-$VOS backup $1 $VOSARGS 2>$ERRFILE >&2
-$VOS dump $1.backup -time "$TIME" $VOSARGS 2>$ERRFILE | $TARVOL -acv
+# The tarvol arguments, kept as positional parameters so paths stay whole
+set -- -acv
+if [[ -n "$STATSFILE" ]]; then
+    set -- "$@" -S "$STATSFILE"
+fi
+if [[ -n "$CATALOG" ]]; then
+    set -- "$@" -C "$CATALOG"
+fi
+
+$VOS backup $VOLUME $VOSARGS 2>$ERRFILE >&2
+$VOS dump $VOLUME.backup -time "$TIME" $VOSARGS 2>$ERRFILE | $TARVOL "$@"
 egrep -v "^Dumped volume|^Created backup volume for" $ERRFILE >&2 || true
@@ -0,0 +1,937 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Writing of BackupPC backups (see bpcpool.h).  The first MB of a file is
+ * held in memory, which is all its digest needs, and is then compared with
+ * the pool files of that digest.  The rest of the file is compared with the
+ * ones still matching as it streams through, so a file already in the pool is
+ * never written, only linked.  Once none match, what came before is written
+ * from memory and from the last pool file to match, and the rest is written
+ * as it comes.  The attributes of every directory are kept until the end,
+ * since vos dump does not give the entries of a directory together.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include <zlib.h>
+
+#include "bpcpool.h"
+#include "record.h"
+
+#define ATTRIB_MAGIC 0x17555555
+/* Of a file, only its first MB goes into its digest, in two parts */
+#define DIGESTSIZE (1 << 20)
+#define DIGESTPART 131072
+/* BackupPC's default $Conf{HardLinkMax} */
+#define HARDLINKMAX 31999
+#define MAXCANDIDATES 16
+#define IOSIZE 65536
+#define DIRBUCKETS 65536
+/* The pool, a/b/c/, the digest and a suffix */
+#define POOLPATH (MAXPATHLEN + 64)
+
+struct Buffer
+{
+    unsigned char *data;
+    size_t len, size;
+};
+
+struct Entry
+{
+    struct Entry *next;
+    struct BpcMember m;
+    char name[1];
+};
+
+struct Dir
+{
+    struct Dir *hashnext;
+    char *key;                  /* "." or "./path", as it was added */
+    char *path;                 /* mangled, under the backup */
+    struct Entry *entries;
+    size_t count;
+};
+
+/* A pool file being read back, to compare with the file being written */
+struct Reader
+{
+    int fd;
+    int checksums;              /* rsync checksums follow the data */
+    int done;
+    z_stream z;
+    unsigned char in[IOSIZE];
+    char path[MAXPATHLEN];
+};
+
+enum { HEAD, MATCH, WRITE };
+
+static struct
+{
+    char pool[MAXPATHLEN + 8];
+    char root[MAXPATHLEN];      /* the share's directory */
+    int level, error;
+    struct Dir *dirs[DIRBUCKETS];
+
+    /* The file being written */
+    int open, state;
+    char path[MAXPATHLEN];
+    uint64_t size, done;
+    struct Buffer head;
+    char digest[33];            /* in hex */
+    int chain;                  /* the first free suffix, -1 for none */
+    struct Reader *candidates[MAXCANDIDATES];
+    int ncandidates;
+    char matched[MAXPATHLEN];   /* the last candidate to stop matching */
+    int fd;
+    z_stream z;
+    unsigned char out[IOSIZE], cmp[IOSIZE];
+
+    struct BpcStats stats;
+} g_bpc;
+
+static int
+Failed(const char *what, const char *path)
+{
+    fprintf(stderr, "Cannot %s '%s'. Code = %d\n", what, path, errno);
+    g_bpc.error = 1;
+    return -1;
+}
+
+/* Make room for n more bytes */
+static unsigned char *
+Grow(struct Buffer *b, size_t n)
+{
+    if (b->len + n > b->size)
+    {
+        size_t size = b->size ? b->size : 4096;
+        unsigned char *data;
+
+        while (size < b->len + n)
+            size *= 2;
+        data = realloc(b->data, size);
+        if (!data)
+            return NULL;
+        b->data = data;
+        b->size = size;
+    }
+    b->len += n;
+    return b->data + b->len - n;
+}
+
+/* A number as Perl's pack("w") writes it: 7 bits a byte, high bits first */
+static int
+PutNumber(struct Buffer *b, uint64_t value)
+{
+    unsigned char tmp[10], *p;
+    int n = sizeof(tmp);
+
+    tmp[--n] = value & 0x7f;
+    while (value >>= 7)
+        tmp[--n] = 0x80 | (value & 0x7f);
+    if (!(p = Grow(b, sizeof(tmp) - n)))
+        return -1;
+    memcpy(p, tmp + n, sizeof(tmp) - n);
+    return 0;
+}
+
+/* A number as pack("N") writes it: 4 bytes, big-endian */
+static int
+PutLong(struct Buffer *b, uint32_t value)
+{
+    unsigned char *p;
+
+    if (!(p = Grow(b, 4)))
+        return -1;
+    putvalue(p, 4, value);
+    return 0;
+}
+
+/* Append a name to a path the way BackupPC mangles it */
+static int
+Mangle(char *path, size_t size, const char *name, size_t len)
+{
+    size_t n = strlen(path);
+    size_t i;
+
+    if (n + 2 >= size)
+        return -1;
+    path[n++] = '/';
+    path[n++] = 'f';
+    for (i = 0; i < len; i++)
+    {
+        if (n + 4 >= size)
+            return -1;
+        if (strchr("%/\n\r", name[i]))
+            n += sprintf(path + n, "%%%02x", (unsigned char)name[i]);
+        else
+            path[n++] = name[i];
+    }
+    path[n] = 0;
+    return 0;
+}
+
+/* Make a directory and any of its parents that are missing */
+static int
+MakeDirs(char *path)
+{
+    char *slash;
+    int code;
+
+    if (mkdir(path, 0750) == 0 || errno == EEXIST)
+        return 0;
+    if (errno != ENOENT || !(slash = strrchr(path, '/')) || slash == path)
+        return -1;
+    *slash = 0;
+    code = MakeDirs(path);
+    *slash = '/';
+    if (code || (mkdir(path, 0750) && errno != EEXIST))
+        return -1;
+    return 0;
+}
+
+static unsigned int
+HashKey(const char *key)
+{
+    unsigned int h = 2166136261u;
+
+    while (*key)
+        h = (h ^ (unsigned char)*key++) * 16777619u;
+    return h % DIRBUCKETS;
+}
+
+/* Find a directory, making it the first time */
+static struct Dir *
+FindDir(const char *key)
+{
+    unsigned int h = HashKey(key);
+    char path[MAXPATHLEN];
+    const char *p, *end;
+    struct Dir *d;
+
+    for (d = g_bpc.dirs[h]; d; d = d->hashnext)
+    {
+        if (strcmp(d->key, key) == 0)
+            return d;
+    }
+
+    snprintf(path, sizeof(path), "%s", g_bpc.root);
+    for (p = key; *p; p = *end ? end + 1 : end)
+    {
+        end = strchr(p, '/');
+        if (!end)
+            end = p + strlen(p);
+        if ((end - p == 1 && p[0] == '.') || end == p)
+            continue;
+        if (Mangle(path, sizeof(path), p, end - p))
+        {
+            fprintf(stderr, "Path too long: '%s'\n", key);
+            g_bpc.error = 1;
+            return NULL;
+        }
+    }
+    if (MakeDirs(path))
+    {
+        Failed("create", path);
+        return NULL;
+    }
+
+    d = calloc(1, sizeof(*d));
+    if (!d || !(d->key = strdup(key)) || !(d->path = strdup(path)))
+    {
+        if (d)
+            free(d->key);
+        free(d);
+        fprintf(stderr, "Out of memory\n");
+        g_bpc.error = 1;
+        return NULL;
+    }
+    d->hashnext = g_bpc.dirs[h];
+    g_bpc.dirs[h] = d;
+    return d;
+}
+
+static void
+FreeDirs(void)
+{
+    struct Entry *e;
+    struct Dir *d;
+    int i;
+
+    for (i = 0; i < DIRBUCKETS; i++)
+    {
+        while ((d = g_bpc.dirs[i]))
+        {
+            g_bpc.dirs[i] = d->hashnext;
+            while ((e = d->entries))
+            {
+                d->entries = e->next;
+                free(e);
+            }
+            free(d->key);
+            free(d->path);
+            free(d);
+        }
+    }
+}
+
+static int
+AddEntry(struct Dir *d, const struct BpcMember *m, const char *name,
+    size_t len)
+{
+    struct Entry *e = malloc(sizeof(*e) + len);
+
+    if (!e)
+    {
+        fprintf(stderr, "Out of memory\n");
+        g_bpc.error = 1;
+        return -1;
+    }
+    e->m = *m;
+    memcpy(e->name, name, len);
+    e->name[len] = 0;
+    e->next = d->entries;
+    d->entries = e;
+    d->count++;
+    return 0;
+}
+
+static struct Reader *
+OpenReader(const char *path)
+{
+    struct Reader *r = malloc(sizeof(*r));
+    ssize_t n;
+
+    if (!r)
+        return NULL;
+    memset(&r->z, 0, sizeof(r->z));
+    r->checksums = r->done = 0;
+    snprintf(r->path, sizeof(r->path), "%s", path);
+    if ((r->fd = open(path, O_RDONLY)) < 0)
+    {
+        free(r);
+        return NULL;
+    }
+    if (g_bpc.level)
+    {
+        if (inflateInit(&r->z) != Z_OK)
+        {
+            close(r->fd);
+            free(r);
+            return NULL;
+        }
+        /* BackupPC marks a file with rsync checksums after it this way */
+        if ((n = read(r->fd, r->in, IOSIZE)) > 0 && r->in[0] == 0xd6)
+        {
+            r->in[0] = 0x78;
+            r->checksums = 1;
+        }
+        r->z.next_in = r->in;
+        r->z.avail_in = n > 0 ? n : 0;
+    }
+    return r;
+}
+
+static void
+CloseReader(struct Reader *r)
+{
+    if (g_bpc.level)
+        inflateEnd(&r->z);
+    close(r->fd);
+    free(r);
+}
+
+/* Read up to size bytes of a pool file's data; fewer only at its end */
+static ssize_t
+ReadPool(struct Reader *r, unsigned char *out, size_t size)
+{
+    size_t got = 0;
+    ssize_t n = 0;
+    int code;
+
+    if (!g_bpc.level)
+    {
+        while (got < size && (n = read(r->fd, out + got, size - got)) > 0)
+            got += n;
+        return n < 0 ? -1 : (ssize_t)got;
+    }
+
+    r->z.next_out = out;
+    r->z.avail_out = size;
+    while (r->z.avail_out > 0 && !r->done)
+    {
+        if (r->z.avail_in == 0)
+        {
+            if ((n = read(r->fd, r->in, IOSIZE)) < 0)
+                return -1;
+            if (n == 0)
+                break;
+            r->z.next_in = r->in;
+            r->z.avail_in = n;
+        }
+        code = inflate(&r->z, Z_NO_FLUSH);
+        if (code == Z_STREAM_END)
+        {
+            /* A big file can be several streams, one after the other */
+            if (r->checksums)
+                r->done = 1;
+            else
+                inflateReset(&r->z);
+        }
+        else if (code != Z_OK)
+            return -1;
+    }
+    return size - r->z.avail_out;
+}
+
+/* Whether a pool file goes on with exactly this data */
+static int
+Matches(struct Reader *r, const unsigned char *data, size_t size)
+{
+    size_t n;
+
+    while (size > 0)
+    {
+        n = size < IOSIZE ? size : IOSIZE;
+        if (ReadPool(r, g_bpc.cmp, n) != (ssize_t)n ||
+                memcmp(g_bpc.cmp, data, n))
+            return 0;
+        data += n;
+        size -= n;
+    }
+    return 1;
+}
+
+static void
+DropCandidates(void)
+{
+    while (g_bpc.ncandidates > 0)
+        CloseReader(g_bpc.candidates[--g_bpc.ncandidates]);
+}
+
+/* Keep only the candidates that go on with this data */
+static void
+Compare(const unsigned char *data, size_t size)
+{
+    int i, n = 0;
+
+    for (i = 0; i < g_bpc.ncandidates; i++)
+    {
+        struct Reader *r = g_bpc.candidates[i];
+
+        if (Matches(r, data, size))
+        {
+            g_bpc.candidates[n++] = r;
+            continue;
+        }
+        snprintf(g_bpc.matched, sizeof(g_bpc.matched), "%s", r->path);
+        CloseReader(r);
+    }
+    g_bpc.ncandidates = n;
+}
+
+/* The file's place in the pool, at the current place in the chain */
+static void
+PoolPath(char *path)
+{
+    const char *d = g_bpc.digest;
+
+    if (g_bpc.chain < 0)
+        snprintf(path, POOLPATH, "%s/%c/%c/%c/%s", g_bpc.pool, d[0], d[1],
+            d[2], d);
+    else
+        snprintf(path, POOLPATH, "%s/%c/%c/%c/%s_%d", g_bpc.pool, d[0], d[1],
+            d[2], d, g_bpc.chain);
+}
+
+/*
+ * Work out the file's digest from its first MB and open the pool files with
+ * that digest, as candidates for it, noting the first free place in the chain.
+ */
+static void
+FindCandidates(uint64_t size)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int i, len;
+    char number[24], path[POOLPATH];
+    struct Reader *r;
+    struct stat st;
+
+    g_bpc.chain = -1;
+    g_bpc.matched[0] = 0;
+    if (!ctx)
+        return;
+    snprintf(number, sizeof(number), "%llu", (unsigned long long)size);
+    EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
+    EVP_DigestUpdate(ctx, number, strlen(number));
+    if (size > 2 * DIGESTPART)
+    {
+        EVP_DigestUpdate(ctx, g_bpc.head.data, DIGESTPART);
+        EVP_DigestUpdate(ctx, g_bpc.head.data + g_bpc.head.len - DIGESTPART,
+            DIGESTPART);
+    }
+    else
+        EVP_DigestUpdate(ctx, g_bpc.head.data, g_bpc.head.len);
+    EVP_DigestFinal_ex(ctx, md, &len);
+    EVP_MD_CTX_free(ctx);
+
+    for (i = 0; i < len && i < 16; i++)
+        sprintf(g_bpc.digest + 2 * i, "%02x", md[i]);
+
+    for (;; g_bpc.chain++)
+    {
+        PoolPath(path);
+        if (stat(path, &st))
+            break;
+        /* A file with too many links cannot take any more */
+        if (st.st_nlink >= HARDLINKMAX ||
+                g_bpc.ncandidates == MAXCANDIDATES)
+            continue;
+        if ((r = OpenReader(path)))
+            g_bpc.candidates[g_bpc.ncandidates++] = r;
+    }
+    Compare(g_bpc.head.data, g_bpc.head.len);
+}
+
+static int
+WriteAll(const unsigned char *data, size_t size)
+{
+    ssize_t n;
+
+    while (size > 0)
+    {
+        if ((n = write(g_bpc.fd, data, size)) < 0)
+            return -1;
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/* Write to the new file, compressing into the cpool */
+static int
+WriteOut(const unsigned char *data, size_t size, int flush)
+{
+    int code;
+
+    if (!g_bpc.level)
+        return WriteAll(data, size);
+
+    g_bpc.z.next_in = (unsigned char *)data;
+    g_bpc.z.avail_in = size;
+    do
+    {
+        g_bpc.z.next_out = g_bpc.out;
+        g_bpc.z.avail_out = IOSIZE;
+        code = deflate(&g_bpc.z, flush);
+        if (code == Z_STREAM_ERROR ||
+                WriteAll(g_bpc.out, IOSIZE - g_bpc.z.avail_out))
+            return -1;
+    } while (g_bpc.z.avail_out == 0 || (flush && code != Z_STREAM_END));
+    return 0;
+}
+
+/*
+ * No pool file matches, so write the file after all: the first MB from
+ * memory and then, up to where the data is now, from the pool file that
+ * matched that far.
+ */
+static int
+StartNew(void)
+{
+    struct Reader *r = NULL;
+    uint64_t pos;
+    ssize_t n;
+
+    g_bpc.state = WRITE;
+    g_bpc.fd = open(g_bpc.path, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (g_bpc.fd < 0)
+        return Failed("create", g_bpc.path);
+    if (g_bpc.level && deflateInit(&g_bpc.z, g_bpc.level) != Z_OK)
+    {
+        close(g_bpc.fd);
+        g_bpc.fd = -1;
+        return Failed("compress", g_bpc.path);
+    }
+    if (WriteOut(g_bpc.head.data, g_bpc.head.len, Z_NO_FLUSH))
+        return Failed("write", g_bpc.path);
+
+    if (g_bpc.done == g_bpc.head.len)
+        return 0;
+    if (!(r = OpenReader(g_bpc.matched)))
+        return Failed("open", g_bpc.matched);
+    /* The first MB, a whole number of reads, is skipped */
+    for (pos = 0; pos < g_bpc.done; pos += n)
+    {
+        n = g_bpc.done - pos < IOSIZE ? g_bpc.done - pos : IOSIZE;
+        if (ReadPool(r, g_bpc.cmp, n) != n || (pos >= g_bpc.head.len &&
+                    WriteOut(g_bpc.cmp, n, Z_NO_FLUSH)))
+        {
+            CloseReader(r);
+            return Failed("copy", g_bpc.matched);
+        }
+    }
+    CloseReader(r);
+    return 0;
+}
+
+/* Finish the new file and add it to the pool */
+static int
+AddToPool(void)
+{
+    char path[POOLPATH];
+    int code = 0;
+
+    if (g_bpc.fd < 0)
+        return -1;
+    if (WriteOut(NULL, 0, g_bpc.level ? Z_FINISH : Z_NO_FLUSH))
+        code = Failed("write", g_bpc.path);
+    if (g_bpc.level)
+        deflateEnd(&g_bpc.z);
+    if (close(g_bpc.fd) && !code)
+        code = Failed("write", g_bpc.path);
+    g_bpc.fd = -1;
+    if (code)
+        return code;
+    g_bpc.stats.newbytes += g_bpc.done;
+
+    for (;; g_bpc.chain++)
+    {
+        PoolPath(path);
+        if (link(g_bpc.path, path) == 0)
+            return 0;
+        if (errno == ENOENT)
+        {
+            /* The pool's directories are made as they are needed */
+            *strrchr(path, '/') = 0;
+            if (MakeDirs(path))
+                return Failed("create", path);
+            g_bpc.chain--;
+        }
+        else if (errno != EEXIST)
+            return Failed("pool", g_bpc.path);
+    }
+}
+
+int
+bpcstart(const char *backupdir, const char *share, int level)
+{
+    char top[MAXPATHLEN], *p;
+    struct stat st;
+    int i;
+
+    /* Anything left from a run that failed */
+    DropCandidates();
+    if (g_bpc.open && g_bpc.state == WRITE && g_bpc.fd >= 0)
+        close(g_bpc.fd);
+    FreeDirs();
+
+    g_bpc.level = level;
+    g_bpc.error = g_bpc.open = 0;
+    g_bpc.fd = -1;
+    memset(&g_bpc.stats, 0, sizeof(g_bpc.stats));
+    if (!g_bpc.head.data && !Grow(&g_bpc.head, DIGESTSIZE))
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    g_bpc.head.len = 0;
+
+    if (mkdir(backupdir, 0750) && errno != EEXIST)
+        return Failed("create", backupdir);
+    if (!realpath(backupdir, top))
+        return Failed("open", backupdir);
+
+    /* The pool is in TOPDIR, three levels up from the backup */
+    for (i = 0; i < 3 && (p = strrchr(top, '/')); i++)
+    {
+        if (i == 2 && strcmp(p, "/pc") != 0)
+            break;
+        *p = 0;
+    }
+    if (i < 3 || !top[0])
+    {
+        fprintf(stderr, "'%s' is not a BackupPC backup (TOPDIR/pc/HOST/N)\n",
+            backupdir);
+        return -1;
+    }
+    snprintf(g_bpc.pool, sizeof(g_bpc.pool), "%s/%s", top,
+        level ? "cpool" : "pool");
+    if (stat(g_bpc.pool, &st) || !S_ISDIR(st.st_mode))
+        return Failed("find the pool", g_bpc.pool);
+
+    snprintf(g_bpc.root, sizeof(g_bpc.root), "%s", backupdir);
+    if (Mangle(g_bpc.root, sizeof(g_bpc.root), share, strlen(share)) ||
+            !FindDir("."))
+        return Failed("create", g_bpc.root);
+    return 0;
+}
+
+int
+bpcadd(const struct BpcMember *m, const char *dir, const char *name)
+{
+    struct Dir *d;
+    const char *base;
+
+    if (g_bpc.open)
+        bpcend();
+
+    if (!name)
+    {
+        /* A directory is an entry of its parent */
+        if (!FindDir(dir))
+            return -1;
+        if (strcmp(dir, ".") == 0)
+            return 0;
+        if ((base = strrchr(dir, '/')))
+        {
+            char parent[MAXPATHLEN];
+
+            snprintf(parent, sizeof(parent), "%.*s", (int)(base - dir), dir);
+            d = FindDir(parent);
+            base++;
+        }
+        else
+        {
+            d = FindDir(".");
+            base = dir;
+        }
+        return d ? AddEntry(d, m, base, strlen(base)) : -1;
+    }
+
+    if (!(d = FindDir(dir)))
+        return -1;
+    snprintf(g_bpc.path, sizeof(g_bpc.path), "%s", d->path);
+    if (Mangle(g_bpc.path, sizeof(g_bpc.path), name, strlen(name)))
+    {
+        fprintf(stderr, "Path too long: '%s/%s'\n", dir, name);
+        g_bpc.error = 1;
+        return -1;
+    }
+    if (AddEntry(d, m, name, strlen(name)))
+        return -1;
+
+    g_bpc.open = 1;
+    g_bpc.state = HEAD;
+    g_bpc.size = m->size;
+    g_bpc.done = 0;
+    g_bpc.head.len = 0;
+    return 0;
+}
+
+int
+bpcwrite(const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    size_t n;
+
+    if (!g_bpc.open)
+        return -1;
+    if (g_bpc.state == HEAD)
+    {
+        n = DIGESTSIZE - g_bpc.head.len;
+        if (n > size)
+            n = size;
+        memcpy(g_bpc.head.data + g_bpc.head.len, p, n);
+        g_bpc.head.len += n;
+        g_bpc.done += n;
+        p += n;
+        size -= n;
+        if (!size)
+            return 0;
+
+        /* There is more than the digest needs, so the size is the one given */
+        FindCandidates(g_bpc.size);
+        g_bpc.state = MATCH;
+        if (!g_bpc.ncandidates && StartNew())
+            return -1;
+    }
+
+    if (g_bpc.state == MATCH)
+    {
+        Compare(p, size);
+        if (!g_bpc.ncandidates && StartNew())
+            return -1;
+    }
+    g_bpc.done += size;
+    if (g_bpc.state == WRITE && g_bpc.fd >= 0 &&
+            WriteOut(p, size, Z_NO_FLUSH))
+        return Failed("write", g_bpc.path);
+    return 0;
+}
+
+int
+bpcend(void)
+{
+    int i, code = 0;
+    unsigned char c;
+
+    if (!g_bpc.open)
+        return -1;
+    g_bpc.open = 0;
+    g_bpc.stats.files++;
+
+    if (g_bpc.done == 0)
+    {
+        /* BackupPC does not pool empty files */
+        if ((g_bpc.fd = open(g_bpc.path, O_WRONLY | O_CREAT | O_TRUNC,
+                        0640)) < 0)
+            return Failed("create", g_bpc.path);
+        close(g_bpc.fd);
+        g_bpc.fd = -1;
+        return 0;
+    }
+
+    if (g_bpc.state == HEAD)
+    {
+        /* All of it is in memory, so the size is what was written */
+        FindCandidates(g_bpc.done);
+        g_bpc.state = MATCH;
+    }
+
+    if (g_bpc.state == MATCH)
+    {
+        /* A candidate that is longer is not a match */
+        for (i = 0; i < g_bpc.ncandidates; i++)
+        {
+            if (ReadPool(g_bpc.candidates[i], &c, 1) == 0)
+                break;
+        }
+        if (i < g_bpc.ncandidates)
+        {
+            unlink(g_bpc.path);
+            if (link(g_bpc.candidates[i]->path, g_bpc.path) == 0)
+            {
+                g_bpc.stats.pooled++;
+                DropCandidates();
+                return 0;
+            }
+            code = Failed("link", g_bpc.candidates[i]->path);
+        }
+        if (g_bpc.ncandidates)
+        {
+            snprintf(g_bpc.matched, sizeof(g_bpc.matched), "%s",
+                g_bpc.candidates[0]->path);
+            DropCandidates();
+        }
+        if (StartNew())
+            return -1;
+    }
+    return AddToPool() || code ? -1 : 0;
+}
+
+static int
+CompareEntries(const void *a, const void *b)
+{
+    return strcmp((*(struct Entry * const *)a)->name,
+        (*(struct Entry * const *)b)->name);
+}
+
+/* Write a directory's attrib file, pooled like any other file */
+static int
+WriteAttrib(struct Dir *d, struct Buffer *b, struct Entry **sorted)
+{
+    struct BpcMember m;
+    struct Entry *e;
+    size_t i, len;
+    int code = 0;
+
+    for (i = 0, e = d->entries; e; e = e->next)
+        sorted[i++] = e;
+    qsort(sorted, d->count, sizeof(*sorted), CompareEntries);
+
+    b->len = 0;
+    if (!Grow(b, 4))
+        return -1;
+    putvalue(b->data, 4, ATTRIB_MAGIC);
+    for (i = 0; i < d->count && !code; i++)
+    {
+        e = sorted[i];
+        len = strlen(e->name);
+        code = PutNumber(b, len) || !Grow(b, len);
+        if (!code)
+        {
+            memcpy(b->data + b->len - len, e->name, len);
+            code = PutNumber(b, e->m.type) || PutNumber(b, e->m.mode) ||
+                PutNumber(b, e->m.uid) || PutNumber(b, e->m.gid) ||
+                PutNumber(b, e->m.size >> 32) ||
+                PutNumber(b, e->m.size & 0xffffffff) ||
+                PutLong(b, e->m.mtime);
+        }
+    }
+    if (code)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    memset(&m, 0, sizeof(m));
+    snprintf(g_bpc.path, sizeof(g_bpc.path), "%s/attrib", d->path);
+    g_bpc.open = 1;
+    g_bpc.state = HEAD;
+    g_bpc.size = b->len;
+    g_bpc.done = 0;
+    g_bpc.head.len = 0;
+    if (bpcwrite(b->data, b->len))
+    {
+        g_bpc.open = 0;
+        return -1;
+    }
+    return bpcend();
+}
+
+int
+bpcfinish(struct BpcStats *stats)
+{
+    struct Buffer attrib = { NULL, 0, 0 };
+    struct Entry **sorted = NULL;
+    struct Dir *d;
+    size_t most = 0;
+    int i;
+
+    if (g_bpc.open)
+        bpcend();
+
+    for (i = 0; i < DIRBUCKETS; i++)
+    {
+        for (d = g_bpc.dirs[i]; d; d = d->hashnext)
+        {
+            if (d->count > most)
+                most = d->count;
+        }
+    }
+    if (most && !(sorted = malloc(most * sizeof(*sorted))))
+    {
+        fprintf(stderr, "Out of memory\n");
+        g_bpc.error = 1;
+    }
+
+    for (i = 0; i < DIRBUCKETS && sorted; i++)
+    {
+        for (d = g_bpc.dirs[i]; d; d = d->hashnext)
+        {
+            /* BackupPC has no attrib file for an empty directory */
+            if (d->count && WriteAttrib(d, &attrib, sorted))
+                g_bpc.error = 1;
+        }
+    }
+    FreeDirs();
+    free(sorted);
+    free(attrib.data);
+
+    if (stats)
+        *stats = g_bpc.stats;
+    return g_bpc.error ? -1 : 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * A BackupPC (version 3) backup, written straight into its directory and
+ * pool instead of as an archive that BackupPC_tarExtract parses and then
+ * reads again to pool each file:
+ *
+ *   TOPDIR/pc/HOST/N/fSHARE/fdir/ffile   the files, under mangled names
+ *   TOPDIR/pc/HOST/N/fSHARE/fdir/attrib  the attributes of the entries of
+ *                                        the directory
+ *   TOPDIR/cpool/a/b/c/abc...[_K]        each distinct file once, hard linked
+ *                                        from the backups (pool if not
+ *                                        compressed)
+ *
+ * A name is mangled by escaping %, /, newline and carriage return as %xx and
+ * putting an f in front, so that it cannot clash with attrib.  A file is
+ * pooled under the MD5 of its size in decimal and its data, or of only the
+ * first 128 KB and the 128 KB before the end of its first MB if it is over
+ * 256 KB.  Different files with the same digest are chained as _0, _1 and so
+ * on.  Files in the cpool are zlib compressed.  Symlinks and hard links are
+ * files holding their target, as BackupPC_tarExtract writes them.
+ */
+
+/* Needed for size_t */
+#include <stddef.h>
+/* Needed for uint64_t */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* BackupPC's file types, as attrib files store them */
+enum
+{
+    BPC_FTYPE_FILE = 0, BPC_FTYPE_HARDLINK = 1, BPC_FTYPE_SYMLINK = 2,
+    BPC_FTYPE_DIR = 5
+};
+
+struct BpcMember
+{
+    int type;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t mtime;
+    uint64_t size;
+};
+
+struct BpcStats
+{
+    uint64_t files;             /* written, attrib files included */
+    uint64_t pooled;            /* of those, found in the pool already */
+    uint64_t newbytes;          /* in files added to the pool, uncompressed */
+};
+
+/*
+ * start() opens the backup directory TOPDIR/pc/HOST/N, making it if need be,
+ * and finds the pool from it: the cpool, compressing at level, or the pool if
+ * level is 0.  add() adds a member of a directory, which is "." or "./path";
+ * a directory is added with no name.  A member that is not a directory is
+ * followed by its data, given to write() in as many pieces as it likes, and
+ * then by end().  finish() writes the attrib files.  Errors are reported as
+ * they happen, and finish() returns -1 if there were any.
+ */
+int bpcstart(const char *backupdir, const char *share, int level);
+int bpcadd(const struct BpcMember *m, const char *dir, const char *name);
+int bpcwrite(const void *data, size_t size);
+int bpcend(void);
+int bpcfinish(struct BpcStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,772 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * A segment file is a header, blocks of entries sorted by path, a table of
+ * the archives the entries come from and a sparse index of the first path in
+ * each block.  Numbers are stored as varints, and each path as the length it
+ * shares with the path before it followed by the rest, starting over at each
+ * block so that a lookup only has to decode the block the index leads it to.
+ *
+ *   header   "tarcat1\n", then entry count, block count, source count and
+ *            the offsets of the source table and the index, as varints
+ *   entry    shared, suffix length, suffix, type, source, vnode, dataVersion,
+ *            size, mtime, offset
+ *   source   archive id length and archive id, volume length and volume
+ *   index    block offset, first path length and first path
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "catalog.h"
+#include "manifest.h"
+
+#define MAGIC "tarcat1\n"
+#define MAGICLEN 8
+/* Room for the header, which is rewritten once the offsets are known */
+#define HEADERSIZE 64
+#define BLOCKENTRIES 64
+#define MAXPATH (2 * MAXPATHLEN)
+
+struct Source
+{
+    char *archive;
+    char *volume;
+};
+
+struct Block
+{
+    uint64_t offset;
+    const char *first;
+    size_t firstlen;
+};
+
+struct Segment
+{
+    char file[MAXPATHLEN];
+    const unsigned char *data;
+    size_t size;
+    uint64_t count;
+    uint64_t blocksend;
+    uint32_t nblocks, nsources;
+    struct Block *blocks;
+    struct Source *sources;
+};
+
+struct Cursor
+{
+    struct Segment *seg;
+    uint64_t pos;
+    uint32_t block;             /* the block after the one being read */
+    char path[MAXPATH];
+    struct CatalogEntry e;
+    int source;
+};
+
+struct Writer
+{
+    FILE *out;
+    char file[MAXPATHLEN];
+    char tmpfile[MAXPATHLEN + 8];
+    uint64_t pos;
+    uint64_t count;
+    uint32_t nblocks;
+    int inblock;
+    char prev[MAXPATH];
+    size_t prevlen;
+    FILE *index;                /* built up in a temp file */
+};
+
+/* Varints are 7 bits at a time, low first, with the top bit set on all but
+ * the last byte */
+static void
+PutVarint(struct Writer *w, FILE *out, uint64_t v)
+{
+    do
+    {
+        int c = v & 0x7f;
+        v >>= 7;
+        putc(v ? c | 0x80 : c, out);
+        if (out == w->out)
+            w->pos++;
+    } while (v);
+}
+
+static int
+GetVarint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+    uint64_t value = 0;
+    int shift = 0;
+
+    while (*p < end && shift < 64)
+    {
+        unsigned char c = *(*p)++;
+        value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+        {
+            *v = value;
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+static void
+PutBytes(struct Writer *w, FILE *out, const void *data, size_t len)
+{
+    PutVarint(w, out, len);
+    fwrite(data, 1, len, out);
+    if (out == w->out)
+        w->pos += len;
+}
+
+static int
+ComparePaths(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+
+    if (c)
+        return c;
+    return alen < blen ? -1 : alen > blen;
+}
+
+static int
+WriterOpen(struct Writer *w, const char *dir, const char *tag)
+{
+    static unsigned int serial = 0;
+
+    memset(w, 0, sizeof(*w));
+    snprintf(w->file, sizeof(w->file), "%s/%ld-%s-%d-%u.seg", dir,
+            (long)time(NULL), tag, (int)getpid(), serial++);
+    snprintf(w->tmpfile, sizeof(w->tmpfile), "%s.tmp", w->file);
+    w->out = fopen(w->tmpfile, "w");
+    w->index = tmpfile();
+    if (!w->out || !w->index)
+    {
+        fprintf(stderr, "Cannot create '%s'. Code = %d\n", w->tmpfile, errno);
+        if (w->out)
+        {
+            fclose(w->out);
+            unlink(w->tmpfile);
+        }
+        if (w->index)
+            fclose(w->index);
+        return -1;
+    }
+    fseeko(w->out, HEADERSIZE, SEEK_SET);
+    w->pos = HEADERSIZE;
+    return 0;
+}
+
+/* Entries must be added in order of path */
+static void
+WriterAdd(struct Writer *w, const struct CatalogEntry *e, int source)
+{
+    size_t shared = 0;
+
+    if (w->inblock == BLOCKENTRIES)
+        w->inblock = 0;
+    if (w->inblock == 0)
+    {
+        /* A new block, indexed by its first path */
+        PutVarint(w, w->index, w->pos);
+        PutBytes(w, w->index, e->path, e->pathlen);
+        w->nblocks++;
+    }
+    else
+    {
+        while (shared < w->prevlen && shared < e->pathlen &&
+                w->prev[shared] == e->path[shared])
+            shared++;
+    }
+
+    PutVarint(w, w->out, shared);
+    PutBytes(w, w->out, e->path + shared, e->pathlen - shared);
+    putc(e->type, w->out);
+    w->pos++;
+    PutVarint(w, w->out, source);
+    PutVarint(w, w->out, e->vnode);
+    PutVarint(w, w->out, e->dataversion);
+    PutVarint(w, w->out, e->size);
+    PutVarint(w, w->out, e->mtime);
+    PutVarint(w, w->out, e->offset);
+
+    w->prevlen = e->pathlen < MAXPATH ? e->pathlen : MAXPATH;
+    memcpy(w->prev, e->path, w->prevlen);
+    w->inblock++;
+    w->count++;
+}
+
+/* Write the sources, the index and the header, and put the segment in place */
+static int
+WriterClose(struct Writer *w, const struct Source *sources, int nsources)
+{
+    uint64_t sourcesoffset = w->pos, indexoffset;
+    unsigned char header[HEADERSIZE];
+    struct Writer h;
+    FILE *hf;
+    size_t n;
+    int i;
+
+    for (i = 0; i < nsources; i++)
+    {
+        PutBytes(w, w->out, sources[i].archive, strlen(sources[i].archive));
+        PutBytes(w, w->out, sources[i].volume, strlen(sources[i].volume));
+    }
+
+    indexoffset = w->pos;
+    rewind(w->index);
+    while ((n = fread(header, 1, sizeof(header), w->index)) > 0)
+    {
+        fwrite(header, 1, n, w->out);
+        w->pos += n;
+    }
+    fclose(w->index);
+
+    /* The header is built in memory, then written over the reserved space */
+    memset(header, 0, sizeof(header));
+    memcpy(header, MAGIC, MAGICLEN);
+    hf = fmemopen(header + MAGICLEN, HEADERSIZE - MAGICLEN, "w");
+    memset(&h, 0, sizeof(h));
+    PutVarint(&h, hf, w->count);
+    PutVarint(&h, hf, w->nblocks);
+    PutVarint(&h, hf, nsources);
+    PutVarint(&h, hf, sourcesoffset);
+    PutVarint(&h, hf, indexoffset);
+    fclose(hf);
+
+    if (fseeko(w->out, 0, SEEK_SET) ||
+            fwrite(header, 1, HEADERSIZE, w->out) != HEADERSIZE ||
+            fflush(w->out) || fsync(fileno(w->out)) || fclose(w->out) ||
+            rename(w->tmpfile, w->file))
+    {
+        fprintf(stderr, "Could not write '%s'. Code = %d\n", w->tmpfile,
+                errno);
+        unlink(w->tmpfile);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+CompareRecords(const void *a, const void *b)
+{
+    const struct ManifestRecord *x = a, *y = b;
+
+    return ComparePaths(x->path, x->pathlen, y->path, y->pathlen);
+}
+
+int
+catalogadd(const char *dir, const char *manifest, const char *archive)
+{
+    struct Manifest m;
+    struct ManifestRecord r, *records = NULL;
+    size_t n = 0, allocated = 0, i;
+    struct Writer w;
+    struct Source source;
+    char volume[MAXPATHLEN] = "", tag[32] = "0";
+    const char *p;
+    int code;
+
+    if (manifestopen(manifest, &m))
+        return -1;
+
+    for (p = NULL; (p = manifestnext(&m, p, &r)); )
+    {
+        if (r.kind == 'V')
+        {
+            if (manifestpath(&r, volume, sizeof(volume)) < 0)
+                volume[0] = 0;
+            snprintf(tag, sizeof(tag), "%u", r.vnode);
+        }
+        if (r.kind != 'M' || r.type == 'a')
+            continue;
+        if (n == allocated)
+        {
+            allocated = allocated ? allocated * 2 : 4096;
+            records = realloc(records, allocated * sizeof(*records));
+            if (!records)
+            {
+                fprintf(stderr, "Out of memory cataloging '%s'\n", manifest);
+                manifestclose(&m);
+                return -1;
+            }
+        }
+        records[n++] = r;
+    }
+    qsort(records, n, sizeof(*records), CompareRecords);
+
+    if (WriterOpen(&w, dir, tag))
+    {
+        free(records);
+        manifestclose(&m);
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+    {
+        struct CatalogEntry e;
+
+        e.path = records[i].path;
+        e.pathlen = records[i].pathlen;
+        e.type = records[i].type;
+        e.vnode = records[i].vnode;
+        e.dataversion = records[i].dataversion;
+        e.size = records[i].size;
+        e.mtime = records[i].mtime;
+        e.offset = records[i].offset;
+        WriterAdd(&w, &e, 0);
+    }
+    source.archive = (char *)archive;
+    source.volume = volume;
+    code = WriterClose(&w, &source, 1);
+
+    free(records);
+    manifestclose(&m);
+    return code;
+}
+
+static void
+SegmentClose(struct Segment *s)
+{
+    uint32_t i;
+
+    if (s->sources)
+    {
+        for (i = 0; i < s->nsources; i++)
+        {
+            free(s->sources[i].archive);
+            free(s->sources[i].volume);
+        }
+    }
+    free(s->sources);
+    free(s->blocks);
+    if (s->data)
+        munmap((void *)s->data, s->size);
+    memset(s, 0, sizeof(*s));
+}
+
+static char *
+GetString(const unsigned char **p, const unsigned char *end)
+{
+    uint64_t len;
+    char *s;
+
+    if (GetVarint(p, end, &len) || len > (uint64_t)(end - *p))
+        return NULL;
+    s = malloc(len + 1);
+    if (s)
+    {
+        memcpy(s, *p, len);
+        s[len] = 0;
+    }
+    *p += len;
+    return s;
+}
+
+static int
+SegmentOpen(struct Segment *s, const char *file)
+{
+    const unsigned char *p, *end;
+    uint64_t count, nblocks, nsources, sourcesoffset, indexoffset, len;
+    struct stat st;
+    uint32_t i;
+    int fd;
+
+    memset(s, 0, sizeof(*s));
+    snprintf(s->file, sizeof(s->file), "%s", file);
+    fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st))
+    {
+        fprintf(stderr, "Cannot open '%s'. Code = %d\n", file, errno);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (st.st_size >= HEADERSIZE)
+    {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            s->data = data;
+            s->size = st.st_size;
+        }
+    }
+    close(fd);
+
+    if (!s->data || memcmp(s->data, MAGIC, MAGICLEN) != 0)
+    {
+        fprintf(stderr, "'%s' is not a catalog segment\n", file);
+        SegmentClose(s);
+        return -1;
+    }
+
+    p = s->data + MAGICLEN;
+    end = s->data + s->size;
+    if (GetVarint(&p, end, &count) || GetVarint(&p, end, &nblocks) ||
+            GetVarint(&p, end, &nsources) ||
+            GetVarint(&p, end, &sourcesoffset) ||
+            GetVarint(&p, end, &indexoffset) || sourcesoffset > s->size ||
+            indexoffset > s->size || nblocks > s->size ||
+            nsources > s->size)
+    {
+        fprintf(stderr, "'%s' has a bad header\n", file);
+        SegmentClose(s);
+        return -1;
+    }
+    s->count = count;
+    s->blocksend = sourcesoffset;
+    s->nblocks = nblocks;
+    s->nsources = nsources;
+    s->blocks = calloc(nblocks + 1, sizeof(struct Block));
+    s->sources = calloc(nsources + 1, sizeof(struct Source));
+
+    p = s->data + sourcesoffset;
+    for (i = 0; i < s->nsources; i++)
+    {
+        s->sources[i].archive = GetString(&p, end);
+        s->sources[i].volume = GetString(&p, end);
+        if (!s->sources[i].archive || !s->sources[i].volume)
+            break;
+    }
+
+    p = s->data + indexoffset;
+    for (i = 0; i < s->nblocks; i++)
+    {
+        if (GetVarint(&p, end, &s->blocks[i].offset) ||
+                GetVarint(&p, end, &len) || len > (uint64_t)(end - p) ||
+                s->blocks[i].offset > sourcesoffset)
+            break;
+        s->blocks[i].first = (const char *)p;
+        s->blocks[i].firstlen = len;
+        p += len;
+    }
+
+    if (i < s->nblocks || !s->sources || (s->nsources &&
+                !s->sources[s->nsources - 1].volume))
+    {
+        fprintf(stderr, "'%s' is damaged\n", file);
+        SegmentClose(s);
+        return -1;
+    }
+    return 0;
+}
+
+/* Position a cursor before the first entry that could start with prefix */
+static void
+CursorSeek(struct Cursor *c, struct Segment *s, const char *prefix,
+        size_t prefixlen)
+{
+    uint32_t lo = 0, hi = s->nblocks;
+
+    /* The last block whose first path sorts before the prefix */
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (ComparePaths(s->blocks[mid].first, s->blocks[mid].firstlen,
+                    prefix, prefixlen) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    memset(c, 0, sizeof(*c));
+    c->seg = s;
+    c->block = lo > 0 ? lo - 1 : 0;
+    c->pos = s->nblocks ? s->blocks[c->block].offset : s->blocksend;
+}
+
+/* Decode the next entry, returning 0 at the end of the segment */
+static int
+CursorNext(struct Cursor *c)
+{
+    struct Segment *s = c->seg;
+    const unsigned char *p = s->data + c->pos;
+    const unsigned char *end = s->data + s->blocksend;
+    uint64_t shared, len, source, vnode, dv, size, mtime, offset;
+
+    if (p >= end)
+        return 0;
+    if (c->block < s->nblocks && c->pos == s->blocks[c->block].offset)
+    {
+        /* The first entry of a block shares nothing with the one before */
+        c->e.pathlen = 0;
+        c->block++;
+    }
+
+    if (GetVarint(&p, end, &shared) || GetVarint(&p, end, &len) ||
+            shared > c->e.pathlen || shared + len > MAXPATH ||
+            len > (uint64_t)(end - p))
+    {
+        fprintf(stderr, "'%s' is damaged at %llu\n", s->file,
+                (unsigned long long)c->pos);
+        return 0;
+    }
+    memcpy(c->path + shared, p, len);
+    p += len;
+    c->e.path = c->path;
+    c->e.pathlen = shared + len;
+
+    if (p >= end)
+        return 0;
+    c->e.type = *p++;
+    if (GetVarint(&p, end, &source) || GetVarint(&p, end, &vnode) ||
+            GetVarint(&p, end, &dv) || GetVarint(&p, end, &size) ||
+            GetVarint(&p, end, &mtime) || GetVarint(&p, end, &offset) ||
+            source >= s->nsources)
+    {
+        fprintf(stderr, "'%s' is damaged at %llu\n", s->file,
+                (unsigned long long)c->pos);
+        return 0;
+    }
+    c->source = source;
+    c->e.archive = s->sources[source].archive;
+    c->e.volume = s->sources[source].volume;
+    c->e.vnode = vnode;
+    c->e.dataversion = dv;
+    c->e.size = size;
+    c->e.mtime = mtime;
+    c->e.offset = offset;
+    c->pos = p - s->data;
+    return 1;
+}
+
+/* List the segment files in the catalog */
+static int
+Segments(const char *dir, char ***files)
+{
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    int n = 0, allocated = 0;
+
+    *files = NULL;
+    if (!d)
+    {
+        fprintf(stderr, "Cannot open catalog '%s'. Code = %d\n", dir, errno);
+        return -1;
+    }
+    while ((de = readdir(d)))
+    {
+        size_t len = strlen(de->d_name);
+
+        if (len < 5 || strcmp(de->d_name + len - 4, ".seg") != 0)
+            continue;
+        if (n == allocated)
+        {
+            allocated = allocated ? allocated * 2 : 64;
+            *files = realloc(*files, allocated * sizeof(char *));
+        }
+        (*files)[n] = malloc(strlen(dir) + len + 2);
+        sprintf((*files)[n], "%s/%s", dir, de->d_name);
+        n++;
+    }
+    closedir(d);
+    return n;
+}
+
+static void
+FreeSegments(char **files, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        free(files[i]);
+    free(files);
+}
+
+/* Paths in archives start with "./" and do not end with "/" */
+static void
+Normalize(const char *pattern, char *buf, size_t size)
+{
+    size_t len;
+
+    if (strcmp(pattern, ".") == 0 || strncmp(pattern, "./", 2) == 0)
+        snprintf(buf, size, "%s", pattern);
+    else
+    {
+        while (*pattern == '/')
+            pattern++;
+        snprintf(buf, size, "./%s", pattern);
+    }
+    len = strlen(buf);
+    while (len > 1 && buf[len - 1] == '/')
+        buf[--len] = 0;
+}
+
+int
+catalogsearch(const char *dir, const char *pattern,
+        int (*visit)(const struct CatalogEntry *e, void *arg), void *arg)
+{
+    char full[MAXPATH + 3], path[MAXPATH + 1];
+    char **files;
+    size_t prefixlen;
+    int n, i, glob, stop = 0;
+
+    Normalize(pattern, full, sizeof(full));
+    prefixlen = strcspn(full, "*?[\\");
+    glob = full[prefixlen] != 0;
+
+    n = Segments(dir, &files);
+    if (n < 0)
+        return -1;
+
+    for (i = 0; i < n && !stop; i++)
+    {
+        struct Segment s;
+        struct Cursor c;
+
+        if (SegmentOpen(&s, files[i]))
+            continue;
+        CursorSeek(&c, &s, full, prefixlen);
+        while (!stop && CursorNext(&c))
+        {
+            int cmp = memcmp(c.e.path, full, c.e.pathlen < prefixlen ?
+                    c.e.pathlen : prefixlen);
+
+            if (cmp < 0 || (cmp == 0 && c.e.pathlen < prefixlen))
+                continue;
+            if (cmp > 0)
+                break;
+            /* Only whole components match, so foo/ba is not foo/bar */
+            if (!glob && c.e.pathlen > prefixlen &&
+                    c.e.path[prefixlen] != '/')
+                continue;
+            if (glob)
+            {
+                memcpy(path, c.e.path, c.e.pathlen);
+                path[c.e.pathlen] = 0;
+                if (fnmatch(full, path, 0) != 0)
+                    continue;
+            }
+            stop = visit(&c.e, arg);
+        }
+        SegmentClose(&s);
+    }
+
+    FreeSegments(files, n);
+    return 0;
+}
+
+/* A heap of cursors, ordered by their current path */
+static int
+CursorLess(struct Cursor *a, struct Cursor *b)
+{
+    int c = ComparePaths(a->e.path, a->e.pathlen, b->e.path, b->e.pathlen);
+
+    /* Older segments first, so merging again gives the same order */
+    return c < 0 || (c == 0 && strcmp(a->seg->file, b->seg->file) < 0);
+}
+
+static void
+SiftDown(struct Cursor **heap, int n, int i)
+{
+    for (;;)
+    {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        struct Cursor *t;
+
+        if (l < n && CursorLess(heap[l], heap[m]))
+            m = l;
+        if (r < n && CursorLess(heap[r], heap[m]))
+            m = r;
+        if (m == i)
+            return;
+        t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+int
+catalogcompact(const char *dir)
+{
+    char **files;
+    struct Segment *segs;
+    struct Cursor *cursors, **heap;
+    struct Source *sources;
+    int *base;
+    int n, i, nheap = 0, nsources = 0, code;
+    struct Writer w;
+
+    n = Segments(dir, &files);
+    if (n <= 1)
+    {
+        FreeSegments(files, n > 0 ? n : 0);
+        return n < 0 ? -1 : 0;
+    }
+
+    segs = calloc(n, sizeof(*segs));
+    cursors = calloc(n, sizeof(*cursors));
+    heap = calloc(n, sizeof(*heap));
+    base = calloc(n, sizeof(*base));
+    for (i = 0; i < n; i++)
+    {
+        if (SegmentOpen(&segs[i], files[i]))
+        {
+            /* Leave the catalog alone rather than lose a damaged segment */
+            code = -1;
+            goto out;
+        }
+        base[i] = nsources;
+        nsources += segs[i].nsources;
+    }
+
+    sources = calloc(nsources, sizeof(*sources));
+    for (i = 0; i < n; i++)
+    {
+        memcpy(sources + base[i], segs[i].sources,
+                segs[i].nsources * sizeof(*sources));
+        CursorSeek(&cursors[i], &segs[i], "", 0);
+        if (CursorNext(&cursors[i]))
+            heap[nheap++] = &cursors[i];
+    }
+    for (i = nheap / 2 - 1; i >= 0; i--)
+        SiftDown(heap, nheap, i);
+
+    code = WriterOpen(&w, dir, "all");
+    if (code == 0)
+    {
+        while (nheap > 0)
+        {
+            struct Cursor *c = heap[0];
+
+            WriterAdd(&w, &c->e, base[c->seg - segs] + c->source);
+            if (!CursorNext(c))
+                heap[0] = heap[--nheap];
+            SiftDown(heap, nheap, 0);
+        }
+        code = WriterClose(&w, sources, nsources);
+    }
+    free(sources);
+
+    /* Only now that the merged segment is in place can the old ones go */
+    for (i = 0; code == 0 && i < n; i++)
+        unlink(files[i]);
+
+out:
+    for (i = 0; i < n; i++)
+        SegmentClose(&segs[i]);
+    free(segs);
+    free(cursors);
+    free(heap);
+    free(base);
+    FreeSegments(files, n);
+    return code;
+}
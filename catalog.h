@@ -0,0 +1,49 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * A catalog is a directory of segment files, each listing the members of one
+ * or more archives sorted by path, so that the archives holding a path can be
+ * found without reading them.  tarvol adds a segment for each archive it
+ * writes, and compaction merges the segments into one.
+ */
+
+/* Needed for uint64_t */
+#include <stdint.h>
+/* Needed for size_t */
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct CatalogEntry
+{
+    const char *archive;
+    const char *volume;
+    const char *path;           /* escaped as in the manifest, not terminated */
+    size_t pathlen;
+    char type;
+    uint32_t vnode;
+    uint32_t dataversion;
+    uint32_t mtime;
+    uint64_t size;
+    uint64_t offset;
+};
+
+/* Add a segment for the archive described by a manifest */
+int catalogadd(const char *dir, const char *manifest, const char *archive);
+/*
+ * Call visit for each entry whose path is pattern or below it or, if pattern
+ * has wildcards, matches it.  Stops early if visit returns nonzero.
+ */
+int catalogsearch(const char *dir, const char *pattern,
+        int (*visit)(const struct CatalogEntry *e, void *arg), void *arg);
+/* Merge every segment in the catalog into one */
+int catalogcompact(const char *dir);
+
+#ifdef __cplusplus
+}
+#endif
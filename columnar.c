@@ -0,0 +1,754 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Writing and reading of columnar archives (see columnar.h).  While the data
+ * is being written, the columns of the current block are kept in memory, and
+ * finished blocks are compressed into a temporary file that becomes the
+ * footer, so memory use does not grow with the size of the volume.
+ *
+ * The dictionary for small files is trained much as zstd's COVER trainer
+ * does: the samples are cut into as many epochs as the dictionary has
+ * segments, and from each epoch the segment whose 8-byte substrings are found
+ * in the most samples is taken, after which those substrings count for
+ * nothing, so that the segments do not repeat each other.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "columnar.h"
+#include "record.h"
+
+#define TRAILERSIZE 32
+#define MAXPATH 4096
+/* Count, then offset, compressed and raw length of each of n columns */
+#define BLOCKENTRY(n) (4 + (n) * 16)
+/* Train the dictionary on this much of the first small files */
+#define SAMPLEBYTES (1 << 20)
+#define SEGMENT 256
+#define DMER 8
+#define DMERBITS 20
+
+/* Bytes per value of each column, 0 for paths */
+static const int g_widths[COL_COUNT] = {
+    1, 0, 8, 8, 4, 4, 4, 4, 4, 4, 4, 1, 4
+};
+
+struct Buffer
+{
+    unsigned char *data;
+    size_t len, size;
+};
+
+struct ColumnarBlock
+{
+    uint32_t count;
+    struct
+    {
+        uint64_t offset;
+        uint32_t length, rawlength;
+    } col[COL_COUNT];
+};
+
+struct ColumnarCursor
+{
+    uint32_t block, next;       /* the member next() returns next */
+    int loaded;
+    struct Buffer col[COL_COUNT];
+    size_t pathpos;
+    size_t pathlen;
+    char path[MAXPATH];
+};
+
+static struct
+{
+    FILE *blocks;
+    uint64_t blockbytes;
+    struct Buffer col[COL_COUNT];
+    struct Buffer index;
+    uint32_t count, nblocks;
+    uint64_t members;
+    char last[MAXPATH];
+    size_t lastlen;
+    /* Small files */
+    size_t small;
+    struct Buffer dict, samples, sizes, packed;
+    z_stream z;
+    int deflating;
+} g_writer;
+
+/* Make room for n more bytes */
+static unsigned char *
+Grow(struct Buffer *b, size_t n)
+{
+    if (b->len + n > b->size)
+    {
+        size_t size = b->size ? b->size : 4096;
+        unsigned char *data;
+
+        while (size < b->len + n)
+            size *= 2;
+        data = realloc(b->data, size);
+        if (!data)
+            return NULL;
+        b->data = data;
+        b->size = size;
+    }
+    b->len += n;
+    return b->data + b->len - n;
+}
+
+static int
+PutValue(struct Buffer *b, int width, uint64_t value)
+{
+    unsigned char *p = Grow(b, width);
+
+    if (!p)
+        return -1;
+    putvalue(p, width, value);
+    return 0;
+}
+
+static int
+PutNumber(struct Buffer *b, uint64_t value)
+{
+    unsigned char *p;
+
+    do
+    {
+        if (!(p = Grow(b, 1)))
+            return -1;
+        *p = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+        value >>= 7;
+    } while (value);
+    return 0;
+}
+
+static int
+GetNumber(const struct Buffer *b, size_t *pos, uint64_t *value)
+{
+    int shift;
+
+    *value = 0;
+    for (shift = 0; *pos < b->len && shift < 64; shift += 7)
+    {
+        unsigned char c = b->data[(*pos)++];
+
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+static void
+ResetWriter(void)
+{
+    int i;
+
+    for (i = 0; i < COL_COUNT; i++)
+        free(g_writer.col[i].data);
+    free(g_writer.index.data);
+    free(g_writer.dict.data);
+    free(g_writer.samples.data);
+    free(g_writer.sizes.data);
+    free(g_writer.packed.data);
+    if (g_writer.deflating)
+        deflateEnd(&g_writer.z);
+    if (g_writer.blocks)
+        fclose(g_writer.blocks);
+    memset(&g_writer, 0, sizeof(g_writer));
+}
+
+int
+columnarstart(FILE *out, uint32_t volumeid, const char *volumename)
+{
+    size_t len = strlen(volumename);
+
+    ResetWriter();
+
+    g_writer.blocks = tmpfile();
+    if (!g_writer.blocks)
+    {
+        fprintf(stderr, "Could not create temp file for the footer\n");
+        return -1;
+    }
+
+    if (len > 255)
+        len = 255;
+    if (PutValue(&g_writer.index, 4, volumeid) ||
+            PutValue(&g_writer.index, 1, len) ||
+            !Grow(&g_writer.index, len) ||
+            PutValue(&g_writer.index, 4, 0))
+        return -1;
+    memcpy(g_writer.index.data + 5, volumename, len);
+
+    if (fwrite(COLUMNAR_MAGIC, 1, 8, out) != 8)
+        return -1;
+    return 8;
+}
+
+/* Compress the columns of the current block into the footer */
+static int
+FlushBlock(void)
+{
+    unsigned char *entry, *p;
+    int i;
+
+    if (!g_writer.count)
+        return 0;
+    if (!(entry = Grow(&g_writer.index, BLOCKENTRY(COL_COUNT))))
+        return -1;
+    putvalue(entry, 4, g_writer.count);
+
+    for (i = 0, p = entry + 4; i < COL_COUNT; i++, p += 16)
+    {
+        struct Buffer *b = &g_writer.col[i];
+        uLongf length = compressBound(b->len);
+        unsigned char *z = malloc(length);
+
+        if (!z || compress2(z, &length, b->data, b->len, 6) != Z_OK ||
+                fwrite(z, 1, length, g_writer.blocks) != length)
+        {
+            free(z);
+            return -1;
+        }
+        free(z);
+        putvalue(p, 8, g_writer.blockbytes);
+        putvalue(p + 8, 4, length);
+        putvalue(p + 12, 4, b->len);
+        g_writer.blockbytes += length;
+        b->len = 0;
+    }
+
+    g_writer.nblocks++;
+    g_writer.count = 0;
+    g_writer.lastlen = 0;
+    return 0;
+}
+
+int
+columnaradd(const struct ColumnarMember *m, const char *dir, const char *name)
+{
+    char path[MAXPATH];
+    size_t len, shared;
+    unsigned char *p;
+    struct Buffer *c = g_writer.col;
+
+    if (!g_writer.blocks)
+        return -1;
+
+    /* Directories end in a slash, as tar lists them */
+    len = snprintf(path, sizeof path, "%s/%s", dir, name ? name : "");
+    if (len >= sizeof path)
+        len = sizeof path - 1;
+    for (shared = 0; shared < len && shared < g_writer.lastlen &&
+            path[shared] == g_writer.last[shared]; shared++)
+        ;
+
+    if (PutNumber(&c[COL_PATH], shared) ||
+            PutNumber(&c[COL_PATH], len - shared) ||
+            !(p = Grow(&c[COL_PATH], len - shared)))
+        return -1;
+    memcpy(p, path + shared, len - shared);
+    memcpy(g_writer.last, path, len);
+    g_writer.lastlen = len;
+
+    if (PutValue(&c[COL_TYPE], 1, m->type) ||
+            PutValue(&c[COL_SIZE], 8, m->size) ||
+            PutValue(&c[COL_OFFSET], 8, m->offset) ||
+            PutValue(&c[COL_MODE], 4, m->mode) ||
+            PutValue(&c[COL_OWNER], 4, m->owner) ||
+            PutValue(&c[COL_GROUP], 4, m->group) ||
+            PutValue(&c[COL_MTIME], 4, m->mtime) ||
+            PutValue(&c[COL_VNODE], 4, m->vnode) ||
+            PutValue(&c[COL_UNIQUIFIER], 4, m->uniquifier) ||
+            PutValue(&c[COL_DATAVERSION], 4, m->dataversion) ||
+            PutValue(&c[COL_CODEC], 1, m->codec) ||
+            PutValue(&c[COL_STORED], 4, m->stored))
+        return -1;
+
+    g_writer.members++;
+    if (++g_writer.count == COLUMNAR_BLOCK)
+        return FlushBlock();
+    return 0;
+}
+
+long long
+columnarfinish(FILE *out)
+{
+    unsigned char trailer[TRAILERSIZE], *z = NULL;
+    uLongf length;
+    size_t n, namelen;
+    long long ret = -1;
+
+    if (!g_writer.blocks || FlushBlock())
+        goto done;
+
+    /* The block count goes after the volume name, the dictionary last */
+    namelen = g_writer.index.data[4];
+    putvalue(g_writer.index.data + 5 + namelen, 4, g_writer.nblocks);
+    if (PutValue(&g_writer.index, 4, g_writer.dict.len) ||
+            !Grow(&g_writer.index, g_writer.dict.len))
+        goto done;
+    if (g_writer.dict.len)
+        memcpy(g_writer.index.data + g_writer.index.len - g_writer.dict.len,
+                g_writer.dict.data, g_writer.dict.len);
+    length = compressBound(g_writer.index.len);
+    z = malloc(length);
+    if (!z || compress2(z, &length, g_writer.index.data, g_writer.index.len,
+                6) != Z_OK)
+        goto done;
+
+    rewind(g_writer.blocks);
+    while ((n = fread(g_writer.index.data, 1, g_writer.index.size,
+                    g_writer.blocks)) > 0)
+    {
+        if (fwrite(g_writer.index.data, 1, n, out) != n)
+            goto done;
+    }
+    if (ferror(g_writer.blocks) || fwrite(z, 1, length, out) != length)
+        goto done;
+
+    putvalue(trailer, 8, g_writer.blockbytes + length + TRAILERSIZE);
+    putvalue(trailer + 8, 4, length);
+    putvalue(trailer + 12, 4, g_writer.index.len);
+    putvalue(trailer + 16, 8, g_writer.members);
+    memcpy(trailer + 24, COLUMNAR_MAGIC, 8);
+    if (fwrite(trailer, 1, TRAILERSIZE, out) != TRAILERSIZE)
+        goto done;
+    ret = g_writer.blockbytes + length + TRAILERSIZE;
+
+done:
+    if (ret < 0)
+        fprintf(stderr, "Could not write the archive's metadata. Code = %d\n",
+                errno);
+    free(z);
+    ResetWriter();
+    return ret;
+}
+
+static uint32_t
+HashDmer(const unsigned char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 0x9e3779b97f4a7c15ull) >> (64 - DMERBITS);
+}
+
+/* Train a dictionary on the samples (see the top of the file) */
+static int
+Train(void)
+{
+    const unsigned char *s = g_writer.samples.data;
+    size_t n = g_writer.samples.len, nsamples = g_writer.sizes.len / 4;
+    size_t i, j, k, start, end, epoch, epochs, best, tail = COLUMNAR_DICTSIZE;
+    uint32_t *hash, *freq, *seen;
+    uint64_t score, bestscore;
+
+    if (n < 2 * SEGMENT)
+        return 0;
+    hash = malloc(n * sizeof(*hash));
+    freq = calloc(1 << DMERBITS, sizeof(*freq));
+    seen = calloc(1 << DMERBITS, sizeof(*seen));
+    if (!hash || !freq || !seen || !Grow(&g_writer.dict, COLUMNAR_DICTSIZE))
+    {
+        free(hash);
+        free(freq);
+        free(seen);
+        return -1;
+    }
+
+    /* How many samples each substring is in */
+    for (i = 0, k = 0, start = 0; k < nsamples; k++, start = end)
+    {
+        end = start + getvalue(g_writer.sizes.data + 4 * k, 4);
+        for (i = start; i + DMER <= end; i++)
+        {
+            hash[i] = HashDmer(s + i);
+            if (seen[hash[i]] != k + 1)
+            {
+                seen[hash[i]] = k + 1;
+                freq[hash[i]]++;
+            }
+        }
+        /* Substrings that run into the next sample count for nothing */
+        for (; i < end; i++)
+            hash[i] = 0;
+    }
+    freq[0] = 0;
+
+    epochs = COLUMNAR_DICTSIZE / SEGMENT;
+    epoch = n / epochs;
+    if (epoch < SEGMENT)
+    {
+        epoch = SEGMENT;
+        epochs = n / SEGMENT;
+    }
+    for (k = 0; k < epochs && tail >= SEGMENT; k++)
+    {
+        start = k * epoch;
+        end = start + epoch;
+        if (end > n)
+            end = n;
+        /* Slide a segment through the epoch, scoring its substrings */
+        for (i = start, score = 0; i < start + SEGMENT - DMER + 1; i++)
+            score += freq[hash[i]] > 1 ? freq[hash[i]] : 0;
+        best = start;
+        bestscore = score;
+        for (i = start + 1; i + SEGMENT <= end; i++)
+        {
+            j = i + SEGMENT - DMER;
+            score -= freq[hash[i - 1]] > 1 ? freq[hash[i - 1]] : 0;
+            score += freq[hash[j]] > 1 ? freq[hash[j]] : 0;
+            if (score > bestscore)
+            {
+                best = i;
+                bestscore = score;
+            }
+        }
+        if (!bestscore)
+            continue;
+
+        /* The first segments go last, nearest what they will be used for */
+        tail -= SEGMENT;
+        memcpy(g_writer.dict.data + tail, s + best, SEGMENT);
+        for (i = best; i < best + SEGMENT - DMER + 1; i++)
+            freq[hash[i]] = 0;
+    }
+
+    g_writer.dict.len = COLUMNAR_DICTSIZE - tail;
+    memmove(g_writer.dict.data, g_writer.dict.data + tail, g_writer.dict.len);
+    free(hash);
+    free(freq);
+    free(seen);
+    return 0;
+}
+
+int
+columnarsmall(size_t threshold, const char *dictfile)
+{
+    FILE *f;
+    long size;
+
+    g_writer.small = threshold;
+    if (deflateInit2(&g_writer.z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    g_writer.deflating = 1;
+    if (!dictfile)
+        return 0;
+
+    /* A longer dictionary is cut to its end, which deflate finds nearest */
+    if (!(f = fopen(dictfile, "r")))
+    {
+        fprintf(stderr, "Cannot open '%s'. Code = %d\n", dictfile, errno);
+        return -1;
+    }
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > COLUMNAR_DICTSIZE)
+        fseek(f, size - COLUMNAR_DICTSIZE, SEEK_SET);
+    else
+        rewind(f);
+    g_writer.dict.len = 0;
+    if (Grow(&g_writer.dict, COLUMNAR_DICTSIZE))
+        g_writer.dict.len = fread(g_writer.dict.data, 1, COLUMNAR_DICTSIZE, f);
+    fclose(f);
+    if (!g_writer.dict.len)
+    {
+        fprintf(stderr, "No dictionary in '%s'\n", dictfile);
+        return -1;
+    }
+    return 0;
+}
+
+const void *
+columnarpack(struct ColumnarMember *m, const void *data)
+{
+    unsigned char *p;
+    uLong bound;
+
+    m->codec = CODEC_RAW;
+    m->stored = 0;
+    if (!g_writer.deflating || m->size > g_writer.small || !m->size)
+        return data;
+
+    /* Until there is a dictionary, the files are samples for one */
+    if (!g_writer.dict.len && g_writer.samples.len < SAMPLEBYTES)
+    {
+        if ((p = Grow(&g_writer.samples, m->size)))
+            memcpy(p, data, m->size);
+        if (p && (p = Grow(&g_writer.sizes, 4)))
+            putvalue(p, 4, m->size);
+        if (g_writer.samples.len >= SAMPLEBYTES && Train())
+            fprintf(stderr, "Could not train a dictionary\n");
+    }
+
+    deflateReset(&g_writer.z);
+    if (g_writer.dict.len)
+        deflateSetDictionary(&g_writer.z, g_writer.dict.data,
+                g_writer.dict.len);
+    bound = deflateBound(&g_writer.z, m->size);
+    g_writer.packed.len = 0;
+    if (!Grow(&g_writer.packed, bound))
+        return data;
+    g_writer.z.next_in = (unsigned char *)data;
+    g_writer.z.avail_in = m->size;
+    g_writer.z.next_out = g_writer.packed.data;
+    g_writer.z.avail_out = bound;
+    if (deflate(&g_writer.z, Z_FINISH) != Z_STREAM_END ||
+            bound - g_writer.z.avail_out >= m->size)
+        return data;
+
+    m->codec = g_writer.dict.len ? CODEC_DICTIONARY : CODEC_DEFLATE;
+    m->stored = bound - g_writer.z.avail_out;
+    return g_writer.packed.data;
+}
+
+/* Read and decompress length bytes at offset into b, which holds rawlength */
+static int
+ReadCompressed(FILE *in, uint64_t offset, uint32_t length, uint32_t rawlength,
+    struct Buffer *b)
+{
+    unsigned char *z = malloc(length ? length : 1);
+    uLongf n = rawlength;
+    int ret = -1;
+
+    b->len = 0;
+    if (z && Grow(b, rawlength ? rawlength : 1) &&
+            fseeko(in, offset, SEEK_SET) == 0 &&
+            fread(z, 1, length, in) == length &&
+            uncompress(b->data, &n, z, length) == Z_OK && n == rawlength)
+    {
+        b->len = rawlength;
+        ret = 0;
+    }
+    free(z);
+    return ret;
+}
+
+int
+columnaropen(FILE *in, struct Columnar *c, int columns)
+{
+    unsigned char magic[8], trailer[TRAILERSIZE], *p;
+    struct Buffer index = { NULL, 0, 0 };
+    uint64_t size, length, blocks;
+    uint32_t i, j, namelen;
+
+    memset(c, 0, sizeof(*c));
+    c->in = in;
+    c->columns = columns;
+
+    if (fseeko(in, 0, SEEK_SET) || fread(magic, 1, 8, in) != 8 ||
+            (memcmp(magic, COLUMNAR_MAGIC, 8) &&
+             memcmp(magic, COLUMNAR_MAGIC1, 8)) ||
+            fseeko(in, 0, SEEK_END) || (size = ftello(in)) <
+            8 + TRAILERSIZE || fseeko(in, size - TRAILERSIZE, SEEK_SET) ||
+            fread(trailer, 1, TRAILERSIZE, in) != TRAILERSIZE ||
+            memcmp(trailer + 24, magic, 8))
+    {
+        fprintf(stderr, "Not a columnar archive\n");
+        return -1;
+    }
+
+    c->footersize = getvalue(trailer, 8);
+    length = getvalue(trailer + 8, 4);
+    c->members = getvalue(trailer + 16, 8);
+    if (c->footersize > size - 8 || length + TRAILERSIZE > c->footersize)
+    {
+        fprintf(stderr, "Columnar archive is truncated\n");
+        return -1;
+    }
+    c->footer = size - c->footersize;
+
+    if (ReadCompressed(in, size - TRAILERSIZE - length, length,
+                getvalue(trailer + 12, 4), &index) || index.len < 9 ||
+            (namelen = index.data[4]) + 9 > index.len)
+        goto bad;
+    c->volumeid = getvalue(index.data, 4);
+    memcpy(c->volumename, index.data + 5, namelen);
+    c->volumename[namelen] = 0;
+    c->nblocks = getvalue(index.data + 5 + namelen, 4);
+    c->ncolumns = memcmp(magic, COLUMNAR_MAGIC1, 8) ? COL_COUNT : COL_COUNT1;
+    blocks = 9 + namelen + (uint64_t)c->nblocks * BLOCKENTRY(c->ncolumns);
+    if (c->ncolumns == COL_COUNT1 ? index.len != blocks :
+            index.len < blocks + 4 || index.len != blocks + 4 +
+            (c->dictlen = getvalue(index.data + blocks, 4)))
+        goto bad;
+    if (c->dictlen)
+    {
+        if (!(c->dict = malloc(c->dictlen)))
+            goto bad;
+        memcpy(c->dict, index.data + blocks + 4, c->dictlen);
+    }
+
+    c->blocks = calloc(c->nblocks ? c->nblocks : 1, sizeof(*c->blocks));
+    c->cursor = calloc(1, sizeof(*c->cursor));
+    if (!c->blocks || !c->cursor)
+        goto bad;
+    for (i = 0, p = index.data + 9 + namelen; i < c->nblocks; i++)
+    {
+        c->blocks[i].count = getvalue(p, 4);
+        for (j = 0, p += 4; j < c->ncolumns; j++, p += 16)
+        {
+            c->blocks[i].col[j].offset = c->footer + getvalue(p, 8);
+            c->blocks[i].col[j].length = getvalue(p + 8, 4);
+            c->blocks[i].col[j].rawlength = getvalue(p + 12, 4);
+        }
+    }
+    free(index.data);
+    return 0;
+
+bad:
+    fprintf(stderr, "Columnar archive has a bad index\n");
+    free(index.data);
+    columnarclose(c);
+    return -1;
+}
+
+/* Decompress the chosen columns of the next block */
+static int
+LoadBlock(struct Columnar *c)
+{
+    struct ColumnarCursor *cur = c->cursor;
+    struct ColumnarBlock *b = &c->blocks[cur->block];
+    int i;
+
+    for (i = 0; i < c->ncolumns; i++)
+    {
+        if (!(c->columns & (1 << i)))
+            continue;
+        if (ReadCompressed(c->in, b->col[i].offset, b->col[i].length,
+                    b->col[i].rawlength, &cur->col[i]) ||
+                (g_widths[i] && cur->col[i].len !=
+                 (uint64_t)b->count * g_widths[i]))
+        {
+            fprintf(stderr, "Block %u of the archive is damaged\n",
+                    cur->block);
+            return -1;
+        }
+    }
+    cur->loaded = 1;
+    cur->next = 0;
+    cur->pathpos = cur->pathlen = 0;
+    return 0;
+}
+
+int
+columnarnext(struct Columnar *c, struct ColumnarMember *m, const char **path)
+{
+    struct ColumnarCursor *cur = c->cursor;
+    uint64_t shared, len;
+    uint32_t n;
+
+    while (cur->block < c->nblocks && (!cur->loaded ||
+                cur->next >= c->blocks[cur->block].count))
+    {
+        if (cur->loaded)
+        {
+            cur->block++;
+            cur->loaded = 0;
+        }
+        else if (LoadBlock(c))
+            return -1;
+    }
+    if (cur->block >= c->nblocks)
+        return 0;
+
+    memset(m, 0, sizeof(*m));
+    *path = NULL;
+    n = cur->next++;
+    if (c->columns & (1 << COL_PATH))
+    {
+        struct Buffer *b = &cur->col[COL_PATH];
+
+        if (GetNumber(b, &cur->pathpos, &shared) ||
+                GetNumber(b, &cur->pathpos, &len) ||
+                shared > cur->pathlen || shared + len >= MAXPATH ||
+                len > b->len - cur->pathpos)
+        {
+            fprintf(stderr, "Paths in block %u are damaged\n", cur->block);
+            return -1;
+        }
+        memcpy(cur->path + shared, b->data + cur->pathpos, len);
+        cur->pathpos += len;
+        cur->pathlen = shared + len;
+        cur->path[cur->pathlen] = 0;
+        *path = cur->path;
+    }
+
+#define GET(column, field) \
+    if ((c->columns & (1 << column)) && column < c->ncolumns) \
+        m->field = getvalue(cur->col[column].data + n * g_widths[column], \
+                g_widths[column])
+    GET(COL_TYPE, type);
+    GET(COL_SIZE, size);
+    GET(COL_OFFSET, offset);
+    GET(COL_MODE, mode);
+    GET(COL_OWNER, owner);
+    GET(COL_GROUP, group);
+    GET(COL_MTIME, mtime);
+    GET(COL_VNODE, vnode);
+    GET(COL_UNIQUIFIER, uniquifier);
+    GET(COL_DATAVERSION, dataversion);
+    GET(COL_CODEC, codec);
+    GET(COL_STORED, stored);
+#undef GET
+    return 1;
+}
+
+int
+columnarread(struct Columnar *c, const struct ColumnarMember *m, void *buf)
+{
+    unsigned char *z = malloc(m->stored ? m->stored : 1);
+    z_stream s;
+    int ret = -1;
+
+    memset(&s, 0, sizeof(s));
+    if (!z || fseeko(c->in, m->offset, SEEK_SET) ||
+            fread(z, 1, m->stored, c->in) != m->stored ||
+            inflateInit2(&s, -15) != Z_OK)
+    {
+        free(z);
+        return -1;
+    }
+    if (m->codec == CODEC_DEFLATE || (m->codec == CODEC_DICTIONARY &&
+                c->dictlen && inflateSetDictionary(&s, c->dict,
+                    c->dictlen) == Z_OK))
+    {
+        s.next_in = z;
+        s.avail_in = m->stored;
+        s.next_out = buf;
+        s.avail_out = m->size;
+        if (inflate(&s, Z_FINISH) == Z_STREAM_END && s.avail_out == 0)
+            ret = 0;
+    }
+    inflateEnd(&s);
+    free(z);
+    return ret;
+}
+
+void
+columnarclose(struct Columnar *c)
+{
+    int i;
+
+    if (c->cursor)
+    {
+        for (i = 0; i < COL_COUNT; i++)
+            free(c->cursor->col[i].data);
+        free(c->cursor);
+    }
+    free(c->blocks);
+    free(c->dict);
+    c->cursor = NULL;
+    c->blocks = NULL;
+    c->dict = NULL;
+}
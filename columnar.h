@@ -0,0 +1,133 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * A columnar archive keeps the data of its members packed together and all
+ * of their metadata in a footer, so that listing or searching a huge volume
+ * reads a few MB from the end of the archive instead of a header from every
+ * 512 bytes of it:
+ *
+ *   magic "AFSCOLS2"
+ *   data       file contents, symlink targets and ACL scripts, back to back
+ *   blocks     the members in blocks of up to COLUMNAR_BLOCK, each column of
+ *              a block compressed with zlib on its own
+ *   index      zlib compressed: volume id and name, the number of blocks,
+ *              for each block its member count and where its columns are,
+ *              and the dictionary of small files
+ *   trailer    offset and lengths of the index, member count, magic again
+ *
+ * All numbers are big-endian.  Paths are prefix compressed: each is stored as
+ * the number of bytes it shares with the one before it in the block and the
+ * rest.  A hard link has the offset and size of the data of the file it is a
+ * link to, so restores can tell that they are the same file.
+ *
+ * Small files can be compressed, each on its own so that it can still be read
+ * with one seek, as raw deflate with a preset dictionary trained on the first
+ * of them (or taken from an earlier archive), which is what makes compressing
+ * files of a few KB worthwhile.  Archives from before this ("AFSCOLS1") lack
+ * the codec and stored columns and the dictionary, and are still read.
+ */
+
+/* Needed for FILE* */
+#include <stdio.h>
+/* Needed for uint64_t */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COLUMNAR_MAGIC "AFSCOLS2"
+#define COLUMNAR_MAGIC1 "AFSCOLS1"
+#define COLUMNAR_BLOCK 65536
+/* The most a dictionary can use of deflate's 32 KB window */
+#define COLUMNAR_DICTSIZE 32768
+
+/* The columns, which a reader can choose among */
+enum
+{
+    COL_TYPE, COL_PATH, COL_SIZE, COL_OFFSET, COL_MODE, COL_OWNER, COL_GROUP,
+    COL_MTIME, COL_VNODE, COL_UNIQUIFIER, COL_DATAVERSION, COL_CODEC,
+    COL_STORED, COL_COUNT
+};
+#define COL_ALL ((1 << COL_COUNT) - 1)
+/* The columns of an AFSCOLS1 archive */
+#define COL_COUNT1 COL_CODEC
+
+/* How a member's data is stored */
+enum { CODEC_RAW, CODEC_DEFLATE, CODEC_DICTIONARY };
+
+struct ColumnarMember
+{
+    char type;                  /* f, d, l, h (hard link) or a (ACL script) */
+    uint32_t vnode;
+    uint32_t uniquifier;
+    uint32_t dataversion;
+    uint32_t mtime;
+    uint32_t mode;
+    uint32_t owner;
+    uint32_t group;
+    uint64_t size;
+    uint64_t offset;            /* of the data, from the start of the archive */
+    char codec;
+    uint32_t stored;            /* bytes of compressed data */
+};
+
+/*
+ * Writing: start() writes the magic, add() records a member whose data the
+ * caller writes, and finish() appends the footer.  start() and finish()
+ * return the number of bytes they wrote, and all three return -1 on failure.
+ */
+int columnarstart(FILE *out, uint32_t volumeid, const char *volumename);
+int columnaradd(const struct ColumnarMember *m, const char *dir,
+        const char *name);
+long long columnarfinish(FILE *out);
+/*
+ * After start(), have files of up to threshold bytes compressed, with the
+ * dictionary in dictfile or, if it is NULL, one trained on the first of them.
+ * pack() compresses such a file's data, setting the member's codec and
+ * stored length, and returns what the caller is to write for it: the
+ * compressed data, or the data itself if it does not compress.
+ */
+int columnarsmall(size_t threshold, const char *dictfile);
+const void *columnarpack(struct ColumnarMember *m, const void *data);
+
+struct ColumnarBlock;
+struct ColumnarCursor;
+
+struct Columnar
+{
+    FILE *in;
+    uint32_t volumeid;
+    char volumename[256];
+    uint64_t members;
+    uint64_t footer;            /* where the metadata starts */
+    uint64_t footersize;        /* bytes of metadata, trailer included */
+    uint32_t nblocks;
+    int ncolumns;               /* fewer in older archives */
+    unsigned char *dict;
+    uint32_t dictlen;
+    struct ColumnarBlock *blocks;
+    int columns;                /* decoded by columnarnext() */
+    struct ColumnarCursor *cursor;
+};
+
+/*
+ * Reading: open() reads the trailer and index, and next() returns the members
+ * in order, decompressing only the chosen columns of each block.  next()
+ * returns 1 for a member, whose path stays valid until the next call, 0 at the
+ * end and -1 on failure.
+ */
+int columnaropen(FILE *in, struct Columnar *c, int columns);
+int columnarnext(struct Columnar *c, struct ColumnarMember *m,
+        const char **path);
+/* Read the data of a compressed member, which is m->size bytes */
+int columnarread(struct Columnar *c, const struct ColumnarMember *m,
+        void *buf);
+void columnarclose(struct Columnar *c);
+
+#ifdef __cplusplus
+}
+#endif
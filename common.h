@@ -14,8 +14,58 @@ extern "C" {
 
 extern uintmax_t bytecount;
 extern int acls, verbose;
+/* Write a columnar archive (see columnar.h) instead of tar */
+extern int columnar;
+/* In it, compress files up to this size, with the dictionary in dictfile */
+extern size_t smallfiles;
+extern const char *dictfile;
+/*
+ * Write a BackupPC backup into this directory instead (see bpcpool.h), of the
+ * share named, compressing into the cpool at the level given
+ */
+extern const char *backuppc;
+extern const char *sharename;
+extern int poollevel;
+extern const char *checkpoint;
+extern uintmax_t checkpointinterval;
+extern int resume;
+extern const char *statsfile;
+extern const char *progress;
+extern const char *manifest;
+extern const char *catalog;
+extern const char *archiveid;
+/* Threads decoding directories while converting, 0 to decode them inline */
+extern int dirthreads;
+/* How the dump and archive streams were set up, reported with -P */
+struct IOSetup
+{
+    long inpipe, outpipe;       /* pipe capacity, or 0 if not a pipe */
+    size_t inbuf, outbuf;       /* stdio buffer size */
+};
+extern struct IOSetup iosetup;
+void addrule(int include, const char *pattern);
+void resetcreate(void);
 int create(FILE *dumpfile, FILE *tarfile);
+int scan(FILE *dumpfile, FILE *report);
 int extract(FILE *tarfile, FILE *dumpfile);
+/* Exit status for a job the daemon is too busy to take (EX_TEMPFAIL) */
+#define EXIT_BUSY 75
+int serve(const char *path, int workers, int maxqueue,
+        int (*run)(int argc, char **argv));
+int submit(const char *path, int argc, char **argv);
+/*
+ * Encrypt and/or gzip an archive on its way to out; fclose() waits for it.
+ * When only compressing, an index of seekable frames can be written.
+ */
+FILE *pipeline(FILE *out, int level, const char *keyfile, uintmax_t chunksize,
+        FILE *frames);
+/* A member starts here, so end the frame if it is big enough */
+void pipelineframe(FILE *f);
+/*
+ * Upload what is written to s3://bucket/key, in parts of partsize bytes, this
+ * many at once; fclose() completes the object, or fails and aborts it.
+ */
+FILE *objstore(const char *url, size_t partsize, int uploads);
 
 #ifdef __cplusplus
 }
@@ -23,12 +23,48 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <tar.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include "bpcpool.h"
+#include "catalog.h"
+#include "columnar.h"
 #include "common.h"
+#include "manifest.h"
+#include "probes.h"
+#include "ratelimit.h"
+#include "record.h"
 #include "storage.h"
 
-static FILE *g_tarfile;
+static FILE *g_tarfile, *g_dumpfile;
+static FILE *g_manifest;
+static int g_scan = 0, g_seekable = 0;
+
+/* Include and exclude rules from the command line */
+struct Rule {
+    char *pattern;
+    int glob;
+    struct Rule *next;
+};
+static struct Rule *g_includes, *g_excludes;
+
+/* Statistics gathered by scan(), histograms in power-of-two buckets */
+#define NBUCKETS 48
+static struct {
+    afs_uint32 vnodes, files, dirs, symlinks, other;
+    afs_uint32 outoforder;
+    afs_uint32 aclentries, negativeacls;
+    afs_uint32 maxentries;
+    uintmax_t entries, filebytes, dirbytes;
+    afs_uint32 sizes[NBUCKETS];
+    afs_uint32 fanout[NBUCKETS];
+} g_stats;
 
     afs_int32
 readvalue(FILE *in, int size)
@@ -99,6 +135,20 @@ writechar(FILE *out, char value)
 #define BUFSIZE 16384
 char buf[BUFSIZE];
 
+/* Buffer for copying file data, enlarged for big volumes */
+#define MAXCOPYSIZE (1024 * 1024)
+static char *g_copybuf = buf;
+static size_t g_copysize = BUFSIZE;
+
+/* Progress through the dump, reported with -P */
+static struct {
+    FILE *dumpfile;
+    int fd;
+    time_t start, last;
+    afs_uint32 vnodes;
+    uintmax_t bytes;
+} g_progress;
+
     void
 readdata(in, buffer, size)
     FILE *in;
@@ -130,13 +180,49 @@ readdata(in, buffer, size)
     }
 }
 
+/* Skip over vnode data we do not need, seeking if the input allows it */
+static void
+skipdata(FILE *in, afs_sfsize_t size)
+{
+    if (g_seekable && fseeko(in, size, SEEK_CUR) == 0)
+        return;
+    readdata(in, NULL, size);
+}
+
+/*
+ * Write file data to the archive, within the output rate limit, and time it
+ * so the rate limits can back off
+ */
+static void
+WriteData(const char *data, size_t size)
+{
+    struct timespec start, end;
+
+    ratelimitoutput(size);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (backuppc)
+        bpcwrite(data, size);
+    else
+        fwrite(data, 1, size, g_tarfile);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ratelatency((end.tv_sec - start.tv_sec) +
+        (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+/* The fields of each record of the dump, in the order vos writes them */
+#define DUMPHEADER_FIELDS(X) \
+    X(DumpHeader, volumeid, INT, 'v', volumeId, 4, 0) \
+    X(DumpHeader, volumename, STRING, 'n', volumeName) \
+    X(DumpHeader, dumptimes, ARRAY, 't', dumpTimes, nDumpTimes, 1)
+
+RECORD(g_dumpheaderrecord, DUMPHEADER_FIELDS)
+
     afs_int32
 ReadDumpHeader(in, dh)
     FILE *in;
     struct DumpHeader *dh;     /* Defined in dump.h */
 {
-    int i, done;
-    char tag, c;
+    char tag;
     afs_int32 magic;
 
     memset(dh, 0, sizeof(*dh));
@@ -155,35 +241,7 @@ ReadDumpHeader(in, dh)
         exit(1);
     }
 
-    done = 0;
-    while (!done) {
-        tag = readchar(in);
-        switch (tag) {
-            case 'v':
-                dh->volumeId = ntohl(readvalue(in, 4));
-                break;
-
-            case 'n':
-                for (i = 0, c = 'a'; c != '\0'; i++) {
-                    dh->volumeName[i] = c = readchar(in);
-                }
-                dh->volumeName[i] = c;
-                break;
-
-            case 't':
-                dh->nDumpTimes = ntohl(readvalue(in, 2)) >> 1;
-                for (i = 0; i < dh->nDumpTimes; i++) {
-                    dh->dumpTimes[i].from = ntohl(readvalue(in, 4));
-                    dh->dumpTimes[i].to = ntohl(readvalue(in, 4));
-                }
-                break;
-
-            default:
-                done = 1;
-                break;
-        }
-    }
-
+    tag = decoderecord(in, &g_dumpheaderrecord, dh);
     return ((afs_int32) tag);
 }
 
@@ -215,138 +273,50 @@ struct volumeHeader {
     char message[1024];
 };
 
+#define VOLUMEHEADER_FIELDS(X) \
+    X(volumeHeader, volumeid, INT, 'i', volumeId, 4, 0) \
+    X(volumeHeader, version, SKIP, 'v', 4) \
+    X(volumeHeader, volumename, STRING, 'n', volumeName) \
+    X(volumeHeader, inservice, INT, 's', inService, 1, 0) \
+    X(volumeHeader, blessed, INT, 'b', blessed, 1, 0) \
+    X(volumeHeader, uniquifier, INT, 'u', uniquifier, 4, 0) \
+    X(volumeHeader, type, INT, 't', volType, 1, 0) \
+    X(volumeHeader, parent, INT, 'p', parentVol, 4, 0) \
+    X(volumeHeader, clone, INT, 'c', cloneId, 4, 0) \
+    X(volumeHeader, maxquota, INT, 'q', maxQuota, 4, 0) \
+    X(volumeHeader, minquota, INT, 'm', minQuota, 4, 0) \
+    X(volumeHeader, diskused, INT, 'd', diskUsed, 4, 0) \
+    X(volumeHeader, filecount, INT, 'f', fileCount, 4, 0) \
+    X(volumeHeader, account, INT, 'a', accountNumber, 4, 0) \
+    X(volumeHeader, owner, INT, 'o', owner, 4, 0) \
+    X(volumeHeader, created, INT, 'C', creationDate, 4, 0) \
+    X(volumeHeader, accessed, INT, 'A', accessDate, 4, 0) \
+    X(volumeHeader, updated, INT, 'U', updateDate, 4, 0) \
+    X(volumeHeader, expires, INT, 'E', expirationDate, 4, 0) \
+    X(volumeHeader, backedup, INT, 'B', backupDate, 4, 0) \
+    X(volumeHeader, message, STRING, 'O', message) \
+    X(volumeHeader, weekuse, ARRAY, 'W', weekUse, weekCount, 0) \
+    X(volumeHeader, motd, STRING, 'M', motd) \
+    X(volumeHeader, dayusedate, INT, 'D', dayUseDate, 4, 0) \
+    X(volumeHeader, dayuse, INT, 'Z', dayUse, 4, 0)
+
+RECORD(g_volumeheaderrecord, VOLUMEHEADER_FIELDS)
+
+/* The last volume header read, for reports */
+static struct volumeHeader g_volheader;
+
     afs_int32
 ReadVolumeHeader(in, count)
     FILE *in;
     afs_int32 count;
 {
     struct volumeHeader vh;
-    int i, done;
-    char tag, c;
+    char tag;
 
     memset(&vh, 0, sizeof(vh));
+    tag = decoderecord(in, &g_volumeheaderrecord, &vh);
 
-    done = 0;
-    while (!done) {
-        tag = readchar(in);
-        switch (tag) {
-            case 'i':
-                vh.volumeId = ntohl(readvalue(in, 4));
-                break;
-
-            case 'v':
-                ntohl(readvalue(in, 4));        /* version stamp - ignore */
-                break;
-
-            case 'n':
-                for (i = 0, c = 'a'; c != '\0'; i++) {
-                    vh.volumeName[i] = c = readchar(in);
-                }
-                vh.volumeName[i] = c;
-                break;
-
-            case 's':
-                vh.inService = ntohl(readvalue(in, 1));
-                break;
-
-            case 'b':
-                vh.blessed = ntohl(readvalue(in, 1));
-                break;
-
-            case 'u':
-                vh.uniquifier = ntohl(readvalue(in, 4));
-                break;
-
-            case 't':
-                vh.volType = ntohl(readvalue(in, 1));
-                break;
-
-            case 'p':
-                vh.parentVol = ntohl(readvalue(in, 4));
-                break;
-
-            case 'c':
-                vh.cloneId = ntohl(readvalue(in, 4));
-                break;
-
-            case 'q':
-                vh.maxQuota = ntohl(readvalue(in, 4));
-                break;
-
-            case 'm':
-                vh.minQuota = ntohl(readvalue(in, 4));
-                break;
-
-            case 'd':
-                vh.diskUsed = ntohl(readvalue(in, 4));
-                break;
-
-            case 'f':
-                vh.fileCount = ntohl(readvalue(in, 4));
-                break;
-
-            case 'a':
-                vh.accountNumber = ntohl(readvalue(in, 4));
-                break;
-
-            case 'o':
-                vh.owner = ntohl(readvalue(in, 4));
-                break;
-
-            case 'C':
-                vh.creationDate = ntohl(readvalue(in, 4));
-                break;
-
-            case 'A':
-                vh.accessDate = ntohl(readvalue(in, 4));
-                break;
-
-            case 'U':
-                vh.updateDate = ntohl(readvalue(in, 4));
-                break;
-
-            case 'E':
-                vh.expirationDate = ntohl(readvalue(in, 4));
-                break;
-
-            case 'B':
-                vh.backupDate = ntohl(readvalue(in, 4));
-                break;
-
-            case 'O':
-                for (i = 0, c = 'a'; c != '\0'; i++) {
-                    vh.message[i] = c = readchar(in);
-                }
-                vh.volumeName[i] = c;
-                break;
-
-            case 'W':
-                vh.weekCount = ntohl(readvalue(in, 2));
-                for (i = 0; i < vh.weekCount; i++) {
-                    vh.weekUse[i] = ntohl(readvalue(in, 4));
-                }
-                break;
-
-            case 'M':
-                for (i = 0, c = 'a'; c != '\0'; i++) {
-                    vh.motd[i] = c = readchar(in);
-                }
-                break;
-
-            case 'D':
-                vh.dayUseDate = ntohl(readvalue(in, 4));
-                break;
-
-            case 'Z':
-                vh.dayUse = ntohl(readvalue(in, 4));
-                break;
-
-            default:
-                done = 1;
-                break;
-        }
-    }
-
+    g_volheader = vh;
     return ((afs_int32) tag);
 }
 
@@ -378,14 +348,300 @@ struct vNode {
     afs_sfsize_t dataSize;
 };
 
+/* A size of 4GB or more is written as 'h', high word first */
+#ifdef AFS_LARGEFILE_ENV
+#define VNODE_HUGESIZE(X) \
+    X(vNode, hugesize, INT, 'h', dataSize, 8, RF_LAST | RF_WIDE)
+#else
+#define VNODE_HUGESIZE(X)
+#endif
+
+/* The fields after the vnode number and uniquifier that start a vnode */
+#define VNODE_FIELDS(X) \
+    X(vNode, type, INT, 't', type, 1, 0) \
+    X(vNode, linkcount, INT, 'l', linkCount, 2, 0) \
+    X(vNode, dataversion, INT, 'v', dataVersion, 4, 0) \
+    X(vNode, modtime, INT, 'm', unixModTime, 4, 0) \
+    X(vNode, servtime, INT, 's', servModTime, 4, 0) \
+    X(vNode, author, INT, 'a', author, 4, 0) \
+    X(vNode, owner, INT, 'o', owner, 4, 0) \
+    X(vNode, group, INT, 'g', group, 4, 0) \
+    X(vNode, modebits, INT, 'b', modebits, 2, 0) \
+    X(vNode, parent, INT, 'p', parent, 4, 0) \
+    X(vNode, acl, INTS, 'A', acl, 4, RF_SPARSE) \
+    X(vNode, size, INT, 'f', dataSize, 4, RF_LAST) \
+    VNODE_HUGESIZE(X)
+
+RECORD(g_vnoderecord, VNODE_FIELDS)
+
+/* The vnode number, uniquifier and every field, at most */
+#define VNODEBUFSIZE 512
+
 #define MAXNAMELEN 256
 
+/* Put a script to restore a directory's ACL with fs setacl into buf */
+static void
+BuildAclScript(struct vNode *vn)
+{
+    int q;
+
+    buf[0] = 0;
+    strcat(buf, "#!/bin/sh\n\n");
+    if (vn->acl.positive)
+    {
+        strcat(buf, "fs sa `dirname $0` ");
+        for (q = 0; q < vn->acl.positive && q < 21; q++)
+        {
+            char id[15];
+            sprintf(id, "%d ", vn->acl.entries[q].id);
+            strcat(buf, id);
+            if (vn->acl.entries[q].rights & 1)
+            {
+                strcat(buf, "r");
+            }
+            if (vn->acl.entries[q].rights & 2)
+            {
+                strcat(buf, "w");
+            }
+            if (vn->acl.entries[q].rights & 4)
+            {
+                strcat(buf, "i");
+            }
+            if (vn->acl.entries[q].rights & 8)
+            {
+                strcat(buf, "l");
+            }
+            if (vn->acl.entries[q].rights & 16)
+            {
+                strcat(buf, "d");
+            }
+            if (vn->acl.entries[q].rights & 32)
+            {
+                strcat(buf, "k");
+            }
+            if (vn->acl.entries[q].rights & 64)
+            {
+                strcat(buf, "a");
+            }
+            strcat(buf, " ");
+        }
+        strcat(buf, "-clear\n");
+    }
+    if (vn->acl.negative)
+    {
+        strcat(buf, "fs sa `dirname $0` ");
+        for (; q < vn->acl.total && q < 21; q++)
+        {
+            char id[15];
+            sprintf(id, "%d ", vn->acl.entries[q].id);
+            strcat(buf, id);
+            if (vn->acl.entries[q].rights & 1)
+            {
+                strcat(buf, "r");
+            }
+            if (vn->acl.entries[q].rights & 2)
+            {
+                strcat(buf, "w");
+            }
+            if (vn->acl.entries[q].rights & 4)
+            {
+                strcat(buf, "i");
+            }
+            if (vn->acl.entries[q].rights & 8)
+            {
+                strcat(buf, "l");
+            }
+            if (vn->acl.entries[q].rights & 16)
+            {
+                strcat(buf, "d");
+            }
+            if (vn->acl.entries[q].rights & 32)
+            {
+                strcat(buf, "k");
+            }
+            if (vn->acl.entries[q].rights & 64)
+            {
+                strcat(buf, "a");
+            }
+            strcat(buf, " ");
+        }
+        strcat(buf, " -negative\n");
+    }
+}
+
+/* The file whose data was written last, which its hard links share */
+static struct ColumnarMember g_lastfile;
+/* Set once a small file's data has been read and written with its member */
+static int g_packed;
+
+/*
+ * The columnar counterpart of WriteVNodeTarHeader: describe the vnode in the
+ * footer and write a symlink's target or a directory's ACL script as data.
+ * A file's data is written by the caller, straight after this, unless the
+ * file is small enough to be compressed, when it is read and written here.
+ */
+static void
+AddColumnarMember(FILE *in, const char *dir, struct vNode *vn,
+    const char *link)
+{
+    struct ColumnarMember m;
+    const char *filename = link ? link :
+        (vn->type == vDirectory ? NULL : get(vn->vnode));
+
+    memset(&m, 0, sizeof(m));
+    m.type = link ? 'h' : vn->type == 1 ? 'f' : vn->type == 2 ? 'd' : 'l';
+    m.vnode = vn->vnode;
+    m.uniquifier = vn->uniquifier;
+    m.dataversion = vn->dataVersion;
+    m.mtime = vn->unixModTime;
+    m.mode = vn->modebits;
+    m.owner = vn->owner;
+    m.group = vn->group;
+    m.size = vn->type == 2 ? 0 : vn->dataSize;
+    m.offset = bytecount;
+    if (link)
+    {
+        /* A link shares the data of its file, which has just been written */
+        m.offset = g_lastfile.offset;
+        m.codec = g_lastfile.codec;
+        m.stored = g_lastfile.stored;
+    }
+
+    if (verbose)
+    {
+        if (filename)
+            fprintf(stderr, "%s/%s\n", dir, filename);
+        else
+            fprintf(stderr, "%s/\n", dir);
+    }
+
+    PROBE3(tarvol, header__write, vn->vnode, vn->type, bytecount);
+    if (!link && vn->type == 1 && smallfiles && m.size <= smallfiles)
+    {
+        const void *data;
+
+        readdata(in, g_copybuf, m.size);
+        if (in == g_dumpfile)
+            ratelimit(m.size, 0);
+        data = columnarpack(&m, g_copybuf);
+        if (columnaradd(&m, dir, filename))
+            fprintf(stderr, "Could not describe %s/%s in the footer\n", dir,
+                filename);
+        WriteData(data, m.codec ? m.stored : m.size);
+        bytecount += m.codec ? m.stored : m.size;
+        g_lastfile = m;
+        g_packed = 1;
+        return;
+    }
+    if (vn->type == 1 && !link)
+        g_lastfile = m;
+    if (columnaradd(&m, dir, filename))
+        fprintf(stderr, "Could not describe %s/%s in the footer\n", dir,
+            filename ? filename : "");
+
+    if (vn->type == 3 && !link)
+    {
+        readdata(in, buf, vn->dataSize);
+        WriteData(buf, vn->dataSize);
+        bytecount += vn->dataSize;
+    }
+
+    if (acls && vn->type == 2)
+    {
+        if (verbose)
+            fprintf(stderr, "%s/.afs_acl_restore.sh\n", dir);
+        BuildAclScript(vn);
+        m.type = 'a';
+        m.size = strlen(buf);
+        m.offset = bytecount;
+        m.mode = 0700;
+        columnaradd(&m, dir, ".afs_acl_restore.sh");
+        WriteData(buf, m.size);
+        bytecount += m.size;
+    }
+}
+
+/*
+ * The BackupPC counterpart of WriteVNodeTarHeader: add the vnode to the
+ * backup.  A symlink's target, a hard link's first name and a directory's ACL
+ * script are written as files, as BackupPC_tarExtract would.  A file's data
+ * is written by the caller, straight after this, and ended with bpcend().
+ */
+static void
+AddPoolMember(FILE *in, const char *dir, struct vNode *vn, const char *link)
+{
+    struct BpcMember m;
+    char target[MAXNAMELEN * 2];
+    const char *filename = link ? link :
+        (vn->type == vDirectory ? NULL : get(vn->vnode));
+
+    memset(&m, 0, sizeof(m));
+    m.type = link ? BPC_FTYPE_HARDLINK : vn->type == 1 ? BPC_FTYPE_FILE :
+        vn->type == 2 ? BPC_FTYPE_DIR : BPC_FTYPE_SYMLINK;
+    m.mode = vn->modebits;
+    m.uid = vn->owner;
+    m.gid = vn->group;
+    m.mtime = vn->unixModTime;
+    m.size = vn->type == 2 ? 0 : vn->dataSize;
+    if (link)
+    {
+        /* The link names the file the way tar does */
+        snprintf(target, sizeof target, "%s/%s", dir, get(vn->vnode));
+        m.size = strlen(target);
+    }
+
+    if (verbose)
+    {
+        if (filename)
+            fprintf(stderr, "%s/%s\n", dir, filename);
+        else
+            fprintf(stderr, "%s/\n", dir);
+    }
+
+    PROBE3(tarvol, header__write, vn->vnode, vn->type, bytecount);
+    bpcadd(&m, dir, filename);
+
+    if (link)
+    {
+        WriteData(target, m.size);
+        bpcend();
+        bytecount += m.size;
+    }
+    else if (vn->type == 3)
+    {
+        readdata(in, buf, vn->dataSize);
+        WriteData(buf, vn->dataSize);
+        bpcend();
+        bytecount += vn->dataSize;
+    }
+
+    if (acls && vn->type == 2)
+    {
+        if (verbose)
+            fprintf(stderr, "%s/.afs_acl_restore.sh\n", dir);
+        BuildAclScript(vn);
+        m.type = BPC_FTYPE_FILE;
+        m.size = strlen(buf);
+        m.mode = 0700;
+        bpcadd(&m, dir, ".afs_acl_restore.sh");
+        WriteData(buf, m.size);
+        bpcend();
+        bytecount += m.size;
+    }
+}
+
+/*
+ * Write the header for a vnode.  Given a link, write a hard link by that name
+ * to the file's first name instead, which must already be in the archive.
+ */
 void
-WriteVNodeTarHeader(FILE *in, const char *dir, struct vNode *vn, FILE *dest)
+WriteVNodeTarHeader(FILE *in, const char *dir, struct vNode *vn, FILE *dest,
+    const char *link)
 {
     unsigned int i;
     unsigned int chksum = 0;
-    const char *filename = (vn->type == vDirectory ? NULL : get(vn->vnode));
+    const char *filename = link ? link :
+        (vn->type == vDirectory ? NULL : get(vn->vnode));
     struct Tar
     {
         char name[100];
@@ -406,10 +662,28 @@ WriteVNodeTarHeader(FILE *in, const char *dir, struct vNode *vn, FILE *dest)
         char prefix[167];
     } tarheader;
 
+    if (columnar)
+    {
+        AddColumnarMember(in, dir, vn, link);
+        return;
+    }
+    if (backuppc)
+    {
+        AddPoolMember(in, dir, vn, link);
+        return;
+    }
+
     memset(&tarheader, 0, sizeof(struct Tar));
     memset(tarheader.chksum, ' ', 8);
     strncpy(tarheader.prefix, dir, 167);
-    if (vn->type == 1 /* file */)
+    if (link)
+    {
+        strncpy(tarheader.name, link, 100);
+        tarheader.typeflag = LNKTYPE;
+        snprintf(tarheader.linkname, sizeof(tarheader.linkname), "%s/%s",
+            dir, get(vn->vnode));
+    }
+    else if (vn->type == 1 /* file */)
     {
         strncpy(tarheader.name, filename, 100);
         tarheader.typeflag = REGTYPE;
@@ -441,9 +715,13 @@ WriteVNodeTarHeader(FILE *in, const char *dir, struct vNode *vn, FILE *dest)
     /*
      * In the vos dump format, the target of symlinks is the data.  In the tar
      * format, it is included in the header.  So be sure to write a zero size
-     * for a symlink.
+     * for a symlink.  A hard link has no data either.
      */
-    if (vn->type != 3 /* symlink or mtpt */)
+    if (link)
+    {
+        snprintf(tarheader.size, 12, "%011o", 0);
+    }
+    else if (vn->type != 3 /* symlink or mtpt */)
     {
 #ifdef AFS_LARGEFILE_ENV
         /* 11 octal digits have a maximum size of 8 GB - 1. */
@@ -479,6 +757,23 @@ WriteVNodeTarHeader(FILE *in, const char *dir, struct vNode *vn, FILE *dest)
     }
 
     snprintf(tarheader.chksum, 8, "%07o", chksum);
+    if (g_manifest)
+    {
+        struct ManifestRecord r;
+
+        memset(&r, 0, sizeof(r));
+        r.vnode = vn->vnode;
+        r.uniquifier = vn->uniquifier;
+        r.type = link ? 'h' : vn->type == 1 ? 'f' : vn->type == 2 ? 'd' : 'l';
+        r.dataversion = vn->dataVersion;
+        r.size = vn->dataSize;
+        r.mtime = vn->unixModTime;
+        r.mode = vn->modebits;
+        r.offset = bytecount;
+        manifestmember(g_manifest, &r, dir, filename);
+    }
+    PROBE3(tarvol, header__write, vn->vnode, vn->type, bytecount);
+    pipelineframe(dest);
     fwrite(&tarheader, 1, sizeof(struct Tar), dest);
     bytecount += sizeof(struct Tar);
 
@@ -494,90 +789,7 @@ WriteVNodeTarHeader(FILE *in, const char *dir, struct vNode *vn, FILE *dest)
         }
 
         {
-            int q;
-
-            buf[0] = 0;
-            strcat(buf, "#!/bin/sh\n\n");
-            if (vn->acl.positive)
-            {
-                strcat(buf, "fs sa `dirname $0` ");
-                for (q = 0; q < vn->acl.positive && q < 21; q++)
-                {
-                    char id[15];
-                    sprintf(id, "%d ", vn->acl.entries[q].id);
-                    strcat(buf, id);
-                    if (vn->acl.entries[q].rights & 1)
-                    {
-                        strcat(buf, "r");
-                    }
-                    if (vn->acl.entries[q].rights & 2)
-                    {
-                        strcat(buf, "w");
-                    }
-                    if (vn->acl.entries[q].rights & 4)
-                    {
-                        strcat(buf, "i");
-                    }
-                    if (vn->acl.entries[q].rights & 8)
-                    {
-                        strcat(buf, "l");
-                    }
-                    if (vn->acl.entries[q].rights & 16)
-                    {
-                        strcat(buf, "d");
-                    }
-                    if (vn->acl.entries[q].rights & 32)
-                    {
-                        strcat(buf, "k");
-                    }
-                    if (vn->acl.entries[q].rights & 64)
-                    {
-                        strcat(buf, "a");
-                    }
-                    strcat(buf, " ");
-                }
-                strcat(buf, "-clear\n");
-            }
-            if (vn->acl.negative)
-            {
-                strcat(buf, "fs sa `dirname $0` ");
-                for (; q < vn->acl.total && q < 21; q++)
-                {
-                    char id[15];
-                    sprintf(id, "%d ", vn->acl.entries[q].id);
-                    strcat(buf, id);
-                    if (vn->acl.entries[q].rights & 1)
-                    {
-                        strcat(buf, "r");
-                    }
-                    if (vn->acl.entries[q].rights & 2)
-                    {
-                        strcat(buf, "w");
-                    }
-                    if (vn->acl.entries[q].rights & 4)
-                    {
-                        strcat(buf, "i");
-                    }
-                    if (vn->acl.entries[q].rights & 8)
-                    {
-                        strcat(buf, "l");
-                    }
-                    if (vn->acl.entries[q].rights & 16)
-                    {
-                        strcat(buf, "d");
-                    }
-                    if (vn->acl.entries[q].rights & 32)
-                    {
-                        strcat(buf, "k");
-                    }
-                    if (vn->acl.entries[q].rights & 64)
-                    {
-                        strcat(buf, "a");
-                    }
-                    strcat(buf, " ");
-                }
-                strcat(buf, " -negative\n");
-            }
+            BuildAclScript(vn);
 
             snprintf(tarheader.size, 12, "%011o", strlen(buf));
 
@@ -589,6 +801,22 @@ WriteVNodeTarHeader(FILE *in, const char *dir, struct vNode *vn, FILE *dest)
             {
                 size_t size = strlen(buf);
                 snprintf(tarheader.chksum, 8, "%07o", chksum);
+                if (g_manifest)
+                {
+                    struct ManifestRecord r;
+
+                    memset(&r, 0, sizeof(r));
+                    r.vnode = vn->vnode;
+                    r.uniquifier = vn->uniquifier;
+                    r.type = 'a';
+                    r.dataversion = vn->dataVersion;
+                    r.size = size;
+                    r.mtime = vn->unixModTime;
+                    r.mode = 0700;
+                    r.offset = bytecount;
+                    manifestmember(g_manifest, &r, dir, ".afs_acl_restore.sh");
+                }
+                pipelineframe(dest);
                 fwrite(&tarheader, 1, sizeof(struct Tar), dest);
                 bytecount += sizeof(struct Tar);
 
@@ -610,149 +838,539 @@ WriteVNodeTarHeader(FILE *in, const char *dir, struct vNode *vn, FILE *dest)
 void
 WriteVNode(FILE *out, struct vNode *vn)
 {
-    int i;
+    unsigned char record[VNODEBUFSIZE];
+    size_t size;
+    int code;
 
-    writechar(out, D_VNODE);
-    writevalue(out, 4, htonl(vn->vnode));
-    writevalue(out, 4, htonl(vn->uniquifier));
-    writechar(out, 't');
-    writevalue(out, 1, htonl(vn->type));
-    writechar(out, 'l');
-    writevalue(out, 2, htonl(vn->linkCount));
-    writechar(out, 'v');
-    writevalue(out, 4, htonl(vn->dataVersion));
-    writechar(out, 'm');
-    writevalue(out, 4, htonl(vn->unixModTime));
-    writechar(out, 's');
-    writevalue(out, 4, htonl(vn->servModTime));
-    writechar(out, 'a');
-    writevalue(out, 4, htonl(vn->author));
-    writechar(out, 'o');
-    writevalue(out, 4, htonl(vn->owner));
-    writechar(out, 'g');
-    writevalue(out, 4, htonl(vn->group));
-    writechar(out, 'b');
-    writevalue(out, 2, htonl(vn->modebits));
-    writechar(out, 'p');
-    writevalue(out, 4, htonl(vn->parent));
-    writechar(out, 'A');
-    writevalue(out, 4, htonl(vn->acl.size));
-    writevalue(out, 4, htonl(vn->acl.version));
-    writevalue(out, 4, htonl(vn->acl.total));
-    writevalue(out, 4, htonl(vn->acl.positive));
-    writevalue(out, 4, htonl(vn->acl.negative));
-    for (i = 0; i < 21; i++)
-    {
-        writevalue(out, 4, htonl(vn->acl.entries[i].id));
-        writevalue(out, 4, htonl(vn->acl.entries[i].rights));
-    }
-    writevalue(out, 4, htonl(vn->acl.unused));
-#ifdef AFS_LARGEFILE_ENV
-    if (vn->dataSize > 0xFFFFFFFFL)
-    {
-        writechar(out, 'h');
-        writevalue(out, 4, htonl(vn->dataSize >> 32));
-        writevalue(out, 4, htonl(vn->dataSize & 0xFFFFFFFFL));
+    record[0] = D_VNODE;
+    putvalue(record + 1, 4, (afs_uint32)vn->vnode);
+    putvalue(record + 5, 4, (afs_uint32)vn->uniquifier);
+    size = 9 + encoderecord(&g_vnoderecord, vn, record + 9,
+        sizeof(record) - 9);
+
+    code = fwrite(record, 1, size, out);
+    if (code != size)
+        fprintf(stderr, "Code = %d; Errno = %d\n", code, errno);
+}
+
+/*
+ * Store the names of the entries of a directory read from the dump, writing
+ * them to the manifest if one is given.  Returns the number of entries, not
+ * counting "." and "..".
+ */
+static int
+DecodeDirectory(char *buffer, afs_sfsize_t size, afs_int32 dirvnode,
+    const char *parentdir, int marks, FILE *manifest)
+{
+    unsigned short j;
+    afs_int32 this_vn;
+    char *this_name;
+    char dirname[MAXNAMELEN];
+    int i, entries = 0;
+
+    struct DirEntry {
+        char flag;
+        char length;
+        unsigned short next;
+        struct MKFid {
+            afs_int32 vnode;
+            afs_int32 vunique;
+        } fid;
+        char name[20];
+    };
+
+    struct Pageheader {
+        unsigned short pgcount;
+        unsigned short tag;
+        char freecount;
+        char freebitmap[8];
+        char padding[19];
+    };
+
+    struct DirHeader {
+        struct Pageheader header;
+        char alloMap[128];
+        unsigned short hashTable[128];
+    };
+
+    struct Page0 {
+        struct DirHeader header;
+        struct DirEntry entry[1];
+    } *page0;
+
+    PROBE2(tarvol, dir__start, dirvnode, size);
+    page0 = (struct Page0 *)buffer;
+
+    /* Step through each bucket in the hash table, i,
+     * and follow each element in the hash chain, j.
+     * This gives us each entry of the dir.
+     */
+    for (i = 0; i < 128; i++) {
+        for (j = ntohs(page0->header.hashTable[i]); j;
+            j = ntohs(page0->entry[j].next)) {
+            j -= 13;
+            this_vn = ntohl(page0->entry[j].fid.vnode);
+            this_name = page0->entry[j].name;
+
+            if ((strcmp(this_name, ".") == 0)
+                || (strcmp(this_name, "..") == 0))
+                continue;   /* Skip these */
+
+            entries++;
+            if (manifest)
+                manifestentry(manifest, dirvnode, this_vn,
+                    ntohl(page0->entry[j].fid.vunique), this_name);
+            if (this_vn & 1) {
+                /*ADIRENTRY*/
+                snprintf(dirname, sizeof dirname, "%s/%s",
+                    parentdir, this_name);
+
+                /* Store the directory name associated with the
+                 * vnode number.
+                 */
+                add(this_vn, dirname);
+                if (marks)
+                    mark(this_vn, marks);
+            }
+            /*ADIRENTRY*/
+            else {
+                /*AFILEENTRY*/
+
+                add(this_vn, this_name);
+                if (marks)
+                    mark(this_vn, marks);
+            }
+            /*AFILEENTRY*/}
+    }
+    PROBE2(tarvol, dir__done, dirvnode, entries);
+    return entries;
+}
+
+/*
+ * While converting, directories are decoded on a pool of threads so that
+ * reading the dump goes on meanwhile.  Directories are queued in dump order
+ * and retired in that order by the main thread, which writes out their
+ * manifest entries.  A vnode can only be named once its parent directory has
+ * been decoded, so the main thread only waits when it reaches a vnode whose
+ * directory is still queued.
+ */
+#define MAXDIRTHREADS 16
+#define MAXDIRJOBS 64
+
+struct DirJob {
+    afs_int32 vnode;
+    int marks, done;
+    char *data;
+    afs_sfsize_t size;
+    char parentdir[MAXNAMELEN];
+    char *entries;              /* manifest lines, written when retired */
+    size_t length;
+    struct DirJob *next;
+};
+
+static struct {
+    pthread_t threads[MAXDIRTHREADS];
+    int nthreads, stop, jobs;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    struct DirJob *head, *tail; /* every job not yet retired */
+    struct DirJob *next;        /* the next one to decode */
+} g_dirs = { .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+static void *
+DirectoryWorker(void *arg)
+{
+    struct DirJob *job;
+    FILE *manifest;
+
+    pthread_mutex_lock(&g_dirs.lock);
+    for (;;) {
+        while (!g_dirs.next && !g_dirs.stop)
+            pthread_cond_wait(&g_dirs.work, &g_dirs.lock);
+        if (!g_dirs.next)
+            break;
+        job = g_dirs.next;
+        g_dirs.next = job->next;
+        pthread_mutex_unlock(&g_dirs.lock);
+
+        manifest = NULL;
+        if (g_manifest &&
+            !(manifest = open_memstream(&job->entries, &job->length)))
+            fprintf(stderr, "Could not buffer manifest entries\n");
+        DecodeDirectory(job->data, job->size, job->vnode, job->parentdir,
+            job->marks, manifest);
+        if (manifest)
+            fclose(manifest);
+        free(job->data);
+        job->data = NULL;
+
+        pthread_mutex_lock(&g_dirs.lock);
+        job->done = 1;
+        pthread_cond_broadcast(&g_dirs.done);
+    }
+    pthread_mutex_unlock(&g_dirs.lock);
+    return NULL;
+}
+
+/* Wait for the oldest directory to be decoded, and write out its entries */
+static void
+RetireDirectory(void)
+{
+    struct DirJob *job;
+
+    pthread_mutex_lock(&g_dirs.lock);
+    job = g_dirs.head;
+    while (!job->done)
+        pthread_cond_wait(&g_dirs.done, &g_dirs.lock);
+    g_dirs.head = job->next;
+    if (!g_dirs.head)
+        g_dirs.tail = NULL;
+    g_dirs.jobs--;
+    pthread_mutex_unlock(&g_dirs.lock);
+
+    if (job->length && fwrite(job->entries, 1, job->length, g_manifest) !=
+        job->length)
+        fprintf(stderr, "Could not write manifest entries\n");
+    free(job->entries);
+    free(job);
+}
+
+/* Make sure the entries of a directory are in the name table */
+static void
+WaitDirectory(afs_int32 vnode)
+{
+    struct DirJob *job;
+    int queued = 0;
+
+    if (!g_dirs.nthreads)
+        return;
+    /* Only this thread adds or removes jobs, so the list can be walked */
+    for (job = g_dirs.head; job && !queued; job = job->next)
+        queued = job->vnode == vnode;
+    while (queued && g_dirs.head) {
+        queued = g_dirs.head->vnode != vnode;
+        RetireDirectory();
+    }
+}
+
+/* Decode every directory that is queued */
+static void
+DrainDirectories(void)
+{
+    while (g_dirs.head)
+        RetireDirectory();
+}
+
+static void
+StartDirectories(void)
+{
+    int i;
+
+    for (i = 0; i < dirthreads && i < MAXDIRTHREADS; i++) {
+        if (pthread_create(&g_dirs.threads[i], NULL, DirectoryWorker, NULL))
+            break;
+        g_dirs.nthreads++;
+    }
+}
+
+static void
+StopDirectories(void)
+{
+    int i;
+
+    DrainDirectories();
+    pthread_mutex_lock(&g_dirs.lock);
+    g_dirs.stop = 1;
+    pthread_cond_broadcast(&g_dirs.work);
+    pthread_mutex_unlock(&g_dirs.lock);
+    for (i = 0; i < g_dirs.nthreads; i++)
+        pthread_join(g_dirs.threads[i], NULL);
+    g_dirs.nthreads = g_dirs.stop = 0;
+}
+
+/*
+ * Read the contents of a directory vnode and store the names of its entries,
+ * or queue them to be stored if directories are being decoded on threads.
+ * Returns the number of entries, not counting "." and "..", or 0 if queued.
+ */
+static int
+ReadDirectory(FILE *in, struct vNode *vn, const char *parentdir, int marks)
+{
+    struct DirJob *job;
+    char *buffer;
+    int entries;
+
+    /* readdata() terminates what it reads */
+    buffer = (char *)malloc(vn->dataSize + 1);
+    readdata(in, buffer, vn->dataSize);
+
+    if (!g_dirs.nthreads || !(job = calloc(1, sizeof(*job)))) {
+        entries = DecodeDirectory(buffer, vn->dataSize, vn->vnode, parentdir,
+            marks, g_manifest);
+        free(buffer);
+        return entries;
     }
+
+    if (g_dirs.jobs >= MAXDIRJOBS)
+        RetireDirectory();
+    job->vnode = vn->vnode;
+    job->marks = marks;
+    job->data = buffer;
+    job->size = vn->dataSize;
+    strncpy(job->parentdir, parentdir, sizeof job->parentdir - 1);
+
+    pthread_mutex_lock(&g_dirs.lock);
+    if (g_dirs.tail)
+        g_dirs.tail->next = job;
     else
-#endif
-    {
-        writechar(out, 'f');
-        writevalue(out, 4, htonl(vn->dataSize));
+        g_dirs.head = job;
+    g_dirs.tail = job;
+    if (!g_dirs.next)
+        g_dirs.next = job;
+    g_dirs.jobs++;
+    pthread_cond_signal(&g_dirs.work);
+    pthread_mutex_unlock(&g_dirs.lock);
+    return 0;
+}
+
+void
+addrule(int include, const char *pattern)
+{
+    struct Rule *rule = malloc(sizeof(struct Rule));
+    size_t len;
+
+    /* Paths are matched without the leading "./" */
+    while (pattern[0] == '.' && pattern[1] == '/')
+        pattern += 2;
+    rule->pattern = strdup(pattern);
+    len = strlen(rule->pattern);
+    while (len > 1 && rule->pattern[len - 1] == '/')
+        rule->pattern[--len] = 0;
+    rule->glob = strpbrk(rule->pattern, "*?[") != NULL;
+
+    if (include) {
+        rule->next = g_includes;
+        g_includes = rule;
+    } else {
+        rule->next = g_excludes;
+        g_excludes = rule;
     }
 }
 
-    afs_int32
-ReadVNode(FILE *in, FILE *orphanfile)
+/*
+ * Put everything back the way it was at startup, so that the daemon can run
+ * another job.  The copy buffer is kept, since it will likely be needed again.
+ */
+void
+resetcreate(void)
 {
-    struct vNode vn;
-    int code, i, done;
-    char tag;
-    char dirname[MAXNAMELEN];
-    char parentdir[MAXNAMELEN];
-    char filename[MAXNAMELEN];
-    afs_int32 dirvnode;
+    struct Rule *lists[2] = { g_includes, g_excludes };
+    int i;
 
-    memset(&vn, 0, sizeof(vn));
+    for (i = 0; i < 2; i++) {
+        while (lists[i]) {
+            struct Rule *next = lists[i]->next;
+            free(lists[i]->pattern);
+            free(lists[i]);
+            lists[i] = next;
+        }
+    }
+    g_includes = g_excludes = NULL;
+    g_tarfile = g_dumpfile = NULL;
+    g_manifest = NULL;
+    g_scan = g_seekable = 0;
+    memset(&g_stats, 0, sizeof(g_stats));
+    memset(&g_progress, 0, sizeof(g_progress));
+    memset(&g_volheader, 0, sizeof(g_volheader));
+    clearnames();
+    setnamebudget(0);
+}
 
-    vn.vnode = ntohl(readvalue(in, 4));
-    vn.uniquifier = ntohl(readvalue(in, 4));
+/*
+ * A rule without wildcards matches a path and everything below it.  A rule
+ * with wildcards is matched against the whole path, and "*" matches "/".
+ */
+static int
+MatchRules(struct Rule *rule, const char *path)
+{
+    for (; rule; rule = rule->next) {
+        if (rule->glob) {
+            if (fnmatch(rule->pattern, path, 0) == 0)
+                return 1;
+        } else {
+            size_t len = strlen(rule->pattern);
+            if (strncmp(path, rule->pattern, len) == 0 &&
+                    (path[len] == '\0' || path[len] == '/'))
+                return 1;
+        }
+    }
+    return 0;
+}
 
-    done = 0;
-    while (!done) {
-        tag = readchar(in);
-        switch (tag) {
-            case 't':
-                vn.type = ntohl(readvalue(in, 1));
-                break;
+/*
+ * Apply the include and exclude rules to a vnode whose parent is known.
+ * Returns the marks for the vnode, which the entries of a directory inherit,
+ * so a directory that is excluded or included takes its subtree with it.
+ */
+static int
+FilterVNode(struct vNode *vn, const char *parentdir)
+{
+    char path[MAXNAMELEN * 2];
+    const char *p = path;
+    int m;
 
-            case 'l':
-                vn.linkCount = ntohl(readvalue(in, 2));
-                break;
+    if ((!g_includes && !g_excludes) || vn->vnode == 1)
+        return 0;
 
-            case 'v':
-                vn.dataVersion = ntohl(readvalue(in, 4));
-                break;
+    m = marks(vn->vnode);
+    if (m & NAME_EXCLUDED)
+        return m;
 
-            case 'm':
-                vn.unixModTime = ntohl(readvalue(in, 4));
-                break;
+    if (vn->type == 2)
+        p = parentdir;
+    else
+        snprintf(path, sizeof path, "%s/%s", parentdir, get(vn->vnode));
+    if (p[0] == '.' && p[1] == '/')
+        p += 2;
+
+    if (MatchRules(g_excludes, p))
+        m |= NAME_EXCLUDED;
+    else if (g_includes && MatchRules(g_includes, p))
+        m |= NAME_INCLUDED;
+    return m;
+}
 
-            case 's':
-                vn.servModTime = ntohl(readvalue(in, 4));
-                break;
+/*
+ * A file with several names in its directory has its data written once, under
+ * the first name, and each other name becomes a hard link to it.
+ */
+static void
+WriteLinks(FILE *in, const char *dir, struct vNode *vn)
+{
+    char link[MAXNAMELEN], path[MAXNAMELEN * 2];
+    const char *p;
+    int n;
+
+    for (n = 0; (p = getlink(vn->vnode, n)); n++) {
+        snprintf(link, sizeof link, "%s", p);
+
+        /* The tar link field has no room for longer paths */
+        if (snprintf(path, sizeof path, "%s/%s", dir, get(vn->vnode)) >=
+                100 && !columnar && !backuppc) {
+            fprintf(stderr, "   Cannot link %s/%s to %s: name too long\n",
+                dir, link, path);
+            continue;
+        }
 
-            case 'a':
-                vn.author = ntohl(readvalue(in, 4));
-                break;
+        snprintf(path, sizeof path, "%s/%s", dir, link);
+        p = path;
+        if (p[0] == '.' && p[1] == '/')
+            p += 2;
+        if (MatchRules(g_excludes, p))
+            continue;
 
-            case 'o':
-                vn.owner = ntohl(readvalue(in, 4));
-                break;
+        WriteVNodeTarHeader(in, dir, vn, g_tarfile, link);
+    }
+}
 
-            case 'g':
-                vn.group = ntohl(readvalue(in, 4));
-                break;
+/* Return the histogram bucket for n */
+static int
+bucket(uintmax_t n)
+{
+    int b = 0;
+    while (n && b < NBUCKETS - 1) {
+        n >>= 1;
+        b++;
+    }
+    return b;
+}
 
-            case 'b':
-                vn.modebits = ntohl(readvalue(in, 2));
-                break;
+/* Account for a vnode in scan mode and skip over its data */
+static void
+ScanVNode(FILE *in, struct vNode *vn, int placed, const char *parentdir)
+{
+    int entries;
 
-            case 'p':
-                vn.parent = ntohl(readvalue(in, 4));
-                break;
+    g_stats.vnodes++;
+    if (!placed)
+        g_stats.outoforder++;
 
-            case 'A':
-                vn.acl.size = ntohl(readvalue(in, 4));
-                vn.acl.version = ntohl(readvalue(in, 4));
-                vn.acl.total = ntohl(readvalue(in, 4));
-                vn.acl.positive = ntohl(readvalue(in, 4));
-                vn.acl.negative = ntohl(readvalue(in, 4));
-                for (i = 0; i < 21; i++)
-                {
-                    vn.acl.entries[i].id = ntohl(readvalue(in, 4));
-                    vn.acl.entries[i].rights = ntohl(readvalue(in, 4));
-                }
-                vn.acl.unused = ntohl(readvalue(in, 4));
-                break;
+    switch (vn->type) {
+        case 2:
+            g_stats.dirs++;
+            g_stats.dirbytes += vn->dataSize;
+            g_stats.aclentries += vn->acl.positive + vn->acl.negative;
+            if (vn->acl.negative)
+                g_stats.negativeacls++;
+            entries = ReadDirectory(in, vn, parentdir, 0);
+            g_stats.entries += entries;
+            g_stats.fanout[bucket(entries)]++;
+            if (entries > g_stats.maxentries)
+                g_stats.maxentries = entries;
+            break;
+
+        case 1:
+            g_stats.files++;
+            g_stats.filebytes += vn->dataSize;
+            g_stats.sizes[bucket(vn->dataSize)]++;
+            skipdata(in, vn->dataSize);
+            release(vn->vnode);
+            break;
+
+        case 3:
+            g_stats.symlinks++;
+            skipdata(in, vn->dataSize);
+            release(vn->vnode);
+            break;
+
+        default:
+            g_stats.other++;
+            skipdata(in, vn->dataSize);
+            break;
+    }
+}
+
+    afs_int32
+ReadVNode(FILE *in, FILE *orphanfile)
+{
+    struct vNode vn;
+    unsigned char id[8];
+    int code, done;
+    char tag;
+    char parentdir[MAXNAMELEN];
+    char filename[MAXNAMELEN];
+    afs_int32 dirvnode;
+
+    memset(&vn, 0, sizeof(vn));
 
+    if (fread(id, 1, sizeof(id), in) != sizeof(id))
+        fprintf(stderr, "Code = %d; Errno = %d\n", 0, errno);
+    vn.vnode = getvalue(id, 4);
+    vn.uniquifier = getvalue(id + 4, 4);
+    /* The last argument tells orphans being replayed from the dump */
+    PROBE2(tarvol, vnode__start, vn.vnode, in != g_dumpfile);
+
+    done = 0;
+    while (!done) {
+        /* Returns after the size, which the data follows */
+        tag = decoderecord(in, &g_vnoderecord, &vn);
+        switch (tag) {
 #ifdef AFS_LARGEFILE_ENV
             case 'h':
-                {
-                    afs_uint32 hi, lo;
-                    hi = ntohl(readvalue(in, 4));
-                    lo = ntohl(readvalue(in, 4));
-                    FillInt64(vn.dataSize, hi, lo);
-                }
-                goto common_vnode;
 #endif
-
             case 'f':
-                vn.dataSize = ntohl(readvalue(in, 4));
+                if (in == g_progress.dumpfile) {
+                    g_progress.vnodes++;
+                    g_progress.bytes += vn.dataSize;
+                }
+                /* File data is counted as it is copied */
+                if (in == g_dumpfile)
+                    ratelimit(vn.type == 1 ? 0 : vn.dataSize, 1);
 
-#ifdef AFS_LARGEFILE_ENV
-common_vnode:
-#endif
+                /* Both this vnode's name and its directory's are known once
+                 * its directory has been decoded */
+                WaitDirectory(vn.parent);
                 dirvnode = ((vn.type == vDirectory) ? vn.vnode : vn.parent);
                 if (dirvnode == 1)
                     strncpy(parentdir, ".", sizeof parentdir);
@@ -768,89 +1386,32 @@ common_vnode:
                     }
                 }
 
-                if (parentdir[0] && (vn.vnode == 1 || get(vn.vnode)))
+                if (g_scan)
+                {
+                    ScanVNode(in, &vn,
+                        parentdir[0] && (vn.vnode == 1 || get(vn.vnode)),
+                        parentdir);
+                }
+                else if (parentdir[0] && (vn.vnode == 1 || get(vn.vnode)))
                 {
                     /* Not an orphan */
-                    WriteVNodeTarHeader(in, parentdir, &vn, g_tarfile);
+                    int m = FilterVNode(&vn, parentdir);
+                    int skip = (m & NAME_EXCLUDED) || (g_includes &&
+                        vn.type != 2 && !(m & NAME_INCLUDED));
+
+                    if (!skip)
+                        WriteVNodeTarHeader(in, parentdir, &vn, g_tarfile, NULL);
 
                     if (vn.type == 2) {
                         /*ITSADIR*/
-                        char *buffer;
-                        unsigned short j;
-                        afs_int32 this_vn;
-                        char *this_name;
-
-                        struct DirEntry {
-                            char flag;
-                            char length;
-                            unsigned short next;
-                            struct MKFid {
-                                afs_int32 vnode;
-                                afs_int32 vunique;
-                            } fid;
-                            char name[20];
-                        };
-
-                        struct Pageheader {
-                            unsigned short pgcount;
-                            unsigned short tag;
-                            char freecount;
-                            char freebitmap[8];
-                            char padding[19];
-                        };
-
-                        struct DirHeader {
-                            struct Pageheader header;
-                            char alloMap[128];
-                            unsigned short hashTable[128];
-                        };
-
-                        struct Page0 {
-                            struct DirHeader header;
-                            struct DirEntry entry[1];
-                        } *page0;
-
-
-                        buffer = NULL;
-                        buffer = (char *)malloc(vn.dataSize);
-
-                        readdata(in, buffer, vn.dataSize);
-                        page0 = (struct Page0 *)buffer;
-
-                        /* Step through each bucket in the hash table, i,
-                         * and follow each element in the hash chain, j.
-                         * This gives us each entry of the dir.
-                         */
-                        for (i = 0; i < 128; i++) {
-                            for (j = ntohs(page0->header.hashTable[i]); j;
-                                j = ntohs(page0->entry[j].next)) {
-                                j -= 13;
-                                this_vn = ntohl(page0->entry[j].fid.vnode);
-                                this_name = page0->entry[j].name;
-
-                                if ((strcmp(this_name, ".") == 0)
-                                    || (strcmp(this_name, "..") == 0))
-                                    continue;   /* Skip these */
-
-                                if (this_vn & 1) {
-                                    /*ADIRENTRY*/
-                                    snprintf(dirname, sizeof dirname, "%s/%s",
-                                        parentdir, this_name);
-
-                                    /* Store the directory name associated with the
-                                     * vnode number.
-                                     */
-                                    add(this_vn, dirname);
-                                }
-                                /*ADIRENTRY*/
-                                else {
-                                    /*AFILEENTRY*/
-
-                                    add(this_vn, this_name);
-                                }
-                                /*AFILEENTRY*/}
-                        }
-                        free(buffer);
+                        /* Even a skipped directory has to name its entries */
+                        ReadDirectory(in, &vn, parentdir, m);
+                    }
+                    else if (skip) {
+                        /* Only data that is read costs anything */
+                        if (in == g_dumpfile && !g_seekable)
+                            ratelimit(vn.dataSize, 0);
+                        skipdata(in, vn.dataSize);
                     }
                     /*ITSADIR*/
                     else if (vn.type == 1) {
@@ -858,15 +1419,21 @@ common_vnode:
 
                         afs_sfsize_t size, s;
 
-                        size = vn.dataSize;
+                        /* A small file may have been packed with its member */
+                        size = g_packed ? 0 : vn.dataSize;
+                        g_packed = 0;
                         while (size > 0) {
-                            s = (afs_int32) ((size > BUFSIZE) ? BUFSIZE : size);
-                            code = fread(buf, 1, s, in);
+                            s = (afs_int32) ((size > g_copysize) ? g_copysize : size);
+                            PROBE2(tarvol, copy__start, vn.vnode, s);
+                            code = fread(g_copybuf, 1, s, in);
                             if (code > 0) {
-                                fwrite(buf, 1, code, g_tarfile);
+                                if (in == g_dumpfile)
+                                    ratelimit(code, 0);
+                                WriteData(g_copybuf, code);
                                 bytecount += code;
                                 size -= code;
                             }
+                            PROBE2(tarvol, copy__done, vn.vnode, code);
                             if (code != s) {
                                 if (code < 0)
                                     fprintf(stderr, "Code = %d; Errno = %d\n", code,
@@ -891,13 +1458,16 @@ common_vnode:
                             fprintf(stderr, "   File %s is incomplete\n",
                                 filename);
                         }
+                        if (backuppc)
+                            bpcend();
                         size = 512 - (vn.dataSize % 512);
-                        if (size != 512)
+                        if (size != 512 && !columnar && !backuppc)
                         {
                             memset(buf, 0, size);
                             fwrite(buf, 1, size, g_tarfile);
                             bytecount += size;
                         }
+                        WriteLinks(in, parentdir, &vn);
                     }
                     /*ITSAFILE*/
                     else if (vn.type == 3) {
@@ -907,6 +1477,10 @@ common_vnode:
                     else {
                         fprintf(stderr, "Unknown Vnode block\n");
                     }
+
+                    /* Only directory names are needed after this */
+                    if (vn.type != 2)
+                        release(vn.vnode);
                 }
                 else
                 {
@@ -914,13 +1488,15 @@ common_vnode:
                     {
                         afs_sfsize_t size, s;
 
+                        PROBE2(tarvol, orphan__spill, vn.vnode, vn.dataSize);
                         WriteVNode(orphanfile, &vn);
                         size = vn.dataSize;
                         while (size > 0) {
-                            s = (afs_int32) ((size > BUFSIZE) ? BUFSIZE : size);
-                            code = fread(buf, 1, s, in);
+                            s = (afs_int32) ((size > g_copysize) ? g_copysize : size);
+                            code = fread(g_copybuf, 1, s, in);
                             if (code > 0) {
-                                bytecount += code;
+                                if (in == g_dumpfile)
+                                    ratelimit(code, 0);
                                 size -= code;
                             }
                             if (code != s) {
@@ -929,7 +1505,7 @@ common_vnode:
                                         errno);
                                 break;
                             }
-                            fwrite(buf, 1, s, orphanfile);
+                            fwrite(g_copybuf, 1, s, orphanfile);
                         }
                         if (size != 0)
                         {
@@ -945,15 +1521,305 @@ common_vnode:
         }
     }
 
+    PROBE3(tarvol, vnode__done, vn.vnode, vn.type, vn.dataSize);
     return ((afs_int32) tag);
 }
 
+/*
+ * Size the name table and buffers now that the volume header has told us how
+ * many files there are and how much space they use, so that they do not have
+ * to grow during the conversion.  Nothing has been written to the archive
+ * yet, so its buffer can still be changed.
+ */
+static void
+PrepareVolume(FILE *tarfile)
+{
+    /* diskUsed is in KB, so this is 1/1024 of the volume */
+    size_t size = (afs_uint32)g_volheader.diskUsed;
+
+    if (size > MAXCOPYSIZE)
+        size = MAXCOPYSIZE;
+
+    if (g_volheader.fileCount > 0)
+        reservenames(g_volheader.fileCount);
+
+    if (size > g_copysize) {
+        char *copybuf = malloc(size);
+        if (copybuf) {
+            g_copybuf = copybuf;
+            g_copysize = size;
+            /* Keep a bigger buffer from the I/O profile */
+            if (size > iosetup.outbuf) {
+                setvbuf(tarfile, NULL, _IOFBF, size);
+                /* A pipeline's stream is not the output itself */
+                if (fileno(tarfile) >= 0)
+                    iosetup.outbuf = size;
+            }
+        }
+    }
+
+    if (verbose > 1)
+        fprintf(stderr, "Expecting %d files in %d KB, copying %lu bytes "
+            "at a time\n", g_volheader.fileCount, g_volheader.diskUsed,
+            (unsigned long)g_copysize);
+}
+
+/*
+ * Open the BackupPC backup.  Backups are taken of the .backup clone of a
+ * volume, so unless told otherwise the share is named for the volume itself.
+ */
+static int
+StartPool(const struct DumpHeader *dh)
+{
+    char share[VNAMESIZE];
+    size_t len;
+
+    snprintf(share, sizeof share, "%s", dh->volumeName);
+    len = strlen(share);
+    if (len > 7 && strcmp(share + len - 7, ".backup") == 0)
+        share[len - 7] = 0;
+    return bpcstart(backuppc, sharename ? sharename : share, poollevel);
+}
+
+/*
+ * Report progress as a line of name=value pairs, either appended to a file
+ * descriptor ("fd:N") or replacing the contents of a status file.  Totals come
+ * from the volume header, so they are estimates.
+ */
+static void
+ReportProgress(const char *state)
+{
+    time_t now = time(NULL);
+    long elapsed = now - g_progress.start, eta = -1;
+    uintmax_t totalbytes = (uintmax_t)(afs_uint32)g_volheader.diskUsed * 1024;
+    uintmax_t rate = elapsed ? g_progress.bytes / elapsed : 0;
+    char line[512], tmpname[MAXPATHLEN];
+    int len;
+
+    g_progress.last = now;
+    if (strcmp(state, "done") == 0)
+        eta = 0;
+    else if (rate && totalbytes > g_progress.bytes)
+        eta = (totalbytes - g_progress.bytes) / rate;
+    else if (elapsed && g_progress.vnodes &&
+            g_volheader.fileCount > g_progress.vnodes)
+        eta = (long)((double)elapsed * (g_volheader.fileCount -
+            g_progress.vnodes) / g_progress.vnodes);
+
+    len = snprintf(line, sizeof line, "state=%s vnodes=%u vnodes_total=%d "
+        "bytes=%llu bytes_total=%llu rate=%llu elapsed=%ld eta=%ld "
+        "inpipe=%ld outpipe=%ld inbuf=%lu outbuf=%lu\n", state,
+        g_progress.vnodes, g_volheader.fileCount,
+        (unsigned long long)g_progress.bytes,
+        (unsigned long long)totalbytes, (unsigned long long)rate, elapsed,
+        eta, iosetup.inpipe, iosetup.outpipe, (unsigned long)iosetup.inbuf,
+        (unsigned long)iosetup.outbuf);
+
+    if (g_progress.fd >= 0) {
+        if (write(g_progress.fd, line, len) != len)
+            g_progress.fd = -1;
+    } else {
+        FILE *out;
+
+        snprintf(tmpname, sizeof tmpname, "%s.tmp", progress);
+        out = fopen(tmpname, "w");
+        if (!out)
+            return;
+        fputs(line, out);
+        if (fclose(out) == 0)
+            rename(tmpname, progress);
+    }
+}
+
+static void
+StartProgress(FILE *dumpfile)
+{
+    g_progress.dumpfile = dumpfile;
+    g_progress.start = time(NULL);
+    g_progress.fd = -1;
+    if (strncmp(progress, "fd:", 3) == 0)
+        g_progress.fd = atoi(progress + 3);
+}
+
+/* 2 added the manifest length */
+#define CHECKPOINTVERSION 2
+
+/*
+ * Record how far the conversion has got: the offset of the next vnode in the
+ * dump, the length of the archive and manifest written so far, the orphans
+ * waiting for their parents and the name table.  The archive is synced first
+ * so that a checkpoint never refers to data that could still be lost, and the
+ * old checkpoint is only replaced once the new one is complete.  The version
+ * on the first line changes with the format, so that an older checkpoint is
+ * refused rather than misread.
+ */
+static int
+WriteCheckpoint(FILE *dumpfile, FILE *orphanfile, VolumeId volumeid)
+{
+    char tmpname[MAXPATHLEN];
+    FILE *ckpt;
+    /* The tag of the next vnode has already been read */
+    off_t input = ftello(dumpfile) - 1;
+    off_t output, orphans, pos;
+
+    /* The names and manifest entries of every directory so far */
+    DrainDirectories();
+    if (fflush(g_tarfile) || fsync(fileno(g_tarfile)) ||
+            fflush(orphanfile) || (g_manifest && fflush(g_manifest))) {
+        perror("Could not sync archive for checkpoint");
+        return -1;
+    }
+    output = ftello(g_tarfile);
+    orphans = ftello(orphanfile);
+
+    snprintf(tmpname, sizeof tmpname, "%s.tmp", checkpoint);
+    ckpt = fopen(tmpname, "w");
+    if (!ckpt) {
+        fprintf(stderr, "Cannot open '%s'. Code = %d\n", tmpname, errno);
+        return -1;
+    }
+
+    /* The manifest only has to be as safe as the archive it describes */
+    fprintf(ckpt, "tarvol checkpoint %d\nvolume %u\ninput %lld\n"
+        "output %lld\nbytes %llu\norphans %lld\nmanifest %lld\n",
+        CHECKPOINTVERSION, volumeid,
+        (long long)input, (long long)output, (unsigned long long)bytecount,
+        (long long)orphans, g_manifest ? (long long)ftello(g_manifest) : -1);
+
+    for (pos = 0; pos < orphans; ) {
+        ssize_t n = pread(fileno(orphanfile), buf,
+            (orphans - pos > BUFSIZE) ? BUFSIZE : orphans - pos, pos);
+        if (n <= 0 || fwrite(buf, 1, n, ckpt) != n)
+            break;
+        pos += n;
+    }
+
+    if (pos != orphans || savenames(ckpt) || fflush(ckpt) ||
+            fsync(fileno(ckpt)) || fclose(ckpt) ||
+            rename(tmpname, checkpoint)) {
+        fprintf(stderr, "Could not write checkpoint '%s'\n", tmpname);
+        return -1;
+    }
+
+    if (verbose > 1)
+        fprintf(stderr, "Checkpoint at dump offset %lld\n", (long long)input);
+    return 0;
+}
+
+/*
+ * Restore the state saved by WriteCheckpoint, cut the archive back to the
+ * length it had then and position the dump at the next vnode.
+ */
+static int
+ReadCheckpoint(FILE *dumpfile, FILE *orphanfile, VolumeId volumeid)
+{
+    FILE *ckpt = fopen(checkpoint, "r");
+    unsigned int volume;
+    long long input, output, orphans, manifestlength;
+    unsigned long long bytes;
+    int version;
+
+    if (!ckpt) {
+        fprintf(stderr, "Cannot open '%s'. Code = %d\n", checkpoint, errno);
+        return -1;
+    }
+
+    if (fscanf(ckpt, "tarvol checkpoint %d", &version) != 1) {
+        fprintf(stderr, "'%s' is not a tarvol checkpoint\n", checkpoint);
+        fclose(ckpt);
+        return -1;
+    }
+    if (version != CHECKPOINTVERSION) {
+        fprintf(stderr, "Checkpoint '%s' is version %d, not %d\n", checkpoint,
+            version, CHECKPOINTVERSION);
+        fclose(ckpt);
+        return -1;
+    }
+
+    if (fscanf(ckpt, " volume %u input %lld output %lld bytes %llu"
+            " orphans %lld manifest %lld", &volume, &input, &output, &bytes,
+            &orphans, &manifestlength) != 6 || fgetc(ckpt) != '\n') {
+        fprintf(stderr, "'%s' is not a tarvol checkpoint\n", checkpoint);
+        fclose(ckpt);
+        return -1;
+    }
+
+    if (g_manifest && manifestlength < 0) {
+        fprintf(stderr, "Checkpoint '%s' has no manifest\n", checkpoint);
+        fclose(ckpt);
+        return -1;
+    }
+
+    if (volume != volumeid) {
+        fprintf(stderr, "Checkpoint is for volume %u, not %u\n", volume,
+            volumeid);
+        fclose(ckpt);
+        return -1;
+    }
+
+    while (orphans > 0) {
+        size_t n = fread(buf, 1, (orphans > BUFSIZE) ? BUFSIZE : orphans,
+            ckpt);
+        if (n == 0)
+            break;
+        fwrite(buf, 1, n, orphanfile);
+        orphans -= n;
+    }
+
+    if (orphans || loadnames(ckpt)) {
+        fprintf(stderr, "Checkpoint '%s' is truncated\n", checkpoint);
+        fclose(ckpt);
+        return -1;
+    }
+    fclose(ckpt);
+
+    if (fflush(g_tarfile) || ftruncate(fileno(g_tarfile), output) ||
+            fseeko(g_tarfile, output, SEEK_SET) ||
+            fseeko(dumpfile, input, SEEK_SET) || (g_manifest &&
+            (ftruncate(fileno(g_manifest), manifestlength) ||
+             fseeko(g_manifest, manifestlength, SEEK_SET)))) {
+        perror("Could not resume from checkpoint");
+        return -1;
+    }
+    bytecount = bytes;
+
+    if (verbose > 1)
+        fprintf(stderr, "Resuming at dump offset %lld\n", input);
+    return 0;
+}
+
+/*
+ * Append the volume header statistics for this run to the stats file, one
+ * line per run, for volsched to plan the next run with:
+ *   name id diskUsed(KB) fileCount updateDate backupDate finished elapsed
+ */
+static void
+WriteVolumeStats(time_t start)
+{
+    FILE *out = fopen(statsfile, "a");
+    time_t now = time(NULL);
+
+    if (!out) {
+        fprintf(stderr, "Cannot open '%s'. Code = %d\n", statsfile, errno);
+        return;
+    }
+    fprintf(out, "%s %u %d %d %d %d %ld %ld\n", g_volheader.volumeName,
+        g_volheader.volumeId, g_volheader.diskUsed, g_volheader.fileCount,
+        g_volheader.updateDate, g_volheader.backupDate, (long)now,
+        (long)(now - start));
+    fclose(out);
+}
+
 int
 create(FILE *dumpfile, FILE *tarfile)
 {
     afs_int32 type, count, vcount;
     struct DumpHeader dh;       /* Defined in dump.h */
+    struct stat st;
+    off_t nextcheckpoint = checkpointinterval;
+    time_t start = time(NULL);
     FILE *orphanfile = tmpfile();
+    long long n;
 
     if (!orphanfile)
     {
@@ -961,6 +1827,15 @@ create(FILE *dumpfile, FILE *tarfile)
     }
 
     g_tarfile = tarfile;
+    g_dumpfile = dumpfile;
+    g_seekable = !fstat(fileno(dumpfile), &st) && S_ISREG(st.st_mode);
+
+    if (checkpoint && (!g_seekable || fstat(fileno(tarfile), &st) ||
+            !S_ISREG(st.st_mode) || !orphanfile))
+    {
+        fprintf(stderr, "Checkpoints need a dump file and an archive file\n");
+        return -1;
+    }
 
     /* Read the dump header. From it we get the volume name */
     type = ntohl(readvalue(dumpfile, 1));
@@ -970,28 +1845,87 @@ create(FILE *dumpfile, FILE *tarfile)
     }
     type = ReadDumpHeader(dumpfile, &dh);
 
-    if (verbose > 1)
+    if (manifest)
     {
-        fprintf(stderr, "Converting volume dump of '%s' to tar format.\n",
-            dh.volumeName);
-    }
+        /* When resuming, the manifest is cut back to the checkpoint */
+        g_manifest = fopen(manifest, resume ? "r+" : "w");
+        if (!g_manifest)
+        {
+            fprintf(stderr, "Cannot open '%s'. Code = %d\n", manifest, errno);
+            return -1;
+        }
+        if (!resume)
+            manifestvolume(g_manifest, dh.volumeId, dh.volumeName);
+    }
+
+    if (verbose > 1)
+    {
+        fprintf(stderr, "Converting volume dump of '%s' to %s format.\n",
+            dh.volumeName, columnar ? "columnar" : backuppc ? "BackupPC" :
+            "tar");
+    }
+
+    if (progress)
+        StartProgress(dumpfile);
 
     for (count = 1; type == D_VOLUMEHEADER; count++) {
         type = ReadVolumeHeader(dumpfile, count);
-        for (vcount = 1; type == D_VNODE; vcount++)
+        if (count == 1) {
+            PrepareVolume(tarfile);
+            if (columnar) {
+                if ((n = columnarstart(tarfile, dh.volumeId,
+                            dh.volumeName)) < 0)
+                    return -1;
+                bytecount += n;
+            }
+            if (columnar && smallfiles &&
+                    columnarsmall(smallfiles, dictfile))
+                return -1;
+            if (backuppc && StartPool(&dh))
+                return -1;
+            StartDirectories();
+        }
+        if (resume) {
+            /* Pick up at the first vnode after the checkpoint */
+            if (ReadCheckpoint(dumpfile, orphanfile, dh.volumeId)) {
+                StopDirectories();
+                return -1;
+            }
+            type = readchar(dumpfile);
+            resume = 0;
+        }
+        for (vcount = 1; type == D_VNODE; vcount++) {
             type = ReadVNode(dumpfile, orphanfile);
+            if (progress && time(NULL) != g_progress.last)
+                ReportProgress("running");
+            if (checkpoint && type == D_VNODE &&
+                    ftello(dumpfile) >= nextcheckpoint) {
+                if (WriteCheckpoint(dumpfile, orphanfile, dh.volumeId)) {
+                    StopDirectories();
+                    return -1;
+                }
+                nextcheckpoint = ftello(dumpfile) + checkpointinterval;
+            }
+        }
     }
 
+    /* Orphans are few, so their directories are decoded as they come */
+    StopDirectories();
+
     if (type != D_DUMPEND) {
         fprintf(stderr, "Expected End-of-Dump\n");
         return -1;
     }
 
+    if (progress && ftell(orphanfile) > 0)
+        ReportProgress("orphans");
+
     while (ftell(orphanfile) > 0)
     {
         FILE *neworphanfile = tmpfile();
 
         writechar(orphanfile, D_DUMPEND);
+        PROBE1(tarvol, orphan__replay, ftell(orphanfile));
         rewind(orphanfile);
 
         type = readchar(orphanfile);
@@ -1019,11 +1953,965 @@ create(FILE *dumpfile, FILE *tarfile)
 
     fclose(orphanfile);
 
-    memset(buf, 0, 1024);
-    fwrite(buf, 1, 1024, tarfile);
-    bytecount += 1024;
+    if (columnar) {
+        if ((n = columnarfinish(tarfile)) < 0)
+            return -1;
+        bytecount += n;
+    } else if (backuppc) {
+        struct BpcStats stats;
+
+        if (bpcfinish(&stats))
+            return -1;
+        if (verbose > 1)
+            fprintf(stderr, "Wrote %llu files, %llu of them already in the "
+                "pool, adding %llu bytes to it\n", (afs_uintmax_t)stats.files,
+                (afs_uintmax_t)stats.pooled, (afs_uintmax_t)stats.newbytes);
+    } else {
+        memset(buf, 0, 1024);
+        fwrite(buf, 1, 1024, tarfile);
+        bytecount += 1024;
+    }
 
     fprintf(stderr, "Total bytes written: %llu\n", bytecount);
 
+    if (g_manifest)
+    {
+        if (fclose(g_manifest))
+            fprintf(stderr, "Could not write manifest '%s'\n", manifest);
+        g_manifest = NULL;
+    }
+
+    if (catalog)
+    {
+        char id[MAXPATHLEN];
+
+        /* Without an id, the volume and the time of the run will have to do */
+        if (archiveid)
+            snprintf(id, sizeof id, "%s", archiveid);
+        else
+            snprintf(id, sizeof id, "%s@%ld", dh.volumeName, (long)start);
+        if (catalogadd(catalog, manifest, id))
+            fprintf(stderr, "Could not add the archive to catalog '%s'\n",
+                catalog);
+    }
+
+    if (statsfile)
+        WriteVolumeStats(start);
+
+    if (progress)
+        ReportProgress("done");
+
+    if (checkpoint)
+    {
+        /* The archive is complete, so the checkpoint is of no further use */
+        if (fflush(tarfile) == 0)
+            unlink(checkpoint);
+    }
+
     return 0;
 }
+
+/* Print the distribution in a histogram from scan() */
+static void
+PrintHistogram(FILE *out, const char *title, afs_uint32 *buckets)
+{
+    int b;
+
+    fprintf(out, "\n%s\n", title);
+    for (b = 0; b < NBUCKETS; b++) {
+        if (!buckets[b])
+            continue;
+        if (b == 0)
+            fprintf(out, "  %25s  %u\n", "0", buckets[b]);
+        else
+            fprintf(out, "  %11llu - %11llu  %u\n",
+                (unsigned long long)1 << (b - 1),
+                ((unsigned long long)1 << b) - 1, buckets[b]);
+    }
+}
+
+int
+scan(FILE *dumpfile, FILE *report)
+{
+    afs_int32 type, count, vcount;
+    struct DumpHeader dh;       /* Defined in dump.h */
+    struct stat st;
+
+    g_scan = 1;
+    g_seekable = !fstat(fileno(dumpfile), &st) && S_ISREG(st.st_mode);
+
+    type = ntohl(readvalue(dumpfile, 1));
+    if (type != D_DUMPHEADER) {
+        fprintf(stderr, "Expected DumpHeader\n");
+        return -1;
+    }
+    type = ReadDumpHeader(dumpfile, &dh);
+
+    for (count = 1; type == D_VOLUMEHEADER; count++) {
+        type = ReadVolumeHeader(dumpfile, count);
+        for (vcount = 1; type == D_VNODE; vcount++)
+            type = ReadVNode(dumpfile, NULL);
+    }
+
+    if (type != D_DUMPEND) {
+        fprintf(stderr, "Expected End-of-Dump\n");
+        return -1;
+    }
+
+    fprintf(report, "volume               %s\n", dh.volumeName);
+    fprintf(report, "volume id            %u\n", dh.volumeId);
+    fprintf(report, "header file count    %d\n", g_volheader.fileCount);
+    fprintf(report, "header disk used     %d KB\n", g_volheader.diskUsed);
+    fprintf(report, "vnodes               %u\n", g_stats.vnodes);
+    fprintf(report, "files                %u\n", g_stats.files);
+    fprintf(report, "directories          %u\n", g_stats.dirs);
+    fprintf(report, "symlinks             %u\n", g_stats.symlinks);
+    fprintf(report, "other vnodes         %u\n", g_stats.other);
+    fprintf(report, "file bytes           %llu\n",
+        (unsigned long long)g_stats.filebytes);
+    fprintf(report, "directory bytes      %llu\n",
+        (unsigned long long)g_stats.dirbytes);
+    fprintf(report, "directory entries    %llu\n",
+        (unsigned long long)g_stats.entries);
+    fprintf(report, "largest directory    %u\n", g_stats.maxentries);
+    fprintf(report, "acl entries          %u\n", g_stats.aclentries);
+    fprintf(report, "negative acls        %u\n", g_stats.negativeacls);
+    fprintf(report, "out-of-order vnodes  %u\n", g_stats.outoforder);
+
+    PrintHistogram(report, "file sizes (bytes)", g_stats.sizes);
+    PrintHistogram(report, "directory fan-out (entries)", g_stats.fanout);
+
+    return 0;
+}
+
+/*
+ * extract() does the reverse of create(): it reads an archive and writes a
+ * vos dump of the paths chosen with -i and -e, along with the directories
+ * that lead to them, so that a lost subtree can be restored with vos restore
+ * into a scratch volume.  Directory contents are generated in the AFS page
+ * format from the entries that are kept.
+ *
+ * Given the manifest of a seekable archive, only the headers and data that
+ * are needed are read, and vnodes keep their numbers, uniquifiers and data
+ * versions.  Otherwise the archive is read from start to end, the data of
+ * the chosen files is set aside in a temporary file if the archive cannot be
+ * read twice, and vnodes are numbered as they come.
+ */
+
+/* A member of the archive, as its header describes it */
+struct XMember {
+    char typeflag;
+    char dir[MAXNAMELEN], name[MAXNAMELEN], linkname[MAXNAMELEN];
+    afs_int32 mode, uid, gid, mtime;
+    afs_sfsize_t size;
+};
+
+/* A vnode of the dump being written */
+struct XNode {
+    struct vNode vn;
+    char *path;                 /* of a directory; a file's first name */
+    char *target;               /* of a symbolic link */
+    off_t data;                 /* where a file's data is in g_x.source */
+    off_t header, aclheader;    /* where the manifest says the members are */
+    struct XNode *dir;          /* the directory it is in */
+    struct XEntry *entries, **lastentry;
+    struct XNode *hashnext;     /* in the table of directories */
+    int needed;
+};
+
+struct XEntry {
+    struct XNode *node;
+    struct XEntry *next;
+    char name[1];
+};
+
+#define XBUCKETS 65536
+
+/* AFS directories are made of 2 KB pages of 32-byte blobs */
+#define DIRPAGESIZE 2048
+#define DIRBLOBSIZE 32
+#define DIRPAGEBLOBS (DIRPAGESIZE / DIRBLOBSIZE)
+#define DIRHEADERBLOBS 13       /* of the first page */
+#define DIRMAXPAGES 1023
+#define DIRALLOMAP 128
+#define DIRHASHSIZE 128
+
+static struct {
+    FILE *source;               /* the archive, or the data set aside */
+    struct XNode **nodes;
+    size_t nnodes, allocated;
+    struct XNode **dirs;        /* by path */
+    afs_int32 nextdir, nextfile;
+    VolumeId volumeid;
+    char volumename[VNAMESIZE];
+} g_x;
+
+static unsigned int
+HashPath(const char *path)
+{
+    unsigned int h = 2166136261u;
+
+    while (*path)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h % XBUCKETS;
+}
+
+static struct XNode *
+FindDir(const char *path)
+{
+    struct XNode *n;
+
+    for (n = g_x.dirs[HashPath(path)]; n; n = n->hashnext)
+        if (strcmp(n->path, path) == 0)
+            return n;
+    return NULL;
+}
+
+/* The directory part of a path, or NULL for the root */
+static struct XNode *
+FindParent(const char *path)
+{
+    char dir[MAXNAMELEN];
+    const char *slash = strrchr(path, '/');
+
+    if (!slash || slash - path >= sizeof dir)
+        return NULL;
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = 0;
+    return FindDir(dir);
+}
+
+/* Whether a path is chosen by the include and exclude rules */
+static int
+Selected(const char *path)
+{
+    if (path[0] == '.' && path[1] == '/')
+        path += 2;
+    if (MatchRules(g_excludes, path))
+        return 0;
+    return !g_includes || MatchRules(g_includes, path);
+}
+
+static struct XNode *
+AddNode(afs_int32 type, const char *path, const struct XMember *m)
+{
+    struct XNode *n = calloc(1, sizeof(*n));
+
+    if (!n || !(n->path = strdup(path))) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    if (g_x.nnodes == g_x.allocated) {
+        g_x.allocated = g_x.allocated ? g_x.allocated * 2 : 1024;
+        g_x.nodes = realloc(g_x.nodes, g_x.allocated * sizeof(*g_x.nodes));
+        if (!g_x.nodes) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    g_x.nodes[g_x.nnodes++] = n;
+
+    n->lastentry = &n->entries;
+    n->vn.type = type;
+    n->vn.uniquifier = 1;
+    n->vn.dataVersion = 1;
+    if (type == vDirectory) {
+        /* Odd vnode numbers are directories, and the root is 1 */
+        n->vn.vnode = strcmp(path, ".") == 0 ? 1 : (g_x.nextdir += 2);
+        n->vn.linkCount = 2;
+        n->dir = FindParent(path);
+        n->hashnext = g_x.dirs[HashPath(path)];
+        g_x.dirs[HashPath(path)] = n;
+    } else {
+        n->vn.vnode = (g_x.nextfile += 2);
+    }
+    if (m) {
+        n->vn.modebits = m->mode & 07777;
+        n->vn.owner = n->vn.author = m->uid;
+        n->vn.group = m->gid;
+        n->vn.unixModTime = n->vn.servModTime = m->mtime;
+    }
+    return n;
+}
+
+static void
+AddEntry(struct XNode *dir, const char *name, struct XNode *node)
+{
+    struct XEntry *e = malloc(sizeof(*e) + strlen(name));
+
+    if (!e) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    strcpy(e->name, name);
+    e->node = node;
+    e->next = NULL;
+    *dir->lastentry = e;
+    dir->lastentry = &e->next;
+    /* A directory's ".." is a link to its parent */
+    if (node->vn.type == vDirectory)
+        dir->vn.linkCount++;
+    else
+        node->vn.linkCount++;
+}
+
+/* A number in a header: octal, or base-256 if the top bit is set */
+static uintmax_t
+TarNumber(const char *field, size_t size)
+{
+    uintmax_t value = 0;
+    size_t i;
+
+    if (field[0] & -128) {
+        for (i = 1; i < size; i++)
+            value = (value << 8) + (unsigned char)field[i];
+        return value;
+    }
+    for (i = 0; i < size && field[i] == ' '; i++)
+        ;
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + field[i] - '0';
+    return value;
+}
+
+/*
+ * Read the header of the next member of the archive.  Returns 1 for a
+ * member, 0 at the end of the archive and -1 if the header is damaged.
+ */
+static int
+ReadMember(FILE *in, struct XMember *m)
+{
+    struct Tar
+    {
+        char name[100];
+        char mode[8];
+        char uid[8];
+        char gid[8];
+        char size[12];
+        char mtime[12];
+        char chksum[8];
+        char typeflag;
+        char linkname[100];
+        char magic[6];
+        char version[2];
+        char uname[32];
+        char gname[32];
+        char devmajor[8];
+        char devminor[8];
+        char prefix[167];
+    } h;
+    unsigned char *p = (unsigned char *)&h;
+    unsigned int sum = 0, zero = 1;
+    size_t i;
+
+    if (fread(&h, 1, sizeof(h), in) != sizeof(h)) {
+        fprintf(stderr, "Unexpected end of archive\n");
+        return -1;
+    }
+    for (i = 0; i < sizeof(h); i++) {
+        zero &= !p[i];
+        sum += (i >= offsetof(struct Tar, chksum) &&
+            i < offsetof(struct Tar, typeflag)) ? ' ' : p[i];
+    }
+    if (zero)
+        return 0;
+    if (sum != TarNumber(h.chksum, sizeof h.chksum)) {
+        fprintf(stderr, "Bad header in archive at %lld\n",
+            (long long)ftello(in) - (long long)sizeof(h));
+        return -1;
+    }
+
+    m->typeflag = h.typeflag ? h.typeflag : REGTYPE;
+    snprintf(m->dir, sizeof m->dir, "%.*s", (int)sizeof h.prefix, h.prefix);
+    snprintf(m->name, sizeof m->name, "%.*s", (int)sizeof h.name, h.name);
+    snprintf(m->linkname, sizeof m->linkname, "%.*s",
+        (int)sizeof h.linkname, h.linkname);
+    m->mode = TarNumber(h.mode, sizeof h.mode);
+    m->uid = TarNumber(h.uid, sizeof h.uid);
+    m->gid = TarNumber(h.gid, sizeof h.gid);
+    m->mtime = TarNumber(h.mtime, sizeof h.mtime);
+    /* Only files have data after their headers */
+    m->size = m->typeflag == REGTYPE || m->typeflag == AREGTYPE ?
+        TarNumber(h.size, sizeof h.size) : 0;
+    return 1;
+}
+
+/* Set aside, or skip, the data of a member and its padding */
+static int
+TakeData(FILE *in, afs_sfsize_t size, FILE *spool)
+{
+    afs_sfsize_t padded = (size + 511) & ~(afs_sfsize_t)511, s;
+
+    if (!spool) {
+        if (g_seekable)
+            return fseeko(in, padded, SEEK_CUR);
+        readdata(in, NULL, padded);
+        return 0;
+    }
+    while (size > 0) {
+        s = size > g_copysize ? g_copysize : size;
+        if (fread(g_copybuf, 1, s, in) != s ||
+            fwrite(g_copybuf, 1, s, spool) != s)
+            return -1;
+        size -= s;
+        padded -= s;
+    }
+    readdata(in, NULL, padded);
+    return 0;
+}
+
+/* Read a directory's ACL back from the script BuildAclScript() wrote */
+static void
+ParseAclScript(char *script, struct vNode *vn)
+{
+    static const char *prefix = "fs sa `dirname $0` ";
+    static const char *letters = "rwildka";
+    struct acl_accessList *acl = &vn->acl;
+    char *line, *next, rights[16];
+    const char *c;
+    int id, n, bits;
+
+    memset(acl, 0, sizeof(*acl));
+    for (line = script; line; line = next) {
+        if ((next = strchr(line, '\n')))
+            *next++ = 0;
+        if (strncmp(line, prefix, strlen(prefix)) != 0)
+            continue;
+        line += strlen(prefix);
+        while (acl->total < 21 &&
+            sscanf(line, "%d %15s%n", &id, rights, &n) == 2) {
+            for (bits = 0, c = rights; *c; c++)
+                if (strchr(letters, *c))
+                    bits |= 1 << (strchr(letters, *c) - letters);
+            acl->entries[acl->total].id = id;
+            acl->entries[acl->total].rights = bits;
+            acl->total++;
+            if (strstr(line, "-negative"))
+                acl->negative++;
+            else
+                acl->positive++;
+            line += n;
+        }
+    }
+}
+
+/* With no script to go by, only system:administrators has access */
+static void
+DefaultAcl(struct vNode *vn)
+{
+    vn->acl.total = vn->acl.positive = 1;
+    vn->acl.entries[0].id = -204;
+    vn->acl.entries[0].rights = 127;
+}
+
+/* Read the whole archive, keeping what was chosen */
+static int
+ReadWholeArchive(FILE *in, FILE *spool)
+{
+    struct XMember m;
+    struct XNode *dir, *last = NULL, *n;
+    struct XEntry *e;
+    char path[MAXNAMELEN * 2];
+    const char *base;
+    int code;
+
+    while ((code = ReadMember(in, &m)) > 0) {
+        if (m.typeflag == DIRTYPE) {
+            if (FindDir(m.dir))
+                continue;
+            last = AddNode(vDirectory, m.dir, &m);
+            last->needed = strcmp(m.dir, ".") == 0 || Selected(m.dir);
+            if (!last->dir && last->vn.vnode != 1)
+                fprintf(stderr, "No directory for '%s'\n", m.dir);
+            continue;
+        }
+
+        dir = FindDir(m.dir);
+        snprintf(path, sizeof path, "%s/%s", m.dir, m.name);
+        if (dir && dir == last && m.typeflag == REGTYPE &&
+            strcmp(m.name, ".afs_acl_restore.sh") == 0 &&
+            m.size < sizeof buf) {
+            /* The directory's ACL, written straight after it by -a */
+            last = NULL;
+            if (fread(buf, 1, m.size, in) != m.size)
+                return -1;
+            buf[m.size] = 0;
+            ParseAclScript(buf, &dir->vn);
+            /* This reuses buf */
+            readdata(in, NULL, ((m.size + 511) & ~511) - m.size);
+            continue;
+        }
+        last = NULL;
+
+        if (!dir || !Selected(path) || (m.typeflag != REGTYPE &&
+                m.typeflag != SYMTYPE && m.typeflag != LNKTYPE)) {
+            if (!dir)
+                fprintf(stderr, "No directory for '%s'\n", path);
+            if (TakeData(in, m.size, NULL))
+                return -1;
+            continue;
+        }
+
+        if (m.typeflag == LNKTYPE) {
+            /* Hard links are to a file of the same directory */
+            base = strrchr(m.linkname, '/');
+            base = base ? base + 1 : m.linkname;
+            for (e = dir->entries; e; e = e->next)
+                if (e->node->vn.type == vFile && strcmp(e->name, base) == 0)
+                    break;
+            if (e)
+                AddEntry(dir, m.name, e->node);
+            else
+                fprintf(stderr, "Left out '%s', a link to a file not "
+                    "chosen\n", path);
+            continue;
+        }
+
+        n = AddNode(m.typeflag == SYMTYPE ? vSymlink : vFile, m.name, &m);
+        n->dir = dir;
+        AddEntry(dir, m.name, n);
+        if (m.typeflag == SYMTYPE) {
+            n->target = strdup(m.linkname);
+            n->vn.dataSize = strlen(m.linkname);
+            continue;
+        }
+        n->vn.dataSize = m.size;
+        n->data = ftello(spool ? spool : in);
+        if (TakeData(in, m.size, spool)) {
+            fprintf(stderr, "Could not read the data of '%s'\n", path);
+            return -1;
+        }
+    }
+    return code;
+}
+
+/*
+ * The directories on the way to each file and to each chosen directory are
+ * needed too.  A directory whose ancestors have been marked is marked 2, so
+ * each path is walked once.
+ */
+static void
+MarkNeeded(void)
+{
+    struct XNode *n;
+    size_t i;
+
+    for (i = 0; i < g_x.nnodes; i++) {
+        n = g_x.nodes[i];
+        if (n->vn.type != vDirectory || n->needed)
+            for (n = n->dir; n && n->needed != 2; n = n->dir)
+                n->needed = 2;
+    }
+}
+
+static int
+CompareXNodes(const void *a, const void *b)
+{
+    afs_uint32 x = (*(struct XNode * const *)a)->vn.vnode;
+    afs_uint32 y = (*(struct XNode * const *)b)->vn.vnode;
+
+    return x < y ? -1 : x > y;
+}
+
+static struct XNode *
+FindVNode(afs_uint32 vnode)
+{
+    struct XNode key, *k = &key, **n;
+
+    key.vn.vnode = vnode;
+    n = bsearch(&k, g_x.nodes, g_x.nnodes, sizeof(*g_x.nodes),
+        CompareXNodes);
+    return n ? *n : NULL;
+}
+
+/*
+ * Take the members that are needed from where the manifest says they are,
+ * and the names of the chosen files from its directory entries.
+ */
+static int
+ReadIndexedArchive(FILE *in, const struct Manifest *man)
+{
+    struct ManifestRecord r;
+    struct XMember m;
+    struct XNode *dir, *n;
+    char path[MAXNAMELEN * 2];
+    const char *p, *name;
+    size_t i;
+
+    for (p = NULL; (p = manifestnext(man, p, &r)); ) {
+        if (r.kind == 'V') {
+            g_x.volumeid = r.vnode;
+            snprintf(g_x.volumename, sizeof g_x.volumename, "%.*s",
+                (int)r.pathlen, r.path);
+        }
+        if (r.kind != 'M' || manifestpath(&r, path, sizeof path) < 0)
+            continue;
+
+        if (r.type == 'd') {
+            if (FindDir(path))
+                continue;
+            n = AddNode(vDirectory, path, NULL);
+            n->needed = strcmp(path, ".") == 0 || Selected(path);
+        } else if (r.type == 'a') {
+            if ((dir = FindParent(path)))
+                dir->aclheader = r.offset;
+            continue;
+        } else if (r.type == 'h') {
+            /* A file's other names come from the directory entries */
+            continue;
+        } else {
+            if (!(dir = FindParent(path)) || !Selected(path))
+                continue;
+            name = strrchr(path, '/') + 1;
+            n = AddNode(r.type == 'l' ? vSymlink : vFile, name, NULL);
+            n->dir = dir;
+            n->vn.dataSize = r.size;
+            n->data = r.offset + 512;
+        }
+        n->header = r.offset;
+        n->vn.vnode = r.vnode;
+        n->vn.uniquifier = r.uniquifier;
+        n->vn.dataVersion = r.dataversion;
+    }
+
+    /* The owners, symlink targets and ACLs are only in the archive */
+    MarkNeeded();
+    for (i = 0; i < g_x.nnodes; i++) {
+        n = g_x.nodes[i];
+        if (n->vn.type == vDirectory && !n->needed)
+            continue;
+        if (fseeko(in, n->header, SEEK_SET) || ReadMember(in, &m) <= 0) {
+            fprintf(stderr, "Cannot read the header of '%s'\n", n->path);
+            return -1;
+        }
+        n->vn.modebits = m.mode & 07777;
+        n->vn.owner = n->vn.author = m.uid;
+        n->vn.group = m.gid;
+        n->vn.unixModTime = n->vn.servModTime = m.mtime;
+        if (n->vn.type == vSymlink) {
+            n->target = strdup(m.linkname);
+            n->vn.dataSize = strlen(m.linkname);
+        }
+        if (n->aclheader && (fseeko(in, n->aclheader, SEEK_SET) ||
+                ReadMember(in, &m) <= 0 || m.size >= sizeof buf ||
+                fread(buf, 1, m.size, in) != m.size)) {
+            fprintf(stderr, "Cannot read the ACL of '%s'\n", n->path);
+            return -1;
+        }
+        if (n->aclheader) {
+            buf[m.size] = 0;
+            ParseAclScript(buf, &n->vn);
+        }
+    }
+
+    /* Every name of a chosen file, hard links included */
+    qsort(g_x.nodes, g_x.nnodes, sizeof(*g_x.nodes), CompareXNodes);
+    for (p = NULL; (p = manifestnext(man, p, &r)); ) {
+        if (r.kind != 'E' || (r.vnode & 1) ||
+            manifestpath(&r, path, sizeof path) < 0)
+            continue;
+        if ((n = FindVNode(r.vnode)) && n->vn.uniquifier == r.uniquifier &&
+            n->dir && n->dir->vn.vnode == r.dirvnode)
+            AddEntry(n->dir, path, n);
+    }
+    return 0;
+}
+
+static int
+DirHash(const char *name)
+{
+    unsigned int hval = 0;
+    int tval;
+
+    while (*name)
+        hval = hval * 173 + (signed char)*name++;
+    tval = hval & (DIRHASHSIZE - 1);
+    if (tval == 0)
+        return 0;
+    if (hval >= 1u << 31)
+        tval = DIRHASHSIZE - tval;
+    return tval;
+}
+
+/*
+ * Lay out the contents of a directory as the fileserver would: a header on
+ * the first page holding the hash table and how full each page is, then each
+ * entry in as many blobs as its name needs, with no entry crossing a page.
+ * Returns the contents, or NULL if the directory is too big.
+ */
+static unsigned int
+PlaceEntry(unsigned int blob, unsigned int nblobs)
+{
+    /* The first blob of each page is its header */
+    if (blob % DIRPAGEBLOBS == 0)
+        return blob + 1;
+    if (blob % DIRPAGEBLOBS + nblobs > DIRPAGEBLOBS)
+        return (blob / DIRPAGEBLOBS + 1) * DIRPAGEBLOBS + 1;
+    return blob;
+}
+
+static char *
+BuildDirectory(struct XNode *dir, afs_sfsize_t *length)
+{
+    struct XEntry dot, dotdot, *e;
+    unsigned char *data, *entry;
+    unsigned int blob, page, pages, nblobs, i;
+    const char *name;
+    int h;
+
+    /* Every directory starts with "." and "..", the root's being itself */
+    dot.node = dir;
+    dot.next = &dotdot;
+    dotdot.node = dir->dir ? dir->dir : dir;
+    dotdot.next = dir->entries;
+
+    blob = DIRHEADERBLOBS;
+    for (e = &dot; e; e = e->next) {
+        name = e == &dot ? "." : e == &dotdot ? ".." : e->name;
+        nblobs = 1 + (strlen(name) + 16) / 32;
+        blob = PlaceEntry(blob, nblobs) + nblobs;
+    }
+    pages = (blob + DIRPAGEBLOBS - 1) / DIRPAGEBLOBS;
+    if (pages > DIRMAXPAGES)
+        return NULL;
+
+    data = calloc(pages, DIRPAGESIZE);
+    if (!data) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    /* Page header: pgcount, tag, freecount, then the allocation bitmap */
+    putvalue(data, 2, pages);
+    for (page = 0; page < pages; page++) {
+        putvalue(data + page * DIRPAGESIZE + 2, 2, 1234);
+        data[page * DIRPAGESIZE + 5] = 1;
+    }
+    data[5] = 0xff;
+    data[6] = 0x1f;
+    for (page = 0; page < DIRALLOMAP; page++)
+        data[32 + page] = page == 0 ? DIRPAGEBLOBS - DIRHEADERBLOBS :
+            page < pages ? DIRPAGEBLOBS - 1 : DIRPAGEBLOBS;
+
+    blob = DIRHEADERBLOBS;
+    for (e = &dot; e; e = e->next) {
+        name = e == &dot ? "." : e == &dotdot ? ".." : e->name;
+        nblobs = 1 + (strlen(name) + 16) / 32;
+        blob = PlaceEntry(blob, nblobs);
+        page = blob / DIRPAGEBLOBS;
+        for (i = blob % DIRPAGEBLOBS; i < blob % DIRPAGEBLOBS + nblobs; i++)
+            data[page * DIRPAGESIZE + 5 + i / 8] |= 1 << (i % 8);
+        if (page < DIRALLOMAP)
+            data[32 + page] -= nblobs;
+
+        /* flag, length, next in the hash chain, fid, then the name */
+        entry = data + blob * DIRBLOBSIZE;
+        h = DirHash(name);
+        entry[0] = 1;
+        memcpy(entry + 2, data + 32 + DIRALLOMAP + 2 * h, 2);
+        putvalue(entry + 4, 4, (afs_uint32)e->node->vn.vnode);
+        putvalue(entry + 8, 4, (afs_uint32)e->node->vn.uniquifier);
+        strcpy((char *)entry + 12, name);
+        putvalue(data + 32 + DIRALLOMAP + 2 * h, 2, blob);
+        blob += nblobs;
+    }
+
+    *length = (afs_sfsize_t)pages * DIRPAGESIZE;
+    return (char *)data;
+}
+
+/* Copy a file's data from where it was found or set aside */
+static int
+CopyOut(struct XNode *n, FILE *out)
+{
+    afs_sfsize_t size = n->vn.dataSize, s;
+
+    if (fseeko(g_x.source, n->data, SEEK_SET))
+        return -1;
+    while (size > 0) {
+        s = size > g_copysize ? g_copysize : size;
+        if (fread(g_copybuf, 1, s, g_x.source) != s ||
+            fwrite(g_copybuf, 1, s, out) != s)
+            return -1;
+        size -= s;
+    }
+    return 0;
+}
+
+/* Write the dump of every vnode that is needed, directories first */
+static int
+WriteDump(FILE *out)
+{
+    struct DumpHeader dh;
+    struct volumeHeader vh;
+    unsigned char record[4096];
+    struct XNode *n, **nodes;
+    size_t i, count = 0, size;
+    afs_uint32 uniquifier = 1, diskused = 0;
+    time_t now = time(NULL);
+    char *data;
+    int code = 0;
+
+    /* Only the files chosen, and the directories on the way to them */
+    MarkNeeded();
+    for (i = 0; i < g_x.nnodes; i++) {
+        n = g_x.nodes[i];
+        if (n->vn.type == vDirectory && n->needed && n->dir)
+            AddEntry(n->dir, strrchr(n->path, '/') + 1, n);
+    }
+    nodes = malloc(g_x.nnodes * sizeof(*nodes));
+    if (!nodes) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    for (i = 0; i < g_x.nnodes; i++) {
+        n = g_x.nodes[i];
+        if (n->vn.type == vDirectory ? !n->needed : !n->vn.linkCount)
+            continue;
+        n->vn.parent = n->dir ? n->dir->vn.vnode : 0;
+        if ((afs_uint32)n->vn.uniquifier >= uniquifier)
+            uniquifier = n->vn.uniquifier + 1;
+        diskused += (n->vn.dataSize + 1023) / 1024;
+        nodes[count++] = n;
+    }
+    /* Directories have odd numbers, so put them before the files */
+    qsort(nodes, count, sizeof(*nodes), CompareXNodes);
+
+    memset(&dh, 0, sizeof(dh));
+    dh.volumeId = g_x.volumeid;
+    strncpy(dh.volumeName, g_x.volumename, sizeof dh.volumeName - 1);
+    dh.nDumpTimes = 1;
+    dh.dumpTimes[0].to = now;
+    record[0] = D_DUMPHEADER;
+    putvalue(record + 1, 4, DUMPBEGINMAGIC);
+    putvalue(record + 5, 4, DUMPVERSION);
+    size = 9 + encoderecord(&g_dumpheaderrecord, &dh, record + 9,
+        sizeof(record) - 9);
+    fwrite(record, 1, size, out);
+
+    memset(&vh, 0, sizeof(vh));
+    vh.volumeId = vh.parentVol = g_x.volumeid;
+    strncpy(vh.volumeName, g_x.volumename, sizeof vh.volumeName - 1);
+    vh.inService = vh.blessed = 1;
+    vh.uniquifier = uniquifier;
+    vh.diskUsed = diskused;
+    vh.fileCount = count;
+    vh.creationDate = vh.accessDate = vh.updateDate = now;
+    vh.dayUseDate = now;
+    vh.weekCount = 7;
+    record[0] = D_VOLUMEHEADER;
+    size = encoderecord(&g_volumeheaderrecord, &vh, record + 6,
+        sizeof(record) - 6);
+    /* The version is not kept, but vos writes it after the volume id */
+    memmove(record + 1, record + 6, 5);
+    record[6] = 'v';
+    putvalue(record + 7, 4, 1);
+    fwrite(record, 1, 6 + size, out);
+
+    for (i = 0; i < count && !code; i++) {
+        n = nodes[i];
+        if (n->vn.type == vDirectory) {
+            if (!n->vn.acl.total)
+                DefaultAcl(&n->vn);
+            n->vn.acl.size = sizeof(n->vn.acl);
+            n->vn.acl.version = 1;
+            if (!(data = BuildDirectory(n, &n->vn.dataSize))) {
+                fprintf(stderr, "Directory '%s' is too big\n", n->path);
+                code = -1;
+                break;
+            }
+            WriteVNode(out, &n->vn);
+            fwrite(data, 1, n->vn.dataSize, out);
+            free(data);
+        } else {
+            WriteVNode(out, &n->vn);
+            if (n->vn.type == vSymlink)
+                fwrite(n->target, 1, n->vn.dataSize, out);
+            else if (CopyOut(n, out)) {
+                fprintf(stderr, "Could not copy the data of '%s'\n",
+                    n->path);
+                code = -1;
+            }
+        }
+        if (verbose && n->vn.type == vDirectory)
+            fprintf(stderr, "%s/\n", n->path);
+        else if (verbose)
+            fprintf(stderr, "%s/%s\n", n->dir->path, n->path);
+    }
+
+    putc(D_DUMPEND, out);
+    putvalue(record, 4, DUMPENDMAGIC);
+    fwrite(record, 1, 4, out);
+    free(nodes);
+
+    if (verbose > 1)
+        fprintf(stderr, "Wrote %lu vnodes\n", (unsigned long)count);
+    return code;
+}
+
+int
+extract(FILE *tarfile, FILE *dumpfile)
+{
+    struct stat st;
+    struct Manifest man;
+    FILE *spool = NULL;
+    char *data;
+    size_t i;
+    int code;
+
+    memset(&g_x, 0, sizeof(g_x));
+    g_x.nextdir = 1;
+    strcpy(g_x.volumename, "restore");
+    g_x.dirs = calloc(XBUCKETS, sizeof(*g_x.dirs));
+    if (!g_x.dirs) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    if (g_copysize < MAXCOPYSIZE && (data = malloc(MAXCOPYSIZE))) {
+        g_copybuf = data;
+        g_copysize = MAXCOPYSIZE;
+    }
+
+    g_seekable = !fstat(fileno(tarfile), &st) && S_ISREG(st.st_mode);
+    g_x.source = tarfile;
+    if (manifest) {
+        if (!g_seekable) {
+            fprintf(stderr, "A manifest can only be used with an archive "
+                "file\n");
+            return -1;
+        }
+        if (manifestopen(manifest, &man))
+            return -1;
+        code = ReadIndexedArchive(tarfile, &man);
+        manifestclose(&man);
+    } else {
+        if (!g_seekable && !(spool = g_x.source = tmpfile())) {
+            fprintf(stderr, "Could not create temp file for file data\n");
+            return -1;
+        }
+        code = ReadWholeArchive(tarfile, spool);
+    }
+
+    if (code >= 0 && !FindDir(".")) {
+        fprintf(stderr, "The archive has no root directory\n");
+        code = -1;
+    }
+    if (code >= 0)
+        code = WriteDump(dumpfile);
+
+    if (spool)
+        fclose(spool);
+    for (i = 0; i < g_x.nnodes; i++) {
+        struct XEntry *e, *next;
+
+        for (e = g_x.nodes[i]->entries; e; e = next) {
+            next = e->next;
+            free(e);
+        }
+        free(g_x.nodes[i]->path);
+        free(g_x.nodes[i]->target);
+        free(g_x.nodes[i]);
+    }
+    free(g_x.nodes);
+    free(g_x.dirs);
+    return code < 0 ? -1 : 0;
+}
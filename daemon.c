@@ -0,0 +1,643 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Conversion daemon.  tarvol -D listens on a Unix domain socket and keeps a
+ * pool of worker processes, each of which runs one conversion at a time and
+ * keeps its buffers and name table between jobs.  The conversion code keeps
+ * its state in globals, so workers are processes rather than threads, and a
+ * worker that dies (tarvol exits on a bad dump) is simply replaced.
+ *
+ * tarvol -J submits a job: its working directory, its arguments and its
+ * standard input, output and error, passed as descriptors so that the worker
+ * reads the dump and writes the archive directly.  The daemon answers with the
+ * exit status of the job.  Jobs wait in a queue while all workers are busy,
+ * and are turned away once the queue is full.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#define JOBMAGIC 0x74617276
+#define MAXJOB 65536
+/* Connections waiting to send their job, and how long they may take */
+#define MAXPENDING 64
+#define JOBTIMEOUT 5
+
+struct JobHeader
+{
+    uint32_t magic;
+    uint32_t argc;
+};
+
+struct Job
+{
+    int conn;                   /* client connection, for the reply */
+    int fds[3];
+    size_t length;
+    char *data;                 /* header, cwd and arguments */
+    time_t accepted;            /* of the connection */
+    struct Job *next;
+};
+
+struct Worker
+{
+    pid_t pid;
+    int sock;
+    struct Job *job;
+};
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void
+Stop(int sig)
+{
+    g_stop = 1;
+}
+
+/* Send a message along with descriptors */
+static int
+SendMessage(int sock, const void *data, size_t length, const int *fds,
+        int nfds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)data;
+    iov.iov_len = length;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (nfds)
+    {
+        struct cmsghdr *cmsg;
+
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)length ? 0 : -1;
+}
+
+/* Receive a message and up to three descriptors, setting the rest to -1 */
+static ssize_t
+RecvMessage(int sock, void *data, size_t length, int *fds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    ssize_t n;
+
+    fds[0] = fds[1] = fds[2] = -1;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = data;
+    iov.iov_len = length;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    n = recvmsg(sock, &msg, 0);
+    for (cmsg = CMSG_FIRSTHDR(&msg); n >= 0 && cmsg;
+            cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg),
+                    (count > 3 ? 3 : count) * sizeof(int));
+        }
+    }
+    return n;
+}
+
+static void
+Reply(int conn, int32_t status)
+{
+    if (send(conn, &status, sizeof(status), MSG_NOSIGNAL) < 0 &&
+            verbose)
+    {
+        perror("Could not reply to client");
+    }
+}
+
+static void
+FreeJob(struct Job *job)
+{
+    int i;
+
+    for (i = 0; i < 3; i++)
+    {
+        if (job->fds[i] >= 0)
+            close(job->fds[i]);
+    }
+    if (job->conn >= 0)
+        close(job->conn);
+    free(job->data);
+    free(job);
+}
+
+/*
+ * Run jobs until the daemon goes away.  Each job gets the client's working
+ * directory and standard descriptors, which are put back afterwards.
+ */
+static void
+WorkerLoop(int sock, int (*run)(int, char **))
+{
+    char *data = malloc(MAXJOB);
+    int saved[3], fds[3], i;
+
+    for (i = 0; i < 3; i++)
+        saved[i] = dup(i);
+
+    while (data)
+    {
+        struct JobHeader *header = (struct JobHeader *)data;
+        char *argv[256], *p, *end;
+        const char *cwd;
+        int32_t status = 1;
+        ssize_t n;
+        int argc;
+
+        n = RecvMessage(sock, data, MAXJOB - 1, fds);
+        if (n <= 0)
+            break;
+        data[n] = 0;
+        end = data + n;
+
+        p = data + sizeof(struct JobHeader);
+        cwd = p;
+        p += strlen(p) + 1;
+        for (argc = 0; argc < header->argc && argc < 255 && p < end; argc++)
+        {
+            argv[argc] = p;
+            p += strlen(p) + 1;
+        }
+        argv[argc] = NULL;
+
+        for (i = 0; i < 3; i++)
+        {
+            if (fds[i] >= 0)
+            {
+                dup2(fds[i], i);
+                close(fds[i]);
+            }
+        }
+        /* Do not let anything left over from the last job leak in */
+        __fpurge(stdin);
+        clearerr(stdin);
+        clearerr(stdout);
+
+        if (chdir(cwd) == 0)
+            status = run(argc, argv);
+        else
+            fprintf(stderr, "Cannot change to '%s'. Code = %d\n", cwd, errno);
+
+        fflush(stdout);
+        fflush(stderr);
+        for (i = 0; i < 3; i++)
+            dup2(saved[i], i);
+        __fpurge(stdin);
+        clearerr(stdin);
+        clearerr(stdout);
+        chdir("/");
+
+        if (send(sock, &status, sizeof(status), MSG_NOSIGNAL) < 0)
+            break;
+    }
+    _exit(0);
+}
+
+static int
+StartWorker(struct Worker *w, int (*run)(int, char **))
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv))
+    {
+        perror("socketpair");
+        return -1;
+    }
+
+    w->pid = fork();
+    if (w->pid == 0)
+    {
+        long fd, max = sysconf(_SC_OPEN_MAX);
+
+        /* Drop the listening socket, clients and other workers */
+        if (max < 0 || max > 65536)
+            max = 65536;
+        for (fd = 3; fd < max; fd++)
+        {
+            if (fd != sv[1])
+                close(fd);
+        }
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        WorkerLoop(sv[1], run);
+    }
+    close(sv[1]);
+    if (w->pid < 0)
+    {
+        perror("fork");
+        close(sv[0]);
+        w->sock = -1;
+        return -1;
+    }
+    w->sock = sv[0];
+    w->job = NULL;
+    return 0;
+}
+
+/*
+ * Take a new connection.  Its job is read once it arrives, so that a client
+ * that connects and says nothing does not hold up the daemon.
+ */
+static struct Job *
+AcceptJob(int listener)
+{
+    struct Job *job;
+    int conn = accept(listener, NULL, NULL);
+
+    if (conn < 0)
+        return NULL;
+
+    job = calloc(1, sizeof(struct Job));
+    if (job)
+        job->data = malloc(MAXJOB);
+    if (!job || !job->data)
+    {
+        fprintf(stderr, "Out of memory accepting job\n");
+        if (job)
+            free(job->data);
+        free(job);
+        close(conn);
+        return NULL;
+    }
+    fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) | O_NONBLOCK);
+    job->conn = conn;
+    job->fds[0] = job->fds[1] = job->fds[2] = -1;
+    job->accepted = time(NULL);
+    return job;
+}
+
+/*
+ * Read the job from a connection, returning 1 once it has arrived, 0 if it
+ * has not yet and -1 if it is malformed or the client has gone
+ */
+static int
+ReadJob(struct Job *job)
+{
+    ssize_t n = RecvMessage(job->conn, job->data, MAXJOB, job->fds);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (n < (ssize_t)sizeof(struct JobHeader) ||
+            ((struct JobHeader *)job->data)->magic != JOBMAGIC)
+    {
+        fprintf(stderr, "Ignoring malformed job\n");
+        return -1;
+    }
+    job->length = n;
+    return 1;
+}
+
+int
+serve(const char *path, int nworkers, int maxqueue, int (*run)(int, char **))
+{
+    struct sockaddr_un addr;
+    struct Worker *workers;
+    struct pollfd *polls;
+    struct Job *queue = NULL, **tail = &queue;
+    struct Job *pending = NULL, **next, *job;
+    int listener, i, queued = 0, npending = 0, npolls, timeout, idle;
+    mode_t mask;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path '%s' is too long\n", path);
+        return 1;
+    }
+
+    listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    /* Only our own user may hand us jobs */
+    mask = umask(077);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr,
+                sizeof(addr)) || listen(listener, 64))
+    {
+        umask(mask);
+        fprintf(stderr, "Cannot listen on '%s'. Code = %d\n", path, errno);
+        return 1;
+    }
+    umask(mask);
+    /* A client that gives up before it is accepted must not block us */
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, Stop);
+    signal(SIGINT, Stop);
+
+    workers = calloc(nworkers, sizeof(struct Worker));
+    polls = calloc(nworkers + 1 + MAXPENDING, sizeof(struct pollfd));
+    if (!workers || !polls)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < nworkers; i++)
+    {
+        if (StartWorker(&workers[i], run))
+            return 1;
+    }
+
+    if (verbose)
+    {
+        fprintf(stderr, "Listening on %s with %d workers\n", path, nworkers);
+    }
+
+    while (!g_stop)
+    {
+        /* Hand queued jobs to idle workers */
+        for (i = 0; i < nworkers && queue; i++)
+        {
+            struct Job *job = queue;
+            int j;
+
+            if (workers[i].job || workers[i].pid <= 0)
+                continue;
+
+            queue = job->next;
+            if (!queue)
+                tail = &queue;
+            queued--;
+
+            if (SendMessage(workers[i].sock, job->data, job->length,
+                        job->fds, 3))
+            {
+                Reply(job->conn, 1);
+                FreeJob(job);
+                continue;
+            }
+            /* The worker has its own copies now */
+            for (j = 0; j < 3; j++)
+            {
+                if (job->fds[j] >= 0)
+                    close(job->fds[j]);
+                job->fds[j] = -1;
+            }
+            workers[i].job = job;
+        }
+
+        /* Stop accepting while enough clients are still to send a job */
+        polls[0].fd = npending < MAXPENDING ? listener : -1;
+        polls[0].events = POLLIN;
+        for (i = 0; i < nworkers; i++)
+        {
+            polls[i + 1].fd = workers[i].sock;
+            polls[i + 1].events = POLLIN;
+        }
+        npolls = nworkers + 1;
+        timeout = -1;
+        for (job = pending; job; job = job->next)
+        {
+            time_t left = job->accepted + JOBTIMEOUT - time(NULL);
+
+            polls[npolls].fd = job->conn;
+            polls[npolls++].events = POLLIN;
+            if (left < 0)
+                left = 0;
+            if (timeout < 0 || left * 1000 < timeout)
+                timeout = left * 1000;
+        }
+
+        if (poll(polls, npolls, timeout) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        for (i = 0; i < nworkers; i++)
+        {
+            struct Worker *w = &workers[i];
+            int32_t status;
+            ssize_t n;
+
+            if (!polls[i + 1].revents || w->pid <= 0)
+                continue;
+
+            n = recv(w->sock, &status, sizeof(status), 0);
+            if (n == sizeof(status) && w->job)
+            {
+                Reply(w->job->conn, status);
+            }
+            else if (n <= 0)
+            {
+                /* The worker died, probably by exiting on a bad dump */
+                if (w->job)
+                    Reply(w->job->conn, 1);
+                close(w->sock);
+                waitpid(w->pid, NULL, 0);
+                /* Without a replacement, the slot is left out of the poll */
+                if (StartWorker(w, run))
+                {
+                    w->pid = 0;
+                    w->sock = -1;
+                }
+            }
+            if (w->job)
+            {
+                FreeJob(w->job);
+                w->job = NULL;
+            }
+        }
+
+        /* Queue the jobs that have arrived, and drop clients that are slow */
+        for (i = idle = 0; i < nworkers; i++)
+        {
+            if (!workers[i].job && workers[i].pid > 0)
+                idle++;
+        }
+        for (next = &pending, i = nworkers + 1; (job = *next); i++)
+        {
+            int ready = 0;
+
+            if (polls[i].revents)
+                ready = ReadJob(job);
+            else if (time(NULL) - job->accepted >= JOBTIMEOUT)
+            {
+                fprintf(stderr, "Ignoring a client that sent no job\n");
+                ready = -1;
+            }
+            if (!ready)
+            {
+                next = &job->next;
+                continue;
+            }
+            *next = job->next;
+            job->next = NULL;
+            npending--;
+
+            /* Jobs beyond the idle workers wait, up to maxqueue of them */
+            if (ready < 0)
+                FreeJob(job);
+            else if (queued >= idle + maxqueue)
+            {
+                Reply(job->conn, EXIT_BUSY);
+                FreeJob(job);
+            }
+            else
+            {
+                *tail = job;
+                tail = &job->next;
+                queued++;
+            }
+        }
+
+        if (polls[0].revents & POLLIN)
+        {
+            job = AcceptJob(listener);
+            if (job)
+            {
+                job->next = pending;
+                pending = job;
+                npending++;
+            }
+        }
+    }
+
+    while ((job = pending))
+    {
+        pending = job->next;
+        FreeJob(job);
+    }
+
+    unlink(path);
+    for (i = 0; i < nworkers; i++)
+    {
+        if (workers[i].pid > 0)
+            kill(workers[i].pid, SIGTERM);
+    }
+    while (wait(NULL) > 0)
+        ;
+    return 0;
+}
+
+/*
+ * Send our arguments and standard descriptors to the daemon and wait for it
+ * to run them.  The -J option itself is left out.
+ */
+int
+submit(const char *path, int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    struct JobHeader header;
+    char *data = malloc(MAXJOB), cwd[MAXPATHLEN];
+    size_t length = sizeof(header), len;
+    int sock, i, fds[3] = { 0, 1, 2 };
+    int32_t status;
+
+    if (!data || !getcwd(cwd, sizeof(cwd)))
+    {
+        fprintf(stderr, "Cannot get current directory\n");
+        return 1;
+    }
+
+    header.magic = JOBMAGIC;
+    header.argc = 0;
+    len = strlen(cwd) + 1;
+    memcpy(data + length, cwd, len);
+    length += len;
+
+    for (i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-J") == 0)
+        {
+            i++;
+            continue;
+        }
+        if (strncmp(argv[i], "-J", 2) == 0)
+            continue;
+
+        len = strlen(argv[i]) + 1;
+        if (length + len > MAXJOB)
+        {
+            fprintf(stderr, "Too many arguments for a job\n");
+            return 1;
+        }
+        memcpy(data + length, argv[i], len);
+        length += len;
+        header.argc++;
+    }
+    memcpy(data, &header, sizeof(header));
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path '%s' is too long\n", path);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        fprintf(stderr, "Cannot connect to '%s'. Code = %d\n", path, errno);
+        return 1;
+    }
+
+    fflush(stdout);
+    if (SendMessage(sock, data, length, fds, 3) ||
+            recv(sock, &status, sizeof(status), 0) != sizeof(status))
+    {
+        fprintf(stderr, "Lost connection to the daemon\n");
+        return 1;
+    }
+
+    if (status == EXIT_BUSY)
+    {
+        fprintf(stderr, "The daemon is too busy to take the job\n");
+    }
+    return status;
+}
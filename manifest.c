@@ -0,0 +1,243 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "manifest.h"
+
+static void
+WriteEscaped(FILE *out, const char *s)
+{
+    for (; *s; s++)
+    {
+        switch (*s)
+        {
+            case '\\':
+                fputs("\\\\", out);
+                break;
+            case '\t':
+                fputs("\\t", out);
+                break;
+            case '\n':
+                fputs("\\n", out);
+                break;
+            default:
+                putc(*s, out);
+        }
+    }
+}
+
+void
+manifestvolume(FILE *out, uint32_t volumeid, const char *name)
+{
+    fprintf(out, "V\t%u\t", volumeid);
+    WriteEscaped(out, name);
+    putc('\n', out);
+}
+
+void
+manifestmember(FILE *out, const struct ManifestRecord *r, const char *dir,
+        const char *name)
+{
+    fprintf(out, "M\t%u\t%u\t%c\t%u\t%llu\t%u\t%o\t%llu\t", r->vnode,
+            r->uniquifier, r->type, r->dataversion,
+            (unsigned long long)r->size, r->mtime, r->mode,
+            (unsigned long long)r->offset);
+    WriteEscaped(out, dir);
+    if (name)
+    {
+        putc('/', out);
+        WriteEscaped(out, name);
+    }
+    putc('\n', out);
+}
+
+void
+manifestentry(FILE *out, uint32_t dirvnode, uint32_t vnode,
+        uint32_t uniquifier, const char *name)
+{
+    fprintf(out, "E\t%u\t%u\t%u\t", dirvnode, vnode, uniquifier);
+    WriteEscaped(out, name);
+    putc('\n', out);
+}
+
+int
+manifestopen(const char *file, struct Manifest *m)
+{
+    struct stat st;
+    int fd = open(file, O_RDONLY);
+
+    m->data = NULL;
+    m->size = 0;
+    if (fd < 0 || fstat(fd, &st))
+    {
+        fprintf(stderr, "Cannot open '%s'. Code = %d\n", file, errno);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    if (st.st_size > 0)
+    {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            fprintf(stderr, "Cannot map '%s'. Code = %d\n", file, errno);
+            close(fd);
+            return -1;
+        }
+        /* Manifests are read from start to end */
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        m->data = data;
+        m->size = st.st_size;
+    }
+    close(fd);
+    return 0;
+}
+
+void
+manifestclose(struct Manifest *m)
+{
+    if (m->data)
+        munmap((void *)m->data, m->size);
+    m->data = NULL;
+    m->size = 0;
+}
+
+/* Parse an unsigned number ending in a tab, advancing p past the tab */
+static int
+Field(const char **p, const char *end, int base, uint64_t *value)
+{
+    const char *s = *p;
+    uint64_t v = 0;
+
+    if (s >= end || *s == '\t')
+        return -1;
+    for (; s < end && *s != '\t'; s++)
+    {
+        int digit = *s - '0';
+        if (digit < 0 || digit >= base)
+            return -1;
+        v = v * base + digit;
+    }
+    if (s >= end)
+        return -1;
+    *value = v;
+    *p = s + 1;
+    return 0;
+}
+
+const char *
+manifestnext(const struct Manifest *m, const char *p, struct ManifestRecord *r)
+{
+    const char *end = m->data + m->size;
+    const char *eol, *s;
+    uint64_t v[7];
+    int i, n = 0;
+
+    if (!p)
+        p = m->data;
+    if (!p || p >= end)
+        return NULL;
+
+    eol = memchr(p, '\n', end - p);
+    if (!eol)
+        eol = end;
+
+    memset(r, 0, sizeof(*r));
+    if (eol - p < 2 || p[1] != '\t')
+        return eol + 1;
+    s = p + 2;
+
+    switch (p[0])
+    {
+        case 'V':
+            n = 1;
+            break;
+        case 'E':
+            n = 3;
+            break;
+        case 'M':
+            n = 2;
+            break;
+        default:
+            return eol + 1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (Field(&s, eol, 10, &v[i]))
+            return eol + 1;
+    }
+
+    if (p[0] == 'M')
+    {
+        /* The type, then the rest of the numbers, with the mode in octal */
+        if (eol - s < 2 || s[1] != '\t')
+            return eol + 1;
+        r->type = s[0];
+        s += 2;
+        for (i = 2; i < 7; i++)
+        {
+            if (Field(&s, eol, i == 5 ? 8 : 10, &v[i]))
+                return eol + 1;
+        }
+        r->vnode = v[0];
+        r->uniquifier = v[1];
+        r->dataversion = v[2];
+        r->size = v[3];
+        r->mtime = v[4];
+        r->mode = v[5];
+        r->offset = v[6];
+    }
+    else if (p[0] == 'E')
+    {
+        r->dirvnode = v[0];
+        r->vnode = v[1];
+        r->uniquifier = v[2];
+    }
+    else
+    {
+        r->vnode = v[0];
+    }
+
+    r->kind = p[0];
+    r->path = s;
+    r->pathlen = eol - s;
+    return eol + 1;
+}
+
+int
+manifestpath(const struct ManifestRecord *r, char *buf, size_t size)
+{
+    size_t i, len = 0;
+
+    for (i = 0; i < r->pathlen; i++)
+    {
+        char c = r->path[i];
+
+        if (c == '\\' && i + 1 < r->pathlen)
+        {
+            c = r->path[++i];
+            if (c == 't')
+                c = '\t';
+            else if (c == 'n')
+                c = '\n';
+        }
+        if (len + 1 >= size)
+            return -1;
+        buf[len++] = c;
+    }
+    buf[len] = 0;
+    return len;
+}
@@ -0,0 +1,74 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * A manifest describes a tarvol archive, one tab-separated line per record:
+ *
+ *   V  volumeid  name
+ *   M  vnode  uniquifier  type  dataVersion  size  mtime  mode  offset  path
+ *   E  dirvnode  vnode  uniquifier  name
+ *
+ * An M line is written for each member of the archive, where type is f for a
+ * file, d for a directory, l for a symbolic link, h for a hard link to the
+ * file of the same vnode, whose line comes before it, and a for the ACL
+ * script of the directory vnode.  The offset is that of the member's tar
+ * header and the size is that in the dump.  An E line is written for each
+ * entry of each directory in the dump, whether or not the entry itself is in
+ * the archive.
+ * Backslashes, tabs and newlines in names are escaped with a backslash.
+ */
+
+/* Needed for FILE* */
+#include <stdio.h>
+/* Needed for uint64_t */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ManifestRecord
+{
+    char kind;                  /* V, M or E */
+    char type;
+    uint32_t vnode;             /* the volume id for V */
+    uint32_t uniquifier;
+    uint32_t dirvnode;
+    uint32_t dataversion;
+    uint32_t mtime;
+    uint32_t mode;
+    uint64_t size;
+    uint64_t offset;
+    const char *path;           /* still escaped, not terminated */
+    size_t pathlen;
+};
+
+struct Manifest
+{
+    const char *data;
+    size_t size;
+};
+
+void manifestvolume(FILE *out, uint32_t volumeid, const char *name);
+void manifestmember(FILE *out, const struct ManifestRecord *r,
+        const char *dir, const char *name);
+void manifestentry(FILE *out, uint32_t dirvnode, uint32_t vnode,
+        uint32_t uniquifier, const char *name);
+
+/* Map a manifest into memory, returning 0 on success */
+int manifestopen(const char *file, struct Manifest *m);
+void manifestclose(struct Manifest *m);
+/*
+ * Parse the record at p, returning the start of the next one, or NULL at the
+ * end of the manifest.  Lines that cannot be parsed get kind 0.
+ */
+const char *manifestnext(const struct Manifest *m, const char *p,
+        struct ManifestRecord *r);
+/* Undo the escaping of a path, returning its length or -1 if too long */
+int manifestpath(const struct ManifestRecord *r, char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
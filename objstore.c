@@ -0,0 +1,877 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Object store output.  With -f s3://bucket/key, tarvol uploads the archive
+ * to an S3-compatible object store as it writes it, instead of writing it to
+ * a disk to be copied there afterwards.  The archive is cut into parts of a
+ * multipart upload, which a few threads upload at once.  Only those parts
+ * and the one being filled are held in memory, so the archive writer waits
+ * only when every upload is busy.  A request that fails is tried again after
+ * 1, 2, 4 and 8 seconds, and if a part still cannot be uploaded the upload
+ * is aborted, leaving no object behind.
+ *
+ * Each request is signed with AWS signature version 4 and sent over its own
+ * HTTP/1.1 connection, with TLS for an https endpoint:
+ *
+ *   POST /bucket/key?uploads=                    start, giving an upload id
+ *   PUT /bucket/key?partNumber=N&uploadId=ID     a part, giving its ETag
+ *   POST /bucket/key?uploadId=ID                 complete, listing the ETags
+ *   DELETE /bucket/key?uploadId=ID               abort
+ *
+ * The endpoint, region and credentials are taken from the environment, as
+ * the AWS command line tools take them: AWS_ENDPOINT_URL_S3 or
+ * AWS_ENDPOINT_URL, AWS_REGION or AWS_DEFAULT_REGION, AWS_ACCESS_KEY_ID,
+ * AWS_SECRET_ACCESS_KEY and AWS_SESSION_TOKEN.  Buckets are addressed in the
+ * path, which every S3-compatible store accepts.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/ssl.h>
+
+#include "common.h"
+
+/* S3 takes up to 10000 parts, all but the last of at least 5 MB */
+#define MAXPARTS 10000
+#define MAXUPLOADS 64
+/* Attempts at each request, with twice the wait before each retry */
+#define TRIES 5
+/* Seconds a connection may go without progress */
+#define TIMEOUT 60
+/* The most of a response that is kept; only the start of it matters */
+#define MAXREPLY 65536
+
+struct Part
+{
+    struct Part *next;
+    int number;
+    size_t length;
+    char data[];
+};
+
+struct Store
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct Part *head, *tail;       /* full parts, oldest first */
+    struct Part *spare;             /* uploaded parts for reuse */
+    int parts;                      /* allocated, up to nuploads + 1 */
+    int closed;                     /* the writer has finished */
+    int failed;
+    struct Part *filling;           /* only touched by the writer */
+    size_t partsize;
+    int nparts;
+    char **etags;                   /* of each part, once uploaded */
+    int nuploads;
+    pthread_t uploaders[MAXUPLOADS];
+    uintmax_t bytes;
+    /* Where the object goes, and the credentials to put it there */
+    const char *url;
+    int tls;
+    char *host, *port, *hostheader;
+    char *path;                     /* /bucket/key, URI encoded */
+    char *uploadid;                 /* URI encoded */
+    const char *region, *keyid, *secret, *token;
+    SSL_CTX *ctx;
+};
+
+struct Connection
+{
+    int fd;
+    SSL *ssl;
+};
+
+struct Reply
+{
+    int status;
+    char data[MAXREPLY + 1];
+    size_t length;
+    const char *body;
+};
+
+/* Mark the upload as failed, reporting only the first failure */
+static void
+Fail(struct Store *s, const char *msg)
+{
+    pthread_mutex_lock(&s->lock);
+    if (!s->failed)
+        fprintf(stderr, "%s\n", msg);
+    s->failed = 1;
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Whether the upload has failed, which the uploaders can mark at any time */
+static int
+Failed(struct Store *s)
+{
+    int failed;
+
+    pthread_mutex_lock(&s->lock);
+    failed = s->failed;
+    pthread_mutex_unlock(&s->lock);
+    return failed;
+}
+
+/* Append str to buf, URI encoded as SigV4 wants, leaving / if slash is set */
+static void
+Encode(char *buf, const char *str, size_t len, int slash)
+{
+    char *p = buf + strlen(buf);
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        unsigned char c = str[i];
+
+        if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+                (c >= '0' && c <= '9') || strchr("-._~", c) ||
+                (slash && c == '/'))
+            *p++ = c;
+        else
+            p += sprintf(p, "%%%02X", c);
+    }
+    *p = 0;
+}
+
+static void
+Hex(const unsigned char *data, size_t len, char *out)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        sprintf(out + 2 * i, "%02x", data[i]);
+}
+
+static void
+Sha256(const void *data, size_t len, char hex[65])
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int n;
+
+    EVP_Digest(data, len, md, &n, EVP_sha256(), NULL);
+    Hex(md, n, hex);
+}
+
+static void
+Hmac(const void *key, size_t keylen, const char *msg, unsigned char out[32])
+{
+    unsigned int n = 32;
+
+    HMAC(EVP_sha256(), key, keylen, (const unsigned char *)msg, strlen(msg),
+            out, &n);
+}
+
+/*
+ * Build the head of a request, signed with SigV4 over the method, path,
+ * query (already in canonical form), the headers and the payload hash.
+ */
+static char *
+Sign(struct Store *s, const char *method, const char *query,
+        const void *body, size_t length)
+{
+    char payload[65], date[17], canonical[4096], scope[128], tosign[512];
+    char hash[65], signature[65], *head;
+    unsigned char key[32], next[32];
+    size_t keylen = strlen(s->secret) + 5;
+    char *secret = malloc(keylen);
+    time_t now = time(NULL);
+    struct tm tm;
+
+    if (!secret)
+        return NULL;
+    gmtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%Y%m%dT%H%M%SZ", &tm);
+    Sha256(body, length, payload);
+
+    snprintf(canonical, sizeof(canonical),
+            "%s\n%s\n%s\nhost:%s\nx-amz-content-sha256:%s\nx-amz-date:%s\n"
+            "%s%s%s\nhost;x-amz-content-sha256;x-amz-date%s\n%s",
+            method, s->path, query, s->hostheader, payload, date,
+            s->token ? "x-amz-security-token:" : "", s->token ? s->token : "",
+            s->token ? "\n" : "", s->token ? ";x-amz-security-token" : "",
+            payload);
+    snprintf(scope, sizeof(scope), "%.8s/%s/s3/aws4_request", date,
+            s->region);
+    Sha256(canonical, strlen(canonical), hash);
+    snprintf(tosign, sizeof(tosign), "AWS4-HMAC-SHA256\n%s\n%s\n%s", date,
+            scope, hash);
+
+    /* The signing key is derived from the secret, date, region and service */
+    snprintf(secret, keylen, "AWS4%s", s->secret);
+    snprintf(canonical, sizeof(canonical), "%.8s", date);
+    Hmac(secret, keylen - 1, canonical, key);
+    Hmac(key, sizeof(key), s->region, next);
+    Hmac(next, sizeof(next), "s3", key);
+    Hmac(key, sizeof(key), "aws4_request", next);
+    Hmac(next, sizeof(next), tosign, key);
+    Hex(key, sizeof(key), signature);
+    free(secret);
+
+    if (asprintf(&head, "%s %s?%s HTTP/1.1\r\nHost: %s\r\n"
+                "x-amz-content-sha256: %s\r\nx-amz-date: %s\r\n%s%s%s"
+                "Authorization: AWS4-HMAC-SHA256 Credential=%s/%s, "
+                "SignedHeaders=host;x-amz-content-sha256;x-amz-date%s, "
+                "Signature=%s\r\nContent-Length: %lu\r\n"
+                "Connection: close\r\n\r\n",
+                method, s->path, query, s->hostheader, payload, date,
+                s->token ? "x-amz-security-token: " : "",
+                s->token ? s->token : "", s->token ? "\r\n" : "", s->keyid,
+                scope, s->token ? ";x-amz-security-token" : "", signature,
+                (unsigned long)length) < 0)
+        return NULL;
+    return head;
+}
+
+static int
+Connect(struct Store *s, struct Connection *c)
+{
+    struct addrinfo hints, *res, *ai;
+    struct timeval tv = { TIMEOUT, 0 };
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    c->fd = -1;
+    c->ssl = NULL;
+    if (getaddrinfo(s->host, s->port, &hints, &res))
+        return -1;
+    for (ai = res; ai; ai = ai->ai_next)
+    {
+        c->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                ai->ai_protocol);
+        if (c->fd < 0)
+            continue;
+        setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(c->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(c->fd);
+        c->fd = -1;
+    }
+    freeaddrinfo(res);
+    if (c->fd < 0)
+        return -1;
+
+    if (s->tls)
+    {
+        c->ssl = SSL_new(s->ctx);
+        if (!c->ssl || !SSL_set_fd(c->ssl, c->fd) ||
+                !SSL_set_tlsext_host_name(c->ssl, s->host) ||
+                !SSL_set1_host(c->ssl, s->host) || SSL_connect(c->ssl) != 1)
+            return -1;
+    }
+    return 0;
+}
+
+static void
+Disconnect(struct Connection *c)
+{
+    if (c->ssl)
+    {
+        SSL_shutdown(c->ssl);
+        SSL_free(c->ssl);
+    }
+    if (c->fd >= 0)
+        close(c->fd);
+}
+
+static int
+Send(struct Connection *c, const void *data, size_t len)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while (len > 0)
+    {
+        if (c->ssl)
+            n = SSL_write(c->ssl, p, len > INT_MAX ? INT_MAX : len);
+        else
+            n = write(c->fd, p, len);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static ssize_t
+Receive(struct Connection *c, void *buf, size_t len)
+{
+    if (c->ssl)
+        return SSL_read(c->ssl, buf, len);
+    return read(c->fd, buf, len);
+}
+
+/* The value of a header of a reply, up to the end of its line */
+static const char *
+Header(const struct Reply *r, const char *name, size_t *len)
+{
+    const char *p = strstr(r->data, "\r\n");
+    size_t n = strlen(name);
+
+    while (p && p + 2 < r->body)
+    {
+        p += 2;
+        if (strncasecmp(p, name, n) == 0 && p[n] == ':')
+        {
+            p += n + 1;
+            while (*p == ' ')
+                p++;
+            *len = strcspn(p, "\r\n");
+            return p;
+        }
+        p = strstr(p, "\r\n");
+    }
+    return NULL;
+}
+
+/* Whether all of a reply is in, as far as it is kept */
+static int
+Complete(struct Reply *r)
+{
+    const char *p;
+    size_t len;
+
+    if (!r->body && (p = strstr(r->data, "\r\n\r\n")))
+        r->body = p + 4;
+    if (!r->body)
+        return r->length == MAXREPLY;
+    if ((p = Header(r, "Content-Length", &len)))
+        return r->data + r->length >= r->body + strtoul(p, NULL, 10);
+    if ((p = Header(r, "Transfer-Encoding", &len)))
+        return strstr(r->body, "\r\n0\r\n\r\n") != NULL ||
+            strncmp(r->body, "0\r\n\r\n", 5) == 0;
+    return 0;
+}
+
+/*
+ * Make one request, leaving the reply, cut to MAXREPLY, in r.  Returns the
+ * HTTP status, or -1 if there was no reply.
+ */
+static int
+Request(struct Store *s, const char *method, const char *query,
+        const void *body, size_t length, struct Reply *r)
+{
+    struct Connection c;
+    char *head = Sign(s, method, query, body, length);
+    sigset_t pipe, old;
+    struct timespec zero = { 0, 0 };
+    ssize_t n;
+
+    r->status = -1;
+    r->data[0] = 0;
+    r->length = 0;
+    r->body = NULL;
+    if (!head)
+        return -1;
+
+    /* A connection closed under a write raises SIGPIPE, to be discarded */
+    sigemptyset(&pipe);
+    sigaddset(&pipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe, &old);
+
+    if (Connect(s, &c) == 0 && Send(&c, head, strlen(head)) == 0 &&
+            Send(&c, body, length) == 0)
+    {
+        while (!Complete(r) && (n = Receive(&c, r->data + r->length,
+                        MAXREPLY - r->length)) > 0)
+        {
+            r->length += n;
+            r->data[r->length] = 0;
+        }
+        if (r->body && sscanf(r->data, "HTTP/%*s %d", &r->status) != 1)
+            r->status = -1;
+    }
+    Disconnect(&c);
+    free(head);
+
+    while (sigtimedwait(&pipe, NULL, &zero) > 0)
+        ;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return r->status;
+}
+
+/*
+ * Make a request until it succeeds, or has failed TRIES times or in a way
+ * that trying again will not help.  A 200 can still carry an error when
+ * completing an upload.  Returns whether it succeeded.
+ */
+static int
+Retry(struct Store *s, const char *method, const char *query,
+        const void *body, size_t length, struct Reply *r, const char *what)
+{
+    int i;
+
+    for (i = 0; i < TRIES; i++)
+    {
+        if (i)
+            sleep(1 << (i - 1));
+        Request(s, method, query, body, length, r);
+        if (r->status / 100 == 2 && !strstr(r->body, "<Error>"))
+            return 1;
+        if (verbose)
+            fprintf(stderr, "%s: status %d%s\n", what, r->status,
+                    i + 1 < TRIES ? ", retrying" : "");
+        /* Other client errors are ours, and will not go away */
+        if (r->status / 100 == 4 && r->status != 408 && r->status != 429)
+            break;
+    }
+    return 0;
+}
+
+/* The text of an XML element in a reply, copied */
+static char *
+Element(const struct Reply *r, const char *name)
+{
+    char tag[64];
+    const char *p, *end;
+
+    snprintf(tag, sizeof(tag), "<%s>", name);
+    if (!r->body || !(p = strstr(r->body, tag)))
+        return NULL;
+    p += strlen(tag);
+    snprintf(tag, sizeof(tag), "</%s>", name);
+    if (!(end = strstr(p, tag)))
+        return NULL;
+    return strndup(p, end - p);
+}
+
+static void *
+Uploader(void *arg)
+{
+    struct Store *s = arg;
+    struct Reply *r = malloc(sizeof(*r));
+    struct Part *p;
+    char query[512], what[64], *etag;
+    const char *value;
+    size_t len;
+    int failed;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&s->lock);
+        while (!s->head && !s->closed)
+            pthread_cond_wait(&s->changed, &s->lock);
+        p = s->head;
+        if (p && !(s->head = p->next))
+            s->tail = NULL;
+        failed = s->failed;
+        pthread_mutex_unlock(&s->lock);
+        if (!p)
+            break;
+
+        if (!failed)
+        {
+            snprintf(query, sizeof(query), "partNumber=%d&uploadId=%s",
+                    p->number, s->uploadid);
+            snprintf(what, sizeof(what), "Uploading part %d", p->number);
+            etag = NULL;
+            if (r && Retry(s, "PUT", query, p->data, p->length, r, what) &&
+                    (value = Header(r, "ETag", &len)))
+                etag = strndup(value, len);
+            if (etag)
+            {
+                pthread_mutex_lock(&s->lock);
+                s->etags[p->number - 1] = etag;
+                pthread_mutex_unlock(&s->lock);
+            }
+            else
+            {
+                snprintf(what, sizeof(what), "Could not upload part %d of "
+                        "the archive", p->number);
+                Fail(s, what);
+            }
+        }
+
+        /* Hand the part back to the writer */
+        pthread_mutex_lock(&s->lock);
+        p->next = s->spare;
+        s->spare = p;
+        pthread_cond_broadcast(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+    }
+    free(r);
+    return NULL;
+}
+
+/* A part to fill, waiting for one to be uploaded if there are enough */
+static struct Part *
+Empty(struct Store *s)
+{
+    struct Part *p = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    while (!s->spare && s->parts > s->nuploads)
+        pthread_cond_wait(&s->changed, &s->lock);
+    if (s->spare)
+    {
+        p = s->spare;
+        s->spare = p->next;
+    }
+    else if ((p = malloc(sizeof(*p) + s->partsize)))
+        s->parts++;
+    pthread_mutex_unlock(&s->lock);
+    if (p)
+        p->length = 0;
+    return p;
+}
+
+/* Number a part and queue it for upload */
+static int
+Queue(struct Store *s, struct Part *p)
+{
+    char **etags;
+
+    if (s->nparts == MAXPARTS)
+    {
+        Fail(s, "The archive needs more than 10000 parts; use a larger -p");
+        free(p);
+        return -1;
+    }
+    pthread_mutex_lock(&s->lock);
+    etags = realloc(s->etags, (s->nparts + 1) * sizeof(*etags));
+    if (etags)
+    {
+        s->etags = etags;
+        s->etags[s->nparts] = NULL;
+        p->number = ++s->nparts;
+        p->next = NULL;
+        if (s->tail)
+            s->tail->next = p;
+        else
+            s->head = p;
+        s->tail = p;
+        pthread_cond_broadcast(&s->changed);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (!etags)
+    {
+        Fail(s, "Out of memory for the parts of the archive");
+        free(p);
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t
+StoreWrite(void *cookie, const char *data, size_t size)
+{
+    struct Store *s = cookie;
+    size_t done = 0;
+
+    while (done < size)
+    {
+        size_t n;
+
+        if (Failed(s))
+        {
+            errno = EIO;
+            return done ? done : -1;
+        }
+        if (!s->filling && !(s->filling = Empty(s)))
+        {
+            errno = ENOMEM;
+            return done ? done : -1;
+        }
+        n = s->partsize - s->filling->length;
+        if (n > size - done)
+            n = size - done;
+        memcpy(s->filling->data + s->filling->length, data + done, n);
+        s->filling->length += n;
+        done += n;
+        if (s->filling->length == s->partsize)
+        {
+            Queue(s, s->filling);
+            s->filling = NULL;
+        }
+    }
+    s->bytes += done;
+    return done;
+}
+
+/* Finish the upload, or abort it if a part failed */
+static int
+Finish(struct Store *s)
+{
+    struct Reply *r = malloc(sizeof(*r));
+    char query[512], *xml, *p, *location;
+    size_t size = 64;
+    int i, ok;
+
+    for (i = 0; i < s->nparts; i++)
+        size += strlen(s->etags[i] ? s->etags[i] : "") + 64;
+    xml = malloc(size);
+    snprintf(query, sizeof(query), "uploadId=%s", s->uploadid);
+    if (r && xml && !s->failed)
+    {
+        p = xml + sprintf(xml, "<CompleteMultipartUpload>");
+        for (i = 0; i < s->nparts; i++)
+            p += sprintf(p, "<Part><PartNumber>%d</PartNumber>"
+                    "<ETag>%s</ETag></Part>", i + 1, s->etags[i]);
+        sprintf(p, "</CompleteMultipartUpload>");
+        if (Retry(s, "POST", query, xml, strlen(xml), r,
+                    "Completing the upload"))
+        {
+            if (verbose > 1)
+            {
+                location = Element(r, "Location");
+                fprintf(stderr, "Uploaded %llu bytes in %d parts to %s\n",
+                        (unsigned long long)s->bytes, s->nparts,
+                        location ? location : s->url);
+                free(location);
+            }
+            free(xml);
+            free(r);
+            return 0;
+        }
+        Fail(s, "Could not complete the upload");
+    }
+    else if (!s->failed)
+        Fail(s, "Out of memory completing the upload");
+
+    /* Otherwise the parts stay, and are paid for, until aborted */
+    ok = r && Retry(s, "DELETE", query, "", 0, r, "Aborting the upload");
+    if (!ok)
+        fprintf(stderr, "Could not abort upload %s of %s\n", s->uploadid,
+                s->url);
+    free(xml);
+    free(r);
+    return -1;
+}
+
+static void
+FreeStore(struct Store *s)
+{
+    struct Part *p;
+    int i;
+
+    while ((p = s->spare))
+    {
+        s->spare = p->next;
+        free(p);
+    }
+    for (i = 0; i < s->nparts; i++)
+        free(s->etags[i]);
+    free(s->etags);
+    free(s->host);
+    free(s->port);
+    free(s->hostheader);
+    free(s->path);
+    free(s->uploadid);
+    if (s->ctx)
+        SSL_CTX_free(s->ctx);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->changed);
+    free(s);
+}
+
+/* Upload the last part, wait for the uploads and complete the object */
+static int
+StoreClose(void *cookie)
+{
+    struct Store *s = cookie;
+    int i, ret;
+
+    /* An empty archive is still one (empty) part */
+    if (s->filling && (s->filling->length || !s->nparts))
+        Queue(s, s->filling);
+    else
+        free(s->filling);
+    s->filling = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    s->closed = 1;
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+    for (i = 0; i < s->nuploads; i++)
+        pthread_join(s->uploaders[i], NULL);
+
+    ret = Finish(s) ? EOF : 0;
+    FreeStore(s);
+    if (ret)
+        errno = EIO;
+    return ret;
+}
+
+/*
+ * Find the endpoint, host and port from the environment and the bucket and
+ * key from the URL.
+ */
+static int
+Locate(struct Store *s, const char *url)
+{
+    const char *endpoint = getenv("AWS_ENDPOINT_URL_S3");
+    const char *p, *end;
+    char *aws = NULL;
+    int ok;
+
+    if (!endpoint)
+        endpoint = getenv("AWS_ENDPOINT_URL");
+    s->region = getenv("AWS_REGION");
+    if (!s->region)
+        s->region = getenv("AWS_DEFAULT_REGION");
+    if (!s->region)
+        s->region = "us-east-1";
+    if (!endpoint)
+    {
+        if (asprintf(&aws, "https://s3.%s.amazonaws.com", s->region) < 0)
+            return -1;
+        endpoint = aws;
+    }
+
+    s->tls = strncmp(endpoint, "https://", 8) == 0;
+    if (!s->tls && strncmp(endpoint, "http://", 7) != 0)
+    {
+        fprintf(stderr, "Cannot use endpoint '%s'\n", endpoint);
+        free(aws);
+        return -1;
+    }
+    p = endpoint + (s->tls ? 8 : 7);
+    end = p + strcspn(p, ":/");
+    s->host = strndup(p, end - p);
+    if (*end == ':')
+        s->port = strndup(end + 1, strcspn(end + 1, "/"));
+    else
+        s->port = strdup(s->tls ? "443" : "80");
+    /* The Host header only names the port if it is not the usual one */
+    if (*end == ':')
+        s->hostheader = strndup(p, end - p + 1 + strlen(s->port));
+    else
+        s->hostheader = strdup(s->host);
+    free(aws);
+
+    /* s3://bucket/key becomes /bucket/key */
+    p = url + 5;
+    end = strchr(p, '/');
+    s->path = malloc(3 * strlen(p) + 2);
+    if (!s->host || !s->port || !s->hostheader || !s->path)
+        return -1;
+    ok = end && end > p && end[1];
+    if (ok)
+    {
+        strcpy(s->path, "/");
+        Encode(s->path, p, strlen(p), 1);
+    }
+    else
+        fprintf(stderr, "'%s' must be s3://BUCKET/KEY\n", url);
+    return ok ? 0 : -1;
+}
+
+FILE *
+objstore(const char *url, size_t partsize, int uploads)
+{
+    cookie_io_functions_t io = { NULL, StoreWrite, NULL, StoreClose };
+    struct Store *s = calloc(1, sizeof(*s));
+    struct Reply *r = malloc(sizeof(*r));
+    sigset_t all, old;
+    char *id = NULL;
+    FILE *f = NULL;
+    int i;
+
+    if (!s || !r)
+    {
+        free(s);
+        free(r);
+        return NULL;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->changed, NULL);
+    s->url = url;
+    s->partsize = partsize;
+    s->nuploads = uploads < 1 ? 1 : uploads > MAXUPLOADS ? MAXUPLOADS :
+        uploads;
+    s->keyid = getenv("AWS_ACCESS_KEY_ID");
+    s->secret = getenv("AWS_SECRET_ACCESS_KEY");
+    s->token = getenv("AWS_SESSION_TOKEN");
+    if (!s->keyid || !s->secret)
+    {
+        fprintf(stderr, "AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY are "
+                "needed to upload '%s'\n", url);
+        goto fail;
+    }
+    if (Locate(s, url))
+        goto fail;
+    if (s->tls && (!(s->ctx = SSL_CTX_new(TLS_client_method())) ||
+                !SSL_CTX_set_default_verify_paths(s->ctx)))
+    {
+        fprintf(stderr, "Could not set up TLS\n");
+        goto fail;
+    }
+    if (s->ctx)
+        SSL_CTX_set_verify(s->ctx, SSL_VERIFY_PEER, NULL);
+
+    if (!Retry(s, "POST", "uploads=", "", 0, r, "Starting the upload") ||
+            !(id = Element(r, "UploadId")))
+    {
+        fprintf(stderr, "Cannot start an upload to '%s'. Status = %d\n", url,
+                r->status);
+        goto fail;
+    }
+    s->uploadid = malloc(3 * strlen(id) + 1);
+    if (!s->uploadid)
+        goto fail;
+    s->uploadid[0] = 0;
+    Encode(s->uploadid, id, strlen(id), 0);
+
+    f = fopencookie(s, "w", io);
+    if (!f)
+    {
+        s->failed = 1;
+        Finish(s);
+        goto fail;
+    }
+
+    /* The uploads leave signals to the main thread, as the pipeline does */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (i = 0; i < s->nuploads; i++)
+    {
+        if (pthread_create(&s->uploaders[i], NULL, Uploader, s))
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (i == 0)
+    {
+        fprintf(stderr, "Could not start the uploads\n");
+        s->failed = 1;
+        fclose(f);
+        f = NULL;
+    }
+    else
+    {
+        s->nuploads = i;
+        if (verbose > 1)
+            fprintf(stderr, "Uploading to %s in parts of %lu bytes, %d at "
+                    "a time\n", url, (unsigned long)partsize, s->nuploads);
+    }
+    free(id);
+    free(r);
+    return f;
+
+fail:
+    free(id);
+    free(r);
+    FreeStore(s);
+    return NULL;
+}
@@ -0,0 +1,825 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Output pipeline.  Instead of piping the archive through aestar and a
+ * compressor, tarvol can encrypt and compress it itself.  The archive is
+ * written to a stdio stream whose data is cut into large buffers and passed
+ * through bounded queues to the stages, each running in its own threads:
+ *
+ *   archive -> encryption (aestar format 1 or 2) -> gzip -> output
+ *
+ * Encryption comes first because the aestar format is made from the tar
+ * headers.  The encryption stage writes what aestar would, running aespipe
+ * for the data of each member.  The gzip stage compresses each buffer as a
+ * separate gzip member on a pool of threads and writes them out in order;
+ * gzip -d reads the concatenated members as a single file.
+ *
+ * Without encryption the gzip members can be made into seekable frames:
+ * create() calls pipelineframe() before each tar header, which ends the
+ * current buffer there once it holds MINFRAME bytes, and a frame index lists
+ * where each frame starts in the archive and in the compressed output, so a
+ * reader can decompress only the frames holding the members it wants:
+ *
+ *   tarvol frames 1
+ *   offset zoffset length zlength      (one line per frame)
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tar.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "probes.h"
+
+#define BUFFERSIZE (1 << 20)
+/* Full buffers a queue holds before its writer has to wait */
+#define QUEUEDEPTH 4
+#define MAXCOMPRESSORS 8
+/* Small members are batched into frames of at least this much */
+#define MINFRAME (256 * 1024)
+
+/* Trailer block at the very end of a format 2 archive, as in aestar */
+#define TRAILERMAGIC "aestar-trailer"
+
+extern char **environ;
+
+struct Tar
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[167];
+};
+
+struct Buffer
+{
+    struct Buffer *next;
+    uintmax_t seq;
+    size_t length;
+    char data[BUFFERSIZE];
+};
+
+struct Queue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct Buffer *head, *tail;     /* full buffers, oldest first */
+    struct Buffer *spare;           /* drained buffers for reuse */
+    int count;
+    int closed;                     /* the writer has finished */
+    uintmax_t seq;
+    struct Buffer *filling;         /* only touched by the writer */
+    struct Buffer *draining;        /* only touched by the reader */
+    size_t pos;
+};
+
+struct Pipeline
+{
+    struct Queue input;             /* from the archive to the first stage */
+    struct Queue encrypted;         /* from encryption to compression */
+    FILE *out;
+    const char *keyfile;
+    uintmax_t chunksize;
+    int level;
+    int encrypting;
+    pthread_t encryptor;
+    int ncompressors;
+    pthread_t compressors[MAXCOMPRESSORS];
+    /* The compressors take turns writing, in the order of the buffers */
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+    uintmax_t nextseq;
+    int failed;
+    /* The frame index, and where the next frame starts */
+    FILE *file, *frames;
+    uintmax_t position, zposition;
+};
+
+/* The pipeline whose members start frames */
+static struct Pipeline *g_framing;
+
+static void
+InitQueue(struct Queue *q)
+{
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->changed, NULL);
+}
+
+static void
+FreeQueue(struct Queue *q)
+{
+    struct Buffer *b;
+
+    while ((b = q->spare))
+    {
+        q->spare = b->next;
+        free(b);
+    }
+    while ((b = q->head))
+    {
+        q->head = b->next;
+        free(b);
+    }
+    free(q->filling);
+    free(q->draining);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->changed);
+}
+
+/* Queue a full buffer, waiting while the queue is full */
+static void
+Put(struct Queue *q, struct Buffer *b)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count >= QUEUEDEPTH)
+        pthread_cond_wait(&q->changed, &q->lock);
+    b->next = NULL;
+    b->seq = q->seq++;
+    if (q->tail)
+        q->tail->next = b;
+    else
+        q->head = b;
+    q->tail = b;
+    q->count++;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* Take the oldest full buffer, or NULL once the writer has finished */
+static struct Buffer *
+Take(struct Queue *q)
+{
+    struct Buffer *b;
+
+    pthread_mutex_lock(&q->lock);
+    while (!q->head && !q->closed)
+        pthread_cond_wait(&q->changed, &q->lock);
+    b = q->head;
+    if (b)
+    {
+        q->head = b->next;
+        if (!q->head)
+            q->tail = NULL;
+        q->count--;
+        pthread_cond_broadcast(&q->changed);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return b;
+}
+
+static void
+Recycle(struct Queue *q, struct Buffer *b)
+{
+    pthread_mutex_lock(&q->lock);
+    b->next = q->spare;
+    q->spare = b;
+    pthread_mutex_unlock(&q->lock);
+}
+
+static struct Buffer *
+Empty(struct Queue *q)
+{
+    struct Buffer *b;
+
+    pthread_mutex_lock(&q->lock);
+    b = q->spare;
+    if (b)
+        q->spare = b->next;
+    pthread_mutex_unlock(&q->lock);
+    if (!b)
+        b = malloc(sizeof(*b));
+    if (b)
+        b->length = 0;
+    return b;
+}
+
+/* Mark the end of the data, passing on the last partial buffer */
+static void
+Finish(struct Queue *q)
+{
+    if (q->filling && q->filling->length)
+        Put(q, q->filling);
+    else
+        free(q->filling);
+    q->filling = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static ssize_t
+QueueWrite(void *cookie, const char *data, size_t size)
+{
+    struct Queue *q = cookie;
+    size_t done = 0;
+
+    while (done < size)
+    {
+        size_t n;
+
+        if (!q->filling && !(q->filling = Empty(q)))
+        {
+            errno = ENOMEM;
+            return done ? done : -1;
+        }
+        n = BUFFERSIZE - q->filling->length;
+        if (n > size - done)
+            n = size - done;
+        memcpy(q->filling->data + q->filling->length, data + done, n);
+        q->filling->length += n;
+        done += n;
+        if (q->filling->length == BUFFERSIZE)
+        {
+            Put(q, q->filling);
+            q->filling = NULL;
+        }
+    }
+    return done;
+}
+
+static ssize_t
+QueueRead(void *cookie, char *data, size_t size)
+{
+    struct Queue *q = cookie;
+    size_t done = 0;
+
+    while (done < size)
+    {
+        size_t n;
+
+        if (!q->draining || q->pos == q->draining->length)
+        {
+            if (q->draining)
+                Recycle(q, q->draining);
+            q->pos = 0;
+            if (!(q->draining = Take(q)))
+                break;
+        }
+        n = q->draining->length - q->pos;
+        if (n > size - done)
+            n = size - done;
+        memcpy(data + done, q->draining->data + q->pos, n);
+        q->pos += n;
+        done += n;
+    }
+    return done;
+}
+
+static int
+QueueClose(void *cookie)
+{
+    Finish(cookie);
+    return 0;
+}
+
+/* Mark a pipeline as failed, reporting only the first failure */
+static void
+Fail(struct Pipeline *p, const char *msg)
+{
+    pthread_mutex_lock(&p->lock);
+    if (!p->failed)
+        fprintf(stderr, "%s\n", msg);
+    p->failed = 1;
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Whether the pipeline has failed, which any stage can mark at any time */
+static int
+Failed(struct Pipeline *p)
+{
+    int failed;
+
+    pthread_mutex_lock(&p->lock);
+    failed = p->failed;
+    pthread_mutex_unlock(&p->lock);
+    return failed;
+}
+
+/* Return the size of the data following a tar header */
+static uintmax_t
+TarSize(struct Tar *tar)
+{
+    uintmax_t size = 0;
+    int i;
+
+    if (tar->typeflag == DIRTYPE || tar->typeflag == SYMTYPE ||
+            tar->typeflag == LNKTYPE)
+        return 0;
+
+    if (tar->size[0] & -128)
+    {
+        /* GNU size extension */
+        for (i = 1; i < sizeof(tar->size); i++)
+            size = (size << 8) + (unsigned char)tar->size[i];
+    }
+    else
+    {
+        for (i = 0; i < sizeof(tar->size) && tar->size[i] >= '0' &&
+                tar->size[i] <= '7'; i++)
+            size = size * 8 + tar->size[i] - '0';
+    }
+    return size;
+}
+
+/* Whether a header is the end of the archive */
+static int
+EndOfArchive(struct Tar *tar)
+{
+    const char *c = (const char *)tar;
+    size_t i;
+
+    for (i = 0; i < sizeof(*tar); i++)
+    {
+        if (c[i])
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Encrypt length bytes of member data through one aespipe run.  aespipe is
+ * started directly rather than through a shell, and its output is read back
+ * while it is fed so that it can go to the next stage.
+ */
+static int
+CryptData(struct Pipeline *p, FILE *in, FILE *out, int format,
+        uintmax_t offset, uintmax_t length)
+{
+    char sector[32], buf[65536], *argv[6];
+    int toaes[2], fromaes[2], status, ret = 0;
+    size_t pending = 0, sent = 0;
+    uintmax_t received = 0, total = length;
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+
+    argv[0] = "aespipe";
+    argv[1] = "-P";
+    argv[2] = (char *)p->keyfile;
+    argv[3] = NULL;
+    if (format == 2)
+    {
+        /* The IVs come from the position of the data in the archive */
+        snprintf(sector, sizeof(sector), "%llu",
+                (unsigned long long)(offset / 512));
+        argv[3] = "-O";
+        argv[4] = sector;
+        argv[5] = NULL;
+    }
+
+    if (pipe2(toaes, O_CLOEXEC))
+        return 1;
+    if (pipe2(fromaes, O_CLOEXEC))
+    {
+        close(toaes[0]);
+        close(toaes[1]);
+        return 1;
+    }
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, toaes[0], 0);
+    posix_spawn_file_actions_adddup2(&actions, fromaes[1], 1);
+    if (posix_spawnp(&pid, "aespipe", &actions, NULL, argv, environ))
+        pid = -1;
+    posix_spawn_file_actions_destroy(&actions);
+    close(toaes[0]);
+    close(fromaes[1]);
+    fcntl(toaes[1], F_SETFL, O_NONBLOCK);
+
+    if (pid < 0)
+    {
+        close(toaes[1]);
+        close(fromaes[0]);
+        fprintf(stderr, "Could not start aespipe\n");
+        return 1;
+    }
+
+    for (;;)
+    {
+        struct pollfd fds[2];
+        int nfds = 0;
+
+        if (toaes[1] >= 0)
+        {
+            fds[nfds].fd = toaes[1];
+            fds[nfds++].events = POLLOUT;
+        }
+        fds[nfds].fd = fromaes[0];
+        fds[nfds++].events = POLLIN;
+        if (poll(fds, nfds, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ret = 1;
+            break;
+        }
+
+        if (toaes[1] >= 0 && fds[0].revents)
+        {
+            ssize_t n;
+
+            if (sent == pending && length)
+            {
+                pending = length > sizeof(buf) ? sizeof(buf) : length;
+                sent = 0;
+                if (fread(buf, 1, pending, in) != pending)
+                {
+                    fprintf(stderr, "encountered end-of-file\n");
+                    ret = 1;
+                    break;
+                }
+                length -= pending;
+            }
+            n = write(toaes[1], buf + sent, pending - sent);
+            if (n > 0)
+                sent += n;
+            else if (n < 0 && errno != EAGAIN)
+            {
+                ret = 1;
+                break;
+            }
+            if (sent == pending && !length)
+            {
+                close(toaes[1]);
+                toaes[1] = -1;
+            }
+        }
+
+        if (fds[nfds - 1].revents)
+        {
+            char data[65536];
+            ssize_t n = read(fromaes[0], data, sizeof(data));
+
+            if (n <= 0)
+                break;
+            if (fwrite(data, 1, n, out) != n)
+            {
+                ret = 1;
+                break;
+            }
+            received += n;
+        }
+    }
+
+    if (toaes[1] >= 0)
+        close(toaes[1]);
+    close(fromaes[0]);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) || received != total)
+        ret = 1;
+    if (ret)
+        fprintf(stderr, "aespipe failed\n");
+    return ret;
+}
+
+/* Encrypt an archive into the aestar format, as aestar [-c size] would */
+static int
+Encrypt(struct Pipeline *p, FILE *in, FILE *out)
+{
+    int format = p->chunksize ? 2 : 1;
+    uintmax_t offset = 0;
+    FILE *index = NULL;
+    struct Tar tar;
+    char buf[512];
+
+    if (format == 2 && !(index = tmpfile()))
+    {
+        fprintf(stderr, "Could not create temp file for index\n");
+        return 1;
+    }
+
+    while (fread(&tar, 1, sizeof(tar), in) == sizeof(tar) &&
+            !EndOfArchive(&tar))
+    {
+        uintmax_t size = TarSize(&tar);
+        uintmax_t length = (size + 511) / 512 * 512;
+
+        if (verbose > 1)
+        {
+            fprintf(stderr, "encrypting %11llu bytes of data\n",
+                    (unsigned long long)size);
+        }
+
+        if (index)
+        {
+            if (tar.prefix[0])
+                fprintf(index, "%llu %llu %.*s/%.*s\n",
+                        (unsigned long long)offset, (unsigned long long)size,
+                        (int)sizeof(tar.prefix), tar.prefix,
+                        (int)sizeof(tar.name), tar.name);
+            else
+                fprintf(index, "%llu %llu %.*s\n", (unsigned long long)offset,
+                        (unsigned long long)size, (int)sizeof(tar.name),
+                        tar.name);
+        }
+
+        /* The checksum is left alone so that tar programs refuse the member */
+        tar.magic[0] = (format == 2) ? 'c' : 'a';
+        if (fwrite(&tar, 1, sizeof(tar), out) != sizeof(tar))
+            return 1;
+        offset += sizeof(tar);
+
+        PROBE2(tarvol, encrypt__start, offset, length);
+        if (length && CryptData(p, in, out, format, offset, length))
+            return 1;
+        PROBE2(tarvol, encrypt__done, offset, length);
+        offset += length;
+    }
+
+    memset(buf, 0, sizeof(buf));
+    fwrite(buf, 1, sizeof(buf), out);
+    fwrite(buf, 1, sizeof(buf), out);
+    offset += 1024;
+
+    if (index)
+    {
+        /* The index and trailer follow the end-of-archive blocks */
+        uintmax_t indexlen = ftello(index);
+        size_t n;
+
+        rewind(index);
+        while ((n = fread(buf, 1, sizeof(buf), index)) > 0)
+            fwrite(buf, 1, n, out);
+        fclose(index);
+
+        memset(buf, 0, sizeof(buf));
+        fwrite(buf, 1, (512 - indexlen % 512) % 512, out);
+        snprintf(buf, sizeof(buf), TRAILERMAGIC " 2 %llu %llu %llu\n",
+                (unsigned long long)p->chunksize, (unsigned long long)offset,
+                (unsigned long long)indexlen);
+        fwrite(buf, 1, sizeof(buf), out);
+    }
+
+    return ferror(out) != 0;
+}
+
+static void *
+Encryptor(void *arg)
+{
+    struct Pipeline *p = arg;
+    cookie_io_functions_t reader = { QueueRead, NULL, NULL, NULL };
+    cookie_io_functions_t writer = { NULL, QueueWrite, NULL, QueueClose };
+    FILE *in, *out = p->out;
+    char buf[65536];
+
+    in = fopencookie(&p->input, "r", reader);
+    if (p->level)
+        out = fopencookie(&p->encrypted, "w", writer);
+    if (!in || !out)
+    {
+        Fail(p, "Could not start encryption");
+        /* Let the archive writer and the compressors finish */
+        while (QueueRead(&p->input, buf, sizeof(buf)) > 0)
+            ;
+        if (in)
+            fclose(in);
+        if (!out)
+            Finish(&p->encrypted);
+        else if (out != p->out)
+            fclose(out);
+        return NULL;
+    }
+    /* The queues buffer the data already */
+    setvbuf(in, NULL, _IONBF, 0);
+    if (out != p->out)
+        setvbuf(out, NULL, _IONBF, 0);
+
+    if (Encrypt(p, in, out))
+        Fail(p, "Could not encrypt the archive");
+
+    /* Anything after the end of the archive is left behind, like aestar */
+    while (fread(buf, 1, sizeof(buf), in) > 0)
+        ;
+    fclose(in);
+    if (out != p->out)
+        fclose(out);
+    else if (fflush(out))
+        Fail(p, "Could not write the archive");
+    return NULL;
+}
+
+static void *
+Compressor(void *arg)
+{
+    struct Pipeline *p = arg;
+    struct Queue *q = p->encrypting ? &p->encrypted : &p->input;
+    struct Buffer *b;
+    unsigned char *out = NULL;
+    uLong outsize = 0;
+    z_stream z;
+    int ok;
+
+    memset(&z, 0, sizeof(z));
+    /* 16 more window bits asks zlib for the gzip format */
+    ok = deflateInit2(&z, p->level, Z_DEFLATED, 15 + 16, 8,
+            Z_DEFAULT_STRATEGY) == Z_OK;
+    if (ok)
+    {
+        outsize = deflateBound(&z, BUFFERSIZE);
+        out = malloc(outsize);
+        ok = out != NULL;
+    }
+    if (!ok)
+        Fail(p, "Could not start compression");
+
+    while ((b = Take(q)))
+    {
+        size_t length = 0;
+
+        if (ok && !Failed(p))
+        {
+            z.next_in = (unsigned char *)b->data;
+            z.avail_in = b->length;
+            z.next_out = out;
+            z.avail_out = outsize;
+            if (deflate(&z, Z_FINISH) == Z_STREAM_END)
+                length = outsize - z.avail_out;
+            else
+                Fail(p, "Could not compress the archive");
+            deflateReset(&z);
+        }
+
+        /* Wait for the buffers before this one to be written */
+        pthread_mutex_lock(&p->lock);
+        while (p->nextseq != b->seq)
+            pthread_cond_wait(&p->turn, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+
+        if (length && fwrite(out, 1, length, p->out) != length)
+            Fail(p, "Could not write the archive");
+        if (length && p->frames)
+            fprintf(p->frames, "%llu %llu %lu %lu\n",
+                    (unsigned long long)p->position,
+                    (unsigned long long)p->zposition,
+                    (unsigned long)b->length, (unsigned long)length);
+        p->position += b->length;
+        p->zposition += length;
+
+        pthread_mutex_lock(&p->lock);
+        p->nextseq++;
+        pthread_cond_broadcast(&p->turn);
+        pthread_mutex_unlock(&p->lock);
+        Recycle(q, b);
+    }
+
+    if (ok)
+        deflateEnd(&z);
+    free(out);
+    return NULL;
+}
+
+static ssize_t
+PipelineWrite(void *cookie, const char *data, size_t size)
+{
+    struct Pipeline *p = cookie;
+
+    return QueueWrite(&p->input, data, size);
+}
+
+/* Drain the stages and report whether any of them failed */
+static int
+PipelineClose(void *cookie)
+{
+    struct Pipeline *p = cookie;
+    int i, ret;
+
+    Finish(&p->input);
+    if (p->encrypting)
+        pthread_join(p->encryptor, NULL);
+    for (i = 0; i < p->ncompressors; i++)
+        pthread_join(p->compressors[i], NULL);
+    if (p->ncompressors && fflush(p->out))
+        Fail(p, "Could not write the archive");
+    if (p->frames && fflush(p->frames))
+        Fail(p, "Could not write the frame index");
+    ret = p->failed ? EOF : 0;
+    if (g_framing == p)
+        g_framing = NULL;
+
+    FreeQueue(&p->input);
+    FreeQueue(&p->encrypted);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->turn);
+    free(p);
+    return ret;
+}
+
+void
+pipelineframe(FILE *f)
+{
+    struct Pipeline *p = g_framing;
+
+    if (!p || p->file != f || fflush(f))
+        return;
+    if (p->input.filling && p->input.filling->length >= MINFRAME)
+    {
+        Put(&p->input, p->input.filling);
+        p->input.filling = NULL;
+    }
+}
+
+FILE *
+pipeline(FILE *out, int level, const char *keyfile, uintmax_t chunksize,
+        FILE *frames)
+{
+    cookie_io_functions_t io = { NULL, PipelineWrite, NULL, PipelineClose };
+    struct Pipeline *p = calloc(1, sizeof(*p));
+    sigset_t all, old;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    FILE *f;
+    int i;
+
+    if (!p)
+        return NULL;
+    InitQueue(&p->input);
+    InitQueue(&p->encrypted);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->turn, NULL);
+    p->out = out;
+    p->level = level;
+    p->keyfile = keyfile;
+    p->chunksize = chunksize;
+    /* Frames only map to the archive when it is not encrypted */
+    if (level && !keyfile)
+        p->frames = frames;
+
+    f = fopencookie(p, "w", io);
+    if (!f)
+    {
+        free(p);
+        return NULL;
+    }
+    if (p->frames)
+    {
+        p->file = f;
+        g_framing = p;
+        fprintf(p->frames, "tarvol frames 1\n");
+    }
+
+    /*
+     * The stages leave signals to the main thread.  With SIGPIPE blocked,
+     * an aespipe that dies early makes writes to it fail instead.
+     */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (keyfile)
+        p->encrypting = !pthread_create(&p->encryptor, NULL, Encryptor, p);
+    if (level)
+    {
+        int n = cpus < 1 ? 1 : cpus > MAXCOMPRESSORS ? MAXCOMPRESSORS : cpus;
+
+        for (i = 0; i < n; i++)
+        {
+            if (pthread_create(&p->compressors[i], NULL, Compressor, p))
+                break;
+            p->ncompressors++;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if ((keyfile && !p->encrypting) || (level && !p->ncompressors))
+    {
+        fprintf(stderr, "Could not start the output pipeline\n");
+        p->failed = 1;
+        if (!p->encrypting)
+            Finish(&p->encrypted);
+        fclose(f);
+        return NULL;
+    }
+
+    if (verbose > 1)
+        fprintf(stderr, "Output pipeline:%s%s, %d compression threads\n",
+                keyfile ? " encrypt" : "", level ? " gzip" : "",
+                p->ncompressors);
+    return f;
+}
@@ -0,0 +1,26 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Static tracepoints.  When <sys/sdt.h> is installed the Makefile defines
+ * HAVE_SDT, and each PROBEn becomes a USDT probe: a single nop in the code
+ * plus a note naming it and its arguments, which perf and bpftrace can attach
+ * to in a running process.  Otherwise they compile to nothing.  Arguments
+ * should be integers.  The scripts in profiling/ use these probes.
+ */
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define PROBE1(provider, name, a) \
+    DTRACE_PROBE1(provider, name, a)
+#define PROBE2(provider, name, a, b) \
+    DTRACE_PROBE2(provider, name, a, b)
+#define PROBE3(provider, name, a, b, c) \
+    DTRACE_PROBE3(provider, name, a, b, c)
+#else
+#define PROBE1(provider, name, a) do { } while (0)
+#define PROBE2(provider, name, a, b) do { } while (0)
+#define PROBE3(provider, name, a, b, c) do { } while (0)
+#endif
@@ -0,0 +1,33 @@
+#!/bin/sh -e
+
+#
+# Written by Matthew Loar <matthew@loar.name>
+# This work is hereby placed in the public domain by its author.
+#
+# Profile a running tarvol with perf: sampled call graphs (tarvol is built
+# with frame pointers) together with its static tracepoints, then print the
+# hottest functions and the number of each event.
+#
+#   perf.sh PID [SECONDS]
+#
+
+TARVOL=/usr/local/sbin/tarvol
+PID=$1
+DURATION=${2:-30}
+DATA=tarvol-$PID.perf
+
+if [ -z "$PID" ]; then
+    echo "Usage: $0 pid [seconds]" >&2
+    exit 1
+fi
+
+# perf finds the tracepoints through its build-id cache
+perf buildid-cache --add $TARVOL
+perf probe --add 'sdt_tarvol:*' >/dev/null
+trap "perf probe --del 'sdt_tarvol:*' >/dev/null" EXIT
+
+perf record -g -e cpu-clock -e 'sdt_tarvol:*' -p $PID -o $DATA -- \
+    sleep $DURATION
+perf report -i $DATA --stdio --no-children -e cpu-clock --percent-limit 1
+perf script -i $DATA -F event | grep sdt_tarvol | sort | uniq -c
+echo "Raw data is in $DATA"
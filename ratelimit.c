@@ -0,0 +1,294 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Token buckets for bytes and vnodes read and bytes written per second.  Each
+ * bucket fills at its rate up to one second's worth, and the conversion
+ * sleeps whenever a bucket goes into debt, so that reading of the dump (and
+ * with it the fileserver) and writing of the archive are paced rather than
+ * stopped and started.
+ *
+ * Once a second the time taken by writes of the archive is compared with its
+ * long-run average.  If writes have become much slower, whatever is
+ * downstream is struggling, so the rates are halved, down to 1/16 of the
+ * limits, and then raised again by 1/16 a second while writes stay fast.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "ratelimit.h"
+#include "size.h"
+
+#define MINSCALE (1.0 / 16)
+/* Writes this much slower than usual cause a backoff */
+#define SLOWFACTOR 2.0
+#define SLOWMARGIN 0.001
+
+struct Bucket
+{
+    double rate;                /* per second, 0 for no limit */
+    double tokens;
+};
+
+static struct
+{
+    struct Bucket bytes, vnodes, output;
+    double last;                /* when the buckets were last filled */
+    double scale;               /* fraction of the limits in force */
+    double tick;                /* start of the current second */
+    double latency;             /* time spent writing in this second */
+    unsigned int writes;
+    double usual;               /* average time of a write */
+    const char *file;
+    time_t mtime;
+} g_limits;
+
+static volatile sig_atomic_t g_reload = 0;
+
+static void
+Reload(int sig)
+{
+    g_reload = 1;
+}
+
+static double
+Now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+ParseSize(const char *arg, double *size)
+{
+    uintmax_t n;
+
+    if (parsesize(arg, &n))
+        return -1;
+    *size = n;
+    return 0;
+}
+
+static int
+Parse(const char *limits, double *bytes, double *vnodes, double *output)
+{
+    char *copy = strdup(limits), *word, *save;
+    int ret = 0;
+
+    if (!copy)
+        return -1;
+    for (word = strtok_r(copy, " ,\t\n", &save); word && !ret;
+            word = strtok_r(NULL, " ,\t\n", &save))
+    {
+        if (strncmp(word, "bytes=", 6) == 0)
+            ret = ParseSize(word + 6, bytes);
+        else if (strncmp(word, "vnodes=", 7) == 0)
+            ret = ParseSize(word + 7, vnodes);
+        else if (strncmp(word, "output=", 7) == 0)
+            ret = ParseSize(word + 7, output);
+        else
+            ret = -1;
+    }
+    free(copy);
+    return ret;
+}
+
+static void
+SetRates(double bytes, double vnodes, double output)
+{
+    if (verbose && (bytes != g_limits.bytes.rate ||
+                vnodes != g_limits.vnodes.rate ||
+                output != g_limits.output.rate))
+        fprintf(stderr, "Limiting to %.0f bytes and %.0f vnodes read and "
+                "%.0f bytes written per second\n", bytes, vnodes, output);
+    g_limits.bytes.rate = bytes;
+    g_limits.vnodes.rate = vnodes;
+    g_limits.output.rate = output;
+    if (!g_limits.scale)
+        g_limits.scale = 1;
+}
+
+int
+ratelimitset(const char *limits)
+{
+    double bytes = 0, vnodes = 0, output = 0;
+
+    if (Parse(limits, &bytes, &vnodes, &output))
+        return -1;
+    SetRates(bytes, vnodes, output);
+    return 0;
+}
+
+static int
+ReadFile(void)
+{
+    char buf[1024];
+    FILE *f = fopen(g_limits.file, "r");
+    struct stat st;
+    size_t n;
+
+    if (!f)
+        return -1;
+    if (fstat(fileno(f), &st) == 0)
+        g_limits.mtime = st.st_mtime;
+    n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = 0;
+    if (ratelimitset(buf))
+    {
+        fprintf(stderr, "Ignoring bad limits in '%s'\n", g_limits.file);
+        return -1;
+    }
+    return 0;
+}
+
+int
+ratelimitfile(const char *path)
+{
+    struct sigaction sa;
+
+    g_limits.file = path;
+    if (ReadFile())
+    {
+        fprintf(stderr, "Cannot read limits from '%s'. Code = %d\n", path,
+                errno);
+        return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = Reload;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    return 0;
+}
+
+/* Once a second, pick up new limits and adjust for the speed of writes */
+static void
+Tick(double now)
+{
+    struct stat st;
+
+    g_limits.tick = now;
+    if (g_limits.file && (g_reload || (stat(g_limits.file, &st) == 0 &&
+                    st.st_mtime != g_limits.mtime)))
+    {
+        g_reload = 0;
+        ReadFile();
+    }
+
+    if (g_limits.writes)
+    {
+        double latency = g_limits.latency / g_limits.writes;
+
+        if (!g_limits.usual)
+            g_limits.usual = latency;
+        if (latency > g_limits.usual * SLOWFACTOR + SLOWMARGIN)
+        {
+            if (g_limits.scale > MINSCALE)
+            {
+                g_limits.scale /= 2;
+                if (g_limits.scale < MINSCALE)
+                    g_limits.scale = MINSCALE;
+                if (verbose)
+                    fprintf(stderr, "Writes are slow, backing off to %.0f%% "
+                            "of the limits\n", g_limits.scale * 100);
+            }
+        }
+        else
+        {
+            g_limits.usual += (latency - g_limits.usual) / 16;
+            if (g_limits.scale < 1)
+                g_limits.scale += MINSCALE;
+            if (g_limits.scale > 1)
+                g_limits.scale = 1;
+        }
+    }
+    g_limits.latency = 0;
+    g_limits.writes = 0;
+}
+
+/* Fill a bucket and take n tokens, returning how long to wait for them */
+static double
+Take(struct Bucket *b, double n, double elapsed)
+{
+    double rate = b->rate * g_limits.scale;
+
+    if (!rate)
+        return 0;
+    b->tokens += rate * elapsed;
+    if (b->tokens > rate)
+        b->tokens = rate;
+    b->tokens -= n;
+    return b->tokens < 0 ? -b->tokens / rate : 0;
+}
+
+/* Take from each bucket, sleeping off the largest debt */
+static void
+Charge(double bytes, double vnodes, double output)
+{
+    double now, wait, w;
+    struct timespec ts;
+
+    if (!g_limits.scale)
+        return;
+
+    now = Now();
+    if (!g_limits.last)
+        g_limits.last = g_limits.tick = now;
+    if (now - g_limits.tick >= 1)
+        Tick(now);
+
+    wait = Take(&g_limits.bytes, bytes, now - g_limits.last);
+    w = Take(&g_limits.vnodes, vnodes, now - g_limits.last);
+    if (w > wait)
+        wait = w;
+    w = Take(&g_limits.output, output, now - g_limits.last);
+    if (w > wait)
+        wait = w;
+    g_limits.last = now;
+
+    if (wait > 0)
+    {
+        ts.tv_sec = wait;
+        ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+        while (nanosleep(&ts, &ts) && errno == EINTR)
+            ;
+    }
+}
+
+void
+ratelimit(uintmax_t bytes, unsigned int vnodes)
+{
+    Charge(bytes, vnodes, 0);
+}
+
+void
+ratelimitoutput(uintmax_t bytes)
+{
+    Charge(0, 0, bytes);
+}
+
+void
+ratelatency(double seconds)
+{
+    g_limits.latency += seconds;
+    g_limits.writes++;
+}
+
+void
+ratelimitreset(void)
+{
+    memset(&g_limits, 0, sizeof(g_limits));
+    g_reload = 0;
+}
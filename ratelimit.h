@@ -0,0 +1,37 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Rate limits for a conversion, so that a backup can run alongside normal use
+ * of the fileserver.  Limits are given as "bytes=SIZE vnodes=N output=SIZE"
+ * (separated by spaces or commas, with an optional k, M or G suffix, 0 for no
+ * limit), either directly or in a control file that is read again when it
+ * changes or when tarvol gets SIGUSR1.  bytes and vnodes are read from the
+ * dump, and output is file data written to the archive.
+ */
+
+/* Needed for uintmax_t */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Set limits from a string; returns -1 if it cannot be parsed */
+int ratelimitset(const char *limits);
+/* Take limits from a control file, now and whenever it changes */
+int ratelimitfile(const char *path);
+/* Account for data read or vnodes converted, sleeping to keep to the limits */
+void ratelimit(uintmax_t bytes, unsigned int vnodes);
+/* Account for file data written to the archive, sleeping likewise */
+void ratelimitoutput(uintmax_t bytes);
+/* Report how long a write of the archive took, to back off when it is slow */
+void ratelatency(double seconds);
+/* Forget all limits */
+void ratelimitreset(void);
+
+#ifdef __cplusplus
+}
+#endif
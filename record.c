@@ -0,0 +1,273 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * The decoder and encoder for the records described in record.h.  A field's
+ * values are read with a single fread() into a buffer and converted from
+ * there, and a whole record is encoded into a buffer, so that a vnode costs
+ * a handful of calls into stdio rather than one per value.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "record.h"
+
+/* The most bytes of values read at once; an ACL is 192 */
+#define CHUNK 1024
+
+uint64_t
+getvalue(const unsigned char *buf, int width)
+{
+    switch (width)
+    {
+        case 1:
+            return buf[0];
+        case 2:
+            return (uint32_t)buf[0] << 8 | buf[1];
+        case 4:
+            return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+                (uint32_t)buf[2] << 8 | buf[3];
+        default:
+            return getvalue(buf, 4) << 32 | getvalue(buf + 4, 4);
+    }
+}
+
+void
+putvalue(unsigned char *buf, int width, uint64_t value)
+{
+    int i;
+
+    for (i = width - 1; i >= 0; i--, value >>= 8)
+        buf[i] = value & 0xff;
+}
+
+/* Store a value into, or load one from, a member of 1, 2, 4 or 8 bytes */
+static void
+Store(char *member, int size, uint64_t value)
+{
+    uint8_t u8 = value;
+    uint16_t u16 = value;
+    uint32_t u32 = value;
+
+    switch (size)
+    {
+        case 1:
+            memcpy(member, &u8, 1);
+            break;
+        case 2:
+            memcpy(member, &u16, 2);
+            break;
+        case 4:
+            memcpy(member, &u32, 4);
+            break;
+        default:
+            memcpy(member, &value, 8);
+            break;
+    }
+}
+
+static uint64_t
+Load(const char *member, int size)
+{
+    uint8_t u8;
+    uint16_t u16;
+    uint32_t u32;
+    uint64_t u64;
+
+    switch (size)
+    {
+        case 1:
+            memcpy(&u8, member, 1);
+            return u8;
+        case 2:
+            memcpy(&u16, member, 2);
+            return u16;
+        case 4:
+            memcpy(&u32, member, 4);
+            return u32;
+        default:
+            memcpy(&u64, member, 8);
+            return u64;
+    }
+}
+
+/*
+ * Read n values of a field, storing as many as there is room for in the
+ * member, if any, and discarding the rest.  Returns -1 on a short read.
+ */
+static int
+ReadValues(FILE *in, const struct RecordField *f, char *member, unsigned int n)
+{
+    unsigned char buf[CHUNK];
+    unsigned int i, chunk, room = member ? f->count : 0, code;
+
+    while (n > 0)
+    {
+        chunk = n < CHUNK / f->width ? n : CHUNK / f->width;
+        code = fread(buf, f->width, chunk, in);
+        if (code != chunk)
+        {
+            fprintf(stderr, "Code = %d; Errno = %d\n", code, errno);
+            return -1;
+        }
+        for (i = 0; i < chunk && room > 0; i++, room--, member += f->size)
+            Store(member, f->size, getvalue(buf + i * f->width, f->width));
+        n -= chunk;
+    }
+    return 0;
+}
+
+static void
+ReadString(FILE *in, const struct RecordField *f, char *member)
+{
+    unsigned int i = 0;
+    int c;
+
+    while ((c = getc(in)) != EOF && c != 0)
+    {
+        if (i < f->count - 1u)
+            member[i++] = c;
+    }
+    member[i] = 0;
+    if (c == EOF)
+        fprintf(stderr, "Code = %d; Errno = %d\n", 0, errno);
+}
+
+int
+decoderecord(FILE *in, const struct Record *rec, void *record)
+{
+    const struct RecordField *f;
+    unsigned char count[2];
+    char *member;
+    unsigned int n;
+    int tag;
+
+    for (;;)
+    {
+        if ((tag = getc(in)) == EOF)
+        {
+            fprintf(stderr, "Code = %d; Errno = %d\n", 0, errno);
+            return 0;
+        }
+        if (!rec->index[tag])
+            return (char)tag;
+
+        f = &rec->fields[rec->index[tag] - 1];
+        member = (char *)record + f->offset;
+        switch (f->kind)
+        {
+            case RF_INT:
+                ReadValues(in, f, member, f->count);
+                break;
+
+            case RF_STRING:
+                ReadString(in, f, member);
+                break;
+
+            case RF_ARRAY:
+                if (fread(count, 2, 1, in) != 1)
+                {
+                    fprintf(stderr, "Code = %d; Errno = %d\n", 0, errno);
+                    break;
+                }
+                n = getvalue(count, 2);
+                Store((char *)record + f->countoffset, sizeof(int),
+                    (n < f->count ? n : f->count) >> f->countshift);
+                ReadValues(in, f, member, n);
+                break;
+
+            default:
+                ReadValues(in, f, NULL, f->count);
+                break;
+        }
+        if (f->flags & RF_LAST)
+            return (char)tag;
+    }
+}
+
+/* Whether every value of a field is zero */
+static int
+AllZero(const struct RecordField *f, const void *record)
+{
+    const char *member = (const char *)record + f->offset;
+    unsigned int i;
+
+    for (i = 0; i < f->count; i++, member += f->size)
+    {
+        if (Load(member, f->size))
+            return 0;
+    }
+    return 1;
+}
+
+/* Whether a field's value is too big for it and must be written wide */
+static int
+TooWide(const struct RecordField *f, const void *record)
+{
+    uint64_t value;
+
+    if (f->kind != RF_INT || f->count != 1 || f->width >= 8)
+        return 0;
+    value = Load((const char *)record + f->offset, f->size);
+    return (value >> (f->width * 8)) != 0;
+}
+
+size_t
+encoderecord(const struct Record *rec, const void *record,
+    unsigned char *buf, size_t size)
+{
+    const struct RecordField *f;
+    const char *member;
+    unsigned char *p = buf, *end = buf + size;
+    unsigned int i, n;
+    int j;
+
+    for (j = 0; j < rec->nfields; j++)
+    {
+        f = &rec->fields[j];
+        if (f->kind == RF_SKIP)
+            continue;
+        if (f->flags & RF_WIDE)
+            continue;
+        if ((f->flags & RF_SPARSE) && AllZero(f, record))
+            continue;
+        if (j + 1 < rec->nfields && (rec->fields[j + 1].flags & RF_WIDE) &&
+                TooWide(f, record))
+            f = &rec->fields[j + 1];
+
+        member = (const char *)record + f->offset;
+        n = f->count;
+        if (f->kind == RF_STRING)
+            n = strnlen(member, f->count - 1) + 1;
+        else if (f->kind == RF_ARRAY)
+        {
+            n = Load((const char *)record + f->countoffset, sizeof(int)) <<
+                f->countshift;
+            if (n > f->count)
+                n = f->count;
+        }
+
+        if (end - p < 1 + (f->kind == RF_ARRAY ? 2 : 0) + n * f->width)
+            return 0;
+        *p++ = f->tag;
+        if (f->kind == RF_ARRAY)
+        {
+            putvalue(p, 2, n);
+            p += 2;
+        }
+        if (f->kind == RF_STRING)
+        {
+            memcpy(p, member, n - 1);
+            p[n - 1] = 0;
+            p += n;
+            continue;
+        }
+        for (i = 0; i < n; i++, member += f->size, p += f->width)
+            putvalue(p, f->width, Load(member, f->size));
+    }
+    return p - buf;
+}
@@ -0,0 +1,113 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Tagged records of a vos dump.  A record is a run of fields, each a tag
+ * character followed by big-endian values, and ends at the first tag that is
+ * not one of its fields.  Each kind of record is described once, by a list
+ * of its fields in the order vos writes them:
+ *
+ *     #define VNODE_FIELDS(X) \
+ *         X(vNode, type, INT, 't', type, 1, 0) \
+ *         X(vNode, acl, INTS, 'A', acl, 4, RF_SPARSE) \
+ *         ...
+ *     RECORD(g_vnoderecord, VNODE_FIELDS)
+ *
+ * giving the structure, a name for the field, its kind, tag, member and:
+ *
+ *     INT     width in the dump and flags; one value of the member's size
+ *     INTS    width in the dump and flags; the member is read as 32-bit
+ *             values
+ *     STRING  nothing; a NUL-terminated string, cut to fit the member
+ *     ARRAY   the int that counts the values, and the shift to apply to the
+ *             16-bit count in the dump; the member is read as 32-bit values
+ *     SKIP    (no member) width in the dump; the value is ignored
+ *
+ * RECORD() turns the list into a table of fields and an index from tag to
+ * field, both built by the compiler, which drive both decoderecord() and
+ * encoderecord().
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum { RF_INT, RF_STRING, RF_ARRAY, RF_SKIP };
+
+/* The fixed part of a record ends with this field; what follows is data */
+#define RF_LAST 1
+/* Written in place of the field before it when a value does not fit that */
+#define RF_WIDE 2
+/* Left out when all its values are zero, as vos does with a file's ACL */
+#define RF_SPARSE 4
+
+struct RecordField
+{
+    unsigned char tag, kind, flags;
+    unsigned char width;            /* bytes of each value in the dump */
+    unsigned char size;             /* bytes of each value in memory */
+    unsigned short count;           /* values, or bytes for a string */
+    unsigned short offset;
+    unsigned short countoffset;     /* RF_ARRAY: the int counting values */
+    unsigned char countshift;
+};
+
+struct Record
+{
+    const struct RecordField *fields;
+    int nfields;
+    unsigned char index[256];       /* 1 + the field with each tag, or 0 */
+};
+
+#define RECORD_INT(T, tag, member, width, flags) \
+    { tag, RF_INT, flags, width, sizeof(((struct T *)0)->member), 1, \
+        offsetof(struct T, member), 0, 0 }
+#define RECORD_INTS(T, tag, member, width, flags) \
+    { tag, RF_INT, flags, width, 4, sizeof(((struct T *)0)->member) / 4, \
+        offsetof(struct T, member), 0, 0 }
+#define RECORD_STRING(T, tag, member) \
+    { tag, RF_STRING, 0, 1, 1, sizeof(((struct T *)0)->member), \
+        offsetof(struct T, member), 0, 0 }
+#define RECORD_ARRAY(T, tag, member, counter, shift) \
+    { tag, RF_ARRAY, 0, 4, 4, sizeof(((struct T *)0)->member) / 4, \
+        offsetof(struct T, member), offsetof(struct T, counter), shift }
+#define RECORD_SKIP(T, tag, width) \
+    { tag, RF_SKIP, 0, width, 0, 1, 0, 0, 0 }
+
+#define RECORD_FIELD(T, name, kind, ...) RECORD_##kind(T, __VA_ARGS__),
+#define RECORD_ENUM(T, name, kind, ...) T##_##name,
+#define RECORD_INDEX(T, name, kind, tag, ...) \
+    [(unsigned char)(tag)] = T##_##name + 1,
+
+#define RECORD(var, list) \
+    enum { list(RECORD_ENUM) }; \
+    static const struct RecordField var##_fields[] = { list(RECORD_FIELD) }; \
+    static const struct Record var = { var##_fields, \
+        sizeof(var##_fields) / sizeof(var##_fields[0]), \
+        { list(RECORD_INDEX) } };
+
+/* A big-endian value of 1, 2, 4 or 8 bytes */
+uint64_t getvalue(const unsigned char *buf, int width);
+void putvalue(unsigned char *buf, int width, uint64_t value);
+
+/*
+ * Read fields into a record until a tag that is not one of them, or until a
+ * field flagged RF_LAST, and return that tag.
+ */
+int decoderecord(FILE *in, const struct Record *rec, void *record);
+/*
+ * Encode every field of a record into a buffer.  Returns the number of bytes
+ * used, or 0 if the buffer is too small.
+ */
+size_t encoderecord(const struct Record *rec, const void *record,
+    unsigned char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,248 @@
+#!/usr/bin/env python3
+#
+# Written by Matthew Loar <matthew@loar.name>
+# This work is hereby placed in the public domain by its author.
+#
+# A stand-in for an S3-compatible object store, for trying tarvol -f s3://
+# without one.  It keeps objects as files under a directory, takes multipart
+# uploads the way S3 does (parts of at least 5 MB but the last, ETags that
+# are the MD5 of each part) and checks the signature of each request if it
+# knows the secret key.  It can also fail or slow down part uploads, to see
+# tarvol retry them:
+#
+#   AWS_SECRET_ACCESS_KEY=secret ./s3mock.py -d /tmp/s3 -p 9000 -f 3 &
+#   AWS_ENDPOINT_URL=http://localhost:9000 AWS_ACCESS_KEY_ID=key \
+#       AWS_SECRET_ACCESS_KEY=secret tarvol -c -f s3://bucket/vol.tar vol.dump
+#   cmp /tmp/s3/bucket/vol.tar vol.tar
+
+import argparse
+import hashlib
+import hmac
+import os
+import shutil
+import sys
+import threading
+import time
+import urllib.parse
+import uuid
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+MINPART = 5 << 20
+
+
+class Store:
+    def __init__(self, args):
+        self.args = args
+        self.lock = threading.Lock()
+        self.puts = 0
+        self.active = 0
+        self.most = 0
+
+
+def quote(s, slash):
+    return urllib.parse.quote(s, safe='/-_.~' if slash else '-_.~')
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, fmt, *args):
+        if self.server.store.args.verbose:
+            sys.stderr.write('s3mock: ' + fmt % args + '\n')
+
+    def reply(self, status, body=b'', headers=()):
+        if isinstance(body, str):
+            body = body.encode()
+        self.send_response(status)
+        for name, value in headers:
+            self.send_header(name, value)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def error(self, status, code):
+        self.reply(status, '<?xml version="1.0" encoding="UTF-8"?>\n'
+                   '<Error><Code>%s</Code></Error>' % code)
+
+    def signed(self, body):
+        """Check the request's SigV4 signature, if the secret is known"""
+        secret = os.environ.get('AWS_SECRET_ACCESS_KEY')
+        if not secret:
+            return True
+        auth = self.headers.get('Authorization', '')
+        if not auth.startswith('AWS4-HMAC-SHA256 '):
+            return False
+        fields = dict(f.strip().split('=', 1)
+                      for f in auth[len('AWS4-HMAC-SHA256 '):].split(','))
+        scope = fields['Credential'].split('/', 1)[1]
+        names = fields['SignedHeaders'].split(';')
+        payload = hashlib.sha256(body).hexdigest()
+        if self.headers.get('x-amz-content-sha256') != payload:
+            return False
+        path, _, query = self.path.partition('?')
+        params = sorted(urllib.parse.parse_qsl(query, keep_blank_values=True))
+        canonical = '\n'.join([
+            self.command,
+            quote(urllib.parse.unquote(path), True),
+            '&'.join('%s=%s' % (quote(k, False), quote(v, False))
+                     for k, v in params),
+            ''.join('%s:%s\n' % (n, self.headers.get(n, '').strip())
+                    for n in names),
+            ';'.join(names),
+            payload])
+        date = self.headers.get('x-amz-date', '')
+        tosign = '\n'.join(['AWS4-HMAC-SHA256', date, scope,
+                            hashlib.sha256(canonical.encode()).hexdigest()])
+        key = ('AWS4' + secret).encode()
+        for part in scope.split('/'):
+            key = hmac.new(key, part.encode(), hashlib.sha256).digest()
+        signature = hmac.new(key, tosign.encode(), hashlib.sha256).hexdigest()
+        return hmac.compare_digest(signature, fields['Signature'])
+
+    def target(self):
+        store = self.server.store
+        path, _, query = self.path.partition('?')
+        path = urllib.parse.unquote(path).lstrip('/')
+        if not path or '..' in path.split('/'):
+            return None, None
+        return os.path.join(store.args.dir, path), \
+            dict(urllib.parse.parse_qsl(query, keep_blank_values=True))
+
+    def body(self):
+        return self.rfile.read(int(self.headers.get('Content-Length', 0)))
+
+    def uploaddir(self, params):
+        upload = params.get('uploadId', '')
+        d = os.path.join(self.server.store.args.dir, '.uploads', upload)
+        return d if upload and '/' not in upload and os.path.isdir(d) \
+            else None
+
+    def do_POST(self):
+        data = self.body()
+        path, params = self.target()
+        if not path:
+            return self.error(400, 'InvalidURI')
+        if not self.signed(data):
+            return self.error(403, 'SignatureDoesNotMatch')
+        if 'uploads' in params:
+            upload = uuid.uuid4().hex
+            os.makedirs(os.path.join(self.server.store.args.dir, '.uploads',
+                                     upload))
+            return self.reply(200, '<?xml version="1.0" encoding="UTF-8"?>\n'
+                              '<InitiateMultipartUploadResult>'
+                              '<UploadId>%s</UploadId>'
+                              '</InitiateMultipartUploadResult>' % upload)
+        d = self.uploaddir(params)
+        if not d:
+            return self.error(404, 'NoSuchUpload')
+        text = data.decode()
+        parts = []
+        for chunk in text.split('<Part>')[1:]:
+            number = int(chunk.split('<PartNumber>')[1].split('<')[0])
+            etag = chunk.split('<ETag>')[1].split('<')[0]
+            parts.append((number, etag))
+        if not parts or [n for n, _ in parts] != \
+                list(range(1, len(parts) + 1)):
+            return self.error(400, 'InvalidPartOrder')
+        files = [os.path.join(d, str(n)) for n, _ in parts]
+        for i, (f, (n, etag)) in enumerate(zip(files, parts)):
+            if not os.path.exists(f):
+                return self.error(400, 'InvalidPart')
+            with open(f, 'rb') as p:
+                content = p.read()
+            if etag.strip('"') != hashlib.md5(content).hexdigest():
+                return self.error(400, 'InvalidPart')
+            if i + 1 < len(parts) and len(content) < MINPART:
+                return self.error(400, 'EntityTooSmall')
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with open(path, 'wb') as out:
+            for f in files:
+                with open(f, 'rb') as p:
+                    shutil.copyfileobj(p, out)
+        shutil.rmtree(d)
+        store = self.server.store
+        sys.stderr.write('s3mock: stored %s from %d parts, at most %d '
+                         'uploaded at once\n' % (self.path.split('?')[0],
+                                                 len(parts), store.most))
+        self.reply(200, '<?xml version="1.0" encoding="UTF-8"?>\n'
+                   '<CompleteMultipartUploadResult>'
+                   '<Location>http://%s%s</Location>'
+                   '</CompleteMultipartUploadResult>'
+                   % (self.headers.get('Host', ''), self.path.split('?')[0]))
+
+    def do_PUT(self):
+        store = self.server.store
+        with store.lock:
+            store.active += 1
+            store.most = max(store.most, store.active)
+            store.puts += 1
+            n = store.puts
+        try:
+            data = self.body()
+            path, params = self.target()
+            if not path:
+                return self.error(400, 'InvalidURI')
+            if not self.signed(data):
+                return self.error(403, 'SignatureDoesNotMatch')
+            if store.args.delay:
+                time.sleep(store.args.delay)
+            if store.args.fail and n % store.args.fail == 0:
+                return self.error(500, 'InternalError')
+            d = self.uploaddir(params)
+            if not d:
+                return self.error(404, 'NoSuchUpload')
+            with open(os.path.join(d, str(int(params['partNumber']))),
+                      'wb') as f:
+                f.write(data)
+            self.reply(200, headers=[
+                ('ETag', '"%s"' % hashlib.md5(data).hexdigest())])
+        finally:
+            with store.lock:
+                store.active -= 1
+
+    def do_DELETE(self):
+        data = self.body()
+        path, params = self.target()
+        if not path or not self.signed(data):
+            return self.error(403, 'SignatureDoesNotMatch')
+        d = self.uploaddir(params)
+        if not d:
+            return self.error(404, 'NoSuchUpload')
+        shutil.rmtree(d)
+        sys.stderr.write('s3mock: aborted the upload of %s\n'
+                         % self.path.split('?')[0])
+        self.reply(204)
+
+    def do_GET(self):
+        path, _ = self.target()
+        if not path or not os.path.isfile(path):
+            return self.error(404, 'NoSuchKey')
+        with open(path, 'rb') as f:
+            self.reply(200, f.read())
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Serve a directory as a minimal S3-compatible store')
+    parser.add_argument('-d', '--dir', default='.',
+                        help='keep buckets and objects under DIR')
+    parser.add_argument('-p', '--port', type=int, default=9000)
+    parser.add_argument('-f', '--fail', type=int, default=0, metavar='N',
+                        help='fail every Nth part upload with a 500')
+    parser.add_argument('-s', '--delay', type=float, default=0,
+                        metavar='SECONDS', help='take this long over each part')
+    parser.add_argument('-v', '--verbose', action='store_true',
+                        help='log every request')
+    args = parser.parse_args()
+
+    server = ThreadingHTTPServer(('127.0.0.1', args.port), Handler)
+    server.store = Store(args)
+    server.daemon_threads = True
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
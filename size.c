@@ -0,0 +1,45 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "size.h"
+
+int
+parsesize(const char *arg, uintmax_t *size)
+{
+    char *end;
+    uintmax_t n;
+    int shift = 0;
+
+    /* strtoumax would take a minus sign and negate the value */
+    while (isspace((unsigned char)*arg))
+        arg++;
+    if (!isdigit((unsigned char)*arg))
+        return -1;
+    errno = 0;
+    n = strtoumax(arg, &end, 10);
+    if (errno)
+        return -1;
+
+    switch (*end)
+    {
+        case 'G': case 'g':
+            shift += 10;
+            /* FALLTHROUGH */
+        case 'M': case 'm':
+            shift += 10;
+            /* FALLTHROUGH */
+        case 'K': case 'k':
+            shift += 10;
+            end++;
+    }
+    if (*end || (shift && n > UINTMAX_MAX >> shift))
+        return -1;
+    *size = n << shift;
+    return 0;
+}
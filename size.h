@@ -0,0 +1,18 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/* Needed for uintmax_t */
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Parse a size with an optional k, M or G suffix; -1 if it is not one */
+int parsesize(const char *arg, uintmax_t *size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,24 +3,484 @@
  * This work is hereby placed in the public domain by its author.
  */
 
+/*
+ * Names are kept in memory up to a budget.  Past that, the least recently
+ * used entries are spilled to a pair of temporary files: a name heap, and a
+ * slot file indexed directly by vnode number.  Vnode numbers in a volume are
+ * dense, so the slot file is a perfect hash that the filesystem keeps sparse.
+ * File names are spilled before directory names, since each file name is
+ * normally looked up once while a directory name is needed for each of its
+ * children.
+ *
+ * A file can have several names in its directory.  The first is kept as
+ * above; the others are rare, and are simply kept in memory until the file
+ * has been written.
+ *
+ * Directories are decoded on other threads, so the table is behind a lock
+ * and names are handed out as copies in buffers of the calling thread.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
 #include <string>
-#include <map>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "storage.h"
 
-std::map<int, std::string> m_entries;
-void add(int vnode, const char *file)
+/* Rough per-entry cost of the containers, on top of the name itself */
+#define ENTRY_OVERHEAD 96
+
+struct Entry
+{
+    std::string name;
+    bool dir;
+    bool ondisk;                /* an up to date copy is in the slot file */
+    int marks;
+    std::list<int>::iterator lru;
+};
+
+struct Slot
+{
+    uint64_t offset;
+    uint32_t length;
+    uint32_t flags;
+};
+
+#define SLOT_USED 1
+#define SLOT_DIR  2
+#define SLOT_MARKSHIFT 8
+
+std::unordered_map<int, Entry> m_entries;
+static std::unordered_map<int, std::vector<std::string> > m_links;
+static std::list<int> m_files, m_dirs;  /* in memory, least recent first */
+static size_t m_budget = 0, m_used = 0;
+static FILE *m_slots = NULL, *m_names = NULL;
+static off_t m_namesend = 0;
+static thread_local char m_result[4][MAXPATHLEN];
+static thread_local int m_nextresult = 0;
+static thread_local char m_spilled[MAXPATHLEN];
+static pthread_mutex_t m_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Holds the lock on the table for as long as it is in scope */
+struct Locked
+{
+    Locked() { pthread_mutex_lock(&m_lock); }
+    ~Locked() { pthread_mutex_unlock(&m_lock); }
+};
+
+/* Copy a name out to the caller, in one of its own buffers */
+static const char *result(const char *name, size_t length)
 {
-    m_entries.insert(std::make_pair(vnode, file));
+    char *copy = m_result[m_nextresult++ % 4];
+
+    if (length >= MAXPATHLEN)
+    {
+        length = MAXPATHLEN - 1;
+    }
+    memcpy(copy, name, length);
+    copy[length] = 0;
+    return copy;
 }
 
-const char *get(int vnode)
+void setnamebudget(size_t bytes)
 {
-    if (m_entries.find(vnode) != m_entries.end())
+    Locked locked;
+    m_budget = bytes;
+}
+
+void reservenames(size_t count)
+{
+    Locked locked;
+
+    /* Do not set aside more than the budget can hold */
+    if (m_budget && count > m_budget / ENTRY_OVERHEAD)
+    {
+        count = m_budget / ENTRY_OVERHEAD;
+    }
+    m_entries.reserve(count);
+}
+
+static size_t cost(const Entry &e)
+{
+    return e.name.capacity() + ENTRY_OVERHEAD;
+}
+
+static bool readslot(int vnode, Slot *slot)
+{
+    if (!m_slots || vnode < 0)
+    {
+        return false;
+    }
+    if (pread(fileno(m_slots), slot, sizeof(Slot),
+                (off_t)vnode * sizeof(Slot)) != sizeof(Slot))
     {
-        return m_entries.find(vnode)->second.c_str();
+        return false;
+    }
+    return slot->flags & SLOT_USED;
+}
+
+static void writeslot(int vnode, const Slot *slot)
+{
+    if (pwrite(fileno(m_slots), slot, sizeof(Slot),
+                (off_t)vnode * sizeof(Slot)) != sizeof(Slot))
+    {
+        perror("Could not write name slot");
+    }
+}
+
+static bool spill(int vnode)
+{
+    std::unordered_map<int, Entry>::iterator it = m_entries.find(vnode);
+    Entry &e = it->second;
+
+    if (!m_slots)
+    {
+        m_slots = tmpfile();
+        m_names = tmpfile();
+        if (!m_slots || !m_names)
+        {
+            fprintf(stderr, "Could not create temp files for names\n");
+            if (m_slots) fclose(m_slots);
+            if (m_names) fclose(m_names);
+            m_slots = m_names = NULL;
+            return false;
+        }
+    }
+
+    if (!e.ondisk)
+    {
+        Slot slot;
+        slot.offset = m_namesend;
+        slot.length = e.name.size();
+        slot.flags = SLOT_USED | (e.dir ? SLOT_DIR : 0) |
+            (e.marks << SLOT_MARKSHIFT);
+        if (pwrite(fileno(m_names), e.name.data(), slot.length,
+                    m_namesend) != (ssize_t)slot.length)
+        {
+            perror("Could not spill name");
+            return false;
+        }
+        m_namesend += slot.length;
+        writeslot(vnode, &slot);
+    }
+
+    (e.dir ? m_dirs : m_files).erase(e.lru);
+    m_used -= cost(e);
+    m_entries.erase(it);
+    return true;
+}
+
+/* Spill entries until we are back within the budget */
+static void trim(int keep)
+{
+    while (m_budget && m_used > m_budget)
+    {
+        std::list<int> &victims = m_files.empty() ? m_dirs : m_files;
+        if (victims.empty() || victims.front() == keep)
+        {
+            break;
+        }
+        if (!spill(victims.front()))
+        {
+            break;
+        }
+    }
+}
+
+static Entry &insert(int vnode, const std::string &name, bool dir,
+        bool ondisk, int marks)
+{
+    Entry &e = m_entries[vnode];
+    e.name = name;
+    e.dir = dir;
+    e.ondisk = ondisk;
+    e.marks = marks;
+    std::list<int> &lru = dir ? m_dirs : m_files;
+    e.lru = lru.insert(lru.end(), vnode);
+    m_used += cost(e);
+    trim(vnode);
+    return e;
+}
+
+/* Find a name, which is only valid while the lock is held */
+static const char *lookup(int vnode)
+{
+    std::unordered_map<int, Entry>::iterator it = m_entries.find(vnode);
+    Slot slot;
+
+    if (it != m_entries.end())
+    {
+        Entry &e = it->second;
+        if (e.dir)
+        {
+            m_dirs.splice(m_dirs.end(), m_dirs, e.lru);
+        }
+        return e.name.c_str();
+    }
+    else if (readslot(vnode, &slot))
+    {
+        char *name = m_spilled;
+
+        if (slot.length >= MAXPATHLEN ||
+                pread(fileno(m_names), name, slot.length,
+                    slot.offset) != (ssize_t)slot.length)
+        {
+            fprintf(stderr, "Could not read spilled name for vnode %d\n",
+                    vnode);
+            return NULL;
+        }
+        name[slot.length] = 0;
+
+        if (slot.flags & SLOT_DIR)
+        {
+            /* A directory that is being used again is worth keeping */
+            return insert(vnode, name, true, true,
+                    slot.flags >> SLOT_MARKSHIFT).name.c_str();
+        }
+        return name;
     }
     else
     {
         return NULL;
     }
 }
+
+void add(int vnode, const char *file)
+{
+    Locked locked;
+    Slot slot;
+
+    if (m_entries.find(vnode) != m_entries.end() || readslot(vnode, &slot))
+    {
+        const char *first;
+
+        /* Further names of a file are its hard links */
+        if (!(vnode & 1) && (first = lookup(vnode)) &&
+                strcmp(first, file) != 0)
+        {
+            std::vector<std::string> &links = m_links[vnode];
+            for (size_t i = 0; i < links.size(); i++)
+            {
+                if (links[i] == file)
+                {
+                    return;
+                }
+            }
+            links.push_back(file);
+        }
+        return;
+    }
+    /* Odd vnode numbers are directories */
+    insert(vnode, file, vnode & 1, false, 0);
+}
+
+const char *get(int vnode)
+{
+    Locked locked;
+    const char *name = lookup(vnode);
+
+    return name ? result(name, strlen(name)) : NULL;
+}
+
+const char *getlink(int vnode, int n)
+{
+    Locked locked;
+    std::unordered_map<int, std::vector<std::string> >::iterator it =
+        m_links.find(vnode);
+
+    if (it == m_links.end() || n < 0 || (size_t)n >= it->second.size())
+    {
+        return NULL;
+    }
+    return result(it->second[n].data(), it->second[n].size());
+}
+
+void mark(int vnode, int marks)
+{
+    Locked locked;
+    std::unordered_map<int, Entry>::iterator it = m_entries.find(vnode);
+    Slot slot;
+
+    if (it != m_entries.end())
+    {
+        Entry &e = it->second;
+        if ((e.marks | marks) != e.marks)
+        {
+            e.marks |= marks;
+            e.ondisk = false;
+        }
+    }
+    else if (readslot(vnode, &slot))
+    {
+        slot.flags |= marks << SLOT_MARKSHIFT;
+        writeslot(vnode, &slot);
+    }
+}
+
+int marks(int vnode)
+{
+    Locked locked;
+    std::unordered_map<int, Entry>::iterator it = m_entries.find(vnode);
+    Slot slot;
+
+    if (it != m_entries.end())
+    {
+        return it->second.marks;
+    }
+    else if (readslot(vnode, &slot))
+    {
+        return slot.flags >> SLOT_MARKSHIFT;
+    }
+    return 0;
+}
+
+void release(int vnode)
+{
+    Locked locked;
+    std::unordered_map<int, Entry>::iterator it = m_entries.find(vnode);
+    bool ondisk = m_slots != NULL;
+
+    m_links.erase(vnode);
+    if (it != m_entries.end())
+    {
+        Entry &e = it->second;
+        ondisk = e.ondisk;
+        (e.dir ? m_dirs : m_files).erase(e.lru);
+        m_used -= cost(e);
+        m_entries.erase(it);
+    }
+    if (ondisk)
+    {
+        Slot slot;
+        memset(&slot, 0, sizeof(slot));
+        writeslot(vnode, &slot);
+    }
+}
+
+void clearnames(void)
+{
+    Locked locked;
+
+    /* Clearing keeps the buckets, so the next volume does not rehash */
+    m_entries.clear();
+    m_links.clear();
+    m_files.clear();
+    m_dirs.clear();
+    m_used = 0;
+    if (m_slots)
+    {
+        fclose(m_slots);
+        fclose(m_names);
+        m_slots = m_names = NULL;
+    }
+    m_namesend = 0;
+}
+
+/*
+ * Snapshot records are the vnode, its marks and the length of its name, then
+ * the name.  A record with vnode -1 ends the snapshot.
+ */
+static bool saverecord(FILE *out, int32_t vnode, int32_t marks,
+        const char *name, uint32_t length)
+{
+    int32_t head[3] = { vnode, marks, (int32_t)length };
+    return fwrite(head, sizeof(head), 1, out) == 1 &&
+        fwrite(name, 1, length, out) == length;
+}
+
+int savenames(FILE *out)
+{
+    Locked locked;
+    std::unordered_map<int, Entry>::iterator it;
+
+    for (it = m_entries.begin(); it != m_entries.end(); ++it)
+    {
+        const Entry &e = it->second;
+        if (!saverecord(out, it->first, e.marks, e.name.data(),
+                    e.name.size()))
+        {
+            return -1;
+        }
+    }
+
+    if (m_slots)
+    {
+        struct stat st;
+        int vnode;
+
+        if (fstat(fileno(m_slots), &st))
+        {
+            return -1;
+        }
+        for (vnode = 0; (off_t)((vnode + 1) * sizeof(Slot)) <= st.st_size;
+                vnode++)
+        {
+            Slot slot;
+            char name[MAXPATHLEN];
+
+            if (!readslot(vnode, &slot) ||
+                    m_entries.find(vnode) != m_entries.end())
+            {
+                continue;
+            }
+            if (slot.length >= MAXPATHLEN ||
+                    pread(fileno(m_names), name, slot.length,
+                        slot.offset) != (ssize_t)slot.length ||
+                    !saverecord(out, vnode, slot.flags >> SLOT_MARKSHIFT,
+                        name, slot.length))
+            {
+                return -1;
+            }
+        }
+    }
+
+    /* Links come after every first name, so loading adds them as links */
+    std::unordered_map<int, std::vector<std::string> >::iterator lt;
+    for (lt = m_links.begin(); lt != m_links.end(); ++lt)
+    {
+        for (size_t i = 0; i < lt->second.size(); i++)
+        {
+            if (!saverecord(out, lt->first, 0, lt->second[i].data(),
+                        lt->second[i].size()))
+            {
+                return -1;
+            }
+        }
+    }
+
+    return saverecord(out, -1, 0, "", 0) ? 0 : -1;
+}
+
+int loadnames(FILE *in)
+{
+    int32_t head[3];
+    char name[MAXPATHLEN];
+
+    while (fread(head, sizeof(head), 1, in) == 1)
+    {
+        if (head[0] == -1)
+        {
+            return 0;
+        }
+        if ((uint32_t)head[2] >= MAXPATHLEN ||
+                fread(name, 1, head[2], in) != (size_t)head[2])
+        {
+            break;
+        }
+        name[head[2]] = 0;
+        add(head[0], name);
+        if (head[1])
+        {
+            mark(head[0], head[1]);
+        }
+    }
+    return -1;
+}
@@ -3,12 +3,39 @@
  * This work is hereby placed in the public domain by its author.
  */
 
+/* Needed for FILE* */
+#include <stdio.h>
+/* Needed for size_t */
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 void add(int vnode, const char *file);
+/*
+ * The table can be used from several threads.  A name returned is a copy,
+ * valid until the calling thread's fourth call after this one.
+ */
 const char *get(int vnode);
+/* The nth other name of a file with hard links, or NULL past the last */
+const char *getlink(int vnode, int n);
+/* Marks are kept with a name and passed down to directory entries */
+#define NAME_EXCLUDED 1
+#define NAME_INCLUDED 2
+void mark(int vnode, int marks);
+int marks(int vnode);
+/* Forget the name of a vnode that has been written out */
+void release(int vnode);
+/* Write out or read back every name, for checkpoints */
+int savenames(FILE *out);
+int loadnames(FILE *in);
+/* Forget every name, keeping the memory for the next volume */
+void clearnames(void);
+/* Make room for count names up front */
+void reservenames(size_t count);
+/* Spill names to disk when they use more than bytes (0 for no limit) */
+void setnamebudget(size_t bytes);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,345 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Reports what changed in a volume between two archives, from the manifests
+ * tarvol -M wrote for them.  Members are matched on vnode and uniquifier, so
+ * a file that was renamed is still the same file, and a vnode that was reused
+ * for a new file is not.  Each manifest is mapped, its members are gathered
+ * into an array sorted by vnode and uniquifier, and the two arrays are walked
+ * together in a single pass.
+ *
+ * A member is modified when its data version, size or mtime differ, and
+ * renamed when its path differs.  The members of a renamed directory are not
+ * reported as renamed themselves unless they also moved or changed names.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "manifest.h"
+
+struct Member
+{
+    uint32_t vnode;
+    uint32_t uniquifier;
+    uint32_t dataversion;
+    uint32_t mtime;
+    uint64_t size;
+    const char *path;           /* escaped, as in the manifest */
+    uint32_t pathlen;
+    char type;
+};
+
+struct Rename
+{
+    const struct Member *from, *to;
+};
+
+static int verbose = 0;
+
+static int
+CompareMember(const void *a, const void *b)
+{
+    const struct Member *x = a, *y = b;
+
+    if (x->vnode != y->vnode)
+        return x->vnode < y->vnode ? -1 : 1;
+    return x->uniquifier < y->uniquifier ? -1 : x->uniquifier > y->uniquifier;
+}
+
+static int
+ComparePaths(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+
+    if (c)
+        return c;
+    return alen < blen ? -1 : alen > blen;
+}
+
+static int
+CompareRename(const void *a, const void *b)
+{
+    const struct Rename *x = a, *y = b;
+
+    return ComparePaths(x->from->path, x->from->pathlen, y->from->path,
+            y->from->pathlen);
+}
+
+/* Gather the members of a manifest, sorted by vnode and uniquifier */
+static struct Member *
+Load(const char *file, struct Manifest *m, size_t *count)
+{
+    struct Member *members = NULL;
+    size_t n = 0, allocated = 0;
+    struct ManifestRecord r;
+    const char *p;
+    int sorted = 1;
+
+    if (manifestopen(file, m))
+        exit(2);
+
+    for (p = NULL; (p = manifestnext(m, p, &r)); )
+    {
+        /* ACL scripts go with their directory, and links with their file */
+        if (r.kind != 'M' || r.type == 'a' || r.type == 'h')
+            continue;
+
+        if (n == allocated)
+        {
+            allocated = allocated ? allocated * 2 : 65536;
+            members = realloc(members, allocated * sizeof(*members));
+            if (!members)
+            {
+                fprintf(stderr, "Out of memory reading '%s'\n", file);
+                exit(2);
+            }
+        }
+        members[n].vnode = r.vnode;
+        members[n].uniquifier = r.uniquifier;
+        members[n].dataversion = r.dataversion;
+        members[n].mtime = r.mtime;
+        members[n].size = r.size;
+        members[n].path = r.path;
+        members[n].pathlen = r.pathlen;
+        members[n].type = r.type;
+        if (n > 0 && sorted && CompareMember(&members[n - 1], &members[n]) > 0)
+            sorted = 0;
+        n++;
+    }
+
+    /* Dumps are mostly in vnode order already, so this is often skipped */
+    if (!sorted)
+        qsort(members, n, sizeof(*members), CompareMember);
+    if (verbose)
+        fprintf(stderr, "%s: %lu members%s\n", file, (unsigned long)n,
+                sorted ? "" : ", sorted");
+    *count = n;
+    return members;
+}
+
+static int
+SamePath(const struct Member *a, const struct Member *b)
+{
+    return a->pathlen == b->pathlen &&
+        memcmp(a->path, b->path, a->pathlen) == 0;
+}
+
+/* Length of the directory part of a path, without the last slash */
+static size_t
+DirLength(const struct Member *m)
+{
+    size_t len = m->pathlen;
+
+    while (len > 0 && m->path[len - 1] != '/')
+        len--;
+    return len ? len - 1 : 0;
+}
+
+/*
+ * Whether a member only has a new path because a directory above it was
+ * renamed: its name is the same, and its old directory became its new one.
+ */
+static int
+MovedWithParent(const struct Member *from, const struct Member *to,
+        const struct Rename *renames, size_t nrenames)
+{
+    size_t fromdir = DirLength(from), todir = DirLength(to);
+    size_t lo = 0, hi = nrenames;
+
+    if (from->pathlen - fromdir != to->pathlen - todir ||
+            memcmp(from->path + fromdir, to->path + todir,
+                from->pathlen - fromdir) != 0)
+        return 0;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct Member *d = renames[mid].from;
+        int c = ComparePaths(d->path, d->pathlen, from->path, fromdir);
+
+        if (c == 0)
+        {
+            d = renames[mid].to;
+            return d->pathlen == todir &&
+                memcmp(d->path, to->path, todir) == 0;
+        }
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+static void
+Print(char code, const struct Member *m, const struct Member *to)
+{
+    printf("%c\t%.*s", code, (int)m->pathlen, m->path);
+    if (to)
+        printf("\t%.*s", (int)to->pathlen, to->path);
+    putchar('\n');
+}
+
+/* Print a usage message and exit */
+static void usage(const char *arg, int status, const char *msg)
+{
+    if (msg) fprintf(stderr, "%s: %s\n", arg, msg);
+    fprintf(stderr, "Usage: %s [options] old-manifest new-manifest\n", arg);
+    fprintf(stderr, "  -a     Report every renamed path, even below a renamed directory\n");
+    fprintf(stderr, "  -h     Print this help message\n");
+    fprintf(stderr, "  -s     Only print a summary of the changes\n");
+    fprintf(stderr, "  -v     Verbose mode\n");
+    fprintf(stderr, "Changes are printed as A (added), D (removed), M (modified) or\n");
+    fprintf(stderr, "R (renamed, old and new path), then the path.\n");
+    exit(status);
+}
+
+int main(int argc, char **argv)
+{
+    struct Manifest oldm, newm;
+    struct Member *a, *b;
+    struct Rename *renames = NULL;
+    size_t na, nb, i, j, nrenames = 0;
+    int arg, all = 0, summary = 0;
+    uintmax_t added = 0, removed = 0, modified = 0, renamed = 0;
+    uintmax_t addedbytes = 0, modifiedbytes = 0;
+    int pass;
+
+    while ((arg = getopt(argc, argv, "ahsv")) != -1)
+    {
+        switch (arg)
+        {
+            case 'a':
+                all = 1;
+                break;
+            case 'h':
+                usage(argv[0], 0, NULL);
+                break;
+            case 's':
+                summary = 1;
+                break;
+            case 'v':
+                verbose++;
+                break;
+            case '?':
+                usage(argv[0], 2, NULL);
+                break;
+        }
+    }
+
+    if (argc - optind != 2)
+    {
+        usage(argv[0], 2, "two manifests are required");
+    }
+
+    a = Load(argv[optind], &oldm, &na);
+    b = Load(argv[optind + 1], &newm, &nb);
+
+    /*
+     * The first pass finds the renamed directories, so that the second can
+     * tell which members only moved along with them.
+     */
+    for (pass = all ? 1 : 0; pass < 2; pass++)
+    {
+        i = j = 0;
+        while (i < na || j < nb)
+        {
+            int c = i == na ? 1 : j == nb ? -1 : CompareMember(&a[i], &b[j]);
+
+            if (c < 0)
+            {
+                if (pass)
+                {
+                    removed++;
+                    if (!summary)
+                        Print('D', &a[i], NULL);
+                }
+                i++;
+                continue;
+            }
+            if (c > 0)
+            {
+                if (pass)
+                {
+                    added++;
+                    addedbytes += b[j].size;
+                    if (!summary)
+                        Print('A', &b[j], NULL);
+                }
+                j++;
+                continue;
+            }
+
+            if (!pass)
+            {
+                if (a[i].type == 'd' && !SamePath(&a[i], &b[j]))
+                {
+                    if (nrenames % 1024 == 0)
+                    {
+                        renames = realloc(renames,
+                                (nrenames + 1024) * sizeof(*renames));
+                        if (!renames)
+                        {
+                            fprintf(stderr, "Out of memory\n");
+                            return 2;
+                        }
+                    }
+                    renames[nrenames].from = &a[i];
+                    renames[nrenames].to = &b[j];
+                    nrenames++;
+                }
+            }
+            else
+            {
+                if (a[i].dataversion != b[j].dataversion ||
+                        a[i].size != b[j].size || a[i].mtime != b[j].mtime)
+                {
+                    modified++;
+                    modifiedbytes += b[j].size;
+                    if (!summary)
+                        Print('M', &b[j], NULL);
+                }
+                if (!SamePath(&a[i], &b[j]) && (all ||
+                            !MovedWithParent(&a[i], &b[j], renames,
+                                nrenames)))
+                {
+                    renamed++;
+                    if (!summary)
+                        Print('R', &a[i], &b[j]);
+                }
+            }
+            i++;
+            j++;
+        }
+
+        if (!pass)
+            qsort(renames, nrenames, sizeof(*renames), CompareRename);
+    }
+
+    if (summary || verbose)
+    {
+        fprintf(summary ? stdout : stderr,
+                "added %ju (%ju bytes)\nremoved %ju\n"
+                "modified %ju (%ju bytes)\nrenamed %ju\n", added, addedbytes,
+                removed, modified, modifiedbytes, renamed);
+    }
+
+    manifestclose(&oldm);
+    manifestclose(&newm);
+    if (fflush(stdout))
+    {
+        perror("Could not write changes");
+        return 2;
+    }
+    /* Like diff, the status says whether anything changed */
+    return (added || removed || modified || renamed) ? 1 : 0;
+}
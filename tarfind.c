@@ -0,0 +1,142 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Finds the archives that hold a path, using the catalog that tarvol -C
+ * keeps.  Archives made before there was a catalog can be added from their
+ * manifests, and the catalog can be compacted into a single segment, which
+ * keeps lookups fast once it holds many runs.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "catalog.h"
+
+struct Query
+{
+    const char *volume;
+    int longformat;
+    unsigned long found;
+};
+
+static int
+Print(const struct CatalogEntry *e, void *arg)
+{
+    struct Query *q = arg;
+
+    if (q->volume && strcmp(q->volume, e->volume) != 0)
+        return 0;
+    q->found++;
+
+    if (q->longformat)
+    {
+        char date[32];
+        time_t mtime = e->mtime;
+
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&mtime));
+        printf("%s\t%s\t%c\t%u\t%u\t%llu\t%s\t%llu\t%.*s\n", e->archive,
+                e->volume, e->type, e->vnode, e->dataversion,
+                (unsigned long long)e->size, date,
+                (unsigned long long)e->offset, (int)e->pathlen, e->path);
+    }
+    else
+    {
+        printf("%s\t%.*s\n", e->archive, (int)e->pathlen, e->path);
+    }
+    return 0;
+}
+
+/* Print a usage message and exit */
+static void usage(const char *arg, int status, const char *msg)
+{
+    if (msg) fprintf(stderr, "%s: %s\n", arg, msg);
+    fprintf(stderr, "Usage: %s [options] -C catalog [pattern]...\n", arg);
+    fprintf(stderr, "  -a     Add the archive ID described by MANIFEST (with -A)\n");
+    fprintf(stderr, "  -A     Archive ID for -a\n");
+    fprintf(stderr, "  -c     Compact the catalog into a single segment\n");
+    fprintf(stderr, "  -C     Use the catalog in DIR\n");
+    fprintf(stderr, "  -h     Print this help message\n");
+    fprintf(stderr, "  -l     Long listing: archive, volume, type, vnode, data version,\n");
+    fprintf(stderr, "         size, mtime, offset and path\n");
+    fprintf(stderr, "  -V     Only list files from VOLUME\n");
+    fprintf(stderr, "A pattern without wildcards matches that path and all below it.\n");
+    exit(status);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = NULL, *add = NULL, *id = NULL;
+    struct Query q;
+    int arg, compact = 0, status = 0;
+
+    memset(&q, 0, sizeof(q));
+    while ((arg = getopt(argc, argv, "a:A:cC:hlV:")) != -1)
+    {
+        switch (arg)
+        {
+            case 'a':
+                add = optarg;
+                break;
+            case 'A':
+                id = optarg;
+                break;
+            case 'c':
+                compact = 1;
+                break;
+            case 'C':
+                dir = optarg;
+                break;
+            case 'h':
+                usage(argv[0], 0, NULL);
+                break;
+            case 'l':
+                q.longformat = 1;
+                break;
+            case 'V':
+                q.volume = optarg;
+                break;
+            case '?':
+                usage(argv[0], 2, NULL);
+                break;
+        }
+    }
+
+    if (!dir)
+    {
+        usage(argv[0], 2, "a catalog is required");
+    }
+    if (add && !id)
+    {
+        usage(argv[0], 2, "-a needs an archive ID");
+    }
+    if (!add && !compact && optind >= argc)
+    {
+        usage(argv[0], 2, "nothing to do");
+    }
+
+    if (add && catalogadd(dir, add, id))
+        return 2;
+    if (compact && catalogcompact(dir))
+        return 2;
+
+    for (; optind < argc; optind++)
+    {
+        if (catalogsearch(dir, argv[optind], Print, &q))
+            status = 2;
+    }
+
+    if (fflush(stdout))
+    {
+        perror("Could not write results");
+        return 2;
+    }
+    /* Like grep, the status says whether anything was found */
+    return status ? status : (!add && !compact && !q.found);
+}
@@ -0,0 +1,235 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Lists a columnar archive written by tarvol -F columnar.  Only the footer is
+ * read, and of it only the columns needed, so listing a huge volume takes a
+ * few MB of reads.  With -O the data of the chosen files is copied out, each
+ * read with a single seek, and decompressed if it is a small file that was
+ * compressed.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "columnar.h"
+
+/*
+ * A pattern without wildcards matches a path and everything below it.  A
+ * pattern with wildcards is matched against the whole path.  Paths are
+ * matched without the leading "./".
+ */
+static int
+Match(char **patterns, int npatterns, const char *path)
+{
+    int i;
+
+    if (!npatterns)
+        return 1;
+    if (path[0] == '.' && path[1] == '/')
+        path += 2;
+    for (i = 0; i < npatterns; i++)
+    {
+        const char *p = patterns[i];
+        size_t len;
+
+        while (p[0] == '.' && p[1] == '/')
+            p += 2;
+        len = strlen(p);
+        if (strpbrk(p, "*?["))
+        {
+            if (fnmatch(p, path, 0) == 0)
+                return 1;
+        }
+        else if (strncmp(path, p, len) == 0 && (path[len] == '\0' ||
+                    path[len] == '/' || (len && p[len - 1] == '/')))
+            return 1;
+    }
+    return 0;
+}
+
+/* Copy a member's data to stdout */
+static int
+CopyData(struct Columnar *c, FILE *in, const struct ColumnarMember *m)
+{
+    char buf[65536];
+    uint64_t size = m->size;
+    size_t n;
+
+    if (m->codec)
+    {
+        /* Only small files are compressed, so they fit the buffer */
+        if (size > sizeof(buf) || columnarread(c, m, buf) ||
+                fwrite(buf, 1, size, stdout) != size)
+            return -1;
+        return 0;
+    }
+    if (fseeko(in, m->offset, SEEK_SET))
+        return -1;
+    while (size > 0)
+    {
+        n = fread(buf, 1, size > sizeof(buf) ? sizeof(buf) : size, in);
+        if (n == 0 || fwrite(buf, 1, n, stdout) != n)
+            return -1;
+        size -= n;
+    }
+    return 0;
+}
+
+/* Print a usage message and exit */
+static void usage(const char *arg, int status, const char *msg)
+{
+    if (msg) fprintf(stderr, "%s: %s\n", arg, msg);
+    fprintf(stderr, "Usage: %s [options] archive [pattern]...\n", arg);
+    fprintf(stderr, "  -D     Write the archive's dictionary for small files to stdout, for\n");
+    fprintf(stderr, "         tarvol -Y\n");
+    fprintf(stderr, "  -h     Print this help message\n");
+    fprintf(stderr, "  -l     Long listing: type, vnode, data version, mode, owner, group,\n");
+    fprintf(stderr, "         size, mtime, offset and path\n");
+    fprintf(stderr, "  -O     Write the data of the matching files (not symlinks) to stdout\n");
+    fprintf(stderr, "  -s     Only print a summary of the archive\n");
+    fprintf(stderr, "A pattern without wildcards matches a path and everything below it.\n");
+    exit(status);
+}
+
+int main(int argc, char **argv)
+{
+    struct Columnar c;
+    struct ColumnarMember m;
+    const char *path;
+    FILE *in;
+    int arg, longformat = 0, data = 0, summary = 0, dict = 0, columns, code;
+    unsigned long long found = 0;
+
+    while ((arg = getopt(argc, argv, "DhlOs")) != -1)
+    {
+        switch (arg)
+        {
+            case 'D':
+                dict = 1;
+                break;
+            case 'h':
+                usage(argv[0], 0, NULL);
+                break;
+            case 'l':
+                longformat = 1;
+                break;
+            case 'O':
+                data = 1;
+                break;
+            case 's':
+                summary = 1;
+                break;
+            case '?':
+                usage(argv[0], 2, NULL);
+                break;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        usage(argv[0], 2, "an archive is required");
+    }
+
+    in = fopen(argv[optind], "r");
+    if (!in)
+    {
+        fprintf(stderr, "Cannot open '%s'. Code = %d\n", argv[optind], errno);
+        return 2;
+    }
+
+    columns = 1 << COL_PATH;
+    if (longformat)
+        columns = COL_ALL;
+    else if (data)
+        columns |= 1 << COL_TYPE | 1 << COL_SIZE | 1 << COL_OFFSET |
+            1 << COL_CODEC | 1 << COL_STORED;
+    if (columnaropen(in, &c, columns))
+        return 2;
+
+    if (summary)
+    {
+        printf("volume       %s\n", c.volumename);
+        printf("volume id    %u\n", c.volumeid);
+        printf("members      %llu\n", (unsigned long long)c.members);
+        printf("blocks       %u\n", c.nblocks);
+        printf("data bytes   %llu\n", (unsigned long long)c.footer - 8);
+        printf("footer bytes %llu\n", (unsigned long long)c.footersize);
+        printf("dictionary   %u\n", c.dictlen);
+        columnarclose(&c);
+        return 0;
+    }
+
+    if (dict)
+    {
+        if (!c.dictlen)
+        {
+            fprintf(stderr, "'%s' has no dictionary\n", argv[optind]);
+            return 2;
+        }
+        code = fwrite(c.dict, 1, c.dictlen, stdout) != c.dictlen ||
+            fflush(stdout);
+        columnarclose(&c);
+        if (code)
+        {
+            perror("Could not write the dictionary");
+            return 2;
+        }
+        return 0;
+    }
+
+    optind++;
+    while ((code = columnarnext(&c, &m, &path)) > 0)
+    {
+        if (!Match(argv + optind, argc - optind, path))
+            continue;
+        found++;
+
+        if (data)
+        {
+            if (m.type && strchr("fah", m.type) && CopyData(&c, in, &m))
+            {
+                fprintf(stderr, "Could not copy the data of '%s'\n", path);
+                code = -1;
+                break;
+            }
+        }
+        else if (longformat)
+        {
+            char date[32];
+            time_t mtime = m.mtime;
+
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S",
+                    localtime(&mtime));
+            printf("%c\t%u\t%u\t%04o\t%u\t%u\t%llu\t%s\t%llu\t%s\n", m.type,
+                    m.vnode, m.dataversion, m.mode, m.owner, m.group,
+                    (unsigned long long)m.size, date,
+                    (unsigned long long)m.offset, path);
+        }
+        else
+        {
+            printf("%s\n", path);
+        }
+    }
+    columnarclose(&c);
+    fclose(in);
+
+    if (fflush(stdout))
+    {
+        perror("Could not write results");
+        return 2;
+    }
+    if (code < 0)
+        return 2;
+    /* Like grep, the status says whether anything was found */
+    return !found;
+}
@@ -0,0 +1,848 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Restores a tarvol archive in parallel, using the manifest tarvol -M wrote
+ * for it.  The directory tree is made first.  Then a pool of threads takes the
+ * files in archive order and copies each one straight from its offset in the
+ * archive into place, so that many small files are written at once rather
+ * than one after another as tar would.  Modes and times of directories are
+ * set last, deepest first, since creating their contents changes them, and
+ * the ACL restore scripts written by tarvol -a can be run at the end.  The
+ * other names of a file with several are made as hard links once the files
+ * are in place, or if the file itself is not being restored, the first of
+ * them gets its data instead.
+ *
+ * An archive compressed by tarvol -z can be restored the same way given the
+ * frame index from tarvol -X.  Each thread then decompresses just the frames
+ * holding the files it restores, keeping the last one, which the next file
+ * in archive order is usually in too.
+ *
+ * Paths are looked up one directory at a time from the target without
+ * following symlinks, so that a symlink restored earlier cannot send a later
+ * member outside the target.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "manifest.h"
+
+#define BLOCKSIZE 512
+#define BUFSIZE (256 * 1024)
+/* Smaller files are read and written, which takes fewer calls */
+#define MINCOPYRANGE (64 * 1024)
+/* Files taken from the list at a time by each thread */
+#define BATCH 16
+
+struct Item
+{
+    struct ManifestRecord rec;
+};
+
+/* Another name of a file, linked to it once it is restored */
+struct Link
+{
+    struct ManifestRecord rec, file;
+};
+
+/* A gzip member of the archive, as listed in the frame index */
+struct Frame
+{
+    uint64_t offset, zoffset;
+    uint32_t length, zlength;
+};
+
+static int verbose = 0;
+static int g_archive;
+static const char *g_archivename;
+static int g_owners = 0;
+
+static struct Item *g_files;
+static size_t g_nfiles, g_next = 0;
+static unsigned long g_errors = 0;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct Frame *g_frames;
+static size_t g_nframes;
+static uint32_t g_maxlength, g_maxzlength;
+/* The frame each thread decompressed last */
+static __thread struct
+{
+    const struct Frame *frame;
+    unsigned char *data, *z;
+} g_cache;
+/* The directory each thread opened last, which the next file is usually in */
+static __thread struct
+{
+    char path[MAXPATHLEN];
+    int fd;
+} g_parent = { "", -1 };
+
+static void
+Error(const char *what, const char *path, int code)
+{
+    pthread_mutex_lock(&g_lock);
+    fprintf(stderr, "%s '%s'. Code = %d\n", what, path, code);
+    g_errors++;
+    pthread_mutex_unlock(&g_lock);
+}
+
+static unsigned long
+Octal(const unsigned char *field, size_t len)
+{
+    unsigned long v = 0;
+    size_t i;
+
+    for (i = 0; i < len && field[i] == ' '; i++)
+        ;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        v = v * 8 + (field[i] - '0');
+    return v;
+}
+
+/* Paths come from the archive, so do not let them out of the target */
+static int
+SafePath(const char *path)
+{
+    const char *p = path;
+
+    if (path[0] == '/')
+        return 0;
+    while (*p)
+    {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == 0))
+            return 0;
+        p = strchr(p, '/');
+        if (!p)
+            break;
+        p++;
+    }
+    return 1;
+}
+
+/*
+ * Open the directory a path is in, one component at a time from the target
+ * and never through a symlink, and point name at the last component.  Missing
+ * directories are made if create is set.  The descriptor is kept for the next
+ * call from this thread, so it must not be closed.
+ */
+static int
+OpenParent(const char *path, const char **name, int create)
+{
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : 0;
+    char dir[MAXPATHLEN], *p, *next;
+    int fd, sub, code;
+
+    *name = slash ? slash + 1 : path;
+    if (g_parent.fd >= 0 && strlen(g_parent.path) == len &&
+            strncmp(g_parent.path, path, len) == 0)
+        return g_parent.fd;
+
+    memcpy(dir, path, len);
+    dir[len] = 0;
+    fd = open(".", O_RDONLY | O_DIRECTORY);
+    for (p = dir; fd >= 0 && *p; p = next)
+    {
+        next = strchr(p, '/');
+        if (next)
+            *next++ = 0;
+        else
+            next = p + strlen(p);
+        if (!*p || strcmp(p, ".") == 0)
+            continue;
+        sub = openat(fd, p, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (sub < 0 && errno == ENOENT && create &&
+                (mkdirat(fd, p, 0755) == 0 || errno == EEXIST))
+            sub = openat(fd, p, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        code = errno;
+        close(fd);
+        errno = code;
+        fd = sub;
+    }
+    if (fd < 0)
+        return -1;
+
+    if (g_parent.fd >= 0)
+        close(g_parent.fd);
+    g_parent.fd = fd;
+    memcpy(g_parent.path, path, len);
+    g_parent.path[len] = 0;
+    return fd;
+}
+
+/* Make a directory and any missing parents */
+static int
+MakeDirs(const char *path, mode_t mode)
+{
+    const char *name;
+    int dir = OpenParent(path, &name, 1);
+
+    if (dir < 0)
+        return -1;
+    return mkdirat(dir, name, mode) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+/* Read the frame index written by tarvol -X, returning 0 on success */
+static int
+ReadFrames(const char *file)
+{
+    FILE *in = fopen(file, "r");
+    unsigned long long offset, zoffset;
+    unsigned long length, zlength;
+    size_t allocated = 0;
+
+    if (!in)
+    {
+        fprintf(stderr, "Cannot open '%s'. Code = %d\n", file, errno);
+        return -1;
+    }
+    if (fscanf(in, "tarvol frames 1") != 0 || fgetc(in) != '\n')
+    {
+        fprintf(stderr, "'%s' is not a frame index\n", file);
+        fclose(in);
+        return -1;
+    }
+    while (fscanf(in, "%llu %llu %lu %lu", &offset, &zoffset, &length,
+                &zlength) == 4)
+    {
+        struct Frame *f;
+
+        if (g_nframes == allocated)
+        {
+            allocated = allocated ? allocated * 2 : 1024;
+            g_frames = realloc(g_frames, allocated * sizeof(*g_frames));
+            if (!g_frames)
+            {
+                fprintf(stderr, "Out of memory\n");
+                fclose(in);
+                return -1;
+            }
+        }
+        f = &g_frames[g_nframes];
+        /* Frames follow one another in both the archive and the output */
+        if (g_nframes && (offset != f[-1].offset + f[-1].length ||
+                    zoffset != f[-1].zoffset + f[-1].zlength))
+            break;
+        f->offset = offset;
+        f->zoffset = zoffset;
+        f->length = length;
+        f->zlength = zlength;
+        if (length > g_maxlength)
+            g_maxlength = length;
+        if (zlength > g_maxzlength)
+            g_maxzlength = zlength;
+        g_nframes++;
+    }
+    if (!feof(in))
+    {
+        fprintf(stderr, "Frame index '%s' is damaged\n", file);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+    return 0;
+}
+
+/* Decompress the frame holding an offset into this thread's cache */
+static const struct Frame *
+LoadFrame(uint64_t offset)
+{
+    size_t lo = 0, hi = g_nframes;
+    const struct Frame *f;
+    z_stream z;
+    int code;
+
+    while (hi - lo > 1)
+    {
+        size_t mid = (lo + hi) / 2;
+
+        if (g_frames[mid].offset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    f = &g_frames[lo];
+    if (!g_nframes || offset < f->offset || offset >= f->offset + f->length)
+        return NULL;
+    if (g_cache.frame == f)
+        return f;
+
+    if (!g_cache.data)
+    {
+        g_cache.data = malloc(g_maxlength);
+        g_cache.z = malloc(g_maxzlength);
+        if (!g_cache.data || !g_cache.z)
+            return NULL;
+    }
+    g_cache.frame = NULL;
+    if (pread(g_archive, g_cache.z, f->zlength, f->zoffset) != f->zlength)
+        return NULL;
+
+    memset(&z, 0, sizeof(z));
+    /* 16 more window bits reads the gzip format */
+    if (inflateInit2(&z, 15 + 16) != Z_OK)
+        return NULL;
+    z.next_in = g_cache.z;
+    z.avail_in = f->zlength;
+    z.next_out = g_cache.data;
+    z.avail_out = f->length;
+    code = inflate(&z, Z_FINISH);
+    inflateEnd(&z);
+    if (code != Z_STREAM_END || z.avail_out)
+    {
+        errno = EIO;
+        return NULL;
+    }
+    g_cache.frame = f;
+    return f;
+}
+
+/* Read from the archive, decompressing frames if it is compressed */
+static ssize_t
+ReadArchive(void *buf, size_t size, uint64_t offset)
+{
+    size_t done = 0;
+
+    if (!g_frames)
+        return pread(g_archive, buf, size, offset);
+
+    while (done < size)
+    {
+        const struct Frame *f = LoadFrame(offset);
+        size_t n;
+
+        if (!f)
+            return done ? done : -1;
+        n = f->offset + f->length - offset;
+        if (n > size - done)
+            n = size - done;
+        memcpy((char *)buf + done, g_cache.data + (offset - f->offset), n);
+        done += n;
+        offset += n;
+    }
+    return done;
+}
+
+static int
+CopyData(int out, uint64_t offset, uint64_t size, char *buf)
+{
+    while (!g_frames && size >= MINCOPYRANGE)
+    {
+        off_t in = offset;
+        ssize_t n = copy_file_range(g_archive, &in, out, NULL, size, 0);
+
+        if (n <= 0)
+            break;
+        offset += n;
+        size -= n;
+    }
+
+    /* Where copy_file_range cannot be used, read and write */
+    while (size > 0)
+    {
+        ssize_t n = ReadArchive(buf, size > BUFSIZE ? BUFSIZE : size,
+                offset);
+        ssize_t done = 0;
+
+        if (n <= 0)
+            return -1;
+        while (done < n)
+        {
+            ssize_t w = write(out, buf + done, n - done);
+            if (w < 0)
+                return -1;
+            done += w;
+        }
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static void
+RestoreFile(const struct ManifestRecord *r, char *buf)
+{
+    unsigned char header[BLOCKSIZE];
+    char path[MAXPATHLEN];
+    const char *name;
+    struct timespec times[2];
+    uid_t uid;
+    gid_t gid;
+    int dir, fd;
+
+    if (manifestpath(r, path, sizeof(path)) < 0 || !SafePath(path))
+    {
+        Error("Refusing to restore", path, 0);
+        return;
+    }
+    dir = OpenParent(path, &name, 0);
+    if (dir < 0)
+    {
+        Error("Cannot create", path, errno);
+        return;
+    }
+    /* The header is only needed for a link target or the owner */
+    if ((r->type == 'l' || g_owners) &&
+            ReadArchive(header, BLOCKSIZE, r->offset) != BLOCKSIZE)
+    {
+        Error("Cannot read header for", path, errno);
+        return;
+    }
+    uid = Octal(header + 108, 8);
+    gid = Octal(header + 116, 8);
+    times[0].tv_sec = times[1].tv_sec = r->mtime;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+
+    if (verbose)
+        fprintf(stderr, "%s\n", path);
+
+    if (r->type == 'l')
+    {
+        char target[101];
+
+        memcpy(target, header + 157, 100);
+        target[100] = 0;
+        unlinkat(dir, name, 0);
+        if (symlinkat(target, dir, name))
+        {
+            Error("Cannot create symlink", path, errno);
+            return;
+        }
+        if (g_owners)
+            fchownat(dir, name, uid, gid, AT_SYMLINK_NOFOLLOW);
+        utimensat(dir, name, times, AT_SYMLINK_NOFOLLOW);
+        return;
+    }
+
+    fd = openat(dir, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+    /* Replace a symlink rather than write through it */
+    if (fd < 0 && errno == ELOOP && unlinkat(dir, name, 0) == 0)
+        fd = openat(dir, name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+        Error("Cannot create", path, errno);
+        return;
+    }
+    if (CopyData(fd, r->offset + BLOCKSIZE, r->size, buf))
+        Error("Cannot copy data for", path, errno);
+    if (g_owners && fchown(fd, uid, gid))
+        Error("Cannot change owner of", path, errno);
+    if (fchmod(fd, r->mode & 07777) || futimens(fd, times))
+        Error("Cannot set mode and time of", path, errno);
+    if (close(fd))
+        Error("Cannot write", path, errno);
+}
+
+static void
+MakeLink(const struct Link *l)
+{
+    char path[MAXPATHLEN], target[MAXPATHLEN];
+    const char *name, *targetname;
+    int dir, targetdir;
+
+    if (manifestpath(&l->rec, path, sizeof(path)) < 0 || !SafePath(path) ||
+            manifestpath(&l->file, target, sizeof(target)) < 0 ||
+            !SafePath(target))
+    {
+        Error("Refusing to restore", path, 0);
+        return;
+    }
+    if (verbose)
+        fprintf(stderr, "%s link to %s\n", path, target);
+    /* The next lookup may replace the cached directory, so keep a copy */
+    targetdir = OpenParent(target, &targetname, 0);
+    if (targetdir < 0 || (targetdir = dup(targetdir)) < 0)
+    {
+        Error("Cannot find", target, errno);
+        return;
+    }
+    dir = OpenParent(path, &name, 0);
+    if (dir >= 0)
+        unlinkat(dir, name, 0);
+    if (dir < 0 || linkat(targetdir, targetname, dir, name, 0))
+        Error("Cannot link", path, errno);
+    close(targetdir);
+}
+
+static void *
+Worker(void *arg)
+{
+    char *buf = malloc(BUFSIZE);
+
+    for (;;)
+    {
+        size_t i, end;
+
+        pthread_mutex_lock(&g_lock);
+        i = g_next;
+        g_next += BATCH;
+        pthread_mutex_unlock(&g_lock);
+        if (i >= g_nfiles)
+            break;
+        end = i + BATCH < g_nfiles ? i + BATCH : g_nfiles;
+        for (; i < end; i++)
+            RestoreFile(&g_files[i].rec, buf);
+    }
+    free(buf);
+    free(g_cache.data);
+    free(g_cache.z);
+    g_cache.data = g_cache.z = NULL;
+    g_cache.frame = NULL;
+    if (g_parent.fd >= 0)
+        close(g_parent.fd);
+    g_parent.fd = -1;
+    return NULL;
+}
+
+static int
+CompareOffset(const void *a, const void *b)
+{
+    const struct Item *x = a, *y = b;
+
+    return x->rec.offset < y->rec.offset ? -1 : x->rec.offset > y->rec.offset;
+}
+
+/* Whether a path is one of those asked for, or below one */
+static int
+Wanted(const char *path, char **prefixes, int n)
+{
+    int i;
+
+    if (n == 0)
+        return 1;
+    for (i = 0; i < n; i++)
+    {
+        size_t len = strlen(prefixes[i]);
+        if (strncmp(path, prefixes[i], len) == 0 &&
+                (path[len] == 0 || path[len] == '/'))
+            return 1;
+    }
+    return 0;
+}
+
+/* Whether a path is a directory above one of those asked for */
+static int
+Above(const char *path, char **prefixes, int n)
+{
+    size_t len = strlen(path);
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (strncmp(prefixes[i], path, len) == 0 && prefixes[i][len] == '/')
+            return 1;
+    }
+    return 0;
+}
+
+/* Print a usage message and exit */
+static void usage(const char *arg, int status, const char *msg)
+{
+    if (msg) fprintf(stderr, "%s: %s\n", arg, msg);
+    fprintf(stderr, "Usage: %s [options] archive manifest [path]...\n", arg);
+    fprintf(stderr, "  -a     Run the ACL restore scripts once everything is in place\n");
+    fprintf(stderr, "  -C     Restore into DIR instead of the current directory\n");
+    fprintf(stderr, "  -h     Print this help message\n");
+    fprintf(stderr, "  -j     Restore files with N threads (default 8)\n");
+    fprintf(stderr, "  -v     Verbose mode\n");
+    fprintf(stderr, "  -X     Read an archive compressed by tarvol -z using the frame\n");
+    fprintf(stderr, "         index in FILE (from tarvol -X)\n");
+    fprintf(stderr, "Only the given paths and what is below them are restored, if any,\n");
+    fprintf(stderr, "along with the directories above them.\n");
+    exit(status);
+}
+
+int main(int argc, char **argv)
+{
+    const char *target = NULL;
+    struct Manifest m;
+    struct ManifestRecord r;
+    struct ManifestRecord file;
+    struct Item *dirs = NULL, *scripts = NULL;
+    struct Link *links = NULL;
+    size_t ndirs = 0, nscripts = 0, adirs = 0, ascripts = 0, afiles = 0;
+    size_t nlinks = 0, alinks = 0, i;
+    pthread_t *threads;
+    int arg, jobs = 8, runacls = 0, j, nprefixes, wanted, filewanted = 0;
+    char **prefixes, path[MAXPATHLEN];
+    const char *p;
+
+    while ((arg = getopt(argc, argv, "aC:hj:vX:")) != -1)
+    {
+        switch (arg)
+        {
+            case 'a':
+                runacls = 1;
+                break;
+            case 'C':
+                target = optarg;
+                break;
+            case 'h':
+                usage(argv[0], 0, NULL);
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 1)
+                {
+                    usage(argv[0], 1, "need at least one thread");
+                }
+                break;
+            case 'v':
+                verbose++;
+                break;
+            case 'X':
+                if (ReadFrames(optarg))
+                    return 1;
+                break;
+            case '?':
+                usage(argv[0], 1, NULL);
+                break;
+        }
+    }
+
+    if (argc - optind < 2)
+    {
+        usage(argv[0], 1, "an archive and its manifest are required");
+    }
+    g_archivename = argv[optind];
+    g_archive = open(g_archivename, O_RDONLY);
+    if (g_archive < 0)
+    {
+        fprintf(stderr, "Cannot open '%s'. Code = %d\n", g_archivename, errno);
+        return 1;
+    }
+    if (manifestopen(argv[optind + 1], &m))
+        return 1;
+
+    /* Paths to restore are matched the way they appear in the archive */
+    nprefixes = argc - optind - 2;
+    prefixes = calloc(nprefixes + 1, sizeof(char *));
+    for (j = 0; j < nprefixes; j++)
+    {
+        const char *a = argv[optind + 2 + j];
+        size_t len;
+
+        prefixes[j] = malloc(strlen(a) + 3);
+        sprintf(prefixes[j], "%s%s", strncmp(a, "./", 2) == 0 ||
+                strcmp(a, ".") == 0 ? "" : "./", a);
+        len = strlen(prefixes[j]);
+        while (len > 1 && prefixes[j][len - 1] == '/')
+            prefixes[j][--len] = 0;
+    }
+
+    if (target && chdir(target))
+    {
+        fprintf(stderr, "Cannot change to '%s'. Code = %d\n", target, errno);
+        return 1;
+    }
+    /* Modes are set explicitly, as they are in the archive */
+    umask(0);
+    g_owners = geteuid() == 0;
+
+    memset(&file, 0, sizeof(file));
+    for (p = NULL; (p = manifestnext(&m, p, &r)); )
+    {
+        struct Item **list;
+        size_t *n, *allocated;
+
+        if (r.kind != 'M' || manifestpath(&r, path, sizeof(path)) < 0)
+            continue;
+        wanted = Wanted(path, prefixes, nprefixes);
+        /* A file's links come after it */
+        if (r.type == 'f')
+        {
+            file = r;
+            filewanted = wanted;
+        }
+        /* The directories above a path are made for it, modes and all */
+        if (!wanted && !(r.type == 'd' && Above(path, prefixes, nprefixes)))
+            continue;
+
+        if (r.type == 'h')
+        {
+            if (file.type != 'f' || file.vnode != r.vnode ||
+                    file.uniquifier != r.uniquifier)
+            {
+                Error("Cannot find the file linked to by", path, 0);
+                continue;
+            }
+            if (filewanted)
+            {
+                if (nlinks == alinks)
+                {
+                    alinks = alinks ? alinks * 2 : 256;
+                    links = realloc(links, alinks * sizeof(*links));
+                    if (!links)
+                    {
+                        fprintf(stderr, "Out of memory\n");
+                        return 1;
+                    }
+                }
+                links[nlinks].rec = r;
+                links[nlinks++].file = file;
+                continue;
+            }
+            /* Restore the data under this name, and link any others to it */
+            file.path = r.path;
+            file.pathlen = r.pathlen;
+            filewanted = 1;
+            r = file;
+        }
+
+        switch (r.type)
+        {
+            case 'd':
+                list = &dirs;
+                n = &ndirs;
+                allocated = &adirs;
+                break;
+            case 'a':
+                /* The scripts are restored like any file, and maybe run */
+                if (runacls)
+                {
+                    if (nscripts == ascripts)
+                    {
+                        ascripts = ascripts ? ascripts * 2 : 256;
+                        scripts = realloc(scripts, ascripts * sizeof(*scripts));
+                    }
+                    scripts[nscripts++].rec = r;
+                }
+                /* Fall through */
+            default:
+                list = &g_files;
+                n = &g_nfiles;
+                allocated = &afiles;
+                break;
+        }
+        if (*n == *allocated)
+        {
+            *allocated = *allocated ? *allocated * 2 : 1024;
+            *list = realloc(*list, *allocated * sizeof(struct Item));
+            if (!*list)
+            {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+        }
+        (*list)[(*n)++].rec = r;
+    }
+
+    /* Directories first, writable until their contents are in place */
+    for (i = 0; i < ndirs; i++)
+    {
+        if (manifestpath(&dirs[i].rec, path, sizeof(path)) < 0 ||
+                !SafePath(path))
+        {
+            Error("Refusing to restore", path, 0);
+            continue;
+        }
+        if (verbose)
+            fprintf(stderr, "%s/\n", path);
+        if (MakeDirs(path, 0700))
+            Error("Cannot create directory", path, errno);
+    }
+
+    /* Files in archive order, so that the archive is read sequentially */
+    qsort(g_files, g_nfiles, sizeof(*g_files), CompareOffset);
+    threads = calloc(jobs, sizeof(pthread_t));
+    for (j = 0; j < jobs; j++)
+    {
+        if (pthread_create(&threads[j], NULL, Worker, NULL))
+        {
+            fprintf(stderr, "Cannot start thread %d\n", j);
+            break;
+        }
+    }
+    if (j == 0)
+        Worker(NULL);
+    while (j-- > 0)
+        pthread_join(threads[j], NULL);
+
+    for (i = 0; i < nlinks; i++)
+        MakeLink(&links[i]);
+
+    /* Deepest directories first, so that setting one does not undo another */
+    for (i = ndirs; i-- > 0; )
+    {
+        struct timespec times[2];
+        const char *name;
+        int dir, fd;
+
+        if (manifestpath(&dirs[i].rec, path, sizeof(path)) < 0 ||
+                !SafePath(path) || (dir = OpenParent(path, &name, 0)) < 0 ||
+                (fd = openat(dir, name, O_RDONLY | O_DIRECTORY |
+                             O_NOFOLLOW)) < 0)
+            continue;
+        if (g_owners)
+        {
+            unsigned char header[BLOCKSIZE];
+
+            if (ReadArchive(header, BLOCKSIZE, dirs[i].rec.offset) ==
+                    BLOCKSIZE && fchown(fd, Octal(header + 108, 8),
+                        Octal(header + 116, 8)))
+                Error("Cannot change owner of", path, errno);
+        }
+        times[0].tv_sec = times[1].tv_sec = dirs[i].rec.mtime;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        if (fchmod(fd, dirs[i].rec.mode & 07777) || futimens(fd, times))
+            Error("Cannot set mode and time of", path, errno);
+        close(fd);
+    }
+
+    for (i = 0; i < nscripts; i++)
+    {
+        pid_t pid;
+        int status, dir;
+        const char *name;
+        struct stat st;
+
+        if (manifestpath(&scripts[i].rec, path, sizeof(path)) < 0 ||
+                !SafePath(path))
+            continue;
+        /* Only run a script restored here, not whatever a symlink names */
+        if ((dir = OpenParent(path, &name, 0)) < 0 ||
+                fstatat(dir, name, &st, AT_SYMLINK_NOFOLLOW) ||
+                !S_ISREG(st.st_mode))
+        {
+            Error("Refusing to run", path, 0);
+            continue;
+        }
+        if (verbose)
+            fprintf(stderr, "Running %s\n", path);
+        pid = fork();
+        if (pid == 0)
+        {
+            execl("/bin/sh", "sh", path, (char *)NULL);
+            _exit(127);
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+                WEXITSTATUS(status) != 0)
+            Error("ACL restore failed for", path, 0);
+    }
+
+    manifestclose(&m);
+    if (g_errors)
+    {
+        fprintf(stderr, "%lu errors\n", g_errors);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,593 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Builds a full archive of a volume from an earlier full archive and the
+ * incremental archives made since, each with the manifest tarvol -M wrote for
+ * it, so that a new full backup does not need a full dump from the
+ * fileserver.
+ *
+ * An incremental dump has every directory of the volume in it, so the newest
+ * archive names every file that is still there.  Each of those files is taken
+ * from the newest archive that has a copy of it, matched by vnode and
+ * uniquifier so that a reused vnode is not mistaken for the file it replaced.
+ * Directories come first, then the files in the order they appear in the
+ * source archives, so that each source is read from start to end.  Headers
+ * are copied and renamed where the file has moved, and file data is copied
+ * with copy_file_range so that it need not pass through this process.  As in
+ * tarvol, a file with several names is written once, followed by a hard link
+ * for each other name.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <tar.h>
+#include <unistd.h>
+
+#include "manifest.h"
+
+#define BLOCKSIZE 512
+#define NAMELEN 100
+#define PREFIXLEN 167
+#define SIZEOFFSET 124
+#define CHKSUMOFFSET 148
+#define TYPEOFFSET 156
+#define LINKOFFSET 157
+#define PREFIXOFFSET 345
+
+#define BUFSIZE (1024 * 1024)
+
+struct Source
+{
+    const char *archive;
+    int fd;
+    struct Manifest manifest;
+};
+
+/* A file, link or directory member of one of the sources */
+struct Member
+{
+    struct ManifestRecord rec;
+    int source;
+};
+
+/* A directory of the newest archive and the path it has there */
+struct Dir
+{
+    uint32_t vnode;
+    char *path;
+};
+
+/* A file to write, and where to find it */
+struct Item
+{
+    const struct Member *member;
+    uint32_t dirvnode;
+    const char *name;           /* escaped, from the directory entry */
+    size_t namelen;
+    size_t order;
+    int link;                   /* another name of the item before it */
+};
+
+static int verbose = 0;
+static struct Source *g_sources;
+
+static int g_out;
+static char g_buf[BUFSIZE];
+static size_t g_buflen = 0;
+static uint64_t g_offset = 0;
+
+static int
+Flush(void)
+{
+    size_t done = 0;
+
+    while (done < g_buflen)
+    {
+        ssize_t n = write(g_out, g_buf + done, g_buflen - done);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Could not write archive");
+            return -1;
+        }
+        done += n;
+    }
+    g_buflen = 0;
+    return 0;
+}
+
+static int
+Write(const void *data, size_t size)
+{
+    if (g_buflen + size > BUFSIZE && Flush())
+        return -1;
+    memcpy(g_buf + g_buflen, data, size);
+    g_buflen += size;
+    g_offset += size;
+    return 0;
+}
+
+/* Copy size bytes at offset in a source to the archive */
+static int
+Copy(int source, uint64_t offset, uint64_t size)
+{
+    int fd = g_sources[source].fd;
+    static int nocopyrange = 0;
+
+    if (Flush())
+        return -1;
+
+    while (size > 0 && !nocopyrange)
+    {
+        off_t in = offset;
+        ssize_t n = copy_file_range(fd, &in, g_out, NULL, size, 0);
+
+        if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                    errno == EOPNOTSUPP || errno == EBADF))
+        {
+            /* Not between these files, so fall back to reading and writing */
+            nocopyrange = 1;
+            break;
+        }
+        if (n <= 0)
+        {
+            fprintf(stderr, "Could not copy from '%s'. Code = %d\n",
+                    g_sources[source].archive, n < 0 ? errno : 0);
+            return -1;
+        }
+        offset += n;
+        size -= n;
+        g_offset += n;
+    }
+
+    while (size > 0)
+    {
+        size_t want = size > BUFSIZE ? BUFSIZE : size;
+        ssize_t n = pread(fd, g_buf, want, offset);
+
+        if (n <= 0)
+        {
+            fprintf(stderr, "Could not read from '%s'. Code = %d\n",
+                    g_sources[source].archive, n < 0 ? errno : 0);
+            return -1;
+        }
+        g_buflen = n;
+        if (Flush())
+            return -1;
+        offset += n;
+        size -= n;
+        g_offset += n;
+    }
+    return 0;
+}
+
+static int
+ReadHeader(int source, uint64_t offset, unsigned char *header)
+{
+    if (pread(g_sources[source].fd, header, BLOCKSIZE, offset) != BLOCKSIZE)
+    {
+        fprintf(stderr, "Could not read header at %llu in '%s'\n",
+                (unsigned long long)offset, g_sources[source].archive);
+        return -1;
+    }
+    return 0;
+}
+
+/* Give a header a new name the way tarvol does, directory in the prefix */
+static void
+Rename(unsigned char *header, const char *dir, const char *name)
+{
+    unsigned int i, chksum = 0;
+
+    memset(header, 0, NAMELEN);
+    memset(header + PREFIXOFFSET, 0, PREFIXLEN);
+    strncpy((char *)header, name, NAMELEN);
+    strncpy((char *)header + PREFIXOFFSET, dir, PREFIXLEN);
+
+    memset(header + CHKSUMOFFSET, ' ', 8);
+    for (i = 0; i < BLOCKSIZE; i++)
+        chksum += header[i];
+    snprintf((char *)header + CHKSUMOFFSET, 8, "%07o", chksum);
+}
+
+static uint64_t
+Padded(uint64_t size)
+{
+    return (size + BLOCKSIZE - 1) / BLOCKSIZE * BLOCKSIZE;
+}
+
+static int
+CompareMember(const void *a, const void *b)
+{
+    const struct Member *x = a, *y = b;
+
+    if (x->rec.vnode != y->rec.vnode)
+        return x->rec.vnode < y->rec.vnode ? -1 : 1;
+    if (x->rec.uniquifier != y->rec.uniquifier)
+        return x->rec.uniquifier < y->rec.uniquifier ? -1 : 1;
+    /* Newest first */
+    return y->source - x->source;
+}
+
+/* Find the member with the same vnode and uniquifier as key */
+static struct Member *
+FindMember(struct Member *members, size_t count, const struct Member *key)
+{
+    size_t lo = 0, hi = count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct ManifestRecord *r = &members[mid].rec;
+
+        if (r->vnode < key->rec.vnode || (r->vnode == key->rec.vnode &&
+                    r->uniquifier < key->rec.uniquifier))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < count && members[lo].rec.vnode == key->rec.vnode &&
+            members[lo].rec.uniquifier == key->rec.uniquifier)
+        return &members[lo];
+    return NULL;
+}
+
+static int
+CompareDir(const void *a, const void *b)
+{
+    const struct Dir *x = a, *y = b;
+
+    return x->vnode < y->vnode ? -1 : x->vnode > y->vnode;
+}
+
+static int
+CompareItem(const void *a, const void *b)
+{
+    const struct Item *x = a, *y = b;
+
+    if (x->member->rec.vnode != y->member->rec.vnode)
+        return x->member->rec.vnode < y->member->rec.vnode ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static int
+CompareLocation(const void *a, const void *b)
+{
+    const struct Item *x = a, *y = b;
+
+    if (x->member->source != y->member->source)
+        return x->member->source - y->member->source;
+    if (x->member->rec.offset != y->member->rec.offset)
+        return x->member->rec.offset < y->member->rec.offset ? -1 : 1;
+    /* A file's links follow it */
+    if (x->link != y->link)
+        return x->link - y->link;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static void *
+Grow(void *array, size_t count, size_t *allocated, size_t size)
+{
+    if (count < *allocated)
+        return array;
+    *allocated = *allocated ? *allocated * 2 : 1024;
+    array = realloc(array, *allocated * size);
+    if (!array)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return array;
+}
+
+/* Print a usage message and exit */
+static void usage(const char *arg, int status, const char *msg)
+{
+    if (msg) fprintf(stderr, "%s: %s\n", arg, msg);
+    fprintf(stderr, "Usage: %s [options] -f output full manifest "
+            "[incremental manifest]...\n", arg);
+    fprintf(stderr, "  -f     Write the new full archive to ARCHIVE (- for stdout)\n");
+    fprintf(stderr, "  -h     Print this help message\n");
+    fprintf(stderr, "  -M     Write a manifest of the new archive to FILE\n");
+    fprintf(stderr, "  -v     Verbose mode\n");
+    fprintf(stderr, "Archives are given oldest first, each followed by its manifest.\n");
+    exit(status);
+}
+
+int main(int argc, char **argv)
+{
+    const char *output = NULL, *outmanifest = NULL;
+    struct Member *members = NULL;
+    struct Dir *dirs = NULL;
+    struct Item *items = NULL;
+    size_t nmembers = 0, amembers = 0, ndirs = 0, adirs = 0;
+    size_t nitems = 0, aitems = 0, i, j, order, missing = 0;
+    int nsources, latest, arg, s;
+    struct ManifestRecord r;
+    const char *p;
+    FILE *man = NULL;
+    char path[MAXPATHLEN], name[MAXPATHLEN], target[MAXPATHLEN] = "";
+    unsigned char header[BLOCKSIZE];
+
+    while ((arg = getopt(argc, argv, "f:hM:v")) != -1)
+    {
+        switch (arg)
+        {
+            case 'f':
+                output = optarg;
+                break;
+            case 'h':
+                usage(argv[0], 0, NULL);
+                break;
+            case 'M':
+                outmanifest = optarg;
+                break;
+            case 'v':
+                verbose++;
+                break;
+            case '?':
+                usage(argv[0], 1, NULL);
+                break;
+        }
+    }
+
+    if (!output)
+    {
+        usage(argv[0], 1, "an output archive is required");
+    }
+    if (argc - optind < 2 || (argc - optind) % 2)
+    {
+        usage(argv[0], 1, "each archive needs a manifest");
+    }
+
+    nsources = (argc - optind) / 2;
+    latest = nsources - 1;
+    g_sources = calloc(nsources, sizeof(struct Source));
+    for (s = 0; s < nsources; s++)
+    {
+        g_sources[s].archive = argv[optind + 2 * s];
+        g_sources[s].fd = open(g_sources[s].archive, O_RDONLY);
+        if (g_sources[s].fd < 0)
+        {
+            fprintf(stderr, "Cannot open '%s'. Code = %d\n",
+                    g_sources[s].archive, errno);
+            return 1;
+        }
+        if (manifestopen(argv[optind + 2 * s + 1], &g_sources[s].manifest))
+            return 1;
+    }
+
+    /* Every copy of every file, then only the newest of each */
+    for (s = 0; s < nsources; s++)
+    {
+        for (p = NULL; (p = manifestnext(&g_sources[s].manifest, p, &r)); )
+        {
+            if (r.kind != 'M' || (r.type != 'f' && r.type != 'l'))
+                continue;
+            members = Grow(members, nmembers, &amembers, sizeof(*members));
+            members[nmembers].rec = r;
+            members[nmembers].source = s;
+            nmembers++;
+        }
+    }
+    qsort(members, nmembers, sizeof(*members), CompareMember);
+    for (i = j = 0; i < nmembers; i++)
+    {
+        if (j > 0 && members[j - 1].rec.vnode == members[i].rec.vnode &&
+                members[j - 1].rec.uniquifier == members[i].rec.uniquifier)
+            continue;
+        members[j++] = members[i];
+    }
+    nmembers = j;
+
+    if (strcmp(output, "-") == 0)
+        g_out = 1;
+    else
+        g_out = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (g_out < 0)
+    {
+        fprintf(stderr, "Cannot open '%s'. Code = %d\n", output, errno);
+        return 1;
+    }
+    if (outmanifest)
+    {
+        man = fopen(outmanifest, "w");
+        if (!man)
+        {
+            fprintf(stderr, "Cannot open '%s'. Code = %d\n", outmanifest,
+                    errno);
+            return 1;
+        }
+    }
+
+    /*
+     * Directories and their ACL scripts come from the newest archive as they
+     * are, in the same order so that parents still come before children.
+     */
+    for (p = NULL; (p = manifestnext(&g_sources[latest].manifest, p, &r)); )
+    {
+        uint64_t offset = r.offset, length = BLOCKSIZE;
+
+        if (r.kind == 'V' && man && manifestpath(&r, path, sizeof(path)) >= 0)
+            manifestvolume(man, r.vnode, path);
+        if (r.kind != 'M' || (r.type != 'd' && r.type != 'a'))
+            continue;
+
+        if (manifestpath(&r, path, sizeof(path)) < 0)
+        {
+            fprintf(stderr, "Path too long in manifest\n");
+            return 1;
+        }
+        if (r.type == 'd')
+        {
+            dirs = Grow(dirs, ndirs, &adirs, sizeof(*dirs));
+            dirs[ndirs].vnode = r.vnode;
+            dirs[ndirs].path = strdup(path);
+            ndirs++;
+        }
+        else
+        {
+            length += Padded(r.size);
+        }
+
+        if (verbose)
+            fprintf(stderr, "%s%s\n", path, r.type == 'd' ? "/" : "");
+        if (man)
+        {
+            r.offset = g_offset;
+            manifestmember(man, &r, path, NULL);
+        }
+        if (Copy(latest, offset, length))
+            return 1;
+    }
+    qsort(dirs, ndirs, sizeof(*dirs), CompareDir);
+
+    /* The entries of those directories are the files that are still there */
+    for (p = NULL, order = 0;
+            (p = manifestnext(&g_sources[latest].manifest, p, &r)); order++)
+    {
+        struct Member key, *m;
+        struct Dir dkey;
+
+        if (r.kind != 'E' || (r.vnode & 1))
+            continue;
+        dkey.vnode = r.dirvnode;
+        if (!bsearch(&dkey, dirs, ndirs, sizeof(*dirs), CompareDir))
+        {
+            /* The directory was left out of the archive */
+            continue;
+        }
+
+        key.rec.vnode = r.vnode;
+        key.rec.uniquifier = r.uniquifier;
+        m = FindMember(members, nmembers, &key);
+        if (!m)
+        {
+            if (manifestpath(&r, name, sizeof(name)) < 0)
+                name[0] = 0;
+            fprintf(stderr, "No archive has vnode %u.%u (%s)\n", r.vnode,
+                    r.uniquifier, name);
+            missing++;
+            continue;
+        }
+
+        items = Grow(items, nitems, &aitems, sizeof(*items));
+        items[nitems].member = m;
+        items[nitems].dirvnode = r.dirvnode;
+        items[nitems].name = r.path;
+        items[nitems].namelen = r.pathlen;
+        items[nitems].order = order;
+        nitems++;
+    }
+
+    /* Like tarvol, write a file's other names as links to its first */
+    qsort(items, nitems, sizeof(*items), CompareItem);
+    for (i = j = 0; i < nitems; i++)
+    {
+        items[i].link = j > 0 && items[j - 1].member == items[i].member;
+        /* tarvol only links files, and writes a symlink once */
+        if (items[i].link && items[i].member->rec.type != 'f')
+            continue;
+        items[j++] = items[i];
+    }
+    nitems = j;
+
+    qsort(items, nitems, sizeof(*items), CompareLocation);
+    for (i = 0; i < nitems; i++)
+    {
+        const struct Member *m = items[i].member;
+        struct ManifestRecord rec = m->rec;
+        struct Dir dkey, *dir;
+
+        dkey.vnode = items[i].dirvnode;
+        dir = bsearch(&dkey, dirs, ndirs, sizeof(*dirs), CompareDir);
+        r.path = items[i].name;
+        r.pathlen = items[i].namelen;
+        if (manifestpath(&r, name, sizeof(name)) < 0)
+        {
+            fprintf(stderr, "Name too long in manifest\n");
+            return 1;
+        }
+
+        /* The tar link field has no room for longer paths */
+        if (items[i].link && strlen(target) >= 100)
+        {
+            fprintf(stderr, "Cannot link %s/%s to %s: name too long\n",
+                    dir->path, name, target);
+            continue;
+        }
+
+        if (verbose)
+            fprintf(stderr, "%s/%s\n", dir->path, name);
+        if (man)
+        {
+            rec.offset = g_offset;
+            if (items[i].link)
+                rec.type = 'h';
+            manifestmember(man, &rec, dir->path, name);
+        }
+
+        if (ReadHeader(m->source, m->rec.offset, header))
+            return 1;
+        if (items[i].link)
+        {
+            header[TYPEOFFSET] = LNKTYPE;
+            snprintf((char *)header + SIZEOFFSET, 12, "%011o", 0);
+            strncpy((char *)header + LINKOFFSET, target, 100);
+        }
+        else if (snprintf(target, sizeof(target), "%s/%s", dir->path,
+                    name) >= (int)sizeof(target))
+            target[100] = 0;            /* still too long to link to */
+        Rename(header, dir->path, name);
+        if (Write(header, BLOCKSIZE) || (m->rec.type == 'f' &&
+                    !items[i].link && Copy(m->source,
+                        m->rec.offset + BLOCKSIZE, Padded(m->rec.size))))
+            return 1;
+    }
+
+    memset(header, 0, BLOCKSIZE);
+    if (Write(header, BLOCKSIZE) || Write(header, BLOCKSIZE) || Flush())
+        return 1;
+    if (g_out != 1 && close(g_out))
+    {
+        fprintf(stderr, "Could not write '%s'. Code = %d\n", output, errno);
+        return 1;
+    }
+
+    if (man)
+    {
+        /* The directory entries are those of the newest archive */
+        for (p = NULL; (p = manifestnext(&g_sources[latest].manifest, p, &r)); )
+        {
+            if (r.kind == 'E' && manifestpath(&r, name, sizeof(name)) >= 0)
+                manifestentry(man, r.dirvnode, r.vnode, r.uniquifier, name);
+        }
+        if (fclose(man))
+        {
+            fprintf(stderr, "Could not write '%s'\n", outmanifest);
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "Total bytes written: %llu\n",
+            (unsigned long long)g_offset);
+    if (missing)
+    {
+        fprintf(stderr, "%lu files could not be found\n",
+                (unsigned long)missing);
+        return 1;
+    }
+    return 0;
+}
@@ -3,16 +3,75 @@
  * This work is hereby placed in the public domain by its author.
  */
 
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
 
 #include "common.h"
+#include "ratelimit.h"
+#include "size.h"
+#include "storage.h"
 
 uintmax_t bytecount = 0;
 int acls = 0, verbose = 0;
+int columnar = 0;
+size_t smallfiles = 0;
+const char *dictfile = NULL;
+const char *backuppc = NULL;
+const char *sharename = NULL;
+int poollevel = 0;
+const char *checkpoint = NULL;
+uintmax_t checkpointinterval = (uintmax_t)1 << 30;
+int resume = 0;
+const char *statsfile = NULL;
+const char *progress = NULL;
+const char *manifest = NULL;
+const char *catalog = NULL;
+const char *archiveid = NULL;
+int dirthreads = 2;
+struct IOSetup iosetup;
+
+/* Set while running a job for the daemon */
+static int injob = 0;
+
+/*
+ * Set up a stream for the I/O profile: with a size, pipes are enlarged to it
+ * (as far as /proc/sys/fs/pipe-max-size allows, unless we are root), regular
+ * files are read with more readahead, and stdio buffers that much at a time.
+ * Either way, record what the stream ended up with.
+ */
+static void tunestream(FILE *f, size_t size, int input, long *pipesize,
+        size_t *bufsize)
+{
+    struct stat st;
+    int fd = fileno(f);
+
+    if (fstat(fd, &st))
+        return;
+    *bufsize = st.st_blksize;
+    if (S_ISFIFO(st.st_mode))
+    {
+        long n = size;
+
+        while (n > 65536 && fcntl(fd, F_SETPIPE_SZ, n) < 0)
+            n /= 2;
+        *pipesize = fcntl(fd, F_GETPIPE_SZ);
+    }
+    else if (size && input && S_ISREG(st.st_mode))
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    if (size && setvbuf(f, NULL, _IOFBF, size) == 0)
+        *bufsize = size;
+}
 
 /* Print a usage message and exit */
 static void usage(const char *arg, int status, const char *msg)
@@ -20,42 +79,215 @@ static void usage(const char *arg, int status, const char *msg)
     if (msg) fprintf(stderr, "%s: %s\n", arg, msg);
     fprintf(stderr, "Usage: %s [options] [file]\n", arg);
     fprintf(stderr, "  -a     Add ACL restore script to archive\n");
+    fprintf(stderr, "  -A     Name the archive ID in the catalog (default: -f path)\n");
+    fprintf(stderr, "  -B     Encrypt in aestar format 2 with chunks of SIZE bytes\n");
     fprintf(stderr, "  -c     Create archive (vos dump to tar)\n");
-    fprintf(stderr, "  -f     Use archive file or device ARCHIVE\n");
+    fprintf(stderr, "  -C     Add the archive's files to the catalog in DIR\n");
+    fprintf(stderr, "  -D     Run as a daemon taking jobs on socket PATH\n");
+    fprintf(stderr, "  -e     Exclude paths matching PATTERN (may be repeated)\n");
+    fprintf(stderr, "  -E     Encrypt file data like aestar, with the passphrase in FILE\n");
+    fprintf(stderr, "  -f     Use archive file or device ARCHIVE, or upload it to s3://BUCKET/KEY\n");
+    fprintf(stderr, "  -F     Write the archive in FORMAT: tar (default), columnar or backuppc\n");
+    fprintf(stderr, "         (into the BackupPC backup directory given with -f)\n");
     fprintf(stderr, "  -h     Print this help message\n");
+    fprintf(stderr, "  -i     Only include files matching PATTERN (may be repeated)\n");
+    fprintf(stderr, "  -I     Use I/O PROFILE: default, tuned (1M buffers) or a buffer SIZE\n");
+    fprintf(stderr, "  -j     Decode directories on N threads (default 2, 0 for none)\n");
+    fprintf(stderr, "  -J     Hand this job to the daemon on socket PATH\n");
+    fprintf(stderr, "  -k     Write checkpoints to FILE (needs a dump file and -f)\n");
+    fprintf(stderr, "  -K     Checkpoint every SIZE bytes of dump (default 1G)\n");
+    fprintf(stderr, "  -l     Limit the rate, as \"bytes=SIZE,vnodes=N,output=SIZE\" per second\n");
+    fprintf(stderr, "  -L     Take rate limits from FILE, read again on change or SIGUSR1\n");
+    fprintf(stderr, "  -M     Write a manifest of the archive to FILE\n");
+    fprintf(stderr, "  -m     Keep at most SIZE bytes of names in memory (k, M, G suffix)\n");
+    fprintf(stderr, "  -n     Scan the dump and report statistics instead of creating an archive\n");
+    fprintf(stderr, "  -Q     Queue at most N jobs in the daemon (default 16)\n");
+    fprintf(stderr, "  -p     Upload to s3:// in parts of SIZE bytes (default 8M, at least 5M)\n");
+    fprintf(stderr, "  -P     Report progress every second to FILE, or to descriptor N with fd:N\n");
+    fprintf(stderr, "  -r     Resume from the checkpoint given with -k\n");
+    fprintf(stderr, "  -s     Name the BackupPC share SHARE (default: the volume)\n");
+    fprintf(stderr, "  -S     Append volume statistics to FILE (for volsched)\n");
+    fprintf(stderr, "  -T     Compress files of up to SIZE (at most 16k) in a columnar archive,\n");
+    fprintf(stderr, "         with a dictionary trained on the first of them\n");
+    fprintf(stderr, "  -U     Upload N parts at once (default 4)\n");
     fprintf(stderr, "  -v     Verbose mode (multiple for greater verbosity)\n");
-    fprintf(stderr, "  -x     Extract archive (tar to vos dump) (not implemented)\n");
+    fprintf(stderr, "  -W     Run N workers in the daemon (default 4)\n");
+    fprintf(stderr, "  -x     Extract archive (tar to vos dump) of the paths chosen with -i\n");
+    fprintf(stderr, "         and -e, reading only what is needed given its manifest (-M)\n");
+    fprintf(stderr, "  -X     Write an index of seekable gzip frames to FILE (needs -z)\n");
+    fprintf(stderr, "  -Y     Use the dictionary in FILE for -T (from tarls -D) instead\n");
+    fprintf(stderr, "  -z     Compress the archive with gzip at LEVEL (1-9)\n");
+    fprintf(stderr, "  file   Read the vos dump from file instead of stdin\n");
     exit(status);
 }
 
-int main(int argc, char **argv)
+static int job(int argc, char **argv);
+
+static int run(int argc, char **argv)
 {
-    int arg, operation = 0;
-    const char *fileparam = NULL;
-    while ((arg = getopt(argc, argv, "acf:hv")) != -1)
+    int arg, operation = 0, workers = 4, maxqueue = 16, level = 0, object;
+    const char *fileparam = NULL, *daemonpath = NULL, *jobpath = NULL;
+    const char *keyfile = NULL, *framefile = NULL;
+    uintmax_t chunksize = 0, size;
+    size_t iosize = 0, partsize = 0;
+    int uploads = 0;
+    while ((arg = getopt(argc, argv, "aA:B:cC:D:e:E:f:F:hi:I:j:J:k:K:l:L:m:M:np:P:Q:rs:S:T:U:vW:xX:Y:z:")) != -1)
     {
         switch (arg)
         {
             case 'a':
                 acls = 1;
                 break;
+            case 'A':
+                archiveid = optarg;
+                break;
+            case 'B':
+                if (parsesize(optarg, &chunksize) || !chunksize ||
+                        chunksize % 512)
+                {
+                    usage(argv[0], 1, "Chunk size must be a multiple of 512");
+                }
+                break;
+            case 'C':
+                catalog = optarg;
+                break;
+            case 'D':
+                daemonpath = optarg;
+                break;
+            case 'j':
+                dirthreads = atoi(optarg);
+                if (dirthreads < 0)
+                {
+                    usage(argv[0], 1, "Invalid number of threads");
+                }
+                break;
+            case 'J':
+                jobpath = optarg;
+                break;
+            case 'W':
+                workers = atoi(optarg);
+                if (workers < 1)
+                {
+                    usage(argv[0], 1, "Invalid number of workers");
+                }
+                break;
+            case 'Q':
+                maxqueue = atoi(optarg);
+                if (maxqueue < 0)
+                {
+                    usage(argv[0], 1, "Invalid queue length");
+                }
+                break;
+            case 'e':
+                addrule(0, optarg);
+                break;
+            case 'i':
+                addrule(1, optarg);
+                break;
+            case 'E':
+                keyfile = optarg;
+                break;
+            case 'I':
+                if (strcmp(optarg, "default") == 0)
+                    iosize = 0;
+                else if (strcmp(optarg, "tuned") == 0)
+                    iosize = 1 << 20;
+                else if (parsesize(optarg, &size) || !(iosize = size))
+                {
+                    usage(argv[0], 1, "Invalid I/O profile");
+                }
+                break;
+            case 'X':
+                framefile = optarg;
+                break;
+            case 'z':
+                level = atoi(optarg);
+                if (level < 1 || level > 9)
+                {
+                    usage(argv[0], 1, "Invalid compression level");
+                }
+                break;
             case 'h':
                 usage(argv[0], 0, NULL);
                 return 1;
                 break;
             case 'x':
+            case 'c':
+            case 'n':
                 if (operation)
                 {
-                    usage(argv[0], 1, "Both -c and -x were specified");
+                    usage(argv[0], 1, "Only one of -c, -n and -x may be specified");
                 }
-                operation = 'x';
+                operation = arg;
                 break;
-            case 'c':
-                if (operation)
+            case 'm':
                 {
-                    usage(argv[0], 1, "Both -c and -x were specified");
+                    if (parsesize(optarg, &size) || !size)
+                    {
+                        usage(argv[0], 1, "Invalid memory size");
+                    }
+                    setnamebudget(size);
                 }
-                operation = 'c';
+                break;
+            case 'M':
+                manifest = optarg;
+                break;
+            case 'k':
+                checkpoint = optarg;
+                break;
+            case 'K':
+                if (parsesize(optarg, &checkpointinterval) ||
+                        !checkpointinterval)
+                {
+                    usage(argv[0], 1, "Invalid checkpoint interval");
+                }
+                break;
+            case 'l':
+                if (ratelimitset(optarg))
+                {
+                    usage(argv[0], 1, "Invalid rate limits");
+                }
+                break;
+            case 'L':
+                if (ratelimitfile(optarg))
+                    return 1;
+                break;
+            case 'r':
+                resume = 1;
+                break;
+            case 'P':
+                progress = optarg;
+                break;
+            case 's':
+                sharename = optarg;
+                break;
+            case 'S':
+                statsfile = optarg;
+                break;
+            case 'p':
+                if (parsesize(optarg, &size) || size < (5 << 20) ||
+                        size > (1 << 30))
+                {
+                    usage(argv[0], 1, "Part size must be from 5M to 1G");
+                }
+                partsize = size;
+                break;
+            case 'U':
+                uploads = atoi(optarg);
+                if (uploads < 1 || uploads > 64)
+                {
+                    usage(argv[0], 1, "Uploads must be from 1 to 64");
+                }
+                break;
+            case 'T':
+                if (parsesize(optarg, &size) || !size || size > 16384)
+                {
+                    usage(argv[0], 1, "Invalid small file size");
+                }
+                smallfiles = size;
+                break;
+            case 'Y':
+                dictfile = optarg;
                 break;
             case 'v':
                 verbose++;
@@ -63,36 +295,311 @@ int main(int argc, char **argv)
             case 'f':
                 fileparam = optarg;
                 break;
+            case 'F':
+                columnar = strcmp(optarg, "columnar") == 0;
+                backuppc = strcmp(optarg, "backuppc") == 0 ? "" : NULL;
+                if (!columnar && !backuppc && strcmp(optarg, "tar") != 0)
+                {
+                    usage(argv[0], 1, "Invalid archive format");
+                }
+                break;
             case '?':
                 usage(argv[0], 1, NULL);
                 break;
         }
     }
 
+    if ((daemonpath || jobpath) && injob)
+    {
+        fprintf(stderr, "%s: -D and -J cannot be used in a job\n", argv[0]);
+        return 1;
+    }
+    else if (jobpath)
+    {
+        /* Everything else is checked by the daemon */
+        return submit(jobpath, argc, argv);
+    }
+    else if (daemonpath)
+    {
+        return serve(daemonpath, workers, maxqueue, job);
+    }
+
+    if (resume && (!checkpoint || !fileparam || optind >= argc))
+    {
+        usage(argv[0], 1, "-r needs -k, -f and a dump file");
+    }
+
+    if (catalog && checkpoint && !manifest)
+    {
+        usage(argv[0], 1, "-C with -k needs -M, to catalog a resumed run");
+    }
+
+    if (checkpoint && (keyfile || level))
+    {
+        usage(argv[0], 1, "-k cannot be used with -E or -z");
+    }
+
+    if (chunksize && !keyfile)
+    {
+        usage(argv[0], 1, "-B needs -E");
+    }
+
+    if (framefile && (!level || keyfile))
+    {
+        usage(argv[0], 1, "-X needs -z and cannot be used with -E");
+    }
+
+    /* The footer replaces the manifest, and is found by seeking */
+    if (columnar && (checkpoint || manifest || catalog || keyfile || level))
+    {
+        usage(argv[0], 1, "-F columnar cannot be used with -k, -M, -C, -E or -z");
+    }
+
+    /* The files go straight into the backup, so there is no archive */
+    if (backuppc && (!fileparam || checkpoint || manifest || catalog ||
+                keyfile || framefile))
+    {
+        usage(argv[0], 1, "-F backuppc needs -f and cannot be used with -k, -M, -C, -E or -X");
+    }
+
+    if ((smallfiles && !columnar) || (dictfile && !smallfiles))
+    {
+        usage(argv[0], 1, "-T needs -F columnar, and -Y needs -T");
+    }
+
     if (!operation)
     {
-        usage(argv[0], 1, "Either -c or -x is required\n");
+        usage(argv[0], 1, "One of -c, -n or -x is required\n");
         return 1;
     }
+
+    object = fileparam && strncmp(fileparam, "s3://", 5) == 0;
+    if (object && (operation != 'c' || checkpoint || backuppc))
+    {
+        usage(argv[0], 1, "s3:// archives can only be created, without -k or -F backuppc");
+    }
+
+    if ((partsize || uploads) && !object)
+    {
+        usage(argv[0], 1, "-p and -U need -f s3://BUCKET/KEY");
+    }
     else if (operation == 'c')
     {
-        FILE *dumpfile = stdin, *tarfile = stdout;
-        if (fileparam)
+        FILE *dumpfile = stdin, *tarfile = stdout, *outfile, *frames = NULL;
+        char tmpmanifest[MAXPATHLEN];
+        int fd;
+        if (optind < argc)
+        {
+            dumpfile = fopen(argv[optind], "r");
+            if (!dumpfile) {
+                fprintf(stderr, "Cannot open '%s'. Code = %d\n",
+                        argv[optind], errno);
+                return 1;
+            }
+        }
+        if (backuppc)
+        {
+            /* -z compresses into the cpool rather than the output */
+            backuppc = fileparam;
+            poollevel = level;
+            level = 0;
+        }
+        else if (object)
         {
-            tarfile = fopen(fileparam, "w");
+            /* Upload the archive as it is written, with no copy on disk */
+            tarfile = objstore(fileparam, partsize ? partsize : 8 << 20,
+                    uploads ? uploads : 4);
+            if (!tarfile)
+                return 1;
+        }
+        else if (fileparam)
+        {
+            /* When resuming, the archive is cut back to the checkpoint */
+            tarfile = fopen(fileparam, resume ? "r+" : "w");
             if (!tarfile) {
                 fprintf(stderr, "Cannot open '%s'. Code = %d\n",
                         fileparam, errno);
+                return 1;
+            }
+        }
+
+        if (catalog && !archiveid && fileparam)
+        {
+            static char path[MAXPATHLEN];
+            if (object)
+                archiveid = fileparam;
+            else if (realpath(fileparam, path))
+                archiveid = path;
+        }
+        if (catalog && !manifest)
+        {
+            /* The catalog is built from a manifest, so make a temporary one */
+            snprintf(tmpmanifest, sizeof tmpmanifest,
+                    "%s/.manifest.XXXXXX", catalog);
+            fd = mkstemp(tmpmanifest);
+            if (fd < 0)
+            {
+                fprintf(stderr, "Cannot create '%s'. Code = %d\n",
+                        tmpmanifest, errno);
+                return 1;
+            }
+            close(fd);
+            manifest = tmpmanifest;
+        }
+
+        tunestream(dumpfile, iosize, 1, &iosetup.inpipe, &iosetup.inbuf);
+        tunestream(tarfile, iosize, 0, &iosetup.outpipe, &iosetup.outbuf);
+        if (verbose > 1)
+        {
+            fprintf(stderr, "Input pipe %ld, buffer %lu; output pipe %ld, "
+                    "buffer %lu\n", iosetup.inpipe,
+                    (unsigned long)iosetup.inbuf, iosetup.outpipe,
+                    (unsigned long)iosetup.outbuf);
+        }
+
+        if (framefile)
+        {
+            frames = fopen(framefile, "w");
+            if (!frames)
+            {
+                fprintf(stderr, "Cannot open '%s'. Code = %d\n",
+                        framefile, errno);
+                return 1;
+            }
+        }
+
+        outfile = tarfile;
+        if (keyfile || level)
+        {
+            /* Encrypt and compress in this process rather than in a pipe */
+            tarfile = pipeline(outfile, level, keyfile, chunksize, frames);
+            if (!tarfile)
+                return 1;
+        }
+
+        arg = create(dumpfile, tarfile);
+        if (manifest == tmpmanifest)
+            unlink(tmpmanifest);
+        if (dumpfile != stdin)
+            fclose(dumpfile);
+        if (tarfile != outfile && fclose(tarfile))
+            arg = 1;
+        if (frames && fclose(frames))
+        {
+            fprintf(stderr, "Cannot write '%s'. Code = %d\n",
+                    framefile, errno);
+            arg = 1;
+        }
+        tarfile = outfile;
+        if (tarfile != stdout && fclose(tarfile))
+        {
+            fprintf(stderr, "Cannot write '%s'. Code = %d\n",
+                    fileparam, errno);
+            arg = 1;
+        }
+        return arg;
+    }
+    else if (operation == 'n')
+    {
+        FILE *report = stdout;
+        if (fileparam)
+        {
+            report = fopen(fileparam, "w");
+            if (!report) {
+                fprintf(stderr, "Cannot open '%s'. Code = %d\n",
+                        fileparam, errno);
+                return 1;
             }
         }
 
-        return create(dumpfile, tarfile);
+        FILE *dumpfile = stdin;
+        if (optind < argc)
+        {
+            dumpfile = fopen(argv[optind], "r");
+            if (!dumpfile) {
+                fprintf(stderr, "Cannot open '%s'. Code = %d\n",
+                        argv[optind], errno);
+                return 1;
+            }
+        }
+
+        tunestream(dumpfile, iosize, 1, &iosetup.inpipe, &iosetup.inbuf);
+        arg = scan(dumpfile, report);
+        if (dumpfile != stdin)
+            fclose(dumpfile);
+        if (report != stdout)
+            fclose(report);
+        return arg;
     }
     else if (operation == 'x')
     {
-        usage(argv[0], 1, "-x not yet implemented\n");
-        return 1;
+        /* The archive comes from -f and the dump goes to file */
+        FILE *tarfile = stdin, *dumpfile = stdout;
+        if (fileparam)
+        {
+            tarfile = fopen(fileparam, "r");
+            if (!tarfile) {
+                fprintf(stderr, "Cannot open '%s'. Code = %d\n",
+                        fileparam, errno);
+                return 1;
+            }
+        }
+        if (optind < argc)
+        {
+            dumpfile = fopen(argv[optind], "w");
+            if (!dumpfile) {
+                fprintf(stderr, "Cannot open '%s'. Code = %d\n",
+                        argv[optind], errno);
+                return 1;
+            }
+        }
+
+        tunestream(tarfile, iosize, 1, &iosetup.inpipe, &iosetup.inbuf);
+        tunestream(dumpfile, iosize, 0, &iosetup.outpipe, &iosetup.outbuf);
+        arg = extract(tarfile, dumpfile) ? 1 : 0;
+        if (tarfile != stdin)
+            fclose(tarfile);
+        if (fclose(dumpfile))
+        {
+            perror("Could not write the dump");
+            arg = 1;
+        }
+        return arg;
     }
 
     return 0;
 }
+
+/* Run a job for the daemon, starting again from the defaults */
+static int job(int argc, char **argv)
+{
+    bytecount = 0;
+    acls = verbose = 0;
+    columnar = 0;
+    smallfiles = 0;
+    dictfile = NULL;
+    backuppc = sharename = NULL;
+    poollevel = 0;
+    checkpoint = NULL;
+    checkpointinterval = (uintmax_t)1 << 30;
+    resume = 0;
+    statsfile = NULL;
+    progress = NULL;
+    manifest = NULL;
+    catalog = NULL;
+    archiveid = NULL;
+    dirthreads = 2;
+    memset(&iosetup, 0, sizeof(iosetup));
+    resetcreate();
+    ratelimitreset();
+
+    /* Start getopt over on the new arguments */
+    optind = 0;
+    injob = 1;
+    return run(argc, argv);
+}
+
+int main(int argc, char **argv)
+{
+    return run(argc, argv);
+}
@@ -0,0 +1,511 @@
+/*
+ * Written by Matthew Loar <matthew@loar.name>
+ * This work is hereby placed in the public domain by its author.
+ */
+
+/*
+ * Runs backups of many volumes at once.  Volumes come from a listing with one
+ * "volume server [KB]" line each, which can be made from vos listvldb or
+ * written by hand.  The statistics tarvol -S records from earlier runs give
+ * an estimate of how long each volume takes, and the volumes are started
+ * longest first whenever a job slot is free and the volume's fileserver is
+ * below its limit.  Volumes with no history are started before everything
+ * else, since they could be the longest of all.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Used when there is no history to estimate a rate from, in KB/s */
+#define DEFAULT_RATE (50 * 1024)
+
+struct Volume
+{
+    char name[100];
+    char server[256];
+    double cost;                /* estimated seconds */
+    int state;                  /* 0 pending, 1 running, 2 done */
+    pid_t pid;
+    time_t start;
+    double finish;              /* for the dry run */
+    size_t order;               /* position in the listing */
+};
+
+struct History
+{
+    char name[100];
+    long diskused;              /* KB */
+    long elapsed;               /* seconds */
+    size_t order;               /* line number in the stats file */
+};
+
+static int verbose = 0;
+
+/* Volumes are backed up from their .backup clone, so match on the base name */
+static void
+BaseName(char *name)
+{
+    size_t len = strlen(name);
+
+    if (len > 7 && strcmp(name + len - 7, ".backup") == 0)
+        name[len - 7] = 0;
+    else if (len > 9 && strcmp(name + len - 9, ".readonly") == 0)
+        name[len - 9] = 0;
+}
+
+/* By name, newest first */
+static int
+CompareHistory(const void *a, const void *b)
+{
+    const struct History *ha = a, *hb = b;
+    int c = strcmp(ha->name, hb->name);
+
+    if (c || ha->order == hb->order)
+        return c;
+    return ha->order < hb->order ? 1 : -1;
+}
+
+static int
+CompareName(const void *a, const void *b)
+{
+    return strcmp(((const struct History *)a)->name,
+            ((const struct History *)b)->name);
+}
+
+/* Longest first, keeping the listing order among equals */
+static int
+CompareCost(const void *a, const void *b)
+{
+    const struct Volume *va = a, *vb = b;
+
+    if (va->cost != vb->cost)
+        return va->cost < vb->cost ? 1 : -1;
+    if (va->order == vb->order)
+        return 0;
+    return va->order < vb->order ? -1 : 1;
+}
+
+/*
+ * Read the stats file written by tarvol -S.  Later lines are newer, so only
+ * the last line for each volume is kept.
+ */
+static struct History *
+ReadHistory(const char *file, size_t *count, double *rate)
+{
+    FILE *in = fopen(file, "r");
+    struct History *hist = NULL;
+    size_t n = 0, alloc = 0, i;
+    double kb = 0, seconds = 0;
+    char line[1024];
+
+    *count = 0;
+    *rate = DEFAULT_RATE;
+    if (!in)
+    {
+        if (errno != ENOENT)
+            fprintf(stderr, "Cannot open '%s'. Code = %d\n", file, errno);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), in))
+    {
+        struct History h;
+        unsigned int id;
+        long files, updated, backedup, finished;
+
+        if (sscanf(line, "%99s %u %ld %ld %ld %ld %ld %ld", h.name, &id,
+                    &h.diskused, &files, &updated, &backedup, &finished,
+                    &h.elapsed) != 8)
+        {
+            continue;
+        }
+        BaseName(h.name);
+
+        if (n == alloc)
+        {
+            alloc = alloc ? alloc * 2 : 256;
+            hist = realloc(hist, alloc * sizeof(struct History));
+            if (!hist)
+            {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        h.order = n;
+        hist[n++] = h;
+    }
+    fclose(in);
+
+    /* Newest first within each volume, then keep only the first */
+    qsort(hist, n, sizeof(struct History), CompareHistory);
+    for (i = 0; i < n; i++)
+    {
+        if (*count == 0 || strcmp(hist[*count - 1].name, hist[i].name) != 0)
+            hist[(*count)++] = hist[i];
+    }
+
+    for (i = 0; i < *count; i++)
+    {
+        if (hist[i].elapsed > 0)
+        {
+            kb += hist[i].diskused;
+            seconds += hist[i].elapsed;
+        }
+    }
+    if (seconds > 0 && kb > 0)
+        *rate = kb / seconds;
+
+    return hist;
+}
+
+/* Read "volume server [KB]" lines; blank lines and # comments are ignored */
+static struct Volume *
+ReadListing(FILE *in, struct History *hist, size_t nhist, double rate,
+        size_t *count)
+{
+    struct Volume *vols = NULL;
+    size_t n = 0, alloc = 0, i;
+    double longest = 0;
+    char line[1024];
+
+    while (fgets(line, sizeof(line), in))
+    {
+        struct Volume v;
+        struct History key, *h;
+        long kb = -1;
+        int fields;
+
+        memset(&v, 0, sizeof(v));
+        fields = sscanf(line, "%99s %255s %ld", v.name, v.server, &kb);
+        if (fields < 1 || v.name[0] == '#')
+            continue;
+        if (fields < 2)
+        {
+            fprintf(stderr, "No server for volume %s\n", v.name);
+            continue;
+        }
+        BaseName(v.name);
+
+        strcpy(key.name, v.name);
+        h = nhist ? bsearch(&key, hist, nhist, sizeof(struct History),
+                CompareName) : NULL;
+        if (h && h->elapsed > 0)
+            v.cost = h->elapsed;
+        else if (kb >= 0)
+            v.cost = kb / rate;
+        else if (h)
+            v.cost = h->diskused / rate;
+        else
+            v.cost = -1;
+        if (v.cost > longest)
+            longest = v.cost;
+
+        if (n == alloc)
+        {
+            alloc = alloc ? alloc * 2 : 256;
+            vols = realloc(vols, alloc * sizeof(struct Volume));
+            if (!vols)
+            {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        v.order = n;
+        vols[n++] = v;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        if (vols[i].cost < 0)
+            vols[i].cost = longest + 1;
+    }
+
+    qsort(vols, n, sizeof(struct Volume), CompareCost);
+    *count = n;
+    return vols;
+}
+
+static int
+ServerLoad(struct Volume *vols, size_t n, const char *server)
+{
+    size_t i;
+    int load = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        if (vols[i].state == 1 && strcmp(vols[i].server, server) == 0)
+            load++;
+    }
+    return load;
+}
+
+/* Pick the longest pending volume whose server has room */
+static struct Volume *
+NextVolume(struct Volume *vols, size_t n, int perserver)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (vols[i].state == 0 &&
+                ServerLoad(vols, n, vols[i].server) < perserver)
+            return &vols[i];
+    }
+    return NULL;
+}
+
+/* Replace %v with the volume and %s with the server */
+static int
+FormatCommand(char *out, size_t len, const char *cmd, struct Volume *v)
+{
+    size_t o = 0;
+
+    for (; *cmd; cmd++)
+    {
+        const char *sub = NULL;
+
+        if (cmd[0] == '%' && cmd[1] == 'v')
+            sub = v->name;
+        else if (cmd[0] == '%' && cmd[1] == 's')
+            sub = v->server;
+
+        if (sub)
+        {
+            size_t l = strlen(sub);
+            if (o + l >= len)
+                return -1;
+            memcpy(out + o, sub, l);
+            o += l;
+            cmd++;
+        }
+        else
+        {
+            if (o + 1 >= len)
+                return -1;
+            out[o++] = *cmd;
+        }
+    }
+    out[o] = 0;
+    return 0;
+}
+
+static void
+Plan(struct Volume *vols, size_t n, int jobs, int perserver)
+{
+    double now = 0;
+    size_t done = 0, i;
+    int running = 0;
+
+    printf("%10s %10s  %-20s %s\n", "start", "end", "server", "volume");
+    while (done < n)
+    {
+        struct Volume *v;
+        struct Volume *first = NULL;
+
+        while (running < jobs && (v = NextVolume(vols, n, perserver)))
+        {
+            v->state = 1;
+            v->finish = now + v->cost;
+            running++;
+            printf("%10.0f %10.0f  %-20s %s\n", now, v->finish, v->server,
+                    v->name);
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (vols[i].state == 1 &&
+                    (!first || vols[i].finish < first->finish))
+                first = &vols[i];
+        }
+        first->state = 2;
+        now = first->finish;
+        running--;
+        done++;
+    }
+    printf("estimated makespan %.0f seconds\n", now);
+}
+
+static int
+Run(struct Volume *vols, size_t n, int jobs, int perserver, const char *cmd)
+{
+    size_t done = 0, i;
+    int running = 0, failed = 0;
+
+    while (done < n)
+    {
+        struct Volume *v;
+        pid_t pid;
+        int status;
+
+        while (running < jobs && (v = NextVolume(vols, n, perserver)))
+        {
+            char command[4096];
+
+            if (FormatCommand(command, sizeof(command), cmd, v))
+            {
+                fprintf(stderr, "Command too long for %s\n", v->name);
+                v->state = 2;
+                done++;
+                failed++;
+                continue;
+            }
+
+            v->start = time(NULL);
+            v->pid = fork();
+            if (v->pid == 0)
+            {
+                setenv("VOLUME", v->name, 1);
+                setenv("SERVER", v->server, 1);
+                execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+                _exit(127);
+            }
+            else if (v->pid < 0)
+            {
+                perror("fork");
+                return 1;
+            }
+
+            if (verbose)
+            {
+                fprintf(stderr, "started %s on %s (estimate %.0fs)\n",
+                        v->name, v->server, v->cost);
+            }
+            v->state = 1;
+            running++;
+        }
+
+        if (!running)
+            break;
+
+        pid = wait(&status);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("wait");
+            return 1;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (vols[i].state == 1 && vols[i].pid == pid)
+                break;
+        }
+        if (i == n)
+            continue;
+
+        vols[i].state = 2;
+        running--;
+        done++;
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+        {
+            fprintf(stderr, "backup of %s failed\n", vols[i].name);
+            failed++;
+        }
+        else if (verbose)
+        {
+            fprintf(stderr, "finished %s in %lds\n", vols[i].name,
+                    (long)(time(NULL) - vols[i].start));
+        }
+    }
+
+    return failed ? 1 : 0;
+}
+
+/* Print a usage message and exit */
+static void usage(const char *arg, int status, const char *msg)
+{
+    if (msg) fprintf(stderr, "%s: %s\n", arg, msg);
+    fprintf(stderr, "Usage: %s [options] -c command [listing]\n", arg);
+    fprintf(stderr, "  -c command   Run command for each volume (%%v volume, %%s server)\n");
+    fprintf(stderr, "  -h           Print this help message\n");
+    fprintf(stderr, "  -j jobs      Run at most jobs backups at once (default 4)\n");
+    fprintf(stderr, "  -n           Print the plan instead of running it\n");
+    fprintf(stderr, "  -p jobs      Run at most jobs backups per server (default 1)\n");
+    fprintf(stderr, "  -S file      Read volume statistics written by tarvol -S\n");
+    fprintf(stderr, "  -v           Verbose\n");
+    exit(status);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int arg, jobs = 4, perserver = 1, dryrun = 0;
+    const char *cmd = NULL, *statsfile = NULL;
+    struct History *hist = NULL;
+    struct Volume *vols;
+    size_t nhist = 0, nvols;
+    double rate = DEFAULT_RATE;
+    FILE *listing = stdin;
+
+    while ((arg = getopt(argc, argv, "c:hj:np:S:v")) != -1)
+    {
+        switch (arg)
+        {
+            case 'c':
+                cmd = optarg;
+                break;
+            case 'h':
+                usage(argv[0], 0, NULL);
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 'n':
+                dryrun = 1;
+                break;
+            case 'p':
+                perserver = atoi(optarg);
+                break;
+            case 'S':
+                statsfile = optarg;
+                break;
+            case 'v':
+                verbose++;
+                break;
+            case '?':
+                usage(argv[0], 1, NULL);
+                break;
+        }
+    }
+
+    if (jobs < 1 || perserver < 1)
+    {
+        usage(argv[0], 1, "job limits must be at least 1");
+    }
+    if (!cmd && !dryrun)
+    {
+        usage(argv[0], 1, "a command is required");
+    }
+
+    if (optind < argc)
+    {
+        listing = fopen(argv[optind], "r");
+        if (!listing)
+        {
+            fprintf(stderr, "Cannot open '%s'. Code = %d\n", argv[optind],
+                    errno);
+            return 1;
+        }
+    }
+
+    if (statsfile)
+    {
+        hist = ReadHistory(statsfile, &nhist, &rate);
+    }
+    vols = ReadListing(listing, hist, nhist, rate, &nvols);
+
+    if (dryrun)
+    {
+        Plan(vols, nvols, jobs, perserver);
+        return 0;
+    }
+    return Run(vols, nvols, jobs, perserver, cmd);
+}